@@ -1,18 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <limits.h>
+#define CPM_SERVER 1       // Multi-session terminal server (needs epoll)
+#else
+#define CPM_SERVER 0
+#endif
 
 // Debug flags - set to 1 to enable, 0 to disable
 #define DEBUG_CPU 0        // CPU instruction debugging (JNZ, DCR, etc.)
 #define DEBUG_DISK_IO 1    // Disk I/O port operations
 #define DEBUG_HALT 1       // Show registers when halting
+#define DEBUG_CONSOLE 1    // Mirror guest console output to stdout
+#define DEBUG_COVERAGE 0   // Guest execute/read/write coverage counters (see COVERAGE)
 
 int addressBus = 0;
 
-unsigned char mem[0x10000] = { 0 };
-struct i8080 cpu;
-struct i8080* p = &cpu;
+static unsigned char default_memory[0x10000];
+__thread unsigned char *mem = default_memory; // memory of the machine running on this thread
+static __thread int history_recording;   // MemWrite keeps undo entries (see REVERSE EXECUTION)
+static void history_write(unsigned int address);
+
+// Watchpoint flags per 256-byte page (see BREAKPOINTS AND WATCHPOINTS)
+#define WATCH_READ 0x01
+#define WATCH_WRITE 0x02
+static const unsigned char no_watch_pages[256];
+static __thread const unsigned char *watch_page = no_watch_pages;
+static void watch_hit(unsigned int address, int access);
+
+// Coverage counters by kind (see COVERAGE)
+#define COVERAGE_EXECUTE 0
+#define COVERAGE_READ 1
+#define COVERAGE_WRITE 2
+#define COVERAGE_KINDS 3
+#if DEBUG_COVERAGE
+static __thread unsigned short (*coverage_counts)[0x10000];  // NULL unless collecting
+
+static inline void coverage_hit(int kind, unsigned int address) {
+    unsigned short *count = &coverage_counts[kind][address];
+    *count += (*count != 0xFFFF);      // Saturates
+}
+#endif
 char buffer[80]; // for displaying reg dump
 int currentAndNext[6]; // store the just executed and next to be executed instructions for display
 
@@ -22,6 +68,17 @@ void MemWrite(int address, int value)
     if (address < 0 || address >= 0x10000) {
         return; // Bounds check - silently ignore out of range
     }
+    if (history_recording) {
+        history_write(address);
+    }
+    if (watch_page[address >> 8] & WATCH_WRITE) {
+        watch_hit(address, WATCH_WRITE);
+    }
+    #if DEBUG_COVERAGE
+    if (coverage_counts) {
+        coverage_hit(COVERAGE_WRITE, address);
+    }
+    #endif
     mem[address] = value;
     addressBus = address;
 }
@@ -32,6 +89,14 @@ int MemRead(int address)
     if (address < 0 || address >= 0x10000) {
         return 0; // Bounds check - return 0 for out of range
     }
+    if (watch_page[address >> 8] & WATCH_READ) {
+        watch_hit(address, WATCH_READ);
+    }
+    #if DEBUG_COVERAGE
+    if (coverage_counts) {
+        coverage_hit(COVERAGE_READ, address);
+    }
+    #endif
     addressBus = address;
     return mem[address];
 }
@@ -58,1354 +123,4861 @@ typedef struct {
     char input_buffer[256];
     int input_read_pos;
     int input_write_pos;
-    char output_buffer[1024];
-    int output_pos;
+    unsigned char *output_ring;      // Output waiting for the host, grows on demand
+    size_t output_size;              // Ring capacity (power of two)
+    size_t output_read;              // Free-running ring counters
+    size_t output_write;
+    unsigned char burst[128];        // OUT bytes not yet appended to the ring
+    size_t burst_len;
     int waiting_for_input;      // Flag: 1 = CPU is blocked waiting for input
     int input_echo;             // Flag: 1 = echo input characters
+    // BDOS 10 line input in progress. The CPU is suspended until the line
+    // is complete, then continues at line_resume (-1: return through RET).
+    int line_active;
+    unsigned int line_pc;       // Address of the suspended call
+    unsigned int line_addr;     // Guest buffer: max, count, characters
+    unsigned char line_max;
+    unsigned char line_count;
+    int line_resume;
 } console_state;
 
-console_state cpm_console;
+#define CONSOLE_OUTPUT_INITIAL 4096
+#define CONSOLE_OUTPUT_MAX (1024 * 1024)   // Beyond this the oldest output is dropped
+
+// Idle detection. A guest spinning on console status (BIOS CONST, BDOS 11,
+// IN from an empty CONIN) or halted makes no progress, so the machine is
+// marked idle and its runner can park until input arrives. Polls count as a
+// spin only when they come from the same PC with few instructions between
+// them, so programs that check for ^C while computing keep running.
+#define CPM_IDLE_SPIN_POLLS 64         // Consecutive empty polls before parking
+#define CPM_IDLE_SPIN_WINDOW 32        // Max instructions between polls of a spin loop
+#define CPM_IDLE_TICK_MS 10            // Parked machines are released once per tick
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int idle;                          // Flag: 1 = spinning on console status or halted (atomic)
+    unsigned int spin_polls;
+    unsigned int last_poll_pc;
+    unsigned long last_poll_step;
+    unsigned long steps;               // Instructions executed by codestep
+    struct timespec idle_since;
+} idle_state;
 
 // Disk state structure
 typedef struct {
     unsigned char current_disk;     // 0=A:, 1=B:
-    unsigned char current_track;    // 0-76
-    unsigned char current_sector;   // 1-26
+    unsigned char current_track;    // 0 to tracks-1 of the disk format
+    unsigned char current_sector;   // 1 to sectors per track
     unsigned int dma_address;       // DMA transfer address
-    unsigned int dir_base_offset;  // Directory base offset in bytes
 } disk_state;
 
-disk_state cpm_disk;
+// Disk geometry. Everything is counted in 128-byte CP/M records ("sectors"
+// here), whatever the physical sector size of the original medium.
+#define DISK_SECTOR_SIZE 128
+#define DISK_FILL 0xE5             // CP/M empty marker
+#define DISK_MAX_SECTORS 32768     // Largest supported image (4MB)
+#define DISK_PAGE_SECTORS 32       // Sectors per sparse page table entry
+
+// A disk format describes one on-disk layout. The logical-to-physical sector
+// translation (reserved tracks, skew) is computed once per format into
+// phys_index, so every access is a single table lookup.
+typedef struct {
+    const char *name;
+    unsigned int tracks;
+    unsigned int sectors_per_track;      // 128-byte records per track
+    unsigned int reserved_tracks;        // OFF: system tracks before the directory
+    unsigned int block_size;             // BLS: allocation block size in bytes
+    unsigned int dir_entries;            // DRM + 1
+    unsigned int skew;                   // Sector interleave, 1 = none
+    int track_per_block;                 // Core8080 layout: block N is on track N + 1
+    unsigned int *phys_index;            // [track * spt + logical sector] -> image sector
+} disk_format_t;
+
+// Formats are tried in order; the first is the default for new disks
+static disk_format_t disk_formats[] = {
+    { .name = "Core8080 8\" SSSD", .tracks = 77, .sectors_per_track = 26, .reserved_tracks = 0,
+      .block_size = 1024, .dir_entries = 64, .skew = 1, .track_per_block = 1 },
+    { .name = "IBM 3740 8\" SSSD", .tracks = 77, .sectors_per_track = 26, .reserved_tracks = 2,
+      .block_size = 1024, .dir_entries = 64, .skew = 6 },
+    { .name = "Kaypro II 5.25\" SSDD", .tracks = 40, .sectors_per_track = 40, .reserved_tracks = 1,
+      .block_size = 1024, .dir_entries = 64, .skew = 1 },
+    { .name = "Kaypro 4 5.25\" DSDD", .tracks = 80, .sectors_per_track = 40, .reserved_tracks = 1,
+      .block_size = 2048, .dir_entries = 64, .skew = 1 },
+    { .name = "z80pack 4MB hard disk", .tracks = 255, .sectors_per_track = 128, .reserved_tracks = 0,
+      .block_size = 2048, .dir_entries = 1024, .skew = 1 },
+};
+#define DISK_FORMAT_COUNT (int)(sizeof(disk_formats) / sizeof(disk_formats[0]))
+#define DISK_DEFAULT_FORMAT (&disk_formats[0])
+
+// Images are stored sparsely: a page table whose sector pages are allocated
+// on first write. Unallocated sectors read back as the 0xE5 fill, so memory
+// scales with data actually on the disk rather than with its geometry.
+//
+// An overlay drive puts the same sparse pages on top of a shared, read-only
+// base image: unwritten sectors read through to the base, so the pages hold
+// only the sectors this session changed.
+typedef struct base_image {
+    dev_t device;                        // Identity of the mapped file
+    ino_t inode;
+    char path[512];                      // Where it was mapped from
+    int refcount;
+    const unsigned char *data;           // Read-only mapping of the whole file
+    size_t size;
+    unsigned int sectors;                // Image capacity in sectors
+    int sparse;                          // File is in the sparse image format
+    struct base_image *next;
+} base_image_t;
+
+// A page holds DISK_PAGE_SECTORS sectors (4KB). Forked machines share their
+// parent's pages and copy a page on their first write to it.
+typedef struct {
+    int refs;                            // Disks sharing the page
+    unsigned char *sector[DISK_PAGE_SECTORS];  // NULL: fill, or the base image's data
+} disk_page_t;
+
+typedef struct {
+    disk_page_t *page[DISK_MAX_SECTORS / DISK_PAGE_SECTORS];  // NULL until a sector in it is written
+    unsigned int sectors;                // Capacity, from the format or the image file
+    unsigned int populated;              // Number of allocated sectors
+    const disk_format_t *format;         // Layout of the data on the disk
+    int sparse_file;                     // Persist in the sparse image file format
+    base_image_t *base;                  // Overlay drives: shared base image, else NULL
+    int detached;                        // Restored without write-back: the image file is left alone
+} sparse_disk_t;
+
+static const disk_format_t* identify_disk_format(const sparse_disk_t *disk);
+sparse_disk_t* get_current_disk(void);
+
+// Drive table: A: and B: are disk images, other letters can be mapped to host
+// directories whose files are served straight to BDOS (no disk image involved)
+#define CPM_MAX_DRIVES 16
+#define CPM_HOST_MAX_FILES 16
+#define CPM_HOST_READAHEAD 4096    // Read-ahead window per open host file (32 records)
+
+enum drive_type { DRIVE_NONE, DRIVE_IMAGE, DRIVE_HOST };
+
+// Open host file, keyed by drive and FCB-style 8.3 name
+typedef struct {
+    int in_use;
+    int fd;
+    unsigned char drive;
+    char name[11];                  // Space padded, as in the FCB
+    unsigned long last_used;        // use_clock when last looked up, for eviction
+    long ra_offset;                 // File offset of the read-ahead buffer
+    int ra_len;                     // Valid bytes in the read-ahead buffer
+    unsigned char *ra_buf;          // CPM_HOST_READAHEAD bytes while the file is open
+} host_file_t;
 
-// Disk images: 77 tracks × 26 sectors × 128 bytes = 256,256 bytes each
-unsigned char disk_a[77 * 26 * 128];
-unsigned char disk_b[77 * 26 * 128];
+typedef struct {
+    enum drive_type type[CPM_MAX_DRIVES];
+    char path[CPM_MAX_DRIVES][512];
+    host_file_t files[CPM_HOST_MAX_FILES];
+    unsigned long use_clock;
+    DIR *search_dir;                // Directory stream for Search First/Next
+    unsigned char search_drive;
+    int searching;                  // Search Next continues on a host drive
+} host_drive_state;
+
+static void host_close_all_files(void);
+int cpm_mount_host_dir(int drive, const char *path);
+void cpm_unmount_host_dir(int drive);
+
+// Logical devices LST:, PUN: and RDR:, each routed to a host file or pipe,
+// an in-memory capture (LST:/PUN:) or in-memory data (RDR:)
+#define AUX_BUFFER_SIZE 65536          // Host writes and reads happen in chunks this large
+
+enum { CPM_AUX_LIST, CPM_AUX_PUNCH, CPM_AUX_READER, CPM_AUX_DEVICES };
+enum { AUX_NONE, AUX_FD, AUX_MEMORY };
 
-static int disk_a_loaded = 0;
-static int disk_b_loaded = 0;
-static unsigned int disk_dir_base_offset[2] = { 0, 0 };
-static char disk_base_path[512] = { 0 };
+typedef struct {
+    int kind;
+    int fd;
+    int owns_fd;                       // Opened here, closed on detach
+    unsigned char *buffer;             // Pending output, capture, or reader data
+    size_t size;
+    size_t used;                       // Bytes in buffer
+    size_t pos;                        // Next byte to read (reader, capture drain)
+    int eof;                           // Reader source exhausted
+} aux_device_t;
+
+void cpm_aux_flush(void);
+void cpm_aux_detach(int device);
+
+// Host notification state (see EVENT NOTIFICATION)
+#define CPM_EVENT_OUTPUT 0x01          // Console output is available
+#define CPM_EVENT_INPUT  0x02          // The guest blocked reading the console
+#define CPM_EVENT_HALT   0x04          // The CPU executed HLT
+
+typedef void (*cpm_event_fn)(void *context, unsigned int events);
 
-static unsigned int detect_directory_base_offset(const unsigned char *disk, size_t disk_size);
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int pending;              // Events not yet taken by the host (atomic)
+    int pipe[2];                       // [0] handed to the host, [1] written here
+    int pipe_ready;
+    cpm_event_fn callback;
+    void *context;
+    int halted;                        // HLT already reported for this halt
+} event_state;
 
-void cpm_console_init(void) {
-    memset(&cpm_console, 0, sizeof(console_state));
-    cpm_console.waiting_for_input = 0;
-    cpm_console.input_echo = 1;  // Echo input by default
+// Screen model state (see TERMINAL EMULATION)
+#define TERM_ROWS 24
+#define TERM_COLS 80
+
+enum { TERM_NORMAL, TERM_ESCAPE, TERM_ADDRESS_ROW, TERM_ADDRESS_COL };
+
+typedef struct {
+    char cells[TERM_ROWS][TERM_COLS];
+    int row;
+    int col;
+    int state;                       // Escape sequence parser state
+    int address_row;                 // Row of a cursor address in progress
+    unsigned int dirty;              // Bit n = row n changed since the host looked
+    unsigned long generation;        // Bumped on every visible change
+    char scrolled[TERM_ROWS][TERM_COLS];  // Rows pushed off the top, oldest first
+    int scrolled_count;
+} terminal_state;
+
+// Automation script state (see SCRIPTED INPUT)
+#define SCRIPT_MAX_STEPS 256
+#define SCRIPT_ALPHABET 128            // Output is matched on 7-bit ASCII
+
+enum { SCRIPT_IDLE, SCRIPT_RUNNING, SCRIPT_DONE, SCRIPT_TIMEOUT };
+
+typedef struct {
+    char *send;                        // Text to type when the step matches
+    unsigned long long timeout;        // Cycles to wait, 0 = no limit
+    int patterns;                      // Alternatives; 0 = send without waiting
+} script_step_t;
+
+typedef struct {
+    script_step_t steps[SCRIPT_MAX_STEPS];
+    int count;
+    int current;                       // Step waiting for its pattern
+    int state;
+    unsigned long long deadline;       // Cycle count at which the step times out
+    int type_step;                     // First step whose text is still being typed
+    size_t type_pos;                   // Next character of that step's text
+    int type_end;                      // Steps before this one have been triggered
+
+    char **pattern_text;               // Pattern id -> text
+    int *pattern_step;                 // Pattern id -> step
+    int pattern_count;
+
+    int (*next)[SCRIPT_ALPHABET];      // Automaton transitions (goto + failure folded)
+    int *match;                        // Node -> first pattern ending there, -1 if none
+    int *match_next;                   // Pattern id -> next pattern ending at the same node
+    int *dict;                         // Node -> next node on its failure chain with a match
+    int nodes;
+    int node;                          // Current automaton state
+    int built;
+} script_state;
+
+// Record/replay state (see RECORD AND REPLAY)
+enum { REPLAY_OFF, REPLAY_RECORDING, REPLAY_PLAYING, REPLAY_DONE, REPLAY_DIVERGED };
+
+enum {
+    REPLAY_EVENT_KEY,                  // A byte typed at the console
+    REPLAY_EVENT_TRIGGER,              // trigger_interrupt and its opcode
+    REPLAY_EVENT_INTERRUPT,            // The pending interrupt was taken
+    REPLAY_EVENT_HOST_CALL,            // What a host drive call left for the guest
+    REPLAY_EVENT_READER,               // A byte from the paper tape reader
+    REPLAY_EVENT_END
+};
+
+typedef struct {
+    int mode;
+    unsigned char *log;                // Recording: the log so far; playing: its events
+    size_t used;
+    size_t size;
+    size_t pos;                        // Playing: start of the event after the current one
+    unsigned long long last;           // Cycle of the previous event (deltas are from it)
+    unsigned long long due;            // Playing: when to look at the log again, else ~0
+    int kind;                          // Playing: the current event
+    const unsigned char *payload;
+    unsigned char queued[256][2];      // Recording: host input (kind, byte) for the CPU thread
+    int queued_count;                  // Guarded by the idle lock
+} replay_state;
+
+// Reverse execution history (see REVERSE EXECUTION)
+typedef struct {
+    struct i8080 cpu;                  // State before the step
+    unsigned long long cycles;
+    unsigned long long first_write;    // Sequence number of the step's first write
+} history_step_t;
+
+typedef struct {
+    unsigned short address;
+    unsigned char old;
+} history_write_t;
+
+#define HISTORY_TRAP_FCB 36             // FCB bytes a trap may write (at DE)
+#define HISTORY_TRAP_DMA 128            // and the DMA record
+
+typedef struct {
+    history_step_t *steps;             // NULL while history is off
+    history_write_t *writes;
+    unsigned char before[HISTORY_TRAP_FCB + HISTORY_TRAP_DMA];  // What a trap may write, before it
+    unsigned int trap_fcb;
+    unsigned int trap_dma;
+    int trap_pending;
+    unsigned int step_mask;            // Ring sizes are powers of two, less one
+    unsigned int write_mask;
+    unsigned long long step_first;     // Oldest step still held
+    unsigned long long step_next;
+    unsigned long long write_first;
+    unsigned long long write_next;
+} history_state;
+
+// Breakpoints and watchpoints (see BREAKPOINTS AND WATCHPOINTS)
+#define DEBUG_MAX_WATCHES 16
+
+typedef struct {
+    unsigned int start;
+    unsigned int end;                  // Inclusive
+    int flags;                         // WATCH_READ, WATCH_WRITE
+} watch_range_t;
+
+#define DEBUG_ARMED_BREAKS 0x01        // Breakpoints or watchpoints are set
+#define DEBUG_ARMED_GDB 0x02           // The debugger wants the machine (see GDB REMOTE STUB)
+
+typedef struct {
+    int armed;                         // DEBUG_ARMED_ flags, changed atomically
+    int breakpoints;
+    unsigned char breakpoint[0x10000 / 8];
+    unsigned char watch_page[256];
+    watch_range_t watch[DEBUG_MAX_WATCHES];
+    int watches;
+    int hit;                           // A watchpoint fired during this step
+    int attention;                     // The debugger sent something
+    int stop;                          // Why the last run stopped, and where
+    unsigned int stop_pc;
+    unsigned int stop_address;
+    int stop_access;
+} debug_state;
+
+// HLE traps of a machine (see HLE TRAPS)
+#define HLE_MAX_TRAPS 64
+
+typedef int (*hle_trap_fn)(struct i8080* cpu, void *context);
+
+typedef struct {
+    hle_trap_fn handler;
+    void *context;
+    unsigned int address;
+    int guarded;                       // Pass unless the guard bytes are still in memory
+    unsigned char guard[3];
+} hle_trap_t;
+
+typedef struct {
+    unsigned char trapped[0x10000 / 8];  // Bitmap of trapped addresses
+    hle_trap_t trap[HLE_MAX_TRAPS];
+    int count;
+} hle_state;
+
+// Coverage counters and the assembler labels that name addresses (see COVERAGE)
+typedef struct {
+    char name[32];
+    unsigned int address;
+} coverage_label_t;
+
+typedef struct {
+    unsigned short (*counts)[0x10000]; // Hits by kind and address, NULL until started
+    int collecting;
+    coverage_label_t *labels;
+    int label_count;
+    int label_capacity;
+} coverage_state;
+
+#include "cpu_state.h"          // Front panel snapshot (see FRONT PANEL), shared with the host
+
+// Readers only touch the aligned line holding sequence and state, so
+// sampling never pulls interval and due away from the running thread.
+typedef struct {
+    unsigned long long interval;       // Cycles between snapshots, 0 when off
+    unsigned long long due;
+    unsigned int sequence __attribute__((aligned(64)));  // Odd while writing
+    cpu_state_t state;
+} front_panel_t;
+
+// ============================================================================
+// MACHINES
+// ============================================================================
+//
+// Everything that belongs to one emulated computer lives in a machine_t.
+// Code reaches the machine running on the current thread through the
+// cpm_machine pointer; the names below keep the single-machine spelling
+// (cpm_console, disk_a, ...) so the subsystems read as before. Threads start
+// on the default machine, which is the one the app drives, and a server
+// worker selects a session's machine for the duration of a time slice.
+// I/O port handlers, HLE traps and disk formats are shared by all machines.
+
+typedef struct machine {
+    struct i8080 cpu;
+    unsigned char *memory;             // 64KB address space
+    int memory_mapped;                 // Forked: memory is a private mapping of ram_template
+    struct ram_template *ram_template; // Frozen RAM shared with forks (see MACHINE FORKING)
+    unsigned long long cycles;         // 8080 clock states executed since power on
+    console_state console;
+    idle_state idle;
+    disk_state disk;
+    sparse_disk_t disk_a;
+    sparse_disk_t disk_b;
+    int disk_a_loaded;
+    int disk_b_loaded;
+    char disk_dir[512];                // Empty: the app default, or no disk files for sessions
+    host_drive_state host;
+    int search_dir_index;              // BDOS Search Next position
+    aux_device_t aux[CPM_AUX_DEVICES];
+    event_state events;
+    terminal_state term;
+    script_state script;
+    replay_state replay;
+    history_state history;
+    debug_state debug;
+    hle_state hle;
+    front_panel_t panel;
+    coverage_state coverage;
+} machine_t;
+
+machine_t cpm_default_machine = {
+    .memory = default_memory,
+    .idle = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER },
+    .host = { .type = { DRIVE_IMAGE, DRIVE_IMAGE } },
+    .events = { PTHREAD_MUTEX_INITIALIZER, 0, { -1, -1 } },
+    .script = { .state = SCRIPT_IDLE },
+    .replay = { .due = ~0ULL },
+    .panel = { .due = ~0ULL },
+};
+
+__thread machine_t *cpm_machine = &cpm_default_machine;
+
+static void ram_template_release(struct ram_template *ram);
+static void record_event(int kind, const unsigned char *payload, size_t len);
+static int replay_take(int kind, unsigned char *payload);
+static void replay_feed(void);
+static int record_queue_input(int kind, unsigned char value);
+static void history_begin(struct i8080 *cpu);
+static void history_clear(void);
+static int debug_stop(void);
+static int gdb_service(int reason);
+static void gdb_forget_machine(machine_t *machine);
+static void front_panel_publish(void);
+static int watch_match(unsigned int address, int access);
+void cpm_machine_destroy(machine_t *machine);
+
+#define cpu_cycles (cpm_machine->cycles)
+#define cpm_console (cpm_machine->console)
+#define cpm_idle (cpm_machine->idle)
+#define cpm_disk (cpm_machine->disk)
+#define disk_a (cpm_machine->disk_a)
+#define disk_b (cpm_machine->disk_b)
+#define disk_a_loaded (cpm_machine->disk_a_loaded)
+#define disk_b_loaded (cpm_machine->disk_b_loaded)
+#define disk_base_path (cpm_machine->disk_dir)
+#define cpm_host (cpm_machine->host)
+#define search_dir_index (cpm_machine->search_dir_index)
+#define cpm_aux (cpm_machine->aux)
+#define cpm_events (cpm_machine->events)
+#define cpm_term (cpm_machine->term)
+#define cpm_script (cpm_machine->script)
+#define cpm_replay (cpm_machine->replay)
+#define cpm_history (cpm_machine->history)
+#define cpm_debug (cpm_machine->debug)
+#define cpm_hle (cpm_machine->hle)
+#define cpm_panel (cpm_machine->panel)
+#define cpm_coverage (cpm_machine->coverage)
+
+// The idle flag is set by the thread running the machine and cleared by
+// whichever thread delivers input, so it is only accessed atomically
+static inline int cpm_idle_flag(void) {
+    return __atomic_load_n(&cpm_idle.idle, __ATOMIC_ACQUIRE);
 }
 
-int cpm_console_status(void) {
-    return (cpm_console.input_read_pos != cpm_console.input_write_pos) ? 0xFF : 0x00;
+static inline void cpm_idle_set_flag(int idle) {
+    __atomic_store_n(&cpm_idle.idle, idle, __ATOMIC_RELEASE);
 }
 
-unsigned char cpm_console_input(void) {
-    while (cpm_console.input_read_pos == cpm_console.input_write_pos) {
-        return 0; // No input available
+static void cpm_idle_enter(void) {
+    if (!cpm_idle_flag()) {
+        clock_gettime(CLOCK_MONOTONIC, &cpm_idle.idle_since);
+        cpm_idle_set_flag(1);
     }
-    unsigned char ch = cpm_console.input_buffer[cpm_console.input_read_pos];
-    cpm_console.input_read_pos = (cpm_console.input_read_pos + 1) % 256;
-    return ch;
 }
 
-void cpm_console_output(unsigned char ch) {
-    if (cpm_console.output_pos < 1024) {
-        cpm_console.output_buffer[cpm_console.output_pos++] = ch;
-    }
+// The guest did something other than wait: output, consumed input, etc.
+static void cpm_idle_progress(void) {
+    cpm_idle.spin_polls = 0;
+}
 
-    // Mirror output to Xcode console
-    #if DEBUG_DISK_IO
-    if (ch == 0x00) {
-        unsigned int hl = 0x100 * cpu.reg[H] + cpu.reg[L];
-        unsigned int de = 0x100 * cpu.reg[D] + cpu.reg[E];
-        printf("\n[OUT: NUL] PC=0x%04X HL=0x%04X DE=0x%04X\n", cpu.prog_ctr, hl, de);
-        fflush(stdout);
-    }
-    #endif
-    if (ch == '\n' || ch == '\r') {
-        printf("\n");
-        fflush(stdout);
-    } else if (ch >= 32 && ch < 127) {
-        printf("%c", ch);
-        fflush(stdout);
+// A console status or input poll that found nothing to read
+static void cpm_idle_poll(void) {
+    unsigned long since = cpm_idle.steps - cpm_idle.last_poll_step;
+    if (cpm_machine->cpu.prog_ctr == cpm_idle.last_poll_pc && since <= CPM_IDLE_SPIN_WINDOW) {
+        if (++cpm_idle.spin_polls >= CPM_IDLE_SPIN_POLLS) {
+            cpm_idle_enter();
+        }
     } else {
-        printf("[0x%02X]", ch);
-        fflush(stdout);
+        cpm_idle.spin_polls = 0;
     }
+    cpm_idle.last_poll_pc = cpm_machine->cpu.prog_ctr;
+    cpm_idle.last_poll_step = cpm_idle.steps;
 }
 
-void cpm_put_char(unsigned char ch) {
-    cpm_console.input_buffer[cpm_console.input_write_pos] = ch;
-    cpm_console.input_write_pos = (cpm_console.input_write_pos + 1) % 256;
-    cpm_console.waiting_for_input = 0;
+// Wake a parked runner: input arrived or an interrupt was raised
+static void cpm_idle_wake(void) {
+    pthread_mutex_lock(&cpm_idle.lock);
+    cpm_idle_set_flag(0);
+    cpm_idle.spin_polls = 0;
+    pthread_cond_broadcast(&cpm_idle.wake);
+    pthread_mutex_unlock(&cpm_idle.lock);
+}
 
-    // Log input characters (for debugging)
-    static int first_input = 1;
-    if (first_input) {
-        printf("\n[Input→CP/M] ");
-        first_input = 0;
-    }
-    if (ch == '\n') {
-        printf("\\n");
-    } else if (ch >= 32 && ch < 127) {
-        printf("%c", ch);
-    } else {
-        printf("[0x%02X]", ch);
-    }
-    fflush(stdout);
+static long cpm_idle_elapsed_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - cpm_idle.idle_since.tv_sec) * 1000 +
+           (now.tv_nsec - cpm_idle.idle_since.tv_nsec) / 1000000;
 }
 
-unsigned char cpm_get_char(void) {
-    if (cpm_console.output_pos == 0) {
-        return 0;
+// 1 while the machine is idle and stepping it would only spin. A parked
+// machine is released once per tick so timed polling loops still advance.
+int cpm_is_idle(void) {
+    if (cpm_idle_flag() && cpm_idle_elapsed_ms() >= CPM_IDLE_TICK_MS) {
+        cpm_idle_set_flag(0);
+        cpm_idle.spin_polls = 0;
     }
-    unsigned char ch = cpm_console.output_buffer[0];
-    cpm_console.output_pos--;
-    memmove(cpm_console.output_buffer, cpm_console.output_buffer + 1, cpm_console.output_pos);
-    return ch;
+    return cpm_idle_flag();
 }
 
-void cpm_bdos_call(struct i8080* cpu) {
-    unsigned char function = (cpu->reg)[C];
-    unsigned char param_e = (cpu->reg)[E];
-
-    switch (function) {
-        case 1: { // Console Input - wait for character
-            // Check if input is available
-            if (cpm_console.input_read_pos == cpm_console.input_write_pos) {
-                // No input available - set waiting flag and don't advance PC
-                cpm_console.waiting_for_input = 1;
-                // Return without modifying A register - will retry this call
-                return;
-            }
+// Block the calling (emulator) thread while the machine is idle or waiting
+// for console input. Returns 1 when input or an interrupt woke it, 0 when
+// timeout_ms passed first (a negative timeout waits one idle tick).
+int cpm_wait_for_event(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long ms = timeout_ms < 0 ? CPM_IDLE_TICK_MS : timeout_ms;
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
 
-            // Input available - get character
-            unsigned char ch = cpm_console_input();
-            (cpu->reg)[A] = ch;
-            cpm_console.waiting_for_input = 0;
+    int woken = 1;
+    pthread_mutex_lock(&cpm_idle.lock);
+    while (cpm_idle_flag() || cpm_console.waiting_for_input) {
+        if (pthread_cond_timedwait(&cpm_idle.wake, &cpm_idle.lock, &deadline) == ETIMEDOUT) {
+            // Timer event: let a spinning guest run for another window
+            cpm_idle_set_flag(0);
+            cpm_idle.spin_polls = 0;
+            woken = 0;
             break;
         }
+    }
+    pthread_mutex_unlock(&cpm_idle.lock);
+    return woken;
+}
 
-        case 2: // Console Output
-            cpm_console_output(param_e);
-            break;
+// ============================================================================
+// EVENT NOTIFICATION
+// ============================================================================
+//
+// Hosts learn about console output, input waits and halts without polling:
+// either through a pipe whose read end becomes readable when an event is
+// pending (for select/poll/kqueue/dispatch sources), or through a callback
+// run on the emulator thread. Events are coalesced: a kind already pending
+// is not signalled again until the host takes it with cpm_event_take, and
+// checking for that is one atomic load, so per-byte output takes no lock.
+
+static void cpm_event_signal(unsigned int events) {
+    if ((__atomic_load_n(&cpm_events.pending, __ATOMIC_SEQ_CST) & events) == events) {
+        return;
+    }
+    pthread_mutex_lock(&cpm_events.lock);
+    unsigned int previous = __atomic_fetch_or(&cpm_events.pending, events, __ATOMIC_SEQ_CST);
+    unsigned int fresh = events & ~previous;
+    int was_empty = (previous == 0);
+    cpm_event_fn callback = cpm_events.callback;
+    void *context = cpm_events.context;
+    if (fresh && was_empty && cpm_events.pipe_ready) {
+        unsigned char token = 1;
+        (void)!write(cpm_events.pipe[1], &token, 1);   // Full pipe is already readable
+    }
+    pthread_mutex_unlock(&cpm_events.lock);
+    if (fresh && callback) {
+        callback(context, fresh);
+    }
+}
 
-        case 9: { // Print String (terminated by $)
-            unsigned int addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-            #if DEBUG_DISK_IO
-            printf("\n[BDOS-9: Print String @ 0x%04X] ", addr);
-            printf("\n[BDOS-9: Bytes @ 0x%04X] ", addr);
-            for (int i = 0; i < 8; i++) {
-                printf("%02X ", mem[addr + i]);
+// Report a halt once; input or an interrupt ends it
+static void cpm_event_halt(void) {
+    if (!cpm_events.halted) {
+        cpm_events.halted = 1;
+        cpm_aux_flush();
+        cpm_event_signal(CPM_EVENT_HALT);
+    }
+}
+
+// File descriptor that polls readable while events are pending, or -1
+int cpm_event_fd(void) {
+    pthread_mutex_lock(&cpm_events.lock);
+    if (!cpm_events.pipe_ready) {
+        if (pipe(cpm_events.pipe) == 0) {
+            for (int i = 0; i < 2; i++) {
+                fcntl(cpm_events.pipe[i], F_SETFL, fcntl(cpm_events.pipe[i], F_GETFL) | O_NONBLOCK);
+                fcntl(cpm_events.pipe[i], F_SETFD, FD_CLOEXEC);
             }
-            printf("\n");
-            #endif
-            while (mem[addr] != '$') {
-                cpm_console_output(mem[addr++]);
+            cpm_events.pipe_ready = 1;
+            if (__atomic_load_n(&cpm_events.pending, __ATOMIC_SEQ_CST)) {
+                unsigned char token = 1;
+                (void)!write(cpm_events.pipe[1], &token, 1);
             }
-            break;
+        } else {
+            printf("[Events] ERROR: Cannot create notification pipe: %s\n", strerror(errno));
+            fflush(stdout);
         }
+    }
+    int fd = cpm_events.pipe_ready ? cpm_events.pipe[0] : -1;
+    pthread_mutex_unlock(&cpm_events.lock);
+    return fd;
+}
 
-        case 10: { // Read Console Buffer
-            unsigned int buffer_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-            unsigned char max_len = mem[buffer_addr];
-
-            // Use a static variable to track current position during multi-call reads
-            static unsigned char count = 0;
-            static int first_call = 1;
-
-            // First call - initialize
-            if (first_call) {
-                count = 0;
-                first_call = 0;
-                #if DEBUG_DISK_IO
-                printf("\n[BDOS-10: Read Console Buffer @ 0x%04X, max=%d]\n", buffer_addr, max_len);
-                fflush(stdout);
-                #endif
-            }
+// Register a callback for new events (NULL to remove). It runs on the
+// emulator thread, mid-instruction: it should only schedule work.
+void cpm_event_set_callback(cpm_event_fn callback, void *context) {
+    pthread_mutex_lock(&cpm_events.lock);
+    cpm_events.callback = callback;
+    cpm_events.context = context;
+    pthread_mutex_unlock(&cpm_events.lock);
+}
 
-            // Read characters until Enter (0x0D) or buffer full
-            while (count < max_len) {
-                // Check if input is available
-                if (cpm_console.input_read_pos == cpm_console.input_write_pos) {
-                    // No input available - set waiting flag and retry
-                    cpm_console.waiting_for_input = 1;
-                    return;  // Will retry this BDOS call
-                }
+// The guest is about to block reading the console
+static void cpm_event_input_wait(void) {
+    if (!cpm_console.waiting_for_input) {
+        cpm_aux_flush();  // The guest is waiting on the user: hand over printed output
+        cpm_console.waiting_for_input = 1;
+        cpm_event_signal(CPM_EVENT_INPUT);
+    }
+}
 
-                unsigned char ch = cpm_console_input();
+// Return and clear the pending events, re-arming the notification
+unsigned int cpm_event_take(void) {
+    pthread_mutex_lock(&cpm_events.lock);
+    unsigned int events = __atomic_exchange_n(&cpm_events.pending, 0, __ATOMIC_SEQ_CST);
+    if (cpm_events.pipe_ready) {
+        unsigned char drain[64];
+        while (read(cpm_events.pipe[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+    pthread_mutex_unlock(&cpm_events.lock);
+    return events;
+}
 
-                // Echo character if enabled
-                if (cpm_console.input_echo) {
-                    cpm_console_output(ch);
-                }
+// ============================================================================
+// TERMINAL EMULATION
+// ============================================================================
+//
+// Console output also drives an 80x24 screen model that understands the
+// ADM-3A control codes and VT52 escapes CP/M software expects. Each row has
+// a dirty bit and every change, cursor moves included, bumps a generation
+// counter, so the host can skip frames where nothing changed and redraw only
+// the rows that did. Rows scrolled off the top are kept until the host takes
+// them for its scrollback (the newest TERM_ROWS when it falls behind).
+//
+//   ADM-3A   ^H left  ^J down  ^K up  ^L right  ^M return  ^Z clear  ^^ home
+//            ESC = row+32 col+32  cursor address
+//            ^X clear to end of line, ^W clear to end of screen (Kaypro)
+//   VT52     ESC A/B/C/D cursor, ESC H home, ESC Y row+32 col+32 address,
+//            ESC J/K clear to end of screen/line, ESC E clear, ESC I reverse LF
+
+static void term_touch(int row) {
+    cpm_term.dirty |= 1u << row;
+    cpm_term.generation++;
+}
 
-                if (ch == 0x0D || ch == 0x0A) {  // Enter
-                    // Echo newline
-                    if (cpm_console.input_echo) {
-                        cpm_console_output(0x0D);
-                        cpm_console_output(0x0A);
-                    }
-                    break;
-                }
+static void term_clear_rows(int from, int to) {
+    for (int r = from; r < to; r++) {
+        memset(cpm_term.cells[r], ' ', TERM_COLS);
+        term_touch(r);
+    }
+}
 
-                // Backspace handling
-                if (ch == 0x08 || ch == 0x7F) {  // BS or DEL
-                    if (count > 0) {
-                        count--;
-                        if (cpm_console.input_echo) {
-                            cpm_console_output(0x08);  // BS
-                            cpm_console_output(' ');   // Space
-                            cpm_console_output(0x08);  // BS
-                        }
-                    }
-                    continue;
-                }
+static void term_clear_to_eol(void) {
+    memset(&cpm_term.cells[cpm_term.row][cpm_term.col], ' ', TERM_COLS - cpm_term.col);
+    term_touch(cpm_term.row);
+}
 
-                mem[buffer_addr + 2 + count] = ch;
-                count++;
-            }
+static void term_reset(void) {
+    term_clear_rows(0, TERM_ROWS);
+    cpm_term.row = 0;
+    cpm_term.col = 0;
+    cpm_term.state = TERM_NORMAL;
+    cpm_term.scrolled_count = 0;
+}
 
-            mem[buffer_addr + 1] = count;  // Store actual length
-            if (count < max_len) {
-                mem[buffer_addr + 2 + count] = 0;  // Null-terminate for parsers
-            }
-            cpm_console.waiting_for_input = 0;
-            first_call = 1;  // Reset for next call
+static void term_line_feed(void) {
+    if (cpm_term.row < TERM_ROWS - 1) {
+        cpm_term.row++;
+        return;
+    }
+    if (cpm_term.scrolled_count == TERM_ROWS) {
+        memmove(cpm_term.scrolled[0], cpm_term.scrolled[1], (TERM_ROWS - 1) * TERM_COLS);
+        cpm_term.scrolled_count--;
+    }
+    memcpy(cpm_term.scrolled[cpm_term.scrolled_count++], cpm_term.cells[0], TERM_COLS);
+    memmove(cpm_term.cells[0], cpm_term.cells[1], (TERM_ROWS - 1) * TERM_COLS);
+    memset(cpm_term.cells[TERM_ROWS - 1], ' ', TERM_COLS);
+    cpm_term.dirty = (1u << TERM_ROWS) - 1;
+    cpm_term.generation++;
+}
 
-            #if DEBUG_DISK_IO
-            printf("[BDOS-10: Read %d characters]\n", count);
-            fflush(stdout);
-            #endif
-            break;
-        }
+static void term_reverse_line_feed(void) {
+    if (cpm_term.row > 0) {
+        cpm_term.row--;
+        return;
+    }
+    memmove(cpm_term.cells[1], cpm_term.cells[0], (TERM_ROWS - 1) * TERM_COLS);
+    memset(cpm_term.cells[0], ' ', TERM_COLS);
+    cpm_term.dirty = (1u << TERM_ROWS) - 1;
+    cpm_term.generation++;
+}
 
-        case 11: // Get Console Status
-            (cpu->reg)[A] = cpm_console_status();
+static void term_escape(unsigned char ch) {
+    cpm_term.state = TERM_NORMAL;
+    switch (ch) {
+        case 'A': if (cpm_term.row > 0) cpm_term.row--; break;
+        case 'B': if (cpm_term.row < TERM_ROWS - 1) cpm_term.row++; break;
+        case 'C': if (cpm_term.col < TERM_COLS - 1) cpm_term.col++; break;
+        case 'D': if (cpm_term.col > 0) cpm_term.col--; break;
+        case 'H': cpm_term.row = 0; cpm_term.col = 0; break;
+        case 'I': term_reverse_line_feed(); break;
+        case 'J':
+            term_clear_to_eol();
+            term_clear_rows(cpm_term.row + 1, TERM_ROWS);
             break;
+        case 'K': term_clear_to_eol(); break;
+        case 'E': term_clear_rows(0, TERM_ROWS); cpm_term.row = 0; cpm_term.col = 0; break;
+        case '=':
+        case 'Y': cpm_term.state = TERM_ADDRESS_ROW; break;
+        default: break;  // Unsupported escapes are swallowed
+    }
+}
 
-        case 13: // Reset Disk System
-            printf("\n[BDOS-13: Reset Disk System]\n");
-            fflush(stdout);
-            cpm_disk.current_disk = 0;
-            cpm_disk.current_track = 0;
-            cpm_disk.current_sector = 1;
-            (cpu->reg)[A] = 0; // Success
+static void term_decode(unsigned char ch) {
+    ch &= 0x7F;
+    switch (cpm_term.state) {
+        case TERM_ESCAPE:
+            term_escape(ch);
+            return;
+        case TERM_ADDRESS_ROW:
+            cpm_term.address_row = ch - 32;
+            cpm_term.state = TERM_ADDRESS_COL;
+            return;
+        case TERM_ADDRESS_COL: {
+            int row = cpm_term.address_row;
+            int col = ch - 32;
+            cpm_term.row = row < 0 ? 0 : (row >= TERM_ROWS ? TERM_ROWS - 1 : row);
+            cpm_term.col = col < 0 ? 0 : (col >= TERM_COLS ? TERM_COLS - 1 : col);
+            cpm_term.state = TERM_NORMAL;
+            return;
+        }
+        default:
             break;
+    }
 
-        case 14: // Select Disk
-            printf("\n[BDOS-14: Select Disk %c:]\n", 'A' + param_e);
-            fflush(stdout);
-            if (param_e <= 1) {
-                cpm_disk.current_disk = param_e;
-                (cpu->reg)[A] = 0; // Success
-            } else {
-                (cpu->reg)[A] = 0xFF; // Error - invalid disk
-            }
+    switch (ch) {
+        case 0x1B: cpm_term.state = TERM_ESCAPE; break;
+        case '\r': cpm_term.col = 0; break;
+        case '\n': term_line_feed(); break;
+        case 0x08: if (cpm_term.col > 0) cpm_term.col--; break;
+        case 0x0B: if (cpm_term.row > 0) cpm_term.row--; break;
+        case 0x0C: if (cpm_term.col < TERM_COLS - 1) cpm_term.col++; break;
+        case 0x09: cpm_term.col = (cpm_term.col + 8) & ~7; if (cpm_term.col >= TERM_COLS) cpm_term.col = TERM_COLS - 1; break;
+        case 0x18: term_clear_to_eol(); break;
+        case 0x17:
+            term_clear_to_eol();
+            term_clear_rows(cpm_term.row + 1, TERM_ROWS);
             break;
-
-        case 25: // Get Current Disk
-            printf("\n[BDOS-25: Get Current Disk → %c:]\n", 'A' + cpm_disk.current_disk);
-            fflush(stdout);
-            (cpu->reg)[A] = cpm_disk.current_disk;
+        case 0x1A: term_clear_rows(0, TERM_ROWS); cpm_term.row = 0; cpm_term.col = 0; break;
+        case 0x1E: cpm_term.row = 0; cpm_term.col = 0; break;
+        default:
+            if (ch < 0x20 || ch == 0x7F) {
+                break;  // Bell and other controls have no visible effect
+            }
+            if (cpm_term.col >= TERM_COLS) {
+                // Deferred wrap: the cursor sat past the last column
+                cpm_term.col = 0;
+                term_line_feed();
+            }
+            cpm_term.cells[cpm_term.row][cpm_term.col++] = (char)ch;
+            term_touch(cpm_term.row);
             break;
+    }
+}
 
-        case 15: // Open File
-            bdos_open_file(cpu);
-            break;
+static void term_put(unsigned char ch) {
+    int row = cpm_term.row;
+    int col = cpm_term.col;
+    term_decode(ch);
+    if (cpm_term.row != row || cpm_term.col != col) {
+        cpm_term.generation++;  // The host redraws its caret
+    }
+}
 
-        case 16: // Close File
-            bdos_close_file(cpu);
-            break;
+static void term_write(const unsigned char *data, size_t len) {
+    terminal_state *term = &cpm_term;
+    size_t i = 0;
+    while (i < len) {
+        // A run of printable text on the current row is one copy and one touch
+        if (term->state == TERM_NORMAL && term->col < TERM_COLS) {
+            size_t room = TERM_COLS - term->col;
+            size_t run = 0;
+            while (run < room && i + run < len && data[i + run] >= 0x20 && data[i + run] < 0x7F) {
+                run++;
+            }
+            if (run > 0) {
+                memcpy(&term->cells[term->row][term->col], data + i, run);
+                term->col += (int)run;
+                term_touch(term->row);
+                i += run;
+                continue;
+            }
+        }
+        term_put(data[i++]);
+    }
+}
 
-        case 17: // Search First
-            bdos_search_first(cpu);
-            break;
+unsigned long cpm_term_generation(void) {
+    return cpm_term.generation;
+}
 
-        case 18: // Search Next
-            bdos_search_next(cpu);
-            break;
+// Rows changed since the last call, as a bit mask (bit 0 = top row)
+unsigned int cpm_term_take_dirty(void) {
+    unsigned int dirty = cpm_term.dirty;
+    cpm_term.dirty = 0;
+    return dirty;
+}
 
-        case 19: // Delete File
-            bdos_delete_file(cpu);
-            break;
+// Take the rows scrolled off the top since the last call, oldest first, as
+// NUL-terminated strings (buffer holds TERM_ROWS rows of TERM_COLS + 1).
+// Returns the number of rows.
+int cpm_term_take_scrolled(char *buffer) {
+    int count = buffer ? cpm_term.scrolled_count : 0;
+    for (int r = 0; r < count; r++) {
+        memcpy(buffer + r * (TERM_COLS + 1), cpm_term.scrolled[r], TERM_COLS);
+        buffer[r * (TERM_COLS + 1) + TERM_COLS] = '\0';
+    }
+    cpm_term.scrolled_count = 0;
+    return count;
+}
 
-        case 20: // Read Sequential
-            bdos_read_sequential(cpu);
-            break;
+// Copy one row as a NUL-terminated string (buffer holds TERM_COLS + 1)
+int cpm_term_get_row(int row, char *buffer) {
+    if (row < 0 || row >= TERM_ROWS || !buffer) {
+        return 0;
+    }
+    memcpy(buffer, cpm_term.cells[row], TERM_COLS);
+    buffer[TERM_COLS] = '\0';
+    return TERM_COLS;
+}
 
-        case 21: // Write Sequential
-            bdos_write_sequential(cpu);
-            break;
-
-        case 22: // Make File
-            bdos_make_file(cpu);
-            break;
-
-        case 23: // Rename File
-            bdos_rename_file(cpu);
-            break;
-
-        case 26: { // Set DMA Address
-            unsigned int dma = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-            printf("\n[BDOS-26: Set DMA Address → 0x%04X]\n", dma);
-            fflush(stdout);
-            cpm_disk.dma_address = dma;
-            (cpu->reg)[A] = 0; // Success
-            break;
-        }
-
-        default:
-            printf("\n[BDOS: Unimplemented function %d]\n", function);
-            (cpu->reg)[A] = 0xFF; // Error
-            break;
-    }
-}
+void cpm_term_get_cursor(int *row, int *col) {
+    if (row) *row = cpm_term.row;
+    if (col) *col = cpm_term.col < TERM_COLS ? cpm_term.col : TERM_COLS - 1;
+}
 
 // ============================================================================
-// DISK EMULATION
+// SCRIPTED INPUT
 // ============================================================================
+//
+// An automation script is a list of steps: wait until one of the step's
+// patterns appears in the console output, then type the step's text. All
+// patterns of all steps are compiled into one Aho-Corasick automaton, so each
+// output byte costs one table lookup however many patterns there are, and
+// input is injected as soon as the prompt is written. Each node lists every
+// pattern that ends there, so the same prompt can be expected by many steps.
+// Text is typed only as fast as the 256-byte console input ring drains; the
+// rest follows whenever the guest finds the ring empty. Step timeouts are
+// counted in emulated cycles, so a scripted run is deterministic and runs as
+// fast as the emulator can go.
+
+static void console_key(unsigned char ch);
+void cpm_console_write(const unsigned char *data, size_t len);
+
+void cpm_script_clear(void) {
+    for (int i = 0; i < cpm_script.count; i++) {
+        free(cpm_script.steps[i].send);
+    }
+    for (int i = 0; i < cpm_script.pattern_count; i++) {
+        free(cpm_script.pattern_text[i]);
+    }
+    free(cpm_script.pattern_text);
+    free(cpm_script.pattern_step);
+    free(cpm_script.next);
+    free(cpm_script.match);
+    free(cpm_script.match_next);
+    free(cpm_script.dict);
+    memset(&cpm_script, 0, sizeof(script_state));
+    cpm_script.state = SCRIPT_IDLE;
+}
 
-static int get_disk_path(char *buffer, size_t size, const char *filename) {
-    if (!buffer || size == 0) {
+static int script_add_pattern(const char *text, size_t len, int step) {
+    char **texts = realloc(cpm_script.pattern_text, (cpm_script.pattern_count + 1) * sizeof(char *));
+    if (!texts) {
         return 0;
     }
-    const char *base = disk_base_path[0] != '\0' ? disk_base_path : getenv("HOME");
-    if (!base) {
+    cpm_script.pattern_text = texts;
+    int *steps = realloc(cpm_script.pattern_step, (cpm_script.pattern_count + 1) * sizeof(int));
+    if (!steps) {
         return 0;
     }
-    if (disk_base_path[0] != '\0') {
-        int written = snprintf(buffer, size, "%s/%s", base, filename);
-        return (written > 0 && (size_t)written < size);
+    cpm_script.pattern_step = steps;
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        return 0;
     }
-    int written = snprintf(buffer, size, "%s/Documents/%s", base, filename);
-    return (written > 0 && (size_t)written < size);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    texts[cpm_script.pattern_count] = copy;
+    steps[cpm_script.pattern_count] = step;
+    cpm_script.pattern_count++;
+    return 1;
 }
 
-void cpm_set_disk_base_path(const char *path) {
-    if (!path) {
-        disk_base_path[0] = '\0';
-        return;
+// Append a step. expect may hold alternatives separated by '|'; NULL or ""
+// sends immediately. Returns the step index, or -1.
+int cpm_script_add(const char *expect, const char *send, unsigned long long timeout_cycles) {
+    if (cpm_script.count >= SCRIPT_MAX_STEPS) {
+        return -1;
     }
-    snprintf(disk_base_path, sizeof(disk_base_path), "%s", path);
+    int step = cpm_script.count;
+    script_step_t *s = &cpm_script.steps[step];
+    s->send = strdup(send ? send : "");
+    s->timeout = timeout_cycles;
+    s->patterns = 0;
+    if (!s->send) {
+        return -1;
+    }
+    for (const char *p = expect; p && *p; ) {
+        const char *bar = strchr(p, '|');
+        size_t len = bar ? (size_t)(bar - p) : strlen(p);
+        if (len > 0) {
+            if (!script_add_pattern(p, len, step)) {
+                free(s->send);
+                return -1;
+            }
+            s->patterns++;
+        }
+        p = bar ? bar + 1 : p + len;
+    }
+    cpm_script.count++;
+    cpm_script.built = 0;
+    return step;
 }
 
-static int load_disk_image(const char *filename, unsigned char *disk, size_t size) {
-    char path[512];
-    if (!get_disk_path(path, sizeof(path), filename)) {
-        return 0;
+static int script_new_node(int *capacity) {
+    if (cpm_script.nodes == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 64;
+        void *next = realloc(cpm_script.next, grown * sizeof(*cpm_script.next));
+        void *match = next ? realloc(cpm_script.match, grown * sizeof(int)) : NULL;
+        if (next) cpm_script.next = next;
+        if (match) cpm_script.match = match;
+        void *dict = match ? realloc(cpm_script.dict, grown * sizeof(int)) : NULL;
+        if (!dict) {
+            return -1;
+        }
+        cpm_script.dict = dict;
+        *capacity = grown;
     }
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        printf("[Disk] ERROR: Failed to open %s (%s)\n", path, strerror(errno));
-        fflush(stdout);
-        return 0;
+    int node = cpm_script.nodes++;
+    for (int c = 0; c < SCRIPT_ALPHABET; c++) {
+        cpm_script.next[node][c] = -1;
     }
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    printf("[Disk] Loading image %s (%ld bytes)\n", path, file_size);
-    fflush(stdout);
-    if (file_size != (long)size) {
-        fclose(f);
-        printf("[Disk] ERROR: Image size mismatch (expected %lu)\n", (unsigned long)size);
-        fflush(stdout);
+    cpm_script.match[node] = -1;
+    cpm_script.dict[node] = 0;
+    return node;
+}
+
+// Build the automaton: a trie of every pattern, then a breadth-first pass
+// that fills missing transitions from the failure links
+static int script_build(void) {
+    int capacity = 0;
+    free(cpm_script.next);
+    free(cpm_script.match);
+    free(cpm_script.match_next);
+    free(cpm_script.dict);
+    cpm_script.next = NULL;
+    cpm_script.match = NULL;
+    cpm_script.dict = NULL;
+    cpm_script.nodes = 0;
+    cpm_script.match_next = malloc((cpm_script.pattern_count + 1) * sizeof(int));
+    if (!cpm_script.match_next || script_new_node(&capacity) < 0) {
         return 0;
     }
-    size_t read_size = fread(disk, 1, size, f);
-    fclose(f);
-    if (read_size != size) {
-        return 0;
+    for (int id = 0; id < cpm_script.pattern_count; id++) {
+        int node = 0;
+        for (const unsigned char *c = (const unsigned char *)cpm_script.pattern_text[id]; *c; c++) {
+            int ch = *c & 0x7F;
+            if (cpm_script.next[node][ch] < 0) {
+                int child = script_new_node(&capacity);
+                if (child < 0) {
+                    return 0;
+                }
+                cpm_script.next[node][ch] = child;
+            }
+            node = cpm_script.next[node][ch];
+        }
+        cpm_script.match_next[id] = cpm_script.match[node];
+        cpm_script.match[node] = id;
     }
-    printf("[Disk] Loaded image %s\n", path);
-    fflush(stdout);
-    return 1;
-}
 
-static void save_disk_image(const char *filename, unsigned char *disk, size_t size) {
-    char path[512];
-    if (!get_disk_path(path, sizeof(path), filename)) {
-        return;
+    int *fail = calloc(cpm_script.nodes, sizeof(int));
+    int *queue = malloc(cpm_script.nodes * sizeof(int));
+    if (!fail || !queue) {
+        free(fail);
+        free(queue);
+        return 0;
     }
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        printf("[Disk] ERROR: Failed to save %s (%s)\n", path, strerror(errno));
-        fflush(stdout);
-        return;
+    int head = 0, tail = 0;
+    for (int c = 0; c < SCRIPT_ALPHABET; c++) {
+        int child = cpm_script.next[0][c];
+        if (child < 0) {
+            cpm_script.next[0][c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
     }
-    size_t written = fwrite(disk, 1, size, f);
-    fclose(f);
-    if (written != size) {
-        printf("[Disk] ERROR: Short write saving %s\n", path);
-        fflush(stdout);
-        return;
+    while (head < tail) {
+        int node = queue[head++];
+        int f = fail[node];
+        cpm_script.dict[node] = (cpm_script.match[f] >= 0) ? f : cpm_script.dict[f];
+        for (int c = 0; c < SCRIPT_ALPHABET; c++) {
+            int child = cpm_script.next[node][c];
+            if (child < 0) {
+                cpm_script.next[node][c] = cpm_script.next[f][c];
+            } else {
+                fail[child] = cpm_script.next[f][c];
+                queue[tail++] = child;
+            }
+        }
     }
+    free(fail);
+    free(queue);
+    cpm_script.node = 0;
+    cpm_script.built = 1;
+    return 1;
 }
 
-static void cpm_disk_load_images(void) {
-    disk_a_loaded = load_disk_image("A.DSK", disk_a, sizeof(disk_a));
-    disk_b_loaded = load_disk_image("B.DSK", disk_b, sizeof(disk_b));
-    printf("[Disk] A.DSK loaded: %s\n", disk_a_loaded ? "yes" : "no");
-    printf("[Disk] B.DSK loaded: %s\n", disk_b_loaded ? "yes" : "no");
-    fflush(stdout);
+// Type queued step text while the console input ring has room
+static void script_pump(void) {
+    int room = (cpm_console.input_read_pos - cpm_console.input_write_pos + 255) % 256;
+    while (room > 0 && cpm_script.type_step < cpm_script.type_end && cpm_script.state != SCRIPT_TIMEOUT) {
+        const char *text = cpm_script.steps[cpm_script.type_step].send + cpm_script.type_pos;
+        if (*text == '\0') {
+            cpm_script.type_step++;
+            cpm_script.type_pos = 0;
+            continue;
+        }
+        console_key((unsigned char)*text);
+        cpm_script.type_pos++;
+        room--;
+    }
 }
 
-static void cpm_disk_save_current(void) {
-    if (cpm_disk.current_disk == 0) {
-        save_disk_image("A.DSK", disk_a, sizeof(disk_a));
-    } else {
-        save_disk_image("B.DSK", disk_b, sizeof(disk_b));
+// Queue a triggered step's text behind any still being typed
+static void script_type(int step) {
+    if (cpm_script.type_step == cpm_script.type_end) {
+        cpm_script.type_step = step;
+        cpm_script.type_pos = 0;
     }
+    cpm_script.type_end = step + 1;
+    script_pump();
 }
 
-void cpm_disk_init(void) {
-    memset(&cpm_disk, 0, sizeof(disk_state));
-    cpm_disk.dma_address = 0x0080; // Default DMA address
-    memset(disk_a, 0xE5, sizeof(disk_a)); // Fill with 0xE5 (CP/M empty marker)
-    memset(disk_b, 0xE5, sizeof(disk_b));
-    cpm_disk_load_images();
-    disk_dir_base_offset[0] = detect_directory_base_offset(disk_a, sizeof(disk_a));
-    disk_dir_base_offset[1] = detect_directory_base_offset(disk_b, sizeof(disk_b));
-    cpm_disk.dir_base_offset = disk_dir_base_offset[cpm_disk.current_disk];
-    printf("[Disk] Directory base offset A: %u bytes\n", disk_dir_base_offset[0]);
-    printf("[Disk] Directory base offset B: %u bytes\n", disk_dir_base_offset[1]);
-    fflush(stdout);
+// Input is waiting for the guest, refilling the ring from the script first
+static int console_input_ready(void) {
+    if (cpm_console.input_read_pos == cpm_console.input_write_pos &&
+        cpm_script.type_step < cpm_script.type_end) {
+        script_pump();
+    }
+    return cpm_console.input_read_pos != cpm_console.input_write_pos;
+}
 
-    printf("[Disk] Initialized 2 drives (A: and B:)\n");
-    printf("[Disk] Size: 256KB each (77 tracks × 26 sectors × 128 bytes)\n");
-    fflush(stdout);
+// Make step the current one, sending at once for steps with nothing to wait for
+static void script_enter(int step) {
+    while (step < cpm_script.count && cpm_script.steps[step].patterns == 0) {
+        script_type(step);
+        step++;
+    }
+    cpm_script.current = step;
+    if (step >= cpm_script.count) {
+        cpm_script.state = SCRIPT_DONE;
+        printf("[Script] Done\n");
+        fflush(stdout);
+        return;
+    }
+    unsigned long long timeout = cpm_script.steps[step].timeout;
+    cpm_script.deadline = timeout ? cpu_cycles + timeout : 0;
 }
 
-void cpm_select_disk(unsigned char disk) {
-    cpm_disk.current_disk = disk;
-    cpm_disk.dir_base_offset = disk_dir_base_offset[disk];
-    printf("[Disk] Selected drive %c:\n", 'A' + disk);
-    fflush(stdout);
+int cpm_script_start(void) {
+    if (!cpm_script.built && !script_build()) {
+        printf("[Script] ERROR: Out of memory building the pattern automaton\n");
+        fflush(stdout);
+        return 0;
+    }
+    cpm_script.node = 0;
+    cpm_script.type_step = cpm_script.type_end = 0;
+    cpm_script.type_pos = 0;
+    cpm_script.state = SCRIPT_RUNNING;
+    script_enter(0);
+    return 1;
 }
 
-void cpm_set_track(unsigned char track) {
-    cpm_disk.current_track = track;
+// Current state; step receives the step the script is on
+int cpm_script_state(int *step) {
+    if (step) {
+        *step = cpm_script.current;
+    }
+    return cpm_script.state;
 }
 
-void cpm_set_sector(unsigned char sector) {
-    cpm_disk.current_sector = sector;
+// Match console output against the automaton
+static void script_feed(const unsigned char *data, size_t len) {
+    int node = cpm_script.node;
+    for (size_t i = 0; i < len && cpm_script.state == SCRIPT_RUNNING; i++) {
+        node = cpm_script.next[node][data[i] & 0x7F];
+        int matched = 0;
+        for (int m = cpm_script.match[node] >= 0 ? node : cpm_script.dict[node]; m > 0 && !matched; m = cpm_script.dict[m]) {
+            for (int id = cpm_script.match[m]; id >= 0; id = cpm_script.match_next[id]) {
+                if (cpm_script.pattern_step[id] == cpm_script.current) {
+                    script_type(cpm_script.current);
+                    script_enter(cpm_script.current + 1);
+                    matched = 1;
+                    break;
+                }
+            }
+        }
+    }
+    cpm_script.node = node;
 }
 
-void cpm_set_dma(unsigned int address) {
-    cpm_disk.dma_address = address;
+// Called as cycles pass: fail the script when its step runs out of time
+static void script_check_timeout(void) {
+    if (cpm_script.deadline && cpu_cycles >= cpm_script.deadline) {
+        cpm_script.state = SCRIPT_TIMEOUT;
+        printf("[Script] Step %d timed out\n", cpm_script.current);
+        fflush(stdout);
+    }
 }
 
-void cpm_home_disk(void) {
-    cpm_disk.current_track = 0;
-    printf("[Disk] Home: Track 0\n");
-    fflush(stdout);
+void cpm_console_init(void) {
+    free(cpm_console.output_ring);
+    memset(&cpm_console, 0, sizeof(console_state));
+    cpm_console.waiting_for_input = 0;
+    cpm_console.input_echo = 1;  // Echo input by default
+    cpm_idle_set_flag(0);
+    cpm_idle.spin_polls = 0;
+    term_reset();
 }
 
-int cpm_read_sector(void) {
-    // Validate sector number (CP/M sectors are 1-26)
-    if (cpm_disk.current_sector < 1 || cpm_disk.current_sector > 26) {
-        printf("[Disk] ERROR: Invalid sector %d\n", cpm_disk.current_sector);
-        return 1;
+int cpm_console_status(void) {
+    if (!console_input_ready()) {
+        cpm_idle_poll();
+        return 0x00;
     }
+    return 0xFF;
+}
 
-    // Calculate offset in disk image
-    int offset = (cpm_disk.current_track * 26 + (cpm_disk.current_sector - 1)) * 128;
-
-    // Select disk image
-    unsigned char *disk = (cpm_disk.current_disk == 0) ? disk_a : disk_b;
-
-    // Copy sector to DMA address
-    for (int i = 0; i < 128; i++) {
-        mem[cpm_disk.dma_address + i] = disk[offset + i];
+// Store into the guest line buffer; the call's history step covers these
+static void line_store(unsigned int address, unsigned char value) {
+    address &= 0xFFFF;
+    if (history_recording) {
+        history_write(address);
     }
-
-    printf("[Disk] Read %c: T%d S%d → DMA 0x%04X\n",
-           'A' + cpm_disk.current_disk,
-           cpm_disk.current_track,
-           cpm_disk.current_sector,
-           cpm_disk.dma_address);
-    fflush(stdout);
-
-    return 0; // Success
+    mem[address] = value;
 }
 
-int cpm_write_sector(void) {
-    // Validate sector number
-    if (cpm_disk.current_sector < 1 || cpm_disk.current_sector > 26) {
-        printf("[Disk] ERROR: Invalid sector %d\n", cpm_disk.current_sector);
-        return 1;
+// Feed buffered input to the BDOS 10 line in progress, all of it in one
+// pass, with the echo written in spans. A script keeps refilling the ring
+// while it drains, so the echo is flushed whenever it fills. Returns 1 once
+// the line is complete and stored in the guest buffer, 0 while more input
+// is needed.
+static int cpm_console_line_continue(void) {
+    unsigned char echo[256 * 3 + 2];
+    size_t echoed = 0;
+    int done = (cpm_console.line_count >= cpm_console.line_max);
+    while (!done && console_input_ready()) {
+        if (echoed > sizeof(echo) - 3) {
+            if (cpm_console.input_echo) {
+                cpm_console_write(echo, echoed);
+            }
+            echoed = 0;
+        }
+        unsigned char ch = cpm_console.input_buffer[cpm_console.input_read_pos];
+        cpm_console.input_read_pos = (cpm_console.input_read_pos + 1) % 256;
+
+        if (ch == 0x0D || ch == 0x0A) {  // Enter
+            echo[echoed++] = 0x0D;
+            echo[echoed++] = 0x0A;
+            done = 1;
+        } else if (ch == 0x08 || ch == 0x7F) {  // BS or DEL
+            if (cpm_console.line_count > 0) {
+                cpm_console.line_count--;
+                echo[echoed++] = 0x08;
+                echo[echoed++] = ' ';
+                echo[echoed++] = 0x08;
+            }
+        } else {
+            line_store(cpm_console.line_addr + 2 + cpm_console.line_count, ch);
+            echo[echoed++] = ch;
+            done = (++cpm_console.line_count >= cpm_console.line_max);
+        }
     }
-
-    // Calculate offset in disk image
-    int offset = (cpm_disk.current_track * 26 + (cpm_disk.current_sector - 1)) * 128;
-
-    // Select disk image
-    unsigned char *disk = (cpm_disk.current_disk == 0) ? disk_a : disk_b;
-
-    // Copy from DMA address to sector
-    for (int i = 0; i < 128; i++) {
-        disk[offset + i] = mem[cpm_disk.dma_address + i];
+    if (echoed > 0) {
+        cpm_idle_progress();
+        if (cpm_console.input_echo) {
+            cpm_console_write(echo, echoed);
+        }
+    }
+    if (!done) {
+        return 0;
     }
 
-    printf("[Disk] Write %c: T%d S%d ← DMA 0x%04X\n",
-           'A' + cpm_disk.current_disk,
-           cpm_disk.current_track,
-           cpm_disk.current_sector,
-           cpm_disk.dma_address);
+    line_store(cpm_console.line_addr + 1, cpm_console.line_count);  // Store actual length
+    if (cpm_console.line_count < cpm_console.line_max) {
+        line_store(cpm_console.line_addr + 2 + cpm_console.line_count, 0);  // Null-terminate for parsers
+    }
+    cpm_console.line_active = 0;
+    cpm_console.waiting_for_input = 0;
+    #if DEBUG_DISK_IO
+    printf("[BDOS-10: Read %d characters]\n", cpm_console.line_count);
     fflush(stdout);
-    cpm_disk_save_current();
-
-    return 0; // Success
+    #endif
+    return 1;
 }
 
-// ============================================================================
-// CP/M FILE SYSTEM
-// ============================================================================
-
-// FCB (File Control Block) structure - 32 bytes
-typedef struct {
-    unsigned char drive;           // 0: use default, 1-16: A-P
-    char filename[8];              // Filename, padded with spaces
-    char extension[3];             // Extension, padded with spaces
-    unsigned char extent_low;      // Extent number (low byte)
-    unsigned char reserved[2];     // Reserved bytes
-    unsigned char record_count;    // Records in current extent (0-128)
-    unsigned char allocation[16];  // Block allocation map
-} fcb_t;
-
-// Directory entry structure (same as FCB for directory storage)
-typedef struct {
-    unsigned char user_number;     // 0-15 user, 0xE5 = deleted
-    char filename[8];
-    char extension[3];
-    unsigned char extent_low;
-    unsigned char reserved[2];
-    unsigned char record_count;
-    unsigned char allocation[16];
-} dir_entry_t;
-
-// Helper: Get pointer to current disk
-unsigned char* get_current_disk(void) {
-    return (cpm_disk.current_disk == 0) ? disk_a : disk_b;
+unsigned char cpm_console_input(void) {
+    while (!console_input_ready()) {
+        cpm_idle_poll();
+        return 0; // No input available
+    }
+    cpm_idle_progress();
+    unsigned char ch = cpm_console.input_buffer[cpm_console.input_read_pos];
+    cpm_console.input_read_pos = (cpm_console.input_read_pos + 1) % 256;
+    return ch;
 }
 
-static int is_valid_dir_char(unsigned char ch) {
-    ch &= 0x7F;
-    if (ch == ' ' || ch == 0x00) {
+// Make room for len more bytes of output, growing the ring up to its limit
+static int console_output_reserve(size_t len) {
+    size_t used = cpm_console.output_write - cpm_console.output_read;
+    if (used + len <= cpm_console.output_size) {
         return 1;
     }
-    if ((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
-        return 1;
+    size_t size = cpm_console.output_size ? cpm_console.output_size : CONSOLE_OUTPUT_INITIAL;
+    while (size < used + len && size < CONSOLE_OUTPUT_MAX) {
+        size *= 2;
     }
-    return 0;
+    if (size == cpm_console.output_size) {
+        return 0;
+    }
+    unsigned char *ring = malloc(size);
+    if (!ring) {
+        return 0;
+    }
+    // Linearize the pending output at the start of the new ring
+    size_t mask = cpm_console.output_size - 1;
+    for (size_t i = 0; i < used; i++) {
+        ring[i] = cpm_console.output_ring[(cpm_console.output_read + i) & mask];
+    }
+    free(cpm_console.output_ring);
+    cpm_console.output_ring = ring;
+    cpm_console.output_size = size;
+    cpm_console.output_read = 0;
+    cpm_console.output_write = used;
+    return used + len <= size;
 }
 
-static int entry_is_blank(const unsigned char *entry) {
-    for (int i = 0; i < 11; i++) {
-        unsigned char ch = entry[1 + i] & 0x7F;
-        if (ch != 0x00 && ch != ' ') {
-            return 0;
+static void console_output_append(const unsigned char *data, size_t len) {
+    if (!console_output_reserve(len)) {
+        if (!cpm_console.output_ring) {
+            return;
+        }
+        // Host is not keeping up: keep the newest output
+        if (len > cpm_console.output_size) {
+            data += len - cpm_console.output_size;
+            len = cpm_console.output_size;
+        }
+        size_t used = cpm_console.output_write - cpm_console.output_read;
+        if (used + len > cpm_console.output_size) {
+            cpm_console.output_read += used + len - cpm_console.output_size;
         }
     }
-    return 1;
+    size_t mask = cpm_console.output_size - 1;
+    size_t at = cpm_console.output_write & mask;
+    size_t first = cpm_console.output_size - at < len ? cpm_console.output_size - at : len;
+    memcpy(cpm_console.output_ring + at, data, first);
+    memcpy(cpm_console.output_ring, data + first, len - first);
+    cpm_console.output_write += len;
 }
 
-static int entry_has_filename(const unsigned char *entry) {
-    for (int i = 0; i < 8; i++) {
-        unsigned char ch = entry[1 + i] & 0x7F;
-        if (ch != 0x00 && ch != ' ') {
-            return 1;
+// Mirror output to Xcode console (the app's machine only; sessions would
+// interleave)
+static void console_mirror(const unsigned char *data, size_t len) {
+    #if DEBUG_CONSOLE
+    if (cpm_machine != &cpm_default_machine) {
+        return;
+    }
+    size_t run = 0;
+    for (size_t i = 0; i <= len; i++) {
+        unsigned char ch = (i < len) ? data[i] : 0;
+        if (i < len && ch >= 32 && ch < 127) {
+            continue;
+        }
+        fwrite(data + run, 1, i - run, stdout);
+        run = i + 1;
+        if (i == len) {
+            break;
+        }
+        if (ch == '\n' || ch == '\r') {
+            putchar('\n');
+        } else {
+            printf("[0x%02X]", ch);
         }
     }
-    return 0;
+    fflush(stdout);
+    #else
+    (void)data; (void)len;
+    #endif
 }
 
-static int entry_looks_valid(const unsigned char *entry) {
-    unsigned char user = entry[0];
-    if (user == 0xE5 || user > 0x1F) {
-        return 0;
+// Single-byte output (OUT 01h/F2h, BDOS 2) is gathered into a burst and
+// appended to the ring as one span at a line end, when full, when the run
+// returns or when the host reads
+static void console_flush_burst(void) {
+    if (cpm_console.burst_len > 0) {
+        console_output_append(cpm_console.burst, cpm_console.burst_len);
+        cpm_event_signal(CPM_EVENT_OUTPUT);
+        console_mirror(cpm_console.burst, cpm_console.burst_len);
+        cpm_console.burst_len = 0;
     }
+}
 
-    if (entry_is_blank(entry) || !entry_has_filename(entry)) {
-        return 0;
+void cpm_console_output(unsigned char ch) {
+    cpm_idle_progress();
+    cpm_console.burst[cpm_console.burst_len++] = ch;
+    term_put(ch);
+    if (cpm_script.state == SCRIPT_RUNNING) {
+        script_feed(&ch, 1);
     }
 
-    for (int i = 0; i < 11; i++) {
-        unsigned char ch = entry[1 + i];
-        if (!is_valid_dir_char(ch)) {
-            return 0;
-        }
+    #if DEBUG_DISK_IO
+    if (ch == 0x00) {
+        unsigned int hl = 0x100 * cpm_machine->cpu.reg[H] + cpm_machine->cpu.reg[L];
+        unsigned int de = 0x100 * cpm_machine->cpu.reg[D] + cpm_machine->cpu.reg[E];
+        printf("\n[OUT: NUL] PC=0x%04X HL=0x%04X DE=0x%04X\n", cpm_machine->cpu.prog_ctr, hl, de);
+        fflush(stdout);
+    }
+    #endif
+    if (ch == '\r' || ch == '\n' || cpm_console.burst_len == sizeof(cpm_console.burst)) {
+        console_flush_burst();
     }
+}
 
-    return 1;
+// Bulk console output: one append and one mirror write for the whole span
+void cpm_console_write(const unsigned char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    cpm_idle_progress();
+    console_flush_burst();
+    console_output_append(data, len);
+    cpm_event_signal(CPM_EVENT_OUTPUT);
+    term_write(data, len);
+    if (cpm_script.state == SCRIPT_RUNNING) {
+        script_feed(data, len);
+    }
+    console_mirror(data, len);
 }
 
-static int directory_score(const unsigned char *disk, int base_offset) {
-    int score = 0;
-    for (int i = 0; i < 64; i++) {
-        const unsigned char *entry = disk + base_offset + (i * 32);
-        if (entry_looks_valid(entry)) {
-            score++;
+// Print a '$'-terminated string from guest memory, wrapping at 64KB
+static void cpm_console_print_string(unsigned int addr) {
+    size_t remaining = 0x10000;  // Give up after one pass over memory
+    addr &= 0xFFFF;
+    while (remaining > 0) {
+        size_t span = 0x10000 - addr < remaining ? 0x10000 - addr : remaining;
+        const unsigned char *end = memchr(&mem[addr], '$', span);
+        size_t len = end ? (size_t)(end - &mem[addr]) : span;
+        cpm_console_write(&mem[addr], len);
+        if (end) {
+            return;
         }
+        remaining -= span;
+        addr = 0;
     }
-    return score;
 }
 
-static unsigned int detect_directory_base_offset(const unsigned char *disk, size_t disk_size) {
-    int base0 = 0;
-    int base2 = 2 * 26 * 128;
-    int entry_bytes = 64 * 32;
+static void console_enqueue(unsigned char ch) {
+    cpm_console.input_buffer[cpm_console.input_write_pos] = ch;
+    cpm_console.input_write_pos = (cpm_console.input_write_pos + 1) % 256;
+    pthread_mutex_lock(&cpm_idle.lock);
+    cpm_console.waiting_for_input = 0;
+    pthread_mutex_unlock(&cpm_idle.lock);
+    cpm_idle_wake();
+}
 
-    if (base2 + entry_bytes > (int)disk_size) {
-        return 0;
+// A key typed on the CPU thread (scripts, recorded host input)
+static void console_key(unsigned char ch) {
+    if (cpm_replay.mode == REPLAY_PLAYING) {
+        return;  // Input comes from the log
     }
+    record_event(REPLAY_EVENT_KEY, &ch, 1);
+    console_enqueue(ch);
+}
 
-    int score0 = directory_score(disk, base0);
-    int score2 = directory_score(disk, base2);
-    if (score2 > score0) {
-        return (unsigned int)base2;
+void cpm_put_char(unsigned char ch) {
+    if (cpm_replay.mode == REPLAY_PLAYING) {
+        return;  // Input comes from the log
+    }
+    if (!record_queue_input(REPLAY_EVENT_KEY, ch)) {
+        console_enqueue(ch);
     }
 
-    return (unsigned int)base0;
+    // Log input characters (for debugging)
+    if (cpm_machine != &cpm_default_machine) {
+        return;
+    }
+    static int first_input = 1;
+    if (first_input) {
+        printf("\n[Input→CP/M] ");
+        first_input = 0;
+    }
+    if (ch == '\n') {
+        printf("\\n");
+    } else if (ch >= 32 && ch < 127) {
+        printf("%c", ch);
+    } else {
+        printf("[0x%02X]", ch);
+    }
+    fflush(stdout);
 }
 
-// Helper: Read directory entry (0-63 for tracks 0-1)
-void read_dir_entry(int entry_num, dir_entry_t* entry) {
-    unsigned char* disk = get_current_disk();
-    int sector_offset = entry_num / 4;  // 4 entries per sector
-    int entry_offset = entry_num % 4;   // Which entry in sector
-    int disk_offset = (int)cpm_disk.dir_base_offset + sector_offset * 128 + entry_offset * 32;
-    memcpy(entry, &disk[disk_offset], 32);
+unsigned char cpm_get_char(void) {
+    console_flush_burst();
+    if (cpm_console.output_read == cpm_console.output_write) {
+        return 0;
+    }
+    unsigned char ch = cpm_console.output_ring[cpm_console.output_read & (cpm_console.output_size - 1)];
+    cpm_console.output_read++;
+    return ch;
 }
 
-// Helper: Write directory entry
-void write_dir_entry(int entry_num, dir_entry_t* entry) {
-    unsigned char* disk = get_current_disk();
-    int sector_offset = entry_num / 4;
-    int entry_offset = entry_num % 4;
-    int disk_offset = (int)cpm_disk.dir_base_offset + sector_offset * 128 + entry_offset * 32;
-    memcpy(&disk[disk_offset], entry, 32);
-    cpm_disk_save_current();
+// Take up to max bytes of pending output. Returns the number copied.
+int cpm_read_output(unsigned char *buffer, int max) {
+    console_flush_burst();
+    size_t pending = cpm_console.output_write - cpm_console.output_read;
+    size_t len = (size_t)(max > 0 ? max : 0) < pending ? (size_t)max : pending;
+    size_t mask = cpm_console.output_size - 1;
+    for (size_t copied = 0; copied < len; ) {
+        size_t at = (cpm_console.output_read + copied) & mask;
+        size_t chunk = cpm_console.output_size - at < len - copied ? cpm_console.output_size - at : len - copied;
+        memcpy(buffer + copied, cpm_console.output_ring + at, chunk);
+        copied += chunk;
+    }
+    cpm_console.output_read += len;
+    return (int)len;
 }
 
-// Helper: Compare filename and extension
-int fcb_match(dir_entry_t* entry, fcb_t* fcb) {
-    // Check if entry is deleted
-    if (entry->user_number == 0xE5) {
-        #if DEBUG_DISK_IO
-        printf("  [fcb_match] Entry is deleted (0xE5)\n");
-        fflush(stdout);
-        #endif
-        return 0;
-    }
+// ============================================================================
+// LOGICAL DEVICES (LST:, PUN:, RDR:)
+// ============================================================================
+//
+// The list and punch devices gather output in a AUX_BUFFER_SIZE buffer and
+// write it to their file or pipe when it fills, when the guest blocks on
+// console input or halts, and on detach, so a long report costs one host
+// write per 64KB. A capture keeps everything in memory until the host takes
+// it. The reader reads ahead in chunks of the same size and returns ^Z
+// (CP/M end of file) once its source is exhausted, or when none is attached.
+// Reads from a pipe block until the writer supplies data, as a real reader
+// would. Attachments belong to the machine and survive resets.
+
+static int aux_output_device(int device) {
+    return device == CPM_AUX_LIST || device == CPM_AUX_PUNCH;
+}
 
-    if (!entry_looks_valid((const unsigned char *)entry)) {
-        #if DEBUG_DISK_IO
-        printf("  [fcb_match] Entry invalid\n");
-        fflush(stdout);
-        #endif
+static int aux_reserve(aux_device_t *dev, size_t size) {
+    if (dev->size >= size) {
+        return 1;
+    }
+    size_t grown = dev->size ? dev->size : AUX_BUFFER_SIZE;
+    while (grown < size) {
+        grown *= 2;
+    }
+    unsigned char *buffer = realloc(dev->buffer, grown);
+    if (!buffer) {
         return 0;
     }
+    dev->buffer = buffer;
+    dev->size = grown;
+    return 1;
+}
 
-    #if DEBUG_DISK_IO
-    printf("  [fcb_match] Entry: '%.8s.%.3s' vs FCB: '%.8s.%.3s'\n",
-           entry->filename, entry->extension, fcb->filename, fcb->extension);
-    fflush(stdout);
-    #endif
-
-    // Compare filename (handle ? wildcards)
-    for (int i = 0; i < 8; i++) {
-        if (fcb->filename[i] != '?' && fcb->filename[i] != entry->filename[i]) {
-            #if DEBUG_DISK_IO
-            printf("  [fcb_match] Filename mismatch at position %d: '%c' != '%c'\n",
-                   i, fcb->filename[i], entry->filename[i]);
-            fflush(stdout);
-            #endif
-            return 0;
-        }
+static void aux_flush_device(aux_device_t *dev) {
+    if (dev->kind != AUX_FD) {
+        return;
     }
-
-    // Compare extension (handle ? wildcards)
-    for (int i = 0; i < 3; i++) {
-        if (fcb->extension[i] != '?' && fcb->extension[i] != entry->extension[i]) {
-            #if DEBUG_DISK_IO
-            printf("  [fcb_match] Extension mismatch at position %d: '%c' != '%c'\n",
-                   i, fcb->extension[i], entry->extension[i]);
+    size_t done = 0;
+    while (done < dev->used) {
+        ssize_t n = write(dev->fd, dev->buffer + done, dev->used - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("[AUX] ERROR: Device write failed: %s, output dropped\n", strerror(errno));
             fflush(stdout);
-            #endif
-            return 0;
+            break;
         }
+        done += (size_t)n;
     }
+    dev->used = 0;
+}
 
-    #if DEBUG_DISK_IO
-    printf("  [fcb_match] MATCH!\n");
-    fflush(stdout);
-    #endif
-    return 1;
+static void aux_output(int device, unsigned char ch) {
+    aux_device_t *dev = &cpm_aux[device];
+    if (dev->kind == AUX_NONE) {
+        return;  // Nothing attached: output is discarded, as with no printer
+    }
+    if (dev->kind == AUX_MEMORY && dev->pos > 0 && dev->used == dev->size) {
+        // Reclaim what the host has already taken before growing
+        memmove(dev->buffer, dev->buffer + dev->pos, dev->used - dev->pos);
+        dev->used -= dev->pos;
+        dev->pos = 0;
+    }
+    if (!aux_reserve(dev, dev->used + 1)) {
+        return;
+    }
+    dev->buffer[dev->used++] = ch;
+    if (dev->kind == AUX_FD && dev->used == AUX_BUFFER_SIZE) {
+        aux_flush_device(dev);
+    }
 }
 
-// Helper: Find directory entry for FCB
-int find_dir_entry(fcb_t* fcb) {
-    dir_entry_t entry;
+static unsigned char aux_read(void) {
+    aux_device_t *dev = &cpm_aux[CPM_AUX_READER];
+    if (dev->pos == dev->used && dev->kind == AUX_FD && !dev->eof && aux_reserve(dev, AUX_BUFFER_SIZE)) {
+        ssize_t n;
+        do {
+            n = read(dev->fd, dev->buffer, AUX_BUFFER_SIZE);
+        } while (n < 0 && errno == EINTR);
+        dev->pos = 0;
+        dev->used = n > 0 ? (size_t)n : 0;
+        dev->eof = (n <= 0);
+    }
+    if (dev->pos == dev->used) {
+        return 0x1A;
+    }
+    return dev->buffer[dev->pos++];
+}
 
-    for (int i = 0; i < 64; i++) {  // 64 directory entries in tracks 0-1
-        read_dir_entry(i, &entry);
-        if (fcb_match(&entry, fcb) && entry.extent_low == fcb->extent_low) {
-            return i;
-        }
+static unsigned char aux_input(void) {
+    unsigned char ch;
+    if (!replay_take(REPLAY_EVENT_READER, &ch)) {
+        ch = aux_read();
+        record_event(REPLAY_EVENT_READER, &ch, 1);
     }
+    return ch;
+}
 
-    return -1;  // Not found
+// Route a device to a host descriptor. With own_fd the device closes it on
+// detach. Output is appended at the descriptor's current position.
+int cpm_aux_attach_fd(int device, int fd, int own_fd) {
+    if (device < 0 || device >= CPM_AUX_DEVICES || fd < 0) {
+        return 0;
+    }
+    cpm_aux_detach(device);
+    aux_device_t *dev = &cpm_aux[device];
+    dev->kind = AUX_FD;
+    dev->fd = fd;
+    dev->owns_fd = own_fd;
+    return 1;
 }
 
-// Helper: Find free directory entry
-int find_free_dir_entry(void) {
-    dir_entry_t entry;
+// Route a device to a host file or named pipe. LST:/PUN: replace the file.
+int cpm_aux_attach_file(int device, const char *path) {
+    if (device < 0 || device >= CPM_AUX_DEVICES || !path) {
+        return 0;
+    }
+    int flags = aux_output_device(device) ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("[AUX] ERROR: Cannot open %s: %s\n", path, strerror(errno));
+        fflush(stdout);
+        return 0;
+    }
+    return cpm_aux_attach_fd(device, fd, 1);
+}
 
-    for (int i = 0; i < 64; i++) {
-        read_dir_entry(i, &entry);
-        if (entry.user_number == 0xE5 || entry_is_blank((const unsigned char *)&entry) ||
-            !entry_has_filename((const unsigned char *)&entry)) {
-            return i;
-        }
+// Capture LST: or PUN: output in memory; take it with cpm_aux_take
+int cpm_aux_capture(int device) {
+    if (!aux_output_device(device)) {
+        return 0;
     }
+    cpm_aux_detach(device);
+    cpm_aux[device].kind = AUX_MEMORY;
+    return 1;
+}
 
-    return -1;  // Directory full
+// Append data for RDR: to read, ahead of its ^Z
+int cpm_aux_feed(const unsigned char *data, size_t len) {
+    aux_device_t *dev = &cpm_aux[CPM_AUX_READER];
+    if (dev->kind != AUX_MEMORY) {
+        cpm_aux_detach(CPM_AUX_READER);
+        dev->kind = AUX_MEMORY;
+    }
+    if (dev->pos > 0) {
+        memmove(dev->buffer, dev->buffer + dev->pos, dev->used - dev->pos);
+        dev->used -= dev->pos;
+        dev->pos = 0;
+    }
+    if (!aux_reserve(dev, dev->used + len)) {
+        return 0;
+    }
+    memcpy(dev->buffer + dev->used, data, len);
+    dev->used += len;
+    return 1;
 }
 
-// BDOS Function 15: Open File
-int bdos_open_file(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
+// Take up to max captured bytes. Returns the number copied.
+size_t cpm_aux_take(int device, unsigned char *buffer, size_t max) {
+    if (!aux_output_device(device) || cpm_aux[device].kind != AUX_MEMORY) {
+        return 0;
+    }
+    aux_device_t *dev = &cpm_aux[device];
+    size_t len = dev->used - dev->pos < max ? dev->used - dev->pos : max;
+    memcpy(buffer, dev->buffer + dev->pos, len);
+    dev->pos += len;
+    if (dev->pos == dev->used) {
+        dev->pos = dev->used = 0;
+    }
+    return len;
+}
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-15: Open File] %.8s.%.3s\n", fcb.filename, fcb.extension);
-    fflush(stdout);
-    #endif
+// Write buffered LST: and PUN: output to the host
+void cpm_aux_flush(void) {
+    aux_flush_device(&cpm_aux[CPM_AUX_LIST]);
+    aux_flush_device(&cpm_aux[CPM_AUX_PUNCH]);
+}
 
-    int dir_index = find_dir_entry(&fcb);
+void cpm_aux_detach(int device) {
+    if (device < 0 || device >= CPM_AUX_DEVICES) {
+        return;
+    }
+    aux_device_t *dev = &cpm_aux[device];
+    aux_flush_device(dev);
+    if (dev->kind == AUX_FD && dev->owns_fd) {
+        close(dev->fd);
+    }
+    free(dev->buffer);
+    memset(dev, 0, sizeof(aux_device_t));
+}
 
-    if (dir_index >= 0) {
-        // File found - copy directory entry to FCB
-        dir_entry_t entry;
-        read_dir_entry(dir_index, &entry);
+void cpm_bdos_call(struct i8080* cpu) {
+    unsigned char function = (cpu->reg)[C];
+    unsigned char param_e = (cpu->reg)[E];
 
-        // Fall back to allocated blocks if record count wasn't set.
-        if (entry.record_count == 0) {
-            int blocks = 0;
-            while (blocks < 16 && entry.allocation[blocks] != 0) {
-                blocks++;
-            }
-            if (blocks > 0) {
-                entry.record_count = blocks * 8;
+    switch (function) {
+        case 1: { // Console Input - wait for character
+            // Check if input is available
+            if (!console_input_ready()) {
+                // No input available - set waiting flag and don't advance PC
+                cpm_event_input_wait();
+                // Return without modifying A register - will retry this call
+                return;
             }
-        }
 
-        // Copy allocation and record count back to FCB in memory
-        memcpy(&mem[fcb_addr + 16], entry.allocation, 16);
-        mem[fcb_addr + 15] = entry.record_count;
-        mem[fcb_addr + 32] = 0;  // Current record (CR) = 0
+            // Input available - get character
+            unsigned char ch = cpm_console_input();
+            (cpu->reg)[A] = ch;
+            cpm_console.waiting_for_input = 0;
+            break;
+        }
 
-        #if DEBUG_DISK_IO
-        printf("[BDOS-15: File opened, %d records]\n", entry.record_count);
-        fflush(stdout);
-        #endif
+        case 2: // Console Output
+            cpm_console_output(param_e);
+            break;
 
-        (cpu->reg)[A] = 0;  // Success
-        return 0;
-    } else {
-        #if DEBUG_DISK_IO
-        printf("[BDOS-15: File not found]\n");
-        fflush(stdout);
-        #endif
+        case 3: // Reader Input
+            (cpu->reg)[A] = aux_input();
+            break;
 
-        (cpu->reg)[A] = 0xFF;  // File not found
-        return 1;
-    }
-}
+        case 4: // Punch Output
+            aux_output(CPM_AUX_PUNCH, param_e);
+            break;
 
-// BDOS Function 16: Close File
-int bdos_close_file(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
+        case 5: // List Output
+            aux_output(CPM_AUX_LIST, param_e);
+            break;
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-16: Close File] %.8s.%.3s\n", fcb.filename, fcb.extension);
-    fflush(stdout);
-    #endif
+        case 9: { // Print String (terminated by $)
+            unsigned int addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+            #if DEBUG_DISK_IO
+            printf("\n[BDOS-9: Print String @ 0x%04X] ", addr);
+            printf("\n[BDOS-9: Bytes @ 0x%04X] ", addr);
+            for (int i = 0; i < 8; i++) {
+                printf("%02X ", mem[(addr + i) & 0xFFFF]);
+            }
+            printf("\n");
+            #endif
+            cpm_console_print_string(addr);
+            break;
+        }
 
-    int dir_index = find_dir_entry(&fcb);
+        case 10: { // Read Console Buffer
+            unsigned int buffer_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+            cpm_console.line_active = 1;
+            cpm_console.line_pc = cpu->prog_ctr;
+            cpm_console.line_addr = buffer_addr;
+            cpm_console.line_max = mem[buffer_addr];
+            cpm_console.line_count = 0;
+            cpm_console.line_resume = -1;
+            #if DEBUG_DISK_IO
+            printf("\n[BDOS-10: Read Console Buffer @ 0x%04X, max=%d]\n", buffer_addr, cpm_console.line_max);
+            fflush(stdout);
+            #endif
+            if (!cpm_console_line_continue()) {
+                cpm_event_input_wait();  // The caller suspends the CPU on the line
+            }
+            break;
+        }
 
-    if (dir_index >= 0) {
-        // Update directory entry with FCB data
-        dir_entry_t entry;
-        entry.user_number = 0;  // User 0
-        memcpy(entry.filename, fcb.filename, 8);
-        memcpy(entry.extension, fcb.extension, 3);
-        entry.extent_low = fcb.extent_low;
-        entry.reserved[0] = 0;
-        entry.reserved[1] = 0;
-        entry.record_count = mem[fcb_addr + 15];
-        memcpy(entry.allocation, &mem[fcb_addr + 16], 16);
+        case 11: // Get Console Status
+            (cpu->reg)[A] = cpm_console_status();
+            break;
 
-        write_dir_entry(dir_index, &entry);
+        case 13: // Reset Disk System
+            printf("\n[BDOS-13: Reset Disk System]\n");
+            fflush(stdout);
+            cpm_disk.current_disk = 0;
+            cpm_disk.current_track = 0;
+            cpm_disk.current_sector = 1;
+            (cpu->reg)[A] = 0; // Success
+            break;
 
-        #if DEBUG_DISK_IO
-        printf("[BDOS-16: File closed]\n");
-        fflush(stdout);
-        #endif
+        case 14: // Select Disk
+            printf("\n[BDOS-14: Select Disk %c:]\n", 'A' + param_e);
+            fflush(stdout);
+            if (param_e < CPM_MAX_DRIVES && cpm_host.type[param_e] != DRIVE_NONE) {
+                cpm_disk.current_disk = param_e;
+                (cpu->reg)[A] = 0; // Success
+            } else {
+                (cpu->reg)[A] = 0xFF; // Error - invalid disk
+            }
+            break;
 
-        (cpu->reg)[A] = 0;  // Success
-        return 0;
-    } else {
-        (cpu->reg)[A] = 0xFF;  // Error
-        return 1;
-    }
-}
+        case 25: // Get Current Disk
+            printf("\n[BDOS-25: Get Current Disk → %c:]\n", 'A' + cpm_disk.current_disk);
+            fflush(stdout);
+            (cpu->reg)[A] = cpm_disk.current_disk;
+            break;
 
-// BDOS Function 22: Make File
-int bdos_make_file(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
+        case 15: // Open File
+            bdos_open_file(cpu);
+            break;
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-22: Make File] %.8s.%.3s\n", fcb.filename, fcb.extension);
-    fflush(stdout);
-    #endif
+        case 16: // Close File
+            bdos_close_file(cpu);
+            break;
 
-    // Check if file already exists
-    int existing = find_dir_entry(&fcb);
-    if (existing >= 0) {
-        // File exists, reuse its entry
-        dir_entry_t entry;
-        entry.user_number = 0;
-        memcpy(entry.filename, fcb.filename, 8);
-        memcpy(entry.extension, fcb.extension, 3);
-        entry.extent_low = 0;
-        entry.reserved[0] = 0;
-        entry.reserved[1] = 0;
-        entry.record_count = 0;
-        memset(entry.allocation, 0, 16);
+        case 17: // Search First
+            bdos_search_first(cpu);
+            break;
 
-        write_dir_entry(existing, &entry);
+        case 18: // Search Next
+            bdos_search_next(cpu);
+            break;
 
-        // Update FCB in memory
-        mem[fcb_addr + 12] = 0;  // extent_low
-        mem[fcb_addr + 15] = 0;  // record_count
-        memset(&mem[fcb_addr + 16], 0, 16);  // allocation
+        case 19: // Delete File
+            bdos_delete_file(cpu);
+            break;
 
-        (cpu->reg)[A] = 0;  // Success
-        return 0;
-    }
+        case 20: // Read Sequential
+            bdos_read_sequential(cpu);
+            break;
 
-    // Find free directory entry
-    int dir_index = find_free_dir_entry();
+        case 21: // Write Sequential
+            bdos_write_sequential(cpu);
+            break;
 
-    if (dir_index >= 0) {
-        dir_entry_t entry;
-        entry.user_number = 0;
-        memcpy(entry.filename, fcb.filename, 8);
-        memcpy(entry.extension, fcb.extension, 3);
-        entry.extent_low = 0;
-        entry.reserved[0] = 0;
-        entry.reserved[1] = 0;
-        entry.record_count = 0;
-        memset(entry.allocation, 0, 16);
+        case 22: // Make File
+            bdos_make_file(cpu);
+            break;
 
-        write_dir_entry(dir_index, &entry);
+        case 23: // Rename File
+            bdos_rename_file(cpu);
+            break;
 
-        // Update FCB in memory
-        mem[fcb_addr + 12] = 0;  // extent_low
-        mem[fcb_addr + 15] = 0;  // record_count
-        memset(&mem[fcb_addr + 16], 0, 16);  // allocation
-        mem[fcb_addr + 32] = 0;  // Current record
+        case 26: { // Set DMA Address
+            unsigned int dma = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+            printf("\n[BDOS-26: Set DMA Address → 0x%04X]\n", dma);
+            fflush(stdout);
+            cpm_disk.dma_address = dma;
+            (cpu->reg)[A] = 0; // Success
+            break;
+        }
 
-        #if DEBUG_DISK_IO
-        printf("[BDOS-22: File created at dir entry %d]\n", dir_index);
-        fflush(stdout);
-        #endif
+        default:
+            printf("\n[BDOS: Unimplemented function %d]\n", function);
+            (cpu->reg)[A] = 0xFF; // Error
+            break;
+    }
+}
 
-        (cpu->reg)[A] = 0;  // Success
-        return 0;
-    } else {
-        #if DEBUG_DISK_IO
-        printf("[BDOS-22: Directory full]\n");
-        fflush(stdout);
-        #endif
+// ============================================================================
+// SPARSE DISK STORAGE
+// ============================================================================
 
-        (cpu->reg)[A] = 0xFF;  // Directory full
-        return 1;
+// Sparse image file layout (all integers little-endian):
+//   header   32 bytes: magic, version, tracks, sectors/track, sector size, populated
+//   index    one u32 per sector in track order: file offset of its data, 0 = blank
+//   data     populated sectors, DISK_SECTOR_SIZE bytes each
+// The index gives O(1) random access to any sector without reading the rest.
+#define SPARSE_MAGIC "C8080SPD"
+#define SPARSE_VERSION 1
+#define SPARSE_HEADER_SIZE 32
+
+// Base images are mapped once per process and shared by reference count
+static base_image_t *base_images = NULL;
+static pthread_mutex_t base_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t disk_formats_once = PTHREAD_ONCE_INIT;
+
+static unsigned int get_le16(const unsigned char *p);
+static unsigned long get_le32(const unsigned char *p);
+
+// Build every format's translation table. The skew follows the CP/M DISKDEF
+// rule: step by the skew factor, moving on one sector whenever the slot is
+// taken. System tracks are read in physical order by the boot loader, so
+// only tracks from OFF onwards are skewed.
+static void disk_formats_build(void) {
+    for (int f = 0; f < DISK_FORMAT_COUNT; f++) {
+        disk_format_t *fmt = &disk_formats[f];
+        unsigned int spt = fmt->sectors_per_track;
+        unsigned int skewed[256];
+        unsigned char used[256] = { 0 };
+        unsigned int pos = 0;
+        for (unsigned int s = 0; s < spt; s++) {
+            while (used[pos]) {
+                pos = (pos + 1) % spt;
+            }
+            skewed[s] = pos;
+            used[pos] = 1;
+            pos = (pos + fmt->skew) % spt;
+        }
+        fmt->phys_index = malloc(fmt->tracks * spt * sizeof(unsigned int));
+        if (!fmt->phys_index) {
+            printf("[Disk] ERROR: Out of memory building %s table\n", fmt->name);
+            fflush(stdout);
+            abort();
+        }
+        for (unsigned int t = 0; t < fmt->tracks; t++) {
+            for (unsigned int s = 0; s < spt; s++) {
+                fmt->phys_index[t * spt + s] = t * spt + (t < fmt->reserved_tracks ? s : skewed[s]);
+            }
+        }
     }
 }
 
-// BDOS Function 20: Read Sequential
-int bdos_read_sequential(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    unsigned char current_record = mem[fcb_addr + 32];  // CR field
-    unsigned char record_count = mem[fcb_addr + 15];
-
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-20: Read Sequential] CR=%d, RC=%d\n", current_record, record_count);
-    fflush(stdout);
-    #endif
+static unsigned int format_sectors(const disk_format_t *fmt) {
+    return fmt->tracks * fmt->sectors_per_track;
+}
 
-    // Check if we've read all records
-    if (current_record >= record_count) {
-        (cpu->reg)[A] = 1;  // End of file
-        return 1;
+// Image sector holding a logical track and sector (0-based), or -1 if off the disk
+static int disk_sector_index(const disk_format_t *fmt, unsigned int track, unsigned int sector) {
+    if (track >= fmt->tracks || sector >= fmt->sectors_per_track) {
+        return -1;
     }
+    return (int)fmt->phys_index[track * fmt->sectors_per_track + sector];
+}
 
-    // Calculate block and sector
-    // For simplicity: 1 block = 1 track, each record = 128 bytes
-    // Allocate blocks starting at track 2 (tracks 0-1 are directory)
-    unsigned char block = mem[fcb_addr + 16 + (current_record / 8)];
-    if (block == 0) {
-        (cpu->reg)[A] = 1;  // No block allocated
-        return 1;
+// Image sector holding directory record n (four entries per record)
+static int disk_dir_sector_index(const disk_format_t *fmt, unsigned int record) {
+    return disk_sector_index(fmt, fmt->reserved_tracks + record / fmt->sectors_per_track,
+                             record % fmt->sectors_per_track);
+}
+
+// Logical track and sector (1-based) of one record of an allocation block
+static void disk_block_location(const disk_format_t *fmt, unsigned int block, unsigned int record,
+                                unsigned int *track, unsigned int *sector) {
+    if (fmt->track_per_block) {
+        *track = block + 1;
+        *sector = record + 1;
+        return;
     }
+    unsigned int r = block * (fmt->block_size / DISK_SECTOR_SIZE) + record;
+    *track = fmt->reserved_tracks + r / fmt->sectors_per_track;
+    *sector = r % fmt->sectors_per_track + 1;
+}
 
-    // Calculate track and sector
-    unsigned char track = block + 1;  // Blocks start at track 2
-    unsigned char sector = (current_record % 8) + 1;
+// Allocation blocks past the reserved tracks (DSM + 1)
+static unsigned int format_blocks(const disk_format_t *fmt) {
+    return (fmt->tracks - fmt->reserved_tracks) * fmt->sectors_per_track / (fmt->block_size / DISK_SECTOR_SIZE);
+}
 
-    // Read the sector
-    cpm_disk.current_track = track;
-    cpm_disk.current_sector = sector;
-    int result = cpm_read_sector();
+// Entry n of an FCB or directory allocation map: 16 byte-sized block
+// numbers, or 8 little-endian words on disks of more than 256 blocks
+static unsigned int allocation_block(const disk_format_t *fmt, const unsigned char *map, unsigned int n) {
+    if (format_blocks(fmt) > 256) {
+        return n < 8 ? map[2 * n] | (map[2 * n + 1] << 8) : 0;
+    }
+    return n < 16 ? map[n] : 0;
+}
 
-    // Increment current record
-    mem[fcb_addr + 32] = current_record + 1;
+static void allocation_set_block(const disk_format_t *fmt, unsigned char *map, unsigned int n, unsigned int block) {
+    if (format_blocks(fmt) > 256) {
+        if (n < 8) {
+            map[2 * n] = block & 0xFF;
+            map[2 * n + 1] = (block >> 8) & 0xFF;
+        }
+    } else if (n < 16) {
+        map[n] = block & 0xFF;
+    }
+}
 
-    (cpu->reg)[A] = result ? 1 : 0;
-    return result;
+// Sector capacity of an image file from its size and first bytes, 0 if unsupported
+static unsigned int image_file_sectors(const unsigned char *header, unsigned long file_size, int *sparse) {
+    *sparse = file_size >= SPARSE_HEADER_SIZE && memcmp(header, SPARSE_MAGIC, 8) == 0;
+    if (*sparse) {
+        unsigned long sectors = (unsigned long)get_le16(header + 10) * get_le16(header + 12);
+        if (get_le16(header + 8) != SPARSE_VERSION || get_le16(header + 14) != DISK_SECTOR_SIZE ||
+            sectors == 0 || sectors > DISK_MAX_SECTORS ||
+            file_size < SPARSE_HEADER_SIZE + sectors * 4) {
+            return 0;
+        }
+        return (unsigned int)sectors;
+    }
+    for (int f = 0; f < DISK_FORMAT_COUNT; f++) {
+        if (file_size == (unsigned long)format_sectors(&disk_formats[f]) * DISK_SECTOR_SIZE) {
+            return format_sectors(&disk_formats[f]);
+        }
+    }
+    return 0;
 }
 
-// BDOS Function 21: Write Sequential
-int bdos_write_sequential(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    unsigned char current_record = mem[fcb_addr + 32];  // CR field
+static base_image_t* base_image_acquire(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("[Disk] ERROR: Failed to open base image %s (%s)\n", path, strerror(errno));
+        fflush(stdout);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-21: Write Sequential] CR=%d\n", current_record);
+    pthread_mutex_lock(&base_images_lock);
+    base_image_t *base;
+    for (base = base_images; base; base = base->next) {
+        if (base->device == st.st_dev && base->inode == st.st_ino) {
+            base->refcount++;
+            pthread_mutex_unlock(&base_images_lock);
+            close(fd);
+            return base;
+        }
+    }
+
+    void *data = MAP_FAILED;
+    unsigned int sectors = 0;
+    int sparse = 0;
+    if (st.st_size >= DISK_SECTOR_SIZE) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data != MAP_FAILED) {
+        sectors = image_file_sectors(data, (unsigned long)st.st_size, &sparse);
+        if (sectors == 0) {
+            munmap(data, (size_t)st.st_size);
+            data = MAP_FAILED;
+        }
+    }
+    base = (data != MAP_FAILED) ? calloc(1, sizeof(base_image_t)) : NULL;
+    if (!base) {
+        if (data != MAP_FAILED) {
+            munmap(data, (size_t)st.st_size);
+        }
+        pthread_mutex_unlock(&base_images_lock);
+        printf("[Disk] ERROR: %s is not a disk image\n", path);
+        fflush(stdout);
+        return NULL;
+    }
+    base->device = st.st_dev;
+    base->inode = st.st_ino;
+    snprintf(base->path, sizeof(base->path), "%s", path);
+    base->refcount = 1;
+    base->data = data;
+    base->size = (size_t)st.st_size;
+    base->sectors = sectors;
+    base->sparse = sparse;
+    base->next = base_images;
+    base_images = base;
+    pthread_mutex_unlock(&base_images_lock);
+
+    printf("[Disk] Mapped base image %s\n", path);
     fflush(stdout);
-    #endif
+    return base;
+}
 
-    // Calculate which block we need
-    int block_index = current_record / 8;
+static void base_image_release(base_image_t *base) {
+    if (!base) {
+        return;
+    }
+    pthread_mutex_lock(&base_images_lock);
+    if (--base->refcount == 0) {
+        base_image_t **link = &base_images;
+        while (*link != base) {
+            link = &(*link)->next;
+        }
+        *link = base->next;
+        munmap((void *)base->data, base->size);
+        free(base);
+    }
+    pthread_mutex_unlock(&base_images_lock);
+}
 
-    // Check if we need to allocate a new block
-    if (mem[fcb_addr + 16 + block_index] == 0) {
-        // Simple allocation: blocks numbered 1-15 (0 means unallocated)
-        // Block N maps to track N+1 (tracks 0-1 are directory, data starts at track 2)
-        unsigned char new_block = block_index + 1;
-        mem[fcb_addr + 16 + block_index] = new_block;
+static base_image_t* base_image_retain(base_image_t *base) {
+    if (base) {
+        pthread_mutex_lock(&base_images_lock);
+        base->refcount++;
+        pthread_mutex_unlock(&base_images_lock);
+    }
+    return base;
+}
 
-        #if DEBUG_DISK_IO
-        printf("[BDOS-21: Allocated block %d]\n", new_block);
-        fflush(stdout);
-        #endif
+// Sector data in the base image, or NULL when the base holds the fill there
+static const unsigned char* base_image_sector(const base_image_t *base, unsigned int index) {
+    if (index >= base->sectors) {
+        return NULL;
+    }
+    if (!base->sparse) {
+        return base->data + (size_t)index * DISK_SECTOR_SIZE;
     }
+    unsigned long offset = get_le32(base->data + SPARSE_HEADER_SIZE + index * 4);
+    if (offset == 0 || offset + DISK_SECTOR_SIZE > base->size) {
+        return NULL;
+    }
+    return base->data + offset;
+}
 
-    unsigned char block = mem[fcb_addr + 16 + block_index];
-    unsigned char track = block + 1;  // Block 1 → Track 2, Block 2 → Track 3, etc.
-    unsigned char sector = (current_record % 8) + 1;
+static int sector_is_blank(const unsigned char *data) {
+    for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
+        if (data[i] != DISK_FILL) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    // Write the sector
-    cpm_disk.current_track = track;
-    cpm_disk.current_sector = sector;
-    int result = cpm_write_sector();
+// Sector data, or NULL when the sector still holds the 0xE5 fill
+static const unsigned char* sparse_sector(const sparse_disk_t *disk, unsigned int index) {
+    if (index >= disk->sectors) {
+        return NULL;
+    }
+    const disk_page_t *page = disk->page[index / DISK_PAGE_SECTORS];
+    if (page && page->sector[index % DISK_PAGE_SECTORS]) {
+        return page->sector[index % DISK_PAGE_SECTORS];
+    }
+    return disk->base ? base_image_sector(disk->base, index) : NULL;
+}
 
-    // Update record count and current record
-    if (current_record >= mem[fcb_addr + 15]) {
-        mem[fcb_addr + 15] = current_record + 1;  // Update RC
+static void sparse_read_sector(const sparse_disk_t *disk, unsigned int index, unsigned char *dst) {
+    const unsigned char *data = sparse_sector(disk, index);
+    if (data) {
+        memcpy(dst, data, DISK_SECTOR_SIZE);
+    } else {
+        memset(dst, DISK_FILL, DISK_SECTOR_SIZE);
     }
-    mem[fcb_addr + 32] = current_record + 1;  // Increment CR
+}
 
-    (cpu->reg)[A] = result ? 1 : 0;
-    return result;
+static void disk_page_release(disk_page_t *page) {
+    if (page && __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int s = 0; s < DISK_PAGE_SECTORS; s++) {
+            free(page->sector[s]);
+        }
+        free(page);
+    }
 }
 
-// Global for directory search continuation
-static int search_dir_index = 0;
+// The disk's page p for writing: a page still shared with another disk is
+// copied first. NULL when out of memory.
+static disk_page_t* disk_page_own(sparse_disk_t *disk, unsigned int p) {
+    disk_page_t *page = disk->page[p];
+    if (__atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) == 1) {
+        return page;
+    }
+    disk_page_t *copy = calloc(1, sizeof(disk_page_t));
+    if (!copy) {
+        return NULL;
+    }
+    copy->refs = 1;
+    for (int s = 0; s < DISK_PAGE_SECTORS; s++) {
+        if (page->sector[s]) {
+            copy->sector[s] = malloc(DISK_SECTOR_SIZE);
+            if (!copy->sector[s]) {
+                disk_page_release(copy);
+                return NULL;
+            }
+            memcpy(copy->sector[s], page->sector[s], DISK_SECTOR_SIZE);
+        }
+    }
+    disk_page_release(page);
+    disk->page[p] = copy;
+    return copy;
+}
 
-// BDOS Function 17: Search First
-int bdos_search_first(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
-
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-17: Search First] %.8s.%.3s\n", fcb.filename, fcb.extension);
-    printf("  [BDOS-17: DMA] 0x%04X\n", cpm_disk.dma_address);
-    fflush(stdout);
-    #endif
+static void sparse_write_sector(sparse_disk_t *disk, unsigned int index, const unsigned char *src) {
+    if (index >= disk->sectors) {
+        return;
+    }
+    unsigned int p = index / DISK_PAGE_SECTORS;
+    unsigned int slot = index % DISK_PAGE_SECTORS;
+    disk_page_t *page = disk->page[p];
+    const unsigned char *backing = disk->base ? base_image_sector(disk->base, index) : NULL;
+    if (backing ? memcmp(src, backing, DISK_SECTOR_SIZE) == 0 : sector_is_blank(src)) {
+        // Writing what is already underneath (fill or base data) releases the sector
+        if (page && page->sector[slot] && (page = disk_page_own(disk, p)) != NULL) {
+            free(page->sector[slot]);
+            page->sector[slot] = NULL;
+            disk->populated--;
+        }
+        return;
+    }
+    if (!page) {
+        page = calloc(1, sizeof(disk_page_t));
+        if (page) {
+            page->refs = 1;
+            disk->page[p] = page;
+        }
+    } else {
+        page = disk_page_own(disk, p);
+    }
+    if (!page) {
+        printf("[Disk] ERROR: Out of memory allocating sector %u\n", index);
+        fflush(stdout);
+        return;
+    }
+    if (!page->sector[slot]) {
+        page->sector[slot] = malloc(DISK_SECTOR_SIZE);
+        if (!page->sector[slot]) {
+            printf("[Disk] ERROR: Out of memory allocating sector %u\n", index);
+            fflush(stdout);
+            return;
+        }
+        disk->populated++;
+    }
+    memcpy(page->sector[slot], src, DISK_SECTOR_SIZE);
+}
 
-    // Start search from directory entry 0
-    search_dir_index = 0;
+static void sparse_clear(sparse_disk_t *disk) {
+    for (int p = 0; p < DISK_MAX_SECTORS / DISK_PAGE_SECTORS; p++) {
+        disk_page_release(disk->page[p]);
+        disk->page[p] = NULL;
+    }
+    disk->populated = 0;
+}
 
-    // Search through directory
-    dir_entry_t entry;
-    for (int i = 0; i < 64; i++) {
-        read_dir_entry(i, &entry);
-        if (fcb_match(&entry, &fcb)) {
-            // Found a match - copy into DMA slot indicated by directory code
-            int dir_code = i % 4;
-            memcpy(&mem[cpm_disk.dma_address + (dir_code * 32)], &entry, 32);
-            search_dir_index = i + 1;  // Next search starts here
+// Make dst a copy of src that shares its pages until either one writes
+static void sparse_share(sparse_disk_t *dst, const sparse_disk_t *src) {
+    *dst = *src;
+    for (int p = 0; p < DISK_MAX_SECTORS / DISK_PAGE_SECTORS; p++) {
+        if (dst->page[p]) {
+            __atomic_add_fetch(&dst->page[p]->refs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    base_image_retain(dst->base);
+}
 
-            #if DEBUG_DISK_IO
-            printf("[BDOS-17: Found at dir entry %d, returning directory code %d]\n", i, i % 4);
-            printf("  [BDOS-17: DMA bytes] ");
-            for (int j = 0; j < 16; j++) {
-                printf("%02X ", mem[cpm_disk.dma_address + j]);
-            }
-            printf("\n");
-            fflush(stdout);
-            #endif
+// Empty the disk and give it a format, e.g. for a fresh unformatted drive
+static void sparse_reset(sparse_disk_t *disk, const disk_format_t *format) {
+    pthread_once(&disk_formats_once, disk_formats_build);
+    sparse_clear(disk);
+    disk->format = format;
+    disk->sectors = format_sectors(format);
+    disk->detached = 0;
+}
 
-            (cpu->reg)[A] = dir_code;  // Return directory code (0-3) for position in DMA buffer
-            return 0;
+static size_t sparse_bytes_allocated(const sparse_disk_t *disk) {
+    size_t bytes = (size_t)disk->populated * DISK_SECTOR_SIZE;
+    for (int p = 0; p < DISK_MAX_SECTORS / DISK_PAGE_SECTORS; p++) {
+        if (disk->page[p]) {
+            bytes += sizeof(disk_page_t);
         }
     }
+    return bytes;
+}
 
-    #if DEBUG_DISK_IO
-    printf("[BDOS-17: Not found]\n");
-    fflush(stdout);
-    #endif
-
-    (cpu->reg)[A] = 0xFF;  // Not found
-    return 1;
+unsigned long cpm_disk_bytes_allocated(void) {
+    return (unsigned long)(sparse_bytes_allocated(&disk_a) + sparse_bytes_allocated(&disk_b));
 }
 
-// BDOS Function 18: Search Next
-int bdos_search_next(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
+static void put_le16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF;
+}
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-18: Search Next] %.8s.%.3s (from entry %d)\n",
-           fcb.filename, fcb.extension, search_dir_index);
-    printf("  [BDOS-18: DMA] 0x%04X\n", cpm_disk.dma_address);
-    fflush(stdout);
-    #endif
+static void put_le32(unsigned char *p, unsigned long v) {
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF; p[3] = (v >> 24) & 0xFF;
+}
 
-    // Continue search from where we left off
-    dir_entry_t entry;
-    for (int i = search_dir_index; i < 64; i++) {
-        read_dir_entry(i, &entry);
-        if (fcb_match(&entry, &fcb)) {
-            // Found a match - copy into DMA slot indicated by directory code
-            int dir_code = i % 4;
-            memcpy(&mem[cpm_disk.dma_address + (dir_code * 32)], &entry, 32);
-            search_dir_index = i + 1;
+static unsigned int get_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
 
-            #if DEBUG_DISK_IO
-            printf("[BDOS-18: Found at dir entry %d, returning directory code %d]\n", i, i % 4);
-            fflush(stdout);
-            #endif
+static unsigned long get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
 
-            (cpu->reg)[A] = dir_code;  // Return directory code (0-3) for position in DMA buffer
-            return 0;
+// Load the sectors of a sparse image; the disk's capacity is already set
+static int load_sparse_image(FILE *f, const char *path, sparse_disk_t *disk) {
+    size_t index_size = (size_t)disk->sectors * 4;
+    unsigned char *index = malloc(index_size);
+    if (!index || fseek(f, SPARSE_HEADER_SIZE, SEEK_SET) != 0 ||
+        fread(index, 1, index_size, f) != index_size) {
+        free(index);
+        printf("[Disk] ERROR: Truncated sparse image %s\n", path);
+        fflush(stdout);
+        return 0;
+    }
+    unsigned char sector[DISK_SECTOR_SIZE];
+    int ok = 1;
+    for (unsigned int i = 0; i < disk->sectors && ok; i++) {
+        unsigned long offset = get_le32(index + i * 4);
+        if (offset == 0) {
+            continue;
         }
+        ok = fseek(f, (long)offset, SEEK_SET) == 0 &&
+             fread(sector, 1, DISK_SECTOR_SIZE, f) == DISK_SECTOR_SIZE;
+        if (ok) {
+            sparse_write_sector(disk, i, sector);
+        }
+    }
+    free(index);
+    if (!ok) {
+        sparse_clear(disk);
+        printf("[Disk] ERROR: Corrupt sparse image %s\n", path);
+        fflush(stdout);
+        return 0;
     }
+    disk->sparse_file = 1;
+    return 1;
+}
 
-    #if DEBUG_DISK_IO
-    printf("[BDOS-18: No more matches]\n");
-    fflush(stdout);
-    #endif
+static int write_sparse_image(FILE *f, const sparse_disk_t *disk) {
+    unsigned char header[SPARSE_HEADER_SIZE] = { 0 };
+    memcpy(header, SPARSE_MAGIC, 8);
+    put_le16(header + 8, SPARSE_VERSION);
+    put_le16(header + 10, disk->format->tracks);
+    put_le16(header + 12, disk->format->sectors_per_track);
+    put_le16(header + 14, DISK_SECTOR_SIZE);
+    put_le32(header + 16, disk->populated);
+
+    size_t index_size = (size_t)disk->sectors * 4;
+    unsigned char *index = calloc(1, index_size);
+    if (!index) {
+        return 0;
+    }
+    unsigned long next = SPARSE_HEADER_SIZE + index_size;
+    for (unsigned int i = 0; i < disk->sectors; i++) {
+        if (sparse_sector(disk, i)) {
+            put_le32(index + i * 4, next);
+            next += DISK_SECTOR_SIZE;
+        }
+    }
+    int ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+             fwrite(index, 1, index_size, f) == index_size;
+    free(index);
+    for (unsigned int i = 0; i < disk->sectors && ok; i++) {
+        const unsigned char *data = sparse_sector(disk, i);
+        if (data) {
+            ok = fwrite(data, 1, DISK_SECTOR_SIZE, f) == DISK_SECTOR_SIZE;
+        }
+    }
+    return ok;
+}
 
-    (cpu->reg)[A] = 0xFF;  // No more matches
+static int write_raw_image(FILE *f, const sparse_disk_t *disk) {
+    unsigned char sector[DISK_SECTOR_SIZE];
+    for (unsigned int i = 0; i < disk->sectors; i++) {
+        sparse_read_sector(disk, i, sector);
+        if (fwrite(sector, 1, DISK_SECTOR_SIZE, f) != DISK_SECTOR_SIZE) {
+            return 0;
+        }
+    }
     return 1;
 }
 
-// BDOS Function 19: Delete File
-int bdos_delete_file(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
-    fcb_t fcb;
-    memcpy(&fcb, &mem[fcb_addr], 32);
+// ============================================================================
+// DISK PERSISTENCE
+// ============================================================================
+//
+// Guest disk writes never touch the filesystem on the emulation thread. Each
+// dirty sector is queued to a background writer, which appends it to a
+// write-ahead journal next to the image ("A.DSK.journal"). Every so often the
+// writer folds the journal into a fresh copy of the image and renames it into
+// place, so the image file is never seen half written. Loading an image
+// replays whatever is left in its journal; a torn final record fails its
+// checksum and is cut off.
+
+#define JOURNAL_MAGIC 0x324A3843UL             // "C8J2": record keyed by image sector
+#define JOURNAL_RECORD_SIZE (8 + DISK_SECTOR_SIZE + 4)
+#define CHECKPOINT_RECORDS 256                 // Fold the journal after this many records...
+#define CHECKPOINT_SECONDS 5                   // ...or this long after the first one
+
+typedef struct persist_target {
+    char path[512];
+    int journal_fd;
+    int journal_records;                       // Records since the last checkpoint
+    time_t first_record_time;
+    int sparse_file;                           // File format to write on checkpoint
+    const disk_format_t *format;               // Layout when there is no image file yet
+    struct persist_target *next;
+} persist_target_t;
+
+typedef struct persist_record {
+    persist_target_t *target;
+    unsigned int index;                        // Image sector
+    unsigned char *data;                       // One sector, or a whole raw image
+    int full_image;
+    struct persist_record *next;
+} persist_record_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    persist_record_t *head;
+    persist_record_t *tail;
+    persist_target_t *targets;
+    int busy;
+    int started;
+} disk_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static int read_disk_file(const char *path, sparse_disk_t *disk, int *io_error);
+
+static unsigned long journal_checksum(const unsigned char *data, size_t len) {
+    unsigned long hash = 0x811C9DC5UL;
+    for (size_t i = 0; i < len; i++) {
+        hash = ((hash ^ data[i]) * 0x01000193UL) & 0xFFFFFFFFUL;
+    }
+    return hash;
+}
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-19: Delete File] %.8s.%.3s\n", fcb.filename, fcb.extension);
-    fflush(stdout);
-    #endif
+static void journal_path(char *buffer, size_t size, const char *image_path) {
+    snprintf(buffer, size, "%s.journal", image_path);
+}
 
-    int deleted_count = 0;
-    dir_entry_t entry;
+// Apply journal records to a disk in order. Returns the number applied. A
+// torn or corrupt tail is cut off, so records appended later follow the
+// good ones instead of being stranded behind the damage.
+static int journal_replay(const char *image_path, sparse_disk_t *disk) {
+    char path[600];
+    journal_path(path, sizeof(path), image_path);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    int applied = 0;
+    while (fread(record, 1, sizeof(record), f) == sizeof(record)) {
+        if (get_le32(record) != JOURNAL_MAGIC ||
+            get_le32(record + 8 + DISK_SECTOR_SIZE) != journal_checksum(record, 8 + DISK_SECTOR_SIZE)) {
+            break;  // Torn or corrupt tail - everything before it is good
+        }
+        sparse_write_sector(disk, (unsigned int)get_le32(record + 4), record + 8);
+        applied++;
+    }
+    off_t valid = (off_t)applied * JOURNAL_RECORD_SIZE;
+    if (fseeko(f, 0, SEEK_END) == 0 && ftello(f) > valid) {
+        if (truncate(path, valid) == 0) {
+            printf("[Disk] Discarded a torn journal tail of %s\n", image_path);
+        } else {
+            printf("[Disk] ERROR: Cannot truncate journal %s (%s)\n", path, strerror(errno));
+        }
+        fflush(stdout);
+    }
+    fclose(f);
+    return applied;
+}
 
-    // Search and delete all matching entries (handles wildcards)
-    for (int i = 0; i < 64; i++) {
-        read_dir_entry(i, &entry);
-        if (fcb_match(&entry, &fcb)) {
-            // Mark as deleted
-            entry.user_number = 0xE5;
-            write_dir_entry(i, &entry);
-            deleted_count++;
+static int write_file_atomically(const char *path, const sparse_disk_t *disk, int sparse_file) {
+    char temp_path[600];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) {
+        return 0;
+    }
+    int ok = sparse_file ? write_sparse_image(f, disk) : write_raw_image(f, disk);
+    ok = (fflush(f) == 0) && ok && (fsync(fileno(f)) == 0);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
 
-            #if DEBUG_DISK_IO
-            printf("[BDOS-19: Deleted dir entry %d]\n", i);
-            fflush(stdout);
-            #endif
+static void journal_reset(persist_target_t *target) {
+    if (target->journal_fd >= 0) {
+        if (ftruncate(target->journal_fd, 0) == 0) {
+            fsync(target->journal_fd);
         }
+    } else {
+        char path[600];
+        journal_path(path, sizeof(path), target->path);
+        unlink(path);
     }
+    target->journal_records = 0;
+}
 
-    if (deleted_count > 0) {
-        (cpu->reg)[A] = 0;  // Success
-        return 0;
+// Fold the journal into a new image file. Runs on the writer thread only.
+static void journal_checkpoint(persist_target_t *target) {
+    sparse_disk_t image = { 0 };
+    if (!read_disk_file(target->path, &image, NULL)) {
+        sparse_reset(&image, target->format);  // No usable image yet: the journal is the whole disk
+    }
+    journal_replay(target->path, &image);
+    if (write_file_atomically(target->path, &image, target->sparse_file)) {
+        journal_reset(target);
     } else {
-        #if DEBUG_DISK_IO
-        printf("[BDOS-19: File not found]\n");
+        printf("[Disk] ERROR: Checkpoint of %s failed (%s)\n", target->path, strerror(errno));
         fflush(stdout);
-        #endif
+    }
+    sparse_clear(&image);
+}
 
-        (cpu->reg)[A] = 0xFF;  // Not found
-        return 1;
+static void journal_append(persist_record_t *record) {
+    persist_target_t *target = record->target;
+    if (target->journal_fd < 0) {
+        char path[600];
+        journal_path(path, sizeof(path), target->path);
+        target->journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (target->journal_fd < 0) {
+            printf("[Disk] ERROR: Cannot open journal %s (%s)\n", path, strerror(errno));
+            fflush(stdout);
+            return;
+        }
+    }
+    unsigned char buffer[JOURNAL_RECORD_SIZE];
+    put_le32(buffer, JOURNAL_MAGIC);
+    put_le32(buffer + 4, record->index);
+    memcpy(buffer + 8, record->data, DISK_SECTOR_SIZE);
+    put_le32(buffer + 8 + DISK_SECTOR_SIZE, journal_checksum(buffer, 8 + DISK_SECTOR_SIZE));
+    if (write(target->journal_fd, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+        printf("[Disk] ERROR: Journal write for %s failed (%s)\n", target->path, strerror(errno));
+        fflush(stdout);
+        return;
+    }
+    if (target->journal_records++ == 0) {
+        target->first_record_time = time(NULL);
     }
 }
 
-// BDOS Function 23: Rename File
-int bdos_rename_file(struct i8080* cpu) {
-    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+// Replace the image with a complete copy taken on the emulation thread
+static void write_full_image(persist_record_t *record) {
+    persist_target_t *target = record->target;
+    sparse_disk_t image = { 0 };
+    sparse_reset(&image, target->format);
+    for (unsigned int i = 0; i < image.sectors; i++) {
+        sparse_write_sector(&image, i, record->data + (size_t)i * DISK_SECTOR_SIZE);
+    }
+    if (write_file_atomically(target->path, &image, target->sparse_file)) {
+        journal_reset(target);
+    } else {
+        printf("[Disk] ERROR: Failed to save %s (%s)\n", target->path, strerror(errno));
+        fflush(stdout);
+    }
+    sparse_clear(&image);
+}
 
-    // CP/M Rename FCB format:
-    // Bytes 0-11: Old name (drive, filename[8], extension[3])
-    // Bytes 16-27: New name (drive, filename[8], extension[3])
-    fcb_t old_fcb, new_fcb;
+static void* disk_writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&disk_writer.lock);
+    for (;;) {
+        while (!disk_writer.head) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&disk_writer.wake, &disk_writer.lock, &deadline);
+
+            // Time-based checkpoints for journals that stopped growing
+            time_t now = time(NULL);
+            for (persist_target_t *t = disk_writer.targets; t; t = t->next) {
+                if (t->journal_records > 0 && now - t->first_record_time >= CHECKPOINT_SECONDS) {
+                    disk_writer.busy = 1;
+                    pthread_mutex_unlock(&disk_writer.lock);
+                    journal_checkpoint(t);
+                    pthread_mutex_lock(&disk_writer.lock);
+                    disk_writer.busy = 0;
+                }
+            }
+            if (!disk_writer.head) {
+                pthread_cond_broadcast(&disk_writer.idle);
+            }
+        }
 
-    // Clear structures
-    memset(&old_fcb, 0, sizeof(fcb_t));
-    memset(&new_fcb, 0, sizeof(fcb_t));
+        // Take the whole queue and process it without holding the lock
+        persist_record_t *batch = disk_writer.head;
+        disk_writer.head = disk_writer.tail = NULL;
+        disk_writer.busy = 1;
+        pthread_mutex_unlock(&disk_writer.lock);
+
+        while (batch) {
+            persist_record_t *record = batch;
+            batch = batch->next;
+            if (record->full_image) {
+                write_full_image(record);
+            } else {
+                journal_append(record);
+            }
+            free(record->data);
+            free(record);
+        }
 
-    // Copy old name (drive + 8 chars + 3 chars = 12 bytes)
-    old_fcb.drive = mem[fcb_addr];
-    memcpy(old_fcb.filename, &mem[fcb_addr + 1], 8);
-    memcpy(old_fcb.extension, &mem[fcb_addr + 9], 3);
-    old_fcb.extent_low = 0;  // Match extent 0
+        pthread_mutex_lock(&disk_writer.lock);
+        for (persist_target_t *t = disk_writer.targets; t; t = t->next) {
+            if (t->journal_fd >= 0 && t->journal_records > 0) {
+                fsync(t->journal_fd);
+            }
+            if (t->journal_records >= CHECKPOINT_RECORDS) {
+                pthread_mutex_unlock(&disk_writer.lock);
+                journal_checkpoint(t);
+                pthread_mutex_lock(&disk_writer.lock);
+            }
+        }
+        disk_writer.busy = 0;
+        if (!disk_writer.head) {
+            pthread_cond_broadcast(&disk_writer.idle);
+        }
+    }
+    return NULL;
+}
 
-    // Copy new name from bytes 16-27
-    new_fcb.drive = mem[fcb_addr + 16];
-    memcpy(new_fcb.filename, &mem[fcb_addr + 17], 8);
-    memcpy(new_fcb.extension, &mem[fcb_addr + 25], 3);
+// Queue a record for the writer. Never blocks on I/O.
+static void disk_writer_enqueue(const char *path, const sparse_disk_t *disk, persist_record_t *record) {
+    pthread_mutex_lock(&disk_writer.lock);
+    persist_target_t *target;
+    for (target = disk_writer.targets; target; target = target->next) {
+        if (strcmp(target->path, path) == 0) {
+            break;
+        }
+    }
+    if (!target) {
+        target = calloc(1, sizeof(persist_target_t));
+        if (!target) {
+            pthread_mutex_unlock(&disk_writer.lock);
+            free(record->data);
+            free(record);
+            return;
+        }
+        snprintf(target->path, sizeof(target->path), "%s", path);
+        target->journal_fd = -1;
+        target->next = disk_writer.targets;
+        disk_writer.targets = target;
+    }
+    target->sparse_file = disk->sparse_file;
+    target->format = disk->format;
+    record->target = target;
+    record->next = NULL;
+    if (disk_writer.tail) {
+        disk_writer.tail->next = record;
+    } else {
+        disk_writer.head = record;
+    }
+    disk_writer.tail = record;
 
-    #if DEBUG_DISK_IO
-    printf("\n[BDOS-23: Rename File] %.8s.%.3s → %.8s.%.3s\n",
-           old_fcb.filename, old_fcb.extension,
-           new_fcb.filename, new_fcb.extension);
-    fflush(stdout);
-    #endif
+    if (!disk_writer.started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, disk_writer_main, NULL) == 0) {
+            pthread_detach(thread);
+            disk_writer.started = 1;
+        }
+    }
+    pthread_cond_signal(&disk_writer.wake);
+    pthread_mutex_unlock(&disk_writer.lock);
+}
 
-    // Find the old file
-    int dir_index = find_dir_entry(&old_fcb);
+static void persist_sector(const char *path, const sparse_disk_t *disk, unsigned int index) {
+    persist_record_t *record = calloc(1, sizeof(persist_record_t));
+    unsigned char *data = malloc(DISK_SECTOR_SIZE);
+    if (!record || !data) {
+        free(record);
+        free(data);
+        return;
+    }
+    sparse_read_sector(disk, index, data);
+    record->index = index;
+    record->data = data;
+    disk_writer_enqueue(path, disk, record);
+}
 
-    if (dir_index >= 0) {
-        // Read the entry
-        dir_entry_t entry;
-        read_dir_entry(dir_index, &entry);
+static void persist_full_image(const char *path, const sparse_disk_t *disk) {
+    persist_record_t *record = calloc(1, sizeof(persist_record_t));
+    unsigned char *data = malloc((size_t)disk->sectors * DISK_SECTOR_SIZE);
+    if (!record || !data) {
+        free(record);
+        free(data);
+        return;
+    }
+    for (unsigned int i = 0; i < disk->sectors; i++) {
+        sparse_read_sector(disk, i, data + (size_t)i * DISK_SECTOR_SIZE);
+    }
+    record->data = data;
+    record->full_image = 1;
+    disk_writer_enqueue(path, disk, record);
+}
 
-        // Update with new name
-        memcpy(entry.filename, new_fcb.filename, 8);
-        memcpy(entry.extension, new_fcb.extension, 3);
+// Wait until every queued write has reached its journal or image file
+void cpm_disk_flush(void) {
+    pthread_mutex_lock(&disk_writer.lock);
+    while (disk_writer.head || disk_writer.busy) {
+        pthread_cond_wait(&disk_writer.idle, &disk_writer.lock);
+    }
+    pthread_mutex_unlock(&disk_writer.lock);
+}
 
-        // Write it back
-        write_dir_entry(dir_index, &entry);
+// ============================================================================
+// DISK EMULATION
+// ============================================================================
 
-        #if DEBUG_DISK_IO
-        printf("[BDOS-23: Renamed dir entry %d]\n", dir_index);
-        fflush(stdout);
-        #endif
-
-        (cpu->reg)[A] = 0;  // Success
+static int get_disk_path(char *buffer, size_t size, const char *filename) {
+    if (!buffer || size == 0) {
         return 0;
-    } else {
-        #if DEBUG_DISK_IO
-        printf("[BDOS-23: File not found]\n");
-        fflush(stdout);
-        #endif
-
-        (cpu->reg)[A] = 0xFF;  // Not found
-        return 1;
     }
+    if (disk_base_path[0] == '\0' && cpm_machine != &cpm_default_machine) {
+        return 0;  // Sessions without a disk directory keep their disks in memory
+    }
+    const char *base = disk_base_path[0] != '\0' ? disk_base_path : getenv("HOME");
+    if (!base) {
+        return 0;
+    }
+    if (disk_base_path[0] != '\0') {
+        int written = snprintf(buffer, size, "%s/%s", base, filename);
+        return (written > 0 && (size_t)written < size);
+    }
+    int written = snprintf(buffer, size, "%s/Documents/%s", base, filename);
+    return (written > 0 && (size_t)written < size);
 }
 
-// ============================================================================
-// CP/M INITIALIZATION
-// ============================================================================
-
-// Helper: Create a sample file on disk
-void cpm_create_sample_file(const char* name, const char* ext, const char* content) {
-    dir_entry_t entry;
-
-    // Set up directory entry
-    entry.user_number = 0;
-    memset(entry.filename, ' ', 8);
-    memset(entry.extension, ' ', 3);
-    memcpy(entry.filename, name, strlen(name) > 8 ? 8 : strlen(name));
-    memcpy(entry.extension, ext, strlen(ext) > 3 ? 3 : strlen(ext));
-    entry.extent_low = 0;
-    entry.reserved[0] = 0;
-    entry.reserved[1] = 0;
-
-    // Calculate how many records we need
-    int content_len = strlen(content);
-    int records = (content_len + 127) / 128;  // Round up
-    entry.record_count = records;
-
-    // Allocate blocks (simple: one block per 8 records)
-    memset(entry.allocation, 0, 16);
-    int blocks_needed = (records + 7) / 8;
-    for (int i = 0; i < blocks_needed && i < 16; i++) {
-        entry.allocation[i] = i + 1;  // Blocks 1, 2, 3, etc.
+void cpm_set_disk_base_path(const char *path) {
+    if (!path) {
+        disk_base_path[0] = '\0';
+        return;
     }
+    snprintf(disk_base_path, sizeof(disk_base_path), "%s", path);
+}
 
-    // Find free directory entry
-    int dir_index = find_free_dir_entry();
-    if (dir_index < 0) return;  // Directory full
-
-    // Write directory entry
-    write_dir_entry(dir_index, &entry);
+// Read a raw or sparse image file into a disk and identify its format.
+// Bad images are reported here; a read that failed sets io_error (when
+// given) to the errno for the caller, and a missing file leaves it 0.
+static int read_disk_file(const char *path, sparse_disk_t *disk, int *io_error) {
+    if (io_error) {
+        *io_error = 0;
+    }
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        if (io_error && errno != ENOENT) {
+            *io_error = errno;
+        }
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
 
-    // Write content to disk
-    unsigned char* disk = get_current_disk();
-    int offset = 0;
-    for (int rec = 0; rec < records; rec++) {
-        int block = entry.allocation[rec / 8];
-        int track = block + 1;  // Data starts at track 2
-        int sector = (rec % 8) + 1;
-        int disk_offset = (track * 26 + (sector - 1)) * 128;
+    unsigned char header[SPARSE_HEADER_SIZE] = { 0 };
+    size_t header_len = fread(header, 1, sizeof(header), f);
+    int sparse;
+    unsigned int sectors = image_file_sectors(header, header_len == sizeof(header) ? (unsigned long)file_size : 0, &sparse);
+    if (sectors == 0) {
+        fclose(f);
+        printf("[Disk] ERROR: %s has an unsupported size (%ld bytes)\n", path, file_size);
+        fflush(stdout);
+        return 0;
+    }
+    sparse_reset(disk, DISK_DEFAULT_FORMAT);
+    disk->sectors = sectors;
 
-        // Copy up to 128 bytes
-        for (int i = 0; i < 128; i++) {
-            if (offset < content_len) {
-                disk[disk_offset + i] = content[offset++];
-            } else {
-                disk[disk_offset + i] = 0x1A;  // CP/M EOF marker
+    int ok = 1;
+    if (sparse) {
+        ok = load_sparse_image(f, path, disk);
+    } else {
+        unsigned char sector[DISK_SECTOR_SIZE];
+        fseek(f, 0, SEEK_SET);
+        for (unsigned int i = 0; i < sectors && ok; i++) {
+            ok = fread(sector, 1, DISK_SECTOR_SIZE, f) == DISK_SECTOR_SIZE;
+            if (ok) {
+                sparse_write_sector(disk, i, sector);
+            } else if (io_error) {
+                *io_error = ferror(f) && errno ? errno : EIO;
             }
         }
+        disk->sparse_file = 0;
     }
-}
+    fclose(f);
 
-// Helper: Create a sample binary file on disk
-void cpm_create_sample_file_bytes(const char* name, const char* ext, const unsigned char* content, int content_len) {
-    dir_entry_t entry;
+    const disk_format_t *format = ok ? identify_disk_format(disk) : NULL;
+    if (!format) {
+        if (ok) {
+            printf("[Disk] ERROR: %s does not match a known disk format\n", path);
+            fflush(stdout);
+        }
+        sparse_reset(disk, DISK_DEFAULT_FORMAT);
+        return 0;
+    }
+    disk->format = format;
+    return 1;
+}
 
-    // Set up directory entry
-    entry.user_number = 0;
-    memset(entry.filename, ' ', 8);
-    memset(entry.extension, ' ', 3);
-    memcpy(entry.filename, name, strlen(name) > 8 ? 8 : strlen(name));
-    memcpy(entry.extension, ext, strlen(ext) > 3 ? 3 : strlen(ext));
-    entry.extent_low = 0;
-    entry.reserved[0] = 0;
-    entry.reserved[1] = 0;
+static int load_disk_image(const char *filename, sparse_disk_t *disk) {
+    char path[512];
+    if (!get_disk_path(path, sizeof(path), filename)) {
+        return 0;
+    }
+    // Pending writes for this image must land before it is read back
+    cpm_disk_flush();
 
-    // Calculate how many records we need
-    int records = (content_len + 127) / 128;  // Round up
-    entry.record_count = records;
+    int io_error;
+    int loaded = read_disk_file(path, disk, &io_error);
+    if (io_error) {
+        printf("[Disk] ERROR: Failed to load %s (%s)\n", path, strerror(io_error));
+        fflush(stdout);
+    }
+    int replayed = journal_replay(path, disk);
+    if (replayed > 0) {
+        printf("[Disk] Replayed %d journal records for %s\n", replayed, path);
+        fflush(stdout);
+    }
+    if (!loaded && replayed == 0) {
+        printf("[Disk] No image at %s\n", path);
+        fflush(stdout);
+        return 0;
+    }
+    printf("[Disk] Loaded %simage %s (%s, %u sectors populated)\n",
+           disk->sparse_file ? "sparse " : "", path, disk->format->name, disk->populated);
+    fflush(stdout);
+    return 1;
+}
 
-    // Allocate blocks (simple: one block per 8 records)
-    memset(entry.allocation, 0, 16);
-    int blocks_needed = (records + 7) / 8;
-    for (int i = 0; i < blocks_needed && i < 16; i++) {
-        entry.allocation[i] = i + 1;  // Blocks 1, 2, 3, etc.
+// Queue a complete copy of the disk; the writer replaces the file atomically
+static void save_disk_image(const char *filename, sparse_disk_t *disk) {
+    char path[512];
+    if (!get_disk_path(path, sizeof(path), filename)) {
+        return;
     }
+    persist_full_image(path, disk);
+}
 
-    // Find free directory entry
-    int dir_index = find_free_dir_entry();
-    if (dir_index < 0) return;  // Directory full
+// Save a drive in the sparse image format; later saves keep using it
+int cpm_save_disk_sparse(int drive, const char *filename) {
+    if (drive < 0 || drive > 1 || !filename) {
+        return 0;
+    }
+    sparse_disk_t *disk = (drive == 0) ? &disk_a : &disk_b;
+    disk->sparse_file = 1;
+    disk->detached = 0;
+    save_disk_image(filename, disk);
+    return 1;
+}
 
-    // Write directory entry
-    write_dir_entry(dir_index, &entry);
+// Overlay drives: a shared read-only base image plus a private sparse delta.
+// Mounting maps the base (once per process) instead of reading it, and
+// the delta lives in memory until it is committed or discarded.
+static sparse_disk_t* image_drive(int drive) {
+    if (drive == 0) {
+        return &disk_a;
+    }
+    return (drive == 1) ? &disk_b : NULL;
+}
 
-    // Write content to disk
-    unsigned char* disk = get_current_disk();
-    int offset = 0;
-    for (int rec = 0; rec < records; rec++) {
-        int block = entry.allocation[rec / 8];
-        int track = block + 1;  // Data starts at track 2
-        int sector = (rec % 8) + 1;
-        int disk_offset = (track * 26 + (sector - 1)) * 128;
+int cpm_mount_overlay(int drive, const char *base_path) {
+    sparse_disk_t *disk = image_drive(drive);
+    char path[512];
+    if (!disk || !base_path) {
+        return 0;
+    }
+    if (base_path[0] == '/') {
+        snprintf(path, sizeof(path), "%s", base_path);
+    } else if (!get_disk_path(path, sizeof(path), base_path)) {
+        return 0;
+    }
+    base_image_t *base = base_image_acquire(path);
+    if (!base) {
+        return 0;
+    }
+    sparse_reset(disk, DISK_DEFAULT_FORMAT);
+    base_image_release(disk->base);
+    disk->base = base;
+    disk->sectors = base->sectors;
+    disk->sparse_file = base->sparse;
+    const disk_format_t *format = identify_disk_format(disk);
+    if (!format) {
+        printf("[Disk] ERROR: %s does not match a known disk format\n", path);
+        fflush(stdout);
+        base_image_release(base);
+        disk->base = NULL;
+        sparse_reset(disk, DISK_DEFAULT_FORMAT);
+        return 0;
+    }
+    disk->format = format;
+    printf("[Disk] %c: is an overlay of %s (%s)\n", 'A' + drive, path, format->name);
+    fflush(stdout);
+    return 1;
+}
 
-        // Copy up to 128 bytes
-        for (int i = 0; i < 128; i++) {
-            if (offset < content_len) {
-                disk[disk_offset + i] = content[offset++];
-            } else {
-                disk[disk_offset + i] = 0x1A;  // CP/M EOF marker
-            }
-        }
+// Drop the session's changes, returning the drive to the base image contents
+void cpm_overlay_discard(int drive) {
+    sparse_disk_t *disk = image_drive(drive);
+    if (disk && disk->base) {
+        sparse_clear(disk);
     }
 }
 
-void cpm_init(void) {
-    cpm_console_init();
-    cpm_disk_init();
+// Write base + delta to a new image file and make it the drive's base.
+// The file is written next to its destination and renamed into place, so
+// other sessions still mapping an older base at that path are unaffected.
+int cpm_overlay_commit(int drive, const char *filename) {
+    sparse_disk_t *disk = image_drive(drive);
+    char path[512];
+    if (!disk || !disk->base || !filename) {
+        return 0;
+    }
+    if (filename[0] == '/') {
+        snprintf(path, sizeof(path), "%s", filename);
+    } else if (!get_disk_path(path, sizeof(path), filename)) {
+        return 0;
+    }
+    if (!write_file_atomically(path, disk, disk->sparse_file)) {
+        printf("[Disk] ERROR: Failed to commit %s (%s)\n", path, strerror(errno));
+        fflush(stdout);
+        return 0;
+    }
+    return cpm_mount_overlay(drive, path);
+}
 
-    if (!disk_a_loaded) {
-        // Create some sample files for demo on a fresh disk
-        cpm_create_sample_file("WELCOME", "TXT", "Welcome to CP/M 2.2!\r\nType DIR to see files.\r\n");
-        cpm_create_sample_file("HELP", "TXT", "Available commands:\r\nDIR - List files\r\nTYPE filename - Display file\r\nERA filename - Delete file\r\nEXIT - Halt system\r\n");
-        cpm_create_sample_file("README", "TXT", "This is a CP/M 2.2 emulator running on an Intel 8080 CPU.\r\n\r\nHave fun exploring!\r\n");
+// Detach the base; the drive keeps its current contents as a private image
+void cpm_unmount_overlay(int drive) {
+    sparse_disk_t *disk = image_drive(drive);
+    if (!disk || !disk->base) {
+        return;
+    }
+    unsigned char sector[DISK_SECTOR_SIZE];
+    for (unsigned int i = 0; i < disk->sectors; i++) {
+        disk_page_t *page = disk->page[i / DISK_PAGE_SECTORS];
+        if (!page || !page->sector[i % DISK_PAGE_SECTORS]) {
+            sparse_read_sector(disk, i, sector);
+            base_image_t *base = disk->base;
+            disk->base = NULL;
+            sparse_write_sector(disk, i, sector);
+            disk->base = base;
+        }
+    }
+    base_image_release(disk->base);
+    disk->base = NULL;
+}
 
-        static const unsigned char hello_com[] = {
-            0x11, 0x09, 0x01,       // LXI D,0109h
-            0x0E, 0x09,             // MVI C,09h
-            0xCD, 0x05, 0x00,       // CALL 0005h
-            0xC9,                   // RET
-            0x48, 0x45, 0x4C, 0x4C, 0x4F, 0x20, 0x46, 0x52,
-            0x4F, 0x4D, 0x20, 0x43, 0x4F, 0x4D, 0x21, 0x0D,
-            0x0A, 0x24              // "HELLO FROM COM!\r\n$"
-        };
-        cpm_create_sample_file_bytes("HELLO", "COM", hello_com, sizeof(hello_com));
+static void cpm_disk_load_images(void) {
+    // Overlay drives keep their mapped base; only the delta was reset
+    disk_a_loaded = disk_a.base ? 1 : load_disk_image("A.DSK", &disk_a);
+    disk_b_loaded = disk_b.base ? 1 : load_disk_image("B.DSK", &disk_b);
+    printf("[Disk] A.DSK loaded: %s\n", disk_a_loaded ? "yes" : "no");
+    printf("[Disk] B.DSK loaded: %s\n", disk_b_loaded ? "yes" : "no");
+    fflush(stdout);
+}
 
-        static const unsigned char plop_com[] = {
-            0x11, 0x09, 0x01,       // LXI D,0109h
-            0x0E, 0x16,             // MVI C,16h (BDOS Make File)
-            0xCD, 0x05, 0x00,       // CALL 0005h
-            0xC9,                   // RET
-            0x00,                   // Drive (default)
-            0x50, 0x4C, 0x4F, 0x50, 0x20, 0x20, 0x20, 0x20, // "PLOP    "
-            0x54, 0x58, 0x54,       // "TXT"
-            0x00,                   // Extent low
-            0x00, 0x00,             // Reserved
-            0x00,                   // Record count
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 // Allocation
-        };
-        cpm_create_sample_file_bytes("PLOP", "COM", plop_com, sizeof(plop_com));
-        save_disk_image("A.DSK", disk_a, sizeof(disk_a));
+// Queue one dirty sector of the current disk for the background writer
+static void cpm_disk_persist_sector(unsigned int index) {
+    sparse_disk_t *disk = get_current_disk();
+    char path[512];
+    if (disk->base || disk->detached) {
+        return;  // Overlay deltas stay in memory until committed, detached drives until saved
+    }
+    if (get_disk_path(path, sizeof(path), cpm_disk.current_disk == 0 ? "A.DSK" : "B.DSK")) {
+        persist_sector(path, disk, index);
     }
+}
 
-    printf("\n");
-    printf("========================================\n");
-    printf("CP/M System Initialized\n");
-    printf("BDOS Entry: 0x0005\n");
-    printf("Console Ports: 0x00, 0x01\n");
-    printf("Disk Ports: 0x10-0x15\n");
-    printf("========================================\n");
-    if (!disk_a_loaded) {
-        printf("Sample files created on drive A:\n");
-        printf("  WELCOME.TXT\n");
-        printf("  HELP.TXT\n");
-        printf("  README.TXT\n");
-        printf("  HELLO.COM\n");
-        printf("  PLOP.COM\n");
+void cpm_disk_init(void) {
+    memset(&cpm_disk, 0, sizeof(disk_state));
+    cpm_disk.dma_address = 0x0080; // Default DMA address
+    host_close_all_files();
+    // Empty sparse disks read back as 0xE5; overlay drives keep their base
+    if (disk_a.base) {
+        sparse_clear(&disk_a);
     } else {
-        printf("Using disk image from Documents (A.DSK)\n");
+        sparse_reset(&disk_a, DISK_DEFAULT_FORMAT);
     }
-    printf("========================================\n");
-    printf("CP/M Console Output:\n");
+    if (disk_b.base) {
+        sparse_clear(&disk_b);
+    } else {
+        sparse_reset(&disk_b, DISK_DEFAULT_FORMAT);
+    }
+    cpm_disk_load_images();
+
+    printf("[Disk] Initialized 2 drives (A: and B:)\n");
+    printf("[Disk] A: %s, %u tracks × %u sectors\n", disk_a.format->name,
+           disk_a.format->tracks, disk_a.format->sectors_per_track);
+    printf("[Disk] B: %s, %u tracks × %u sectors\n", disk_b.format->name,
+           disk_b.format->tracks, disk_b.format->sectors_per_track);
     fflush(stdout);
 }
 
-// ============================================================================
-// END CP/M SUPPORT
-// ============================================================================
+void cpm_select_disk(unsigned char disk) {
+    if (disk >= CPM_MAX_DRIVES || cpm_host.type[disk] == DRIVE_NONE) {
+        printf("[Disk] ERROR: No drive %c:\n", 'A' + disk);
+        fflush(stdout);
+        return;
+    }
+    cpm_disk.current_disk = disk;
+    printf("[Disk] Selected drive %c:\n", 'A' + disk);
+    fflush(stdout);
+}
 
-unsigned int exec_inst(struct i8080* cpu, unsigned char* mem) {
-    unsigned int p = cpu->prog_ctr;
-    unsigned char opcode = mem[p];
+void cpm_set_track(unsigned char track) {
+    cpm_disk.current_track = track;
+}
+
+void cpm_set_sector(unsigned char sector) {
+    cpm_disk.current_sector = sector;
+}
+
+void cpm_set_dma(unsigned int address) {
+    cpm_disk.dma_address = address;
+}
+
+void cpm_home_disk(void) {
+    cpm_disk.current_track = 0;
+    printf("[Disk] Home: Track 0\n");
+    fflush(stdout);
+}
+
+int cpm_read_sector(void) {
+    // Host directory drives have no sectors - only BDOS file access
+    if (cpm_host.type[cpm_disk.current_disk] != DRIVE_IMAGE) {
+        printf("[Disk] ERROR: Read on non-image drive %c:\n", 'A' + cpm_disk.current_disk);
+        return 1;
+    }
+
+    // Translate the logical track and sector (1-based) through the disk format
+    sparse_disk_t *disk = get_current_disk();
+    int index = disk_sector_index(disk->format, cpm_disk.current_track, cpm_disk.current_sector - 1u);
+    if (index < 0) {
+        printf("[Disk] ERROR: Invalid track %d sector %d\n", cpm_disk.current_track, cpm_disk.current_sector);
+        return 1;
+    }
+
+    // Copy sector to DMA address
+    unsigned char sector[DISK_SECTOR_SIZE];
+    sparse_read_sector(disk, (unsigned int)index, sector);
+    for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
+        if (history_recording) {
+            history_write((cpm_disk.dma_address + i) & 0xFFFF);  // Disk ports write through
+        }
+        mem[(cpm_disk.dma_address + i) & 0xFFFF] = sector[i];
+    }
+
+    printf("[Disk] Read %c: T%d S%d → DMA 0x%04X\n",
+           'A' + cpm_disk.current_disk,
+           cpm_disk.current_track,
+           cpm_disk.current_sector,
+           cpm_disk.dma_address);
+    fflush(stdout);
+
+    return 0; // Success
+}
+
+int cpm_write_sector(void) {
+    // Host directory drives have no sectors - only BDOS file access
+    if (cpm_host.type[cpm_disk.current_disk] != DRIVE_IMAGE) {
+        printf("[Disk] ERROR: Write on non-image drive %c:\n", 'A' + cpm_disk.current_disk);
+        return 1;
+    }
+
+    // Translate the logical track and sector (1-based) through the disk format
+    sparse_disk_t *disk = get_current_disk();
+    int index = disk_sector_index(disk->format, cpm_disk.current_track, cpm_disk.current_sector - 1u);
+    if (index < 0) {
+        printf("[Disk] ERROR: Invalid track %d sector %d\n", cpm_disk.current_track, cpm_disk.current_sector);
+        return 1;
+    }
+
+    // Copy from DMA address to sector
+    unsigned char sector[DISK_SECTOR_SIZE];
+    for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
+        sector[i] = mem[(cpm_disk.dma_address + i) & 0xFFFF];
+    }
+    sparse_write_sector(disk, (unsigned int)index, sector);
+
+    printf("[Disk] Write %c: T%d S%d ← DMA 0x%04X\n",
+           'A' + cpm_disk.current_disk,
+           cpm_disk.current_track,
+           cpm_disk.current_sector,
+           cpm_disk.dma_address);
+    fflush(stdout);
+    cpm_disk_persist_sector((unsigned int)index);
+
+    return 0; // Success
+}
+
+// ============================================================================
+// CP/M FILE SYSTEM
+// ============================================================================
+
+// FCB (File Control Block) structure - 32 bytes
+typedef struct {
+    unsigned char drive;           // 0: use default, 1-16: A-P
+    char filename[8];              // Filename, padded with spaces
+    char extension[3];             // Extension, padded with spaces
+    unsigned char extent_low;      // Extent number (low byte)
+    unsigned char reserved[2];     // Reserved bytes
+    unsigned char record_count;    // Records in current extent (0-128)
+    unsigned char allocation[16];  // Block allocation map
+} fcb_t;
+
+// Directory entry structure (same as FCB for directory storage)
+typedef struct {
+    unsigned char user_number;     // 0-15 user, 0xE5 = deleted
+    char filename[8];
+    char extension[3];
+    unsigned char extent_low;
+    unsigned char reserved[2];
+    unsigned char record_count;
+    unsigned char allocation[16];
+} dir_entry_t;
+
+// Helper: Get pointer to current disk
+sparse_disk_t* get_current_disk(void) {
+    return (cpm_disk.current_disk == 0) ? &disk_a : &disk_b;
+}
+
+static int is_valid_dir_char(unsigned char ch) {
+    ch &= 0x7F;
+    if (ch == ' ' || ch == 0x00) {
+        return 1;
+    }
+    if ((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
+        return 1;
+    }
+    return 0;
+}
+
+static int entry_is_blank(const unsigned char *entry) {
+    for (int i = 0; i < 11; i++) {
+        unsigned char ch = entry[1 + i] & 0x7F;
+        if (ch != 0x00 && ch != ' ') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int entry_has_filename(const unsigned char *entry) {
+    for (int i = 0; i < 8; i++) {
+        unsigned char ch = entry[1 + i] & 0x7F;
+        if (ch != 0x00 && ch != ' ') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int entry_looks_valid(const unsigned char *entry) {
+    unsigned char user = entry[0];
+    if (user == 0xE5 || user > 0x1F) {
+        return 0;
+    }
+
+    if (entry_is_blank(entry) || !entry_has_filename(entry)) {
+        return 0;
+    }
+
+    for (int i = 0; i < 11; i++) {
+        unsigned char ch = entry[1 + i];
+        if (!is_valid_dir_char(ch)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void disk_read_dir_entry(const sparse_disk_t *disk, const disk_format_t *format,
+                                int entry_num, unsigned char *entry) {
+    unsigned char sector[DISK_SECTOR_SIZE];
+    int index = disk_dir_sector_index(format, (unsigned int)entry_num / 4);
+    if (index < 0) {
+        memset(entry, DISK_FILL, 32);
+        return;
+    }
+    sparse_read_sector(disk, (unsigned int)index, sector);
+    memcpy(entry, sector + (entry_num % 4) * 32, 32);
+}
+
+static int directory_score(const sparse_disk_t *disk, const disk_format_t *format) {
+    int score = 0;
+    unsigned char entry[32];
+    for (unsigned int i = 0; i < format->dir_entries; i++) {
+        disk_read_dir_entry(disk, format, (int)i, entry);
+        if (entry_looks_valid(entry)) {
+            score++;
+        }
+    }
+    return score;
+}
+
+// Pick the format of a disk from its capacity, then from which layout's
+// directory holds the most plausible entries. Ties go to the earlier format.
+static const disk_format_t* identify_disk_format(const sparse_disk_t *disk) {
+    pthread_once(&disk_formats_once, disk_formats_build);
+    const disk_format_t *best = NULL;
+    int best_score = -1;
+    for (int f = 0; f < DISK_FORMAT_COUNT; f++) {
+        const disk_format_t *format = &disk_formats[f];
+        if (format_sectors(format) != disk->sectors) {
+            continue;
+        }
+        int score = directory_score(disk, format);
+        if (score > best_score) {
+            best = format;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+const char* cpm_disk_format_name(int drive) {
+    if (drive < 0 || drive > 1) {
+        return NULL;
+    }
+    return ((drive == 0) ? &disk_a : &disk_b)->format->name;
+}
+
+// Number of directory entries on the current disk
+static int dir_entry_count(void) {
+    return (int)get_current_disk()->format->dir_entries;
+}
+
+// Helper: Read directory entry
+void read_dir_entry(int entry_num, dir_entry_t* entry) {
+    sparse_disk_t* disk = get_current_disk();
+    disk_read_dir_entry(disk, disk->format, entry_num, (unsigned char *)entry);
+}
+
+// Helper: Write directory entry
+void write_dir_entry(int entry_num, dir_entry_t* entry) {
+    sparse_disk_t* disk = get_current_disk();
+    int index = disk_dir_sector_index(disk->format, (unsigned int)entry_num / 4);
+    if (index < 0) {
+        return;
+    }
+    unsigned char sector[DISK_SECTOR_SIZE];
+    sparse_read_sector(disk, (unsigned int)index, sector);
+    memcpy(sector + (entry_num % 4) * 32, entry, 32);
+    sparse_write_sector(disk, (unsigned int)index, sector);
+    cpm_disk_persist_sector((unsigned int)index);
+}
+
+// Helper: Compare filename and extension
+int fcb_match(dir_entry_t* entry, fcb_t* fcb) {
+    // Check if entry is deleted
+    if (entry->user_number == 0xE5) {
+        #if DEBUG_DISK_IO
+        printf("  [fcb_match] Entry is deleted (0xE5)\n");
+        fflush(stdout);
+        #endif
+        return 0;
+    }
+
+    if (!entry_looks_valid((const unsigned char *)entry)) {
+        #if DEBUG_DISK_IO
+        printf("  [fcb_match] Entry invalid\n");
+        fflush(stdout);
+        #endif
+        return 0;
+    }
+
+    #if DEBUG_DISK_IO
+    printf("  [fcb_match] Entry: '%.8s.%.3s' vs FCB: '%.8s.%.3s'\n",
+           entry->filename, entry->extension, fcb->filename, fcb->extension);
+    fflush(stdout);
+    #endif
+
+    // Compare filename (handle ? wildcards)
+    for (int i = 0; i < 8; i++) {
+        if (fcb->filename[i] != '?' && ((fcb->filename[i] ^ entry->filename[i]) & 0x7F)) {
+            #if DEBUG_DISK_IO
+            printf("  [fcb_match] Filename mismatch at position %d: '%c' != '%c'\n",
+                   i, fcb->filename[i], entry->filename[i]);
+            fflush(stdout);
+            #endif
+            return 0;
+        }
+    }
+
+    // Compare extension (handle ? wildcards)
+    for (int i = 0; i < 3; i++) {
+        if (fcb->extension[i] != '?' && ((fcb->extension[i] ^ entry->extension[i]) & 0x7F)) {
+            #if DEBUG_DISK_IO
+            printf("  [fcb_match] Extension mismatch at position %d: '%c' != '%c'\n",
+                   i, fcb->extension[i], entry->extension[i]);
+            fflush(stdout);
+            #endif
+            return 0;
+        }
+    }
+
+    #if DEBUG_DISK_IO
+    printf("  [fcb_match] MATCH!\n");
+    fflush(stdout);
+    #endif
+    return 1;
+}
+
+// Helper: Find directory entry for FCB
+int find_dir_entry(fcb_t* fcb) {
+    dir_entry_t entry;
+
+    for (int i = 0; i < dir_entry_count(); i++) {
+        read_dir_entry(i, &entry);
+        if (fcb_match(&entry, fcb) && entry.extent_low == fcb->extent_low) {
+            return i;
+        }
+    }
+
+    return -1;  // Not found
+}
+
+// Helper: Find free directory entry
+int find_free_dir_entry(void) {
+    dir_entry_t entry;
+
+    for (int i = 0; i < dir_entry_count(); i++) {
+        read_dir_entry(i, &entry);
+        if (entry.user_number == 0xE5 || entry_is_blank((const unsigned char *)&entry) ||
+            !entry_has_filename((const unsigned char *)&entry)) {
+            return i;
+        }
+    }
+
+    return -1;  // Directory full
+}
+
+// ============================================================================
+// HOST DIRECTORY DRIVES
+// ============================================================================
+//
+// A host drive maps a directory on the host straight into BDOS. There is no
+// disk image: Search First/Next walks the directory with readdir as the guest
+// asks for entries, and sequential reads/writes go to the host file through a
+// per-file read-ahead buffer. Only host names that fit CP/M 8.3 (letters and
+// digits, case-insensitive) are visible to the guest.
+
+// Translate a host file name to a space padded 8.3 FCB name
+static int host_name_to_fcb(const char *host, char name[11]) {
+    memset(name, ' ', 11);
+    int len = 0;
+    int in_ext = 0;
+    for (const char *c = host; *c; c++) {
+        if (*c == '.') {
+            if (in_ext || c == host) {
+                return 0;
+            }
+            in_ext = 1;
+            len = 0;
+            continue;
+        }
+        unsigned char ch = (unsigned char)toupper((unsigned char)*c);
+        if (!((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9'))) {
+            return 0;
+        }
+        if (len >= (in_ext ? 3 : 8)) {
+            return 0;
+        }
+        name[(in_ext ? 8 : 0) + len++] = (char)ch;
+    }
+    return name[0] != ' ';
+}
+
+// Translate an 8.3 FCB name to "NAME.EXT" (no dot when there is no extension)
+static void fcb_name_to_host(const char name[11], char *out) {
+    int n = 0;
+    for (int i = 0; i < 8 && name[i] != ' '; i++) {
+        out[n++] = name[i] & 0x7F;
+    }
+    if (name[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && name[i] != ' '; i++) {
+            out[n++] = name[i] & 0x7F;
+        }
+    }
+    out[n] = '\0';
+}
+
+static int host_is_regular_file(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// FCB names compare without the attribute bits (read-only, system, archive)
+// that CP/M keeps in bit 7 of the name characters
+static int fcb_names_equal(const char a[11], const char b[11]) {
+    for (int i = 0; i < 11; i++) {
+        if ((a[i] ^ b[i]) & 0x7F) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Find the host file whose 8.3 translation equals the FCB name.
+// Returns 1 and fills path on success.
+static int host_find_file(unsigned char drive, const char name[11], char *path, size_t size) {
+    DIR *dir = opendir(cpm_host.path[drive]);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent *de;
+    char candidate[11];
+    int found = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (!host_name_to_fcb(de->d_name, candidate) || !fcb_names_equal(candidate, name)) {
+            continue;
+        }
+        int written = snprintf(path, size, "%s/%s", cpm_host.path[drive], de->d_name);
+        if (written > 0 && (size_t)written < size && host_is_regular_file(path)) {
+            found = 1;
+            break;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+static host_file_t* host_lookup_open(unsigned char drive, const char name[11]) {
+    for (int i = 0; i < CPM_HOST_MAX_FILES; i++) {
+        host_file_t *hf = &cpm_host.files[i];
+        if (hf->in_use && hf->drive == drive && fcb_names_equal(hf->name, name)) {
+            hf->last_used = ++cpm_host.use_clock;
+            return hf;
+        }
+    }
+    return NULL;
+}
+
+static void host_close_file(host_file_t *hf) {
+    if (hf && hf->in_use) {
+        close(hf->fd);
+        free(hf->ra_buf);
+        hf->ra_buf = NULL;
+        hf->in_use = 0;
+    }
+}
+
+static void host_close_all_files(void) {
+    for (int i = 0; i < CPM_HOST_MAX_FILES; i++) {
+        host_close_file(&cpm_host.files[i]);
+    }
+    if (cpm_host.search_dir) {
+        closedir(cpm_host.search_dir);
+        cpm_host.search_dir = NULL;
+    }
+}
+
+// Get an open handle for the file, opening it (or creating it) on demand
+static host_file_t* host_get_file(unsigned char drive, const char name[11], int create) {
+    host_file_t *hf = host_lookup_open(drive, name);
+    if (hf && !create) {
+        return hf;
+    }
+    host_close_file(hf);
+
+    char path[1024];
+    int fd;
+    if (create) {
+        char host_name[13];
+        if (!host_find_file(drive, name, path, sizeof(path))) {
+            fcb_name_to_host(name, host_name);
+            snprintf(path, sizeof(path), "%s/%s", cpm_host.path[drive], host_name);
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    } else {
+        if (!host_find_file(drive, name, path, sizeof(path))) {
+            return NULL;
+        }
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            fd = open(path, O_RDONLY);
+        }
+    }
+    unsigned char *ra_buf = fd >= 0 ? malloc(CPM_HOST_READAHEAD) : NULL;
+    if (!ra_buf) {
+        printf("[Host] ERROR: Failed to open %s (%s)\n", path, strerror(fd < 0 ? errno : ENOMEM));
+        fflush(stdout);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    // Reuse a free slot, or evict the least recently used file when the
+    // table is full
+    hf = &cpm_host.files[0];
+    for (int i = 0; i < CPM_HOST_MAX_FILES; i++) {
+        if (!cpm_host.files[i].in_use) {
+            hf = &cpm_host.files[i];
+            break;
+        }
+        if (cpm_host.files[i].last_used < hf->last_used) {
+            hf = &cpm_host.files[i];
+        }
+    }
+    host_close_file(hf);
+    hf->in_use = 1;
+    hf->fd = fd;
+    hf->drive = drive;
+    hf->last_used = ++cpm_host.use_clock;
+    for (int i = 0; i < 11; i++) {
+        hf->name[i] = name[i] & 0x7F;
+    }
+    hf->ra_buf = ra_buf;
+    hf->ra_offset = 0;
+    hf->ra_len = 0;
+    return hf;
+}
+
+// Read one 128-byte record, padding a short final record with ^Z.
+// Returns 0 on success, 1 at end of file.
+static int host_read_file_record(host_file_t *hf, long record, unsigned char *dst) {
+    long offset = record * 128;
+    if (offset < hf->ra_offset || offset >= hf->ra_offset + hf->ra_len) {
+        ssize_t got = pread(hf->fd, hf->ra_buf, CPM_HOST_READAHEAD, offset);
+        hf->ra_offset = offset;
+        hf->ra_len = got > 0 ? (int)got : 0;
+        if (hf->ra_len == 0) {
+            return 1;
+        }
+    }
+    int start = (int)(offset - hf->ra_offset);
+    int avail = hf->ra_len - start;
+    if (avail >= 128) {
+        memcpy(dst, hf->ra_buf + start, 128);
+    } else {
+        memcpy(dst, hf->ra_buf + start, avail);
+        memset(dst + avail, 0x1A, 128 - avail);
+    }
+    return 0;
+}
+
+static int host_write_record(host_file_t *hf, long record, const unsigned char *src) {
+    long offset = record * 128;
+    if (pwrite(hf->fd, src, 128, offset) != 128) {
+        printf("[Host] ERROR: Short write (%s)\n", strerror(errno));
+        fflush(stdout);
+        return 1;
+    }
+    // Keep the read-ahead window coherent with what was just written
+    if (offset >= hf->ra_offset && offset < hf->ra_offset + CPM_HOST_READAHEAD &&
+        offset <= hf->ra_offset + hf->ra_len) {
+        int start = (int)(offset - hf->ra_offset);
+        int n = (start + 128 <= CPM_HOST_READAHEAD) ? 128 : CPM_HOST_READAHEAD - start;
+        memcpy(hf->ra_buf + start, src, n);
+        if (start + n > hf->ra_len) {
+            hf->ra_len = start + n;
+        }
+    }
+    return 0;
+}
+
+static long host_file_records(host_file_t *hf) {
+    struct stat st;
+    if (fstat(hf->fd, &st) != 0) {
+        return 0;
+    }
+    return (long)((st.st_size + 127) / 128);
+}
+
+// Record count (RC) of the FCB's current extent
+static void host_update_record_count(host_file_t *hf, unsigned char *fcb) {
+    long remaining = host_file_records(hf) - (long)fcb[12] * 128;
+    fcb[15] = remaining <= 0 ? 0 : (remaining >= 128 ? 128 : (unsigned char)remaining);
+}
+
+int cpm_mount_host_dir(int drive, const char *path) {
+    if (drive < 2 || drive >= CPM_MAX_DRIVES || !path) {
+        printf("[Host] ERROR: Drive %c: cannot be a host directory\n", 'A' + drive);
+        fflush(stdout);
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        printf("[Host] ERROR: Cannot open %s (%s)\n", path, strerror(errno));
+        fflush(stdout);
+        return 0;
+    }
+    closedir(dir);
+    cpm_unmount_host_dir(drive);
+    snprintf(cpm_host.path[drive], sizeof(cpm_host.path[drive]), "%s", path);
+    cpm_host.type[drive] = DRIVE_HOST;
+    printf("[Host] Mounted %s as %c:\n", path, 'A' + drive);
+    fflush(stdout);
+    return 1;
+}
+
+void cpm_unmount_host_dir(int drive) {
+    if (drive < 2 || drive >= CPM_MAX_DRIVES || cpm_host.type[drive] != DRIVE_HOST) {
+        return;
+    }
+    for (int i = 0; i < CPM_HOST_MAX_FILES; i++) {
+        if (cpm_host.files[i].drive == drive) {
+            host_close_file(&cpm_host.files[i]);
+        }
+    }
+    if (cpm_host.search_dir && cpm_host.search_drive == drive) {
+        closedir(cpm_host.search_dir);
+        cpm_host.search_dir = NULL;
+    }
+    cpm_host.type[drive] = DRIVE_NONE;
+    cpm_host.path[drive][0] = '\0';
+    if (cpm_disk.current_disk == drive) {
+        cpm_disk.current_disk = 0;
+    }
+}
+
+// Drive an FCB refers to (0 = default drive)
+static unsigned char fcb_drive(unsigned int fcb_addr) {
+    unsigned char d = mem[fcb_addr];
+    return (d >= 1 && d <= CPM_MAX_DRIVES) ? d - 1 : cpm_disk.current_disk;
+}
+
+static int is_host_drive(unsigned char drive) {
+    return drive < CPM_MAX_DRIVES && cpm_host.type[drive] == DRIVE_HOST;
+}
+
+// The host_* calls work on copies of the guest's FCB and DMA record (see
+// host_call), so they can index them freely wherever the guest put them.
+static int host_open_file(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    (void)dma;
+    host_file_t *hf = host_get_file(drive, (const char *)&fcb[1], 0);
+    if (!hf) {
+        (cpu->reg)[A] = 0xFF;  // File not found
+        return 1;
+    }
+    memset(&fcb[16], 0, 16);
+    host_update_record_count(hf, fcb);
+    fcb[32] = 0;  // Current record (CR) = 0
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+static int host_close_file_fcb(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    (void)dma;
+    host_file_t *hf = host_lookup_open(drive, (const char *)&fcb[1]);
+    if (!hf) {
+        char path[1024];
+        int exists = host_find_file(drive, (const char *)&fcb[1], path, sizeof(path));
+        (cpu->reg)[A] = exists ? 0 : 0xFF;
+        return !exists;
+    }
+    host_close_file(hf);
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+static int host_make_file(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    (void)dma;
+    host_file_t *hf = host_get_file(drive, (const char *)&fcb[1], 1);
+    if (!hf) {
+        (cpu->reg)[A] = 0xFF;
+        return 1;
+    }
+    fcb[12] = 0;  // extent_low
+    fcb[15] = 0;  // record_count
+    memset(&fcb[16], 0, 16);
+    fcb[32] = 0;
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+// Advance CR, rolling over into the next extent every 128 records
+static void host_advance_record(host_file_t *hf, unsigned char *fcb) {
+    unsigned char cr = fcb[32] + 1;
+    if (cr >= 128) {
+        cr = 0;
+        fcb[12]++;
+        host_update_record_count(hf, fcb);
+    }
+    fcb[32] = cr;
+}
+
+static int host_read_sequential(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    host_file_t *hf = host_get_file(drive, (const char *)&fcb[1], 0);
+    long record = (long)fcb[12] * 128 + fcb[32];
+    if (!hf || host_read_file_record(hf, record, dma)) {
+        (cpu->reg)[A] = 1;  // End of file
+        return 1;
+    }
+    host_advance_record(hf, fcb);
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+static int host_write_sequential(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    host_file_t *hf = host_get_file(drive, (const char *)&fcb[1], 0);
+    long record = (long)fcb[12] * 128 + fcb[32];
+    if (!hf || host_write_record(hf, record, dma)) {
+        (cpu->reg)[A] = 2;  // Disk full / write error
+        return 1;
+    }
+    if (fcb[32] >= fcb[15]) {
+        fcb[15] = fcb[32] + 1;  // Update RC
+    }
+    host_advance_record(hf, fcb);
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+// Synthesize the next matching directory entry from the open directory
+// stream; the drive is the one the search started on
+static int host_search_next(struct i8080* cpu, unsigned char *fcb_bytes, unsigned char *dma, unsigned char drive) {
+    if (!cpm_host.search_dir) {
+        (cpu->reg)[A] = 0xFF;
+        return 1;
+    }
+    fcb_t fcb;
+    memcpy(&fcb, fcb_bytes, 32);
+    drive = cpm_host.search_drive;
+
+    struct dirent *de;
+    while ((de = readdir(cpm_host.search_dir)) != NULL) {
+        dir_entry_t entry;
+        char path[1024];
+        char name[11];
+        if (!host_name_to_fcb(de->d_name, name)) {
+            continue;
+        }
+        entry.user_number = 0;
+        memcpy(entry.filename, name, 8);
+        memcpy(entry.extension, name + 8, 3);
+        if (!fcb_match(&entry, &fcb)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cpm_host.path[drive], de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        long records = (long)((st.st_size + 127) / 128);
+        entry.extent_low = 0;
+        entry.reserved[0] = 0;
+        entry.reserved[1] = 0;
+        entry.record_count = records >= 128 ? 128 : (unsigned char)records;
+        memset(entry.allocation, 0, 16);
+        memcpy(dma, &entry, 32);
+        (cpu->reg)[A] = 0;  // Always directory code 0 - entry is at the start of DMA
+        return 0;
+    }
+
+    closedir(cpm_host.search_dir);
+    cpm_host.search_dir = NULL;
+    (cpu->reg)[A] = 0xFF;  // No more matches
+    return 1;
+}
+
+static int host_search_first(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    if (cpm_host.search_dir) {
+        closedir(cpm_host.search_dir);
+    }
+    cpm_host.search_dir = opendir(cpm_host.path[drive]);
+    cpm_host.search_drive = drive;
+    return host_search_next(cpu, fcb, dma, drive);
+}
+
+static int host_delete_file(struct i8080* cpu, unsigned char *fcb_bytes, unsigned char *dma, unsigned char drive) {
+    (void)dma;
+    fcb_t fcb;
+    memcpy(&fcb, fcb_bytes, 32);
+    DIR *dir = opendir(cpm_host.path[drive]);
+    int deleted_count = 0;
+    if (dir) {
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            dir_entry_t entry;
+            char path[1024];
+            char name[11];
+            if (!host_name_to_fcb(de->d_name, name)) {
+                continue;
+            }
+            entry.user_number = 0;
+            memcpy(entry.filename, name, 8);
+            memcpy(entry.extension, name + 8, 3);
+            if (!fcb_match(&entry, &fcb)) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", cpm_host.path[drive], de->d_name);
+            if (!host_is_regular_file(path)) {
+                continue;
+            }
+            host_close_file(host_lookup_open(drive, name));
+            if (unlink(path) == 0) {
+                deleted_count++;
+            }
+        }
+        closedir(dir);
+    }
+    (cpu->reg)[A] = deleted_count > 0 ? 0 : 0xFF;
+    return deleted_count > 0 ? 0 : 1;
+}
+
+static int host_rename_file(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive) {
+    (void)dma;
+    char old_path[1024];
+    char new_path[1024];
+    char new_name[13];
+    const char *old_fcb_name = (const char *)&fcb[1];
+    const char *new_fcb_name = (const char *)&fcb[17];
+
+    if (!host_find_file(drive, old_fcb_name, old_path, sizeof(old_path))) {
+        (cpu->reg)[A] = 0xFF;  // Not found
+        return 1;
+    }
+    fcb_name_to_host(new_fcb_name, new_name);
+    snprintf(new_path, sizeof(new_path), "%s/%s", cpm_host.path[drive], new_name);
+    host_close_file(host_lookup_open(drive, old_fcb_name));
+    if (rename(old_path, new_path) != 0) {
+        printf("[Host] ERROR: Rename %s failed (%s)\n", old_path, strerror(errno));
+        fflush(stdout);
+        (cpu->reg)[A] = 0xFF;
+        return 1;
+    }
+    (cpu->reg)[A] = 0;
+    return 0;
+}
+
+#define HOST_CALL_RECORD (2 + 36 + 128)   // Status, A, FCB, DMA record
+
+typedef int (*host_call_fn)(struct i8080* cpu, unsigned char *fcb, unsigned char *dma, unsigned char drive);
+
+// The call runs on copies of the FCB and DMA record gathered a byte at a
+// time, so an FCB or buffer near FFFFh wraps instead of running off the end
+// of memory. Host directories can change between a recording and its
+// replay, so each call is also logged as what the guest saw: its status, A,
+// the FCB and the DMA record. A replay hands those back without touching
+// the host, so only the drive letters have to be mounted the same way.
+static int host_call(host_call_fn fn, struct i8080* cpu, unsigned int fcb_addr, unsigned char drive) {
+    unsigned char result[HOST_CALL_RECORD];
+    unsigned char *fcb = result + 2, *dma = result + 38;
+    unsigned int dma_address = cpm_disk.dma_address & 0xFFFF;
+    int status;
+    if (replay_take(REPLAY_EVENT_HOST_CALL, result)) {
+        (cpu->reg)[A] = result[1];
+        status = result[0];
+    } else {
+        for (int i = 0; i < 36; i++) {
+            fcb[i] = mem[(fcb_addr + i) & 0xFFFF];
+        }
+        for (int i = 0; i < 128; i++) {
+            dma[i] = mem[(dma_address + i) & 0xFFFF];
+        }
+        status = fn(cpu, fcb, dma, drive);
+        if (cpm_replay.mode == REPLAY_RECORDING) {
+            result[0] = (unsigned char)status;
+            result[1] = (cpu->reg)[A];
+            record_event(REPLAY_EVENT_HOST_CALL, result, sizeof(result));
+        }
+    }
+    for (int i = 0; i < 36; i++) {
+        mem[(fcb_addr + i) & 0xFFFF] = fcb[i];
+    }
+    for (int i = 0; i < 128; i++) {
+        mem[(dma_address + i) & 0xFFFF] = dma[i];
+    }
+    return status;
+}
+
+// BDOS Function 15: Open File
+int bdos_open_file(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_open_file, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-15: Open File] %.8s.%.3s\n", fcb.filename, fcb.extension);
+    fflush(stdout);
+    #endif
+
+    int dir_index = find_dir_entry(&fcb);
+
+    if (dir_index >= 0) {
+        // File found - copy directory entry to FCB
+        dir_entry_t entry;
+        read_dir_entry(dir_index, &entry);
+
+        // Fall back to allocated blocks if record count wasn't set.
+        if (entry.record_count == 0) {
+            const disk_format_t *format = get_current_disk()->format;
+            unsigned int blocks = 0;
+            while (allocation_block(format, entry.allocation, blocks) != 0) {
+                blocks++;
+            }
+            unsigned int records = blocks * (format->block_size / DISK_SECTOR_SIZE);
+            entry.record_count = records > 128 ? 128 : (unsigned char)records;
+        }
+
+        // Copy allocation and record count back to FCB in memory
+        memcpy(&mem[fcb_addr + 16], entry.allocation, 16);
+        mem[fcb_addr + 15] = entry.record_count;
+        mem[fcb_addr + 32] = 0;  // Current record (CR) = 0
+
+        #if DEBUG_DISK_IO
+        printf("[BDOS-15: File opened, %d records]\n", entry.record_count);
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    } else {
+        #if DEBUG_DISK_IO
+        printf("[BDOS-15: File not found]\n");
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0xFF;  // File not found
+        return 1;
+    }
+}
+
+// BDOS Function 16: Close File
+int bdos_close_file(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_close_file_fcb, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-16: Close File] %.8s.%.3s\n", fcb.filename, fcb.extension);
+    fflush(stdout);
+    #endif
+
+    int dir_index = find_dir_entry(&fcb);
+
+    if (dir_index >= 0) {
+        // Update directory entry with FCB data
+        dir_entry_t entry;
+        entry.user_number = 0;  // User 0
+        memcpy(entry.filename, fcb.filename, 8);
+        memcpy(entry.extension, fcb.extension, 3);
+        entry.extent_low = fcb.extent_low;
+        entry.reserved[0] = 0;
+        entry.reserved[1] = 0;
+        entry.record_count = mem[fcb_addr + 15];
+        memcpy(entry.allocation, &mem[fcb_addr + 16], 16);
+
+        write_dir_entry(dir_index, &entry);
+
+        #if DEBUG_DISK_IO
+        printf("[BDOS-16: File closed]\n");
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    } else {
+        (cpu->reg)[A] = 0xFF;  // Error
+        return 1;
+    }
+}
+
+// BDOS Function 22: Make File
+int bdos_make_file(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_make_file, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-22: Make File] %.8s.%.3s\n", fcb.filename, fcb.extension);
+    fflush(stdout);
+    #endif
+
+    // Check if file already exists
+    int existing = find_dir_entry(&fcb);
+    if (existing >= 0) {
+        // File exists, reuse its entry
+        dir_entry_t entry;
+        entry.user_number = 0;
+        memcpy(entry.filename, fcb.filename, 8);
+        memcpy(entry.extension, fcb.extension, 3);
+        entry.extent_low = 0;
+        entry.reserved[0] = 0;
+        entry.reserved[1] = 0;
+        entry.record_count = 0;
+        memset(entry.allocation, 0, 16);
+
+        write_dir_entry(existing, &entry);
+
+        // Update FCB in memory
+        mem[fcb_addr + 12] = 0;  // extent_low
+        mem[fcb_addr + 15] = 0;  // record_count
+        memset(&mem[fcb_addr + 16], 0, 16);  // allocation
+
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    }
+
+    // Find free directory entry
+    int dir_index = find_free_dir_entry();
+
+    if (dir_index >= 0) {
+        dir_entry_t entry;
+        entry.user_number = 0;
+        memcpy(entry.filename, fcb.filename, 8);
+        memcpy(entry.extension, fcb.extension, 3);
+        entry.extent_low = 0;
+        entry.reserved[0] = 0;
+        entry.reserved[1] = 0;
+        entry.record_count = 0;
+        memset(entry.allocation, 0, 16);
+
+        write_dir_entry(dir_index, &entry);
+
+        // Update FCB in memory
+        mem[fcb_addr + 12] = 0;  // extent_low
+        mem[fcb_addr + 15] = 0;  // record_count
+        memset(&mem[fcb_addr + 16], 0, 16);  // allocation
+        mem[fcb_addr + 32] = 0;  // Current record
+
+        #if DEBUG_DISK_IO
+        printf("[BDOS-22: File created at dir entry %d]\n", dir_index);
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    } else {
+        #if DEBUG_DISK_IO
+        printf("[BDOS-22: Directory full]\n");
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0xFF;  // Directory full
+        return 1;
+    }
+}
+
+// BDOS Function 20: Read Sequential
+int bdos_read_sequential(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_read_sequential, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    unsigned char current_record = mem[fcb_addr + 32];  // CR field
+    unsigned char record_count = mem[fcb_addr + 15];
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-20: Read Sequential] CR=%d, RC=%d\n", current_record, record_count);
+    fflush(stdout);
+    #endif
+
+    // Check if we've read all records
+    if (current_record >= record_count) {
+        (cpu->reg)[A] = 1;  // End of file
+        return 1;
+    }
+
+    // Calculate block and sector through the disk format
+    const disk_format_t *format = get_current_disk()->format;
+    unsigned int records_per_block = format->block_size / DISK_SECTOR_SIZE;
+    unsigned int block = allocation_block(format, &mem[fcb_addr + 16], current_record / records_per_block);
+    if (block == 0) {
+        (cpu->reg)[A] = 1;  // No block allocated
+        return 1;
+    }
+
+    unsigned int track, sector;
+    disk_block_location(format, block, current_record % records_per_block, &track, &sector);
+
+    // Read the sector
+    cpm_disk.current_track = track;
+    cpm_disk.current_sector = sector;
+    int result = cpm_read_sector();
+
+    // Increment current record
+    mem[fcb_addr + 32] = current_record + 1;
+
+    (cpu->reg)[A] = result ? 1 : 0;
+    return result;
+}
+
+// BDOS Function 21: Write Sequential
+int bdos_write_sequential(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_write_sequential, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    unsigned char current_record = mem[fcb_addr + 32];  // CR field
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-21: Write Sequential] CR=%d\n", current_record);
+    fflush(stdout);
+    #endif
+
+    // Calculate which block we need
+    const disk_format_t *format = get_current_disk()->format;
+    unsigned int records_per_block = format->block_size / DISK_SECTOR_SIZE;
+    int block_index = current_record / records_per_block;
+
+    // Check if we need to allocate a new block
+    if (allocation_block(format, &mem[fcb_addr + 16], block_index) == 0) {
+        // Simple allocation: blocks numbered 1-15 (0 means unallocated)
+        unsigned int new_block = block_index + 1;
+        allocation_set_block(format, &mem[fcb_addr + 16], block_index, new_block);
+
+        #if DEBUG_DISK_IO
+        printf("[BDOS-21: Allocated block %d]\n", new_block);
+        fflush(stdout);
+        #endif
+    }
+
+    unsigned int block = allocation_block(format, &mem[fcb_addr + 16], block_index);
+    unsigned int track, sector;
+    disk_block_location(format, block, current_record % records_per_block, &track, &sector);
+
+    // Write the sector
+    cpm_disk.current_track = track;
+    cpm_disk.current_sector = sector;
+    int result = cpm_write_sector();
+
+    // Update record count and current record
+    if (current_record >= mem[fcb_addr + 15]) {
+        mem[fcb_addr + 15] = current_record + 1;  // Update RC
+    }
+    mem[fcb_addr + 32] = current_record + 1;  // Increment CR
+
+    (cpu->reg)[A] = result ? 1 : 0;
+    return result;
+}
+
+// Global for directory search continuation
+
+// BDOS Function 17: Search First
+int bdos_search_first(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        int status = host_call(host_search_first, cpu, fcb_addr, fcb_drive(fcb_addr));
+        cpm_host.searching = ((cpu->reg)[A] != 0xFF);
+        return status;
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-17: Search First] %.8s.%.3s\n", fcb.filename, fcb.extension);
+    printf("  [BDOS-17: DMA] 0x%04X\n", cpm_disk.dma_address);
+    fflush(stdout);
+    #endif
+
+    // Start search from directory entry 0
+    search_dir_index = 0;
+    cpm_host.searching = 0;
+    if (cpm_host.search_dir) {
+        closedir(cpm_host.search_dir);
+        cpm_host.search_dir = NULL;
+    }
+
+    // Search through directory
+    dir_entry_t entry;
+    for (int i = 0; i < dir_entry_count(); i++) {
+        read_dir_entry(i, &entry);
+        if (fcb_match(&entry, &fcb)) {
+            // Found a match - copy into DMA slot indicated by directory code
+            int dir_code = i % 4;
+            memcpy(&mem[cpm_disk.dma_address + (dir_code * 32)], &entry, 32);
+            search_dir_index = i + 1;  // Next search starts here
+
+            #if DEBUG_DISK_IO
+            printf("[BDOS-17: Found at dir entry %d, returning directory code %d]\n", i, i % 4);
+            printf("  [BDOS-17: DMA bytes] ");
+            for (int j = 0; j < 16; j++) {
+                printf("%02X ", mem[cpm_disk.dma_address + j]);
+            }
+            printf("\n");
+            fflush(stdout);
+            #endif
+
+            (cpu->reg)[A] = dir_code;  // Return directory code (0-3) for position in DMA buffer
+            return 0;
+        }
+    }
+
+    #if DEBUG_DISK_IO
+    printf("[BDOS-17: Not found]\n");
+    fflush(stdout);
+    #endif
+
+    (cpu->reg)[A] = 0xFF;  // Not found
+    return 1;
+}
+
+// BDOS Function 18: Search Next
+int bdos_search_next(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (cpm_host.searching) {
+        int status = host_call(host_search_next, cpu, fcb_addr, cpm_host.search_drive);
+        cpm_host.searching = ((cpu->reg)[A] != 0xFF);
+        return status;
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-18: Search Next] %.8s.%.3s (from entry %d)\n",
+           fcb.filename, fcb.extension, search_dir_index);
+    printf("  [BDOS-18: DMA] 0x%04X\n", cpm_disk.dma_address);
+    fflush(stdout);
+    #endif
+
+    // Continue search from where we left off
+    dir_entry_t entry;
+    for (int i = search_dir_index; i < dir_entry_count(); i++) {
+        read_dir_entry(i, &entry);
+        if (fcb_match(&entry, &fcb)) {
+            // Found a match - copy into DMA slot indicated by directory code
+            int dir_code = i % 4;
+            memcpy(&mem[cpm_disk.dma_address + (dir_code * 32)], &entry, 32);
+            search_dir_index = i + 1;
+
+            #if DEBUG_DISK_IO
+            printf("[BDOS-18: Found at dir entry %d, returning directory code %d]\n", i, i % 4);
+            fflush(stdout);
+            #endif
+
+            (cpu->reg)[A] = dir_code;  // Return directory code (0-3) for position in DMA buffer
+            return 0;
+        }
+    }
+
+    #if DEBUG_DISK_IO
+    printf("[BDOS-18: No more matches]\n");
+    fflush(stdout);
+    #endif
+
+    (cpu->reg)[A] = 0xFF;  // No more matches
+    return 1;
+}
+
+// BDOS Function 19: Delete File
+int bdos_delete_file(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_delete_file, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+    fcb_t fcb;
+    memcpy(&fcb, &mem[fcb_addr], 32);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-19: Delete File] %.8s.%.3s\n", fcb.filename, fcb.extension);
+    fflush(stdout);
+    #endif
+
+    int deleted_count = 0;
+    dir_entry_t entry;
+
+    // Search and delete all matching entries (handles wildcards)
+    for (int i = 0; i < dir_entry_count(); i++) {
+        read_dir_entry(i, &entry);
+        if (fcb_match(&entry, &fcb)) {
+            // Mark as deleted
+            entry.user_number = 0xE5;
+            write_dir_entry(i, &entry);
+            deleted_count++;
+
+            #if DEBUG_DISK_IO
+            printf("[BDOS-19: Deleted dir entry %d]\n", i);
+            fflush(stdout);
+            #endif
+        }
+    }
+
+    if (deleted_count > 0) {
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    } else {
+        #if DEBUG_DISK_IO
+        printf("[BDOS-19: File not found]\n");
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0xFF;  // Not found
+        return 1;
+    }
+}
+
+// BDOS Function 23: Rename File
+int bdos_rename_file(struct i8080* cpu) {
+    unsigned int fcb_addr = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+    if (is_host_drive(fcb_drive(fcb_addr))) {
+        return host_call(host_rename_file, cpu, fcb_addr, fcb_drive(fcb_addr));
+    }
+
+    // CP/M Rename FCB format:
+    // Bytes 0-11: Old name (drive, filename[8], extension[3])
+    // Bytes 16-27: New name (drive, filename[8], extension[3])
+    fcb_t old_fcb, new_fcb;
+
+    // Clear structures
+    memset(&old_fcb, 0, sizeof(fcb_t));
+    memset(&new_fcb, 0, sizeof(fcb_t));
+
+    // Copy old name (drive + 8 chars + 3 chars = 12 bytes)
+    old_fcb.drive = mem[fcb_addr];
+    memcpy(old_fcb.filename, &mem[fcb_addr + 1], 8);
+    memcpy(old_fcb.extension, &mem[fcb_addr + 9], 3);
+    old_fcb.extent_low = 0;  // Match extent 0
+
+    // Copy new name from bytes 16-27
+    new_fcb.drive = mem[fcb_addr + 16];
+    memcpy(new_fcb.filename, &mem[fcb_addr + 17], 8);
+    memcpy(new_fcb.extension, &mem[fcb_addr + 25], 3);
+
+    #if DEBUG_DISK_IO
+    printf("\n[BDOS-23: Rename File] %.8s.%.3s → %.8s.%.3s\n",
+           old_fcb.filename, old_fcb.extension,
+           new_fcb.filename, new_fcb.extension);
+    fflush(stdout);
+    #endif
+
+    // Find the old file
+    int dir_index = find_dir_entry(&old_fcb);
+
+    if (dir_index >= 0) {
+        // Read the entry
+        dir_entry_t entry;
+        read_dir_entry(dir_index, &entry);
+
+        // Update with new name
+        memcpy(entry.filename, new_fcb.filename, 8);
+        memcpy(entry.extension, new_fcb.extension, 3);
+
+        // Write it back
+        write_dir_entry(dir_index, &entry);
+
+        #if DEBUG_DISK_IO
+        printf("[BDOS-23: Renamed dir entry %d]\n", dir_index);
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0;  // Success
+        return 0;
+    } else {
+        #if DEBUG_DISK_IO
+        printf("[BDOS-23: File not found]\n");
+        fflush(stdout);
+        #endif
+
+        (cpu->reg)[A] = 0xFF;  // Not found
+        return 1;
+    }
+}
+
+// ============================================================================
+// I/O PORT DISPATCH
+// ============================================================================
+//
+// IN and OUT go through a 256-entry table of per-port handlers, so dispatch
+// is one indirect call however many devices are attached. Each entry carries
+// an opaque device pointer handed back to its callbacks. Unclaimed ports read
+// as 0 and ignore writes. The console and disk controllers are registered on
+// the first reset; other devices can be registered after it and stay mapped
+// across later resets. The table is shared by all machines, so the built-in
+// controllers take no device pointer and act on the machine executing the
+// instruction.
+
+typedef unsigned char (*io_read_fn)(void *device, unsigned char port);
+typedef void (*io_write_fn)(void *device, unsigned char port, unsigned char value);
+
+typedef struct {
+    io_read_fn read;
+    io_write_fn write;
+    void *device;
+} io_port_t;
+
+static io_port_t io_ports[256];
+static int io_ports_ready = 0;
+
+static unsigned char io_unmapped_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return 0x00;
+}
+
+static void io_unmapped_write(void *device, unsigned char port, unsigned char value) {
+    (void)device; (void)port; (void)value;
+}
+
+// Map a device onto a port. A NULL callback leaves that direction unmapped.
+int cpm_io_register(unsigned char port, io_read_fn read, io_write_fn write, void *device) {
+    io_ports[port].read = read ? read : io_unmapped_read;
+    io_ports[port].write = write ? write : io_unmapped_write;
+    io_ports[port].device = device;
+    return 1;
+}
+
+void cpm_io_unregister(unsigned char port) {
+    cpm_io_register(port, NULL, NULL, NULL);
+}
+
+// Console device: legacy ports 0x00/0x01, BIOS ports 0xF0-0xF2
+static unsigned char console_status_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return (unsigned char)cpm_console_status();
+}
+
+static unsigned char console_data_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return cpm_console_input();
+}
+
+static void console_data_write(void *device, unsigned char port, unsigned char value) {
+    (void)device; (void)port;
+    cpm_console_output(value);
+}
+
+// Disk controller: legacy ports 0x10-0x15, BIOS ports 0xF3-0xFA.
+// Only the legacy ports are traced; the BIOS ports are hit on every sector.
+#if DEBUG_DISK_IO
+#define DISK_PORT_TRACE(port, ...) do { \
+        if ((port) < 0xF0) { printf(__VA_ARGS__); fflush(stdout); } \
+    } while (0)
+#else
+#define DISK_PORT_TRACE(port, ...) do { } while (0)
+#endif
+
+static void disk_select_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Select disk %d\n", port, value);
+    cpm_select_disk(value);
+}
+
+static void disk_track_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Set track %d\n", port, value);
+    cpm_set_track(value);
+}
+
+static void disk_sector_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Set sector %d\n", port, value);
+    cpm_set_sector(value);
+}
+
+static void disk_dma_low_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    cpm_disk.dma_address = (cpm_disk.dma_address & 0xFF00) | value;
+    DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: DMA low=0x%02X (DMA now: 0x%04X)\n", port, value, cpm_disk.dma_address);
+}
+
+static void disk_dma_high_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    cpm_disk.dma_address = (cpm_disk.dma_address & 0x00FF) | (value << 8);
+    DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: DMA high=0x%02X (DMA now: 0x%04X)\n", port, value, cpm_disk.dma_address);
+}
+
+// Legacy command port: 0=read, 1=write, 2=home
+static void disk_command_write(void *device, unsigned char port, unsigned char value) {
+    (void)device;
+    if (value == 0) {
+        DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Operation=%d (READ)\n", port, value);
+        cpm_read_sector();
+    } else if (value == 1) {
+        DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Operation=%d (WRITE)\n", port, value);
+        cpm_write_sector();
+    } else if (value == 2) {
+        DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Operation=%d (HOME)\n", port, value);
+        cpm_home_disk();
+    } else {
+        DISK_PORT_TRACE(port, "[OUT] Port 0x%02X: Operation=%d (UNKNOWN)\n", port, value);
+    }
+}
+
+// Legacy status port: result of the last operation (0=success)
+static unsigned char disk_status_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return 0x00;
+}
+
+// BIOS ports: reading performs the transfer and returns its status
+static unsigned char disk_read_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return (unsigned char)cpm_read_sector();
+}
+
+static unsigned char disk_write_read(void *device, unsigned char port) {
+    (void)device; (void)port;
+    return (unsigned char)cpm_write_sector();
+}
+
+static void disk_home_write(void *device, unsigned char port, unsigned char value) {
+    (void)device; (void)port; (void)value;
+    cpm_home_disk();
+}
+
+static void cpm_io_init(void) {
+    if (io_ports_ready) {
+        return;
+    }
+    for (int port = 0; port < 256; port++) {
+        cpm_io_unregister((unsigned char)port);
+    }
+
+    // Console (legacy)
+    cpm_io_register(0x00, console_status_read, NULL, NULL);
+    cpm_io_register(0x01, console_status_read, console_data_write, NULL);
+    // Console (BIOS)
+    cpm_io_register(0xF0, console_status_read, NULL, NULL);   // CONST
+    cpm_io_register(0xF1, console_data_read, NULL, NULL);     // CONIN
+    cpm_io_register(0xF2, NULL, console_data_write, NULL);    // CONOUT
+
+    // Disk controller (legacy)
+    cpm_io_register(0x10, NULL, disk_select_write, NULL);
+    cpm_io_register(0x11, NULL, disk_track_write, NULL);
+    cpm_io_register(0x12, NULL, disk_sector_write, NULL);
+    cpm_io_register(0x13, NULL, disk_dma_low_write, NULL);
+    cpm_io_register(0x14, NULL, disk_dma_high_write, NULL);
+    cpm_io_register(0x15, disk_status_read, disk_command_write, NULL);
+    // Disk controller (BIOS)
+    cpm_io_register(0xF3, NULL, disk_select_write, NULL);        // DISK_SELECT
+    cpm_io_register(0xF4, NULL, disk_track_write, NULL);         // DISK_TRACK
+    cpm_io_register(0xF5, NULL, disk_sector_write, NULL);        // DISK_SECTOR
+    cpm_io_register(0xF6, NULL, disk_dma_low_write, NULL);       // DISK_DMA_LO
+    cpm_io_register(0xF7, NULL, disk_dma_high_write, NULL);      // DISK_DMA_HI
+    cpm_io_register(0xF8, disk_read_read, NULL, NULL);           // DISK_READ
+    cpm_io_register(0xF9, disk_write_read, NULL, NULL);          // DISK_WRITE
+    cpm_io_register(0xFA, NULL, disk_home_write, NULL);          // DISK_HOME
+
+    io_ports_ready = 1;
+}
+
+// ============================================================================
+// HLE TRAPS
+// ============================================================================
+//
+// A trap maps a guest address to a native handler that runs when the PC
+// reaches it, however control got there (CALL, JMP, RST, a vector). Each
+// machine has its own traps; a bitmap marks the trapped addresses, so an
+// untrapped instruction costs one bit test. The handler either completes
+// the routine and returns to the guest's caller, asks for the same address
+// to be retried (waiting for input), or passes and lets the guest code at
+// that address run.
+//
+// A cold reset leaves only the BDOS trap at 0005h, and loading code drops
+// the traps on the addresses it overwrites. cpm_hle_install_bios() traps
+// the entries of a standard BIOS jump vector, so BIOS calls skip the port
+// round trips of cpm_bios.asm; it runs when asked, and for the vector at
+// 0000h of a machine booted by cpm_boot_cached or restored from a save
+// state. Each BIOS trap remembers the JMP it replaced and passes if a
+// program has since patched the vector.
+
+#define HLE_RETURN 0                   // Handled: return to the caller (RET)
+#define HLE_RETRY 1                    // Not finished: execute this address again
+#define HLE_PASS 2                     // Not handled: run the guest code here
+
+static inline int hle_trapped(unsigned int addr) {
+    return cpm_hle.trapped[addr >> 3] & (1 << (addr & 7));
+}
+
+static int hle_find(unsigned int addr) {
+    for (int slot = 0; slot < cpm_hle.count; slot++) {
+        if (cpm_hle.trap[slot].address == addr) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static int hle_register(unsigned int addr, hle_trap_fn handler, void *context, const unsigned char *guard) {
+    addr &= 0xFFFF;
+    int slot = hle_find(addr);
+    if (slot < 0) {
+        if (cpm_hle.count == HLE_MAX_TRAPS) {
+            printf("[HLE] ERROR: Trap table full, cannot trap 0x%04X\n", addr);
+            fflush(stdout);
+            return 0;
+        }
+        slot = cpm_hle.count++;
+    }
+    hle_trap_t *trap = &cpm_hle.trap[slot];
+    trap->handler = handler;
+    trap->context = context;
+    trap->address = addr;
+    trap->guarded = guard != NULL;
+    if (guard) {
+        memcpy(trap->guard, guard, 3);
+    }
+    cpm_hle.trapped[addr >> 3] |= (unsigned char)(1 << (addr & 7));
+    return 1;
+}
+
+int cpm_hle_register(unsigned int addr, hle_trap_fn handler, void *context) {
+    return handler ? hle_register(addr, handler, context, NULL) : 0;
+}
+
+void cpm_hle_unregister(unsigned int addr) {
+    addr &= 0xFFFF;
+    int slot = hle_find(addr);
+    if (slot >= 0) {
+        cpm_hle.trap[slot] = cpm_hle.trap[--cpm_hle.count];
+        cpm_hle.trapped[addr >> 3] &= (unsigned char)~(1 << (addr & 7));
+    }
+}
+
+// Drop the traps on length bytes from start, which now hold other code
+static void hle_unregister_range(unsigned int start, unsigned long length) {
+    for (int slot = cpm_hle.count - 1; slot >= 0; slot--) {
+        if (((cpm_hle.trap[slot].address - start) & 0xFFFF) < length) {
+            cpm_hle_unregister(cpm_hle.trap[slot].address);
+        }
+    }
+}
+
+// Run the trap at the PC. Returns the next PC, or -1 to execute normally.
+static int hle_dispatch(struct i8080* cpu, unsigned int pc) {
+    hle_trap_t *trap = &cpm_hle.trap[hle_find(pc)];
+    if (trap->guarded) {
+        for (unsigned int i = 0; i < 3; i++) {
+            if (mem[(pc + i) & 0xFFFF] != trap->guard[i]) {
+                return -1;  // Overwritten: run what is there now
+            }
+        }
+    }
+    switch (trap->handler(cpu, trap->context)) {
+        case HLE_RETURN: return (int)(ret(cpu, mem) & 0xFFFF);
+        case HLE_RETRY:  return (int)pc;
+        default:         return -1;
+    }
+}
+
+static int hle_bdos(struct i8080* cpu, void *context) {
+    (void)context;
+    cpm_bdos_call(cpu);
+    return cpm_console.waiting_for_input ? HLE_RETRY : HLE_RETURN;
+}
+
+// BIOS entries, in jump vector order (BOOT = 0). BOOT, WBOOT and SELDSK stay
+// in guest code: they load the CCP and return addresses of guest tables.
+enum { BIOS_CONST = 2, BIOS_CONIN, BIOS_CONOUT, BIOS_LIST, BIOS_PUNCH, BIOS_READER,
+       BIOS_HOME, BIOS_SELDSK, BIOS_SETTRK, BIOS_SETSEC, BIOS_SETDMA, BIOS_READ,
+       BIOS_WRITE, BIOS_LISTST, BIOS_SECTRAN, BIOS_ENTRIES };
+
+static int hle_bios_entry(struct i8080* cpu, void *context) {
+    switch ((int)(long)context) {
+        case BIOS_CONST:
+            (cpu->reg)[A] = (unsigned char)cpm_console_status();
+            break;
+        case BIOS_CONIN:
+            if (!cpm_console_status()) {
+                cpm_event_input_wait();
+                return HLE_RETRY;
+            }
+            cpm_console.waiting_for_input = 0;
+            (cpu->reg)[A] = cpm_console_input() & 0x7F;
+            break;
+        case BIOS_CONOUT:
+            cpm_console_output((cpu->reg)[C]);
+            break;
+        case BIOS_LIST:
+            aux_output(CPM_AUX_LIST, (cpu->reg)[C]);
+            break;
+        case BIOS_PUNCH:
+            aux_output(CPM_AUX_PUNCH, (cpu->reg)[C]);
+            break;
+        case BIOS_READER:
+            (cpu->reg)[A] = aux_input();
+            break;
+        case BIOS_HOME:
+            cpm_home_disk();
+            break;
+        case BIOS_SETTRK:
+            cpm_set_track((cpu->reg)[C]);
+            break;
+        case BIOS_SETSEC:
+            cpm_set_sector((cpu->reg)[C]);
+            break;
+        case BIOS_SETDMA:
+            cpm_set_dma(0x100 * (cpu->reg)[B] + (cpu->reg)[C]);
+            break;
+        case BIOS_READ:
+            (cpu->reg)[A] = (unsigned char)cpm_read_sector();
+            break;
+        case BIOS_WRITE:
+            (cpu->reg)[A] = (unsigned char)cpm_write_sector();
+            break;
+        case BIOS_LISTST:
+            (cpu->reg)[A] = 0xFF;
+            break;
+        case BIOS_SECTRAN:
+            // Skew is applied by the disk format, so translation is identity
+            (cpu->reg)[H] = (cpu->reg)[B];
+            (cpu->reg)[L] = (cpu->reg)[C];
+            break;
+        default:
+            return HLE_PASS;
+    }
+    return HLE_RETURN;
+}
+
+// Trap the BIOS jump vector at base. The vector must already be in memory.
+int cpm_hle_install_bios(unsigned int base) {
+    int installed = 0;
+    for (int entry = BIOS_CONST; entry < BIOS_ENTRIES; entry++) {
+        unsigned int addr = (base + entry * 3) & 0xFFFF;
+        if (entry == BIOS_SELDSK || mem[addr] != 0xC3) {
+            continue;
+        }
+        unsigned char guard[3] = { mem[addr], mem[(addr + 1) & 0xFFFF], mem[(addr + 2) & 0xFFFF] };
+        installed += hle_register(addr, hle_bios_entry, (void *)(long)entry, guard);
+    }
+    printf("[HLE] BIOS jump vector at 0x%04X: %d entries trapped\n", base & 0xFFFF, installed);
+    fflush(stdout);
+    return installed;
+}
+
+// A BIOS jump vector is 17 consecutive JMP instructions
+static int looks_like_bios_vector(unsigned int base) {
+    for (int entry = 0; entry < BIOS_ENTRIES; entry++) {
+        if (mem[(base + entry * 3) & 0xFFFF] != 0xC3) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Trap the BIOS whose warm-boot entry the JMP at 0000h points to, if that
+// is a complete jump vector
+static int hle_install_page_zero_bios(void) {
+    unsigned int bios = (get_le16(&mem[1]) - 3) & 0xFFFF;
+    if (mem[0] == 0xC3 && looks_like_bios_vector(bios)) {
+        return cpm_hle_install_bios(bios);
+    }
+    return 0;
+}
+
+// Back to the power-on traps: BDOS only
+static void cpm_hle_init(void) {
+    memset(&cpm_hle, 0, sizeof(hle_state));
+    hle_register(0x0005, hle_bdos, NULL, NULL);
+}
+
+// ============================================================================
+// CP/M INITIALIZATION
+// ============================================================================
+
+// Helper: Create a sample file on disk
+void cpm_create_sample_file(const char* name, const char* ext, const char* content) {
+    dir_entry_t entry;
+
+    // Set up directory entry
+    entry.user_number = 0;
+    memset(entry.filename, ' ', 8);
+    memset(entry.extension, ' ', 3);
+    memcpy(entry.filename, name, strlen(name) > 8 ? 8 : strlen(name));
+    memcpy(entry.extension, ext, strlen(ext) > 3 ? 3 : strlen(ext));
+    entry.extent_low = 0;
+    entry.reserved[0] = 0;
+    entry.reserved[1] = 0;
+
+    // Calculate how many records we need
+    int content_len = strlen(content);
+    int records = (content_len + 127) / 128;  // Round up
+    entry.record_count = records;
+
+    // Allocate blocks (simple: consecutive blocks from 1)
+    sparse_disk_t* disk = get_current_disk();
+    int records_per_block = (int)(disk->format->block_size / DISK_SECTOR_SIZE);
+    memset(entry.allocation, 0, 16);
+    int blocks_needed = (records + records_per_block - 1) / records_per_block;
+    for (int i = 0; i < blocks_needed && i < 16; i++) {
+        entry.allocation[i] = i + 1;  // Blocks 1, 2, 3, etc.
+    }
+
+    // Find free directory entry
+    int dir_index = find_free_dir_entry();
+    if (dir_index < 0) return;  // Directory full
+
+    // Write directory entry
+    write_dir_entry(dir_index, &entry);
+
+    // Write content to disk
+    int offset = 0;
+    unsigned char record[DISK_SECTOR_SIZE];
+    for (int rec = 0; rec < records; rec++) {
+        unsigned int track, sector;
+        disk_block_location(disk->format, entry.allocation[rec / records_per_block],
+                            rec % records_per_block, &track, &sector);
+
+        // Copy up to 128 bytes
+        for (int i = 0; i < 128; i++) {
+            if (offset < content_len) {
+                record[i] = content[offset++];
+            } else {
+                record[i] = 0x1A;  // CP/M EOF marker
+            }
+        }
+        int index = disk_sector_index(disk->format, track, sector - 1);
+        if (index >= 0) {
+            sparse_write_sector(disk, (unsigned int)index, record);
+        }
+    }
+}
+
+// Helper: Create a sample binary file on disk
+void cpm_create_sample_file_bytes(const char* name, const char* ext, const unsigned char* content, int content_len) {
+    dir_entry_t entry;
+
+    // Set up directory entry
+    entry.user_number = 0;
+    memset(entry.filename, ' ', 8);
+    memset(entry.extension, ' ', 3);
+    memcpy(entry.filename, name, strlen(name) > 8 ? 8 : strlen(name));
+    memcpy(entry.extension, ext, strlen(ext) > 3 ? 3 : strlen(ext));
+    entry.extent_low = 0;
+    entry.reserved[0] = 0;
+    entry.reserved[1] = 0;
+
+    // Calculate how many records we need
+    int records = (content_len + 127) / 128;  // Round up
+    entry.record_count = records;
+
+    // Allocate blocks (simple: consecutive blocks from 1)
+    sparse_disk_t* disk = get_current_disk();
+    int records_per_block = (int)(disk->format->block_size / DISK_SECTOR_SIZE);
+    memset(entry.allocation, 0, 16);
+    int blocks_needed = (records + records_per_block - 1) / records_per_block;
+    for (int i = 0; i < blocks_needed && i < 16; i++) {
+        entry.allocation[i] = i + 1;  // Blocks 1, 2, 3, etc.
+    }
+
+    // Find free directory entry
+    int dir_index = find_free_dir_entry();
+    if (dir_index < 0) return;  // Directory full
+
+    // Write directory entry
+    write_dir_entry(dir_index, &entry);
+
+    // Write content to disk
+    int offset = 0;
+    unsigned char record[DISK_SECTOR_SIZE];
+    for (int rec = 0; rec < records; rec++) {
+        unsigned int track, sector;
+        disk_block_location(disk->format, entry.allocation[rec / records_per_block],
+                            rec % records_per_block, &track, &sector);
+
+        // Copy up to 128 bytes
+        for (int i = 0; i < 128; i++) {
+            if (offset < content_len) {
+                record[i] = content[offset++];
+            } else {
+                record[i] = 0x1A;  // CP/M EOF marker
+            }
+        }
+        int index = disk_sector_index(disk->format, track, sector - 1);
+        if (index >= 0) {
+            sparse_write_sector(disk, (unsigned int)index, record);
+        }
+    }
+}
+
+void cpm_init(void) {
+    cpm_io_init();
+    cpm_hle_init();
+    cpm_console_init();
+    cpm_events.halted = 0;
+    cpm_disk_init();
+
+    if (!disk_a_loaded) {
+        // Create some sample files for demo on a fresh disk
+        cpm_create_sample_file("WELCOME", "TXT", "Welcome to CP/M 2.2!\r\nType DIR to see files.\r\n");
+        cpm_create_sample_file("HELP", "TXT", "Available commands:\r\nDIR - List files\r\nTYPE filename - Display file\r\nERA filename - Delete file\r\nEXIT - Halt system\r\n");
+        cpm_create_sample_file("README", "TXT", "This is a CP/M 2.2 emulator running on an Intel 8080 CPU.\r\n\r\nHave fun exploring!\r\n");
+
+        static const unsigned char hello_com[] = {
+            0x11, 0x09, 0x01,       // LXI D,0109h
+            0x0E, 0x09,             // MVI C,09h
+            0xCD, 0x05, 0x00,       // CALL 0005h
+            0xC9,                   // RET
+            0x48, 0x45, 0x4C, 0x4C, 0x4F, 0x20, 0x46, 0x52,
+            0x4F, 0x4D, 0x20, 0x43, 0x4F, 0x4D, 0x21, 0x0D,
+            0x0A, 0x24              // "HELLO FROM COM!\r\n$"
+        };
+        cpm_create_sample_file_bytes("HELLO", "COM", hello_com, sizeof(hello_com));
+
+        static const unsigned char plop_com[] = {
+            0x11, 0x09, 0x01,       // LXI D,0109h
+            0x0E, 0x16,             // MVI C,16h (BDOS Make File)
+            0xCD, 0x05, 0x00,       // CALL 0005h
+            0xC9,                   // RET
+            0x00,                   // Drive (default)
+            0x50, 0x4C, 0x4F, 0x50, 0x20, 0x20, 0x20, 0x20, // "PLOP    "
+            0x54, 0x58, 0x54,       // "TXT"
+            0x00,                   // Extent low
+            0x00, 0x00,             // Reserved
+            0x00,                   // Record count
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 // Allocation
+        };
+        cpm_create_sample_file_bytes("PLOP", "COM", plop_com, sizeof(plop_com));
+        save_disk_image("A.DSK", &disk_a);
+    }
+
+    printf("\n");
+    printf("========================================\n");
+    printf("CP/M System Initialized\n");
+    printf("BDOS Entry: 0x0005\n");
+    printf("Console Ports: 0x00, 0x01\n");
+    printf("Disk Ports: 0x10-0x15\n");
+    printf("========================================\n");
+    if (!disk_a_loaded) {
+        printf("Sample files created on drive A:\n");
+        printf("  WELCOME.TXT\n");
+        printf("  HELP.TXT\n");
+        printf("  README.TXT\n");
+        printf("  HELLO.COM\n");
+        printf("  PLOP.COM\n");
+    } else {
+        printf("Using disk image from Documents (A.DSK)\n");
+    }
+    printf("========================================\n");
+    printf("CP/M Console Output:\n");
+    fflush(stdout);
+}
+
+// ============================================================================
+// END CP/M SUPPORT
+// ============================================================================
+
+unsigned int exec_inst(struct i8080* cpu, unsigned char* mem) {
+    unsigned int p = cpu->prog_ctr;
+    unsigned char opcode = mem[p];
     unsigned int dest = 0x100 * (cpu->reg)[H] + (cpu->reg)[L];
     unsigned int d8 = mem[p+1];//8-bit data or least sig. part of 16-bit data
     unsigned int d16 = mem[p+2];//Most sig. part of 16-bit data
@@ -1510,6 +5082,8 @@ unsigned int exec_inst(struct i8080* cpu, unsigned char* mem) {
             printf("\n========================================\n");
             fflush(stdout);
 #endif
+            cpm_idle_enter();  // Only input or an interrupt can resume it
+            cpm_event_halt();
             return p;
         case 0x77: MemWrite(dest, (cpu->reg)[A]); return p+1; // mem[dest] = (cpu->reg)[A]; return p+1;
         case 0x78: (cpu->reg)[A] = (cpu->reg)[B]; return p+1;
@@ -1534,507 +5108,3639 @@ unsigned int exec_inst(struct i8080* cpu, unsigned char* mem) {
                 unsigned char old_val = (cpu->reg)[B];
                 (cpu->reg)[B] = decrement((cpu->reg)[B], cpu);
 #if DEBUG_CPU
-                printf("[DCR B] %02X → %02X, zero flag=%d\n", old_val, (cpu->reg)[B], cpu->iszero);
+                printf("[DCR B] %02X → %02X, zero flag=%d\n", old_val, (cpu->reg)[B], cpu->iszero);
+                fflush(stdout);
+#endif
+            }
+            return p+1;
+        case 0x0d: (cpu->reg)[C] = decrement((cpu->reg)[C], cpu); return p+1;
+        case 0x15: (cpu->reg)[D] = decrement((cpu->reg)[D], cpu); return p+1;
+        case 0x1d: (cpu->reg)[E] = decrement((cpu->reg)[E], cpu); return p+1;
+        case 0x25: (cpu->reg)[H] = decrement((cpu->reg)[H], cpu); return p+1;
+        case 0x2d: (cpu->reg)[L] = decrement((cpu->reg)[L], cpu); return p+1;
+        case 0x35: MemWrite(dest, decrement(MemRead(dest), cpu)); return p+1;
+        case 0x3d: (cpu->reg)[A] = decrement((cpu->reg)[A], cpu); return p+1;
+            //Rotate
+        case 0x07: rotate(1, 0, cpu); return p+1;
+        case 0x17: rotate(1, 1, cpu); return p+1;
+        case 0x0f: rotate(0, 0, cpu); return p+1;
+        case 0x1f: rotate(0, 1, cpu); return p+1;
+        case 0x27: daa(cpu); return p+1;//DAA - Decimal Adjust Accumulator
+        case 0x2f: (cpu->reg)[A] = ~(cpu->reg)[A]; return p+1;
+        case 0x37: cpu->carry = 1; return p+1;
+        case 0x3f: cpu->carry = !(cpu->carry); return p+1;
+            //16-bit inc/dec
+        case 0x03: doubleinr(B, cpu); return p+1;
+        case 0x13: doubleinr(D, cpu); return p+1;
+        case 0x23: doubleinr(H, cpu); return p+1;
+        case 0x33: doubleinr(SP, cpu); return p+1;
+        case 0x0b: doubledcr(B, cpu); return p+1;
+        case 0x1b: doubledcr(D, cpu); return p+1;
+        case 0x2b: doubledcr(H, cpu); return p+1;
+        case 0x3b: doubledcr(SP, cpu); return p+1;
+            //XTHL, XCHG, SPHL
+        case 0xe3: xthl(cpu, mem); return p+1;
+        case 0xeb: xchg(cpu); return p+1;
+        case 0xf9: cpu->stack_ptr = 0x100*(cpu->reg)[H]+(cpu->reg)[L]; return p+1;
+            //Arith/logic
+        case 0x80: add((cpu->reg)[B], cpu, 0); return p+1;
+        case 0x81: add((cpu->reg)[C], cpu, 0); return p+1;
+        case 0x82: add((cpu->reg)[D], cpu, 0); return p+1;
+        case 0x83: add((cpu->reg)[E], cpu, 0); return p+1;
+        case 0x84: add((cpu->reg)[H], cpu, 0); return p+1;
+        case 0x85: add((cpu->reg)[L], cpu, 0); return p+1;
+        case 0x86: add(MemRead(dest), /*mem[dest];*/ cpu, 0); return p+1;
+        case 0x87: add((cpu->reg)[A], cpu, 0); return p+1;
+        case 0x88: add((cpu->reg)[B], cpu, 1); return p+1;
+        case 0x89: add((cpu->reg)[C], cpu, 1); return p+1;
+        case 0x8a: add((cpu->reg)[D], cpu, 1); return p+1;
+        case 0x8b: add((cpu->reg)[E], cpu, 1); return p+1;
+        case 0x8c: add((cpu->reg)[H], cpu, 1); return p+1;
+        case 0x8d: add((cpu->reg)[L], cpu, 1); return p+1;
+        case 0x8e: add(MemRead(dest), /*mem[dest];*/ cpu, 1); return p+1;
+        case 0x8f: add((cpu->reg)[A], cpu, 1); return p+1;
+        case 0x90: sub((cpu->reg)[B], cpu, 0); return p+1;
+        case 0x91: sub((cpu->reg)[C], cpu, 0); return p+1;
+        case 0x92: sub((cpu->reg)[D], cpu, 0); return p+1;
+        case 0x93: sub((cpu->reg)[E], cpu, 0); return p+1;
+        case 0x94: sub((cpu->reg)[H], cpu, 0); return p+1;
+        case 0x95: sub((cpu->reg)[L], cpu, 0); return p+1;
+        case 0x96: sub(MemRead(dest), /*mem[dest];*/ cpu, 0); return p+1;
+        case 0x97: sub((cpu->reg)[A], cpu, 0); return p+1;
+        case 0x98: sub((cpu->reg)[B], cpu, 1); return p+1;
+        case 0x99: sub((cpu->reg)[C], cpu, 1); return p+1;
+        case 0x9a: sub((cpu->reg)[D], cpu, 1); return p+1;
+        case 0x9b: sub((cpu->reg)[E], cpu, 1); return p+1;
+        case 0x9c: sub((cpu->reg)[H], cpu, 1); return p+1;
+        case 0x9d: sub((cpu->reg)[L], cpu, 1); return p+1;
+        case 0x9e: sub(MemRead(dest), /*mem[dest];*/ cpu, 1); return p+1;
+        case 0x9f: sub((cpu->reg)[A], cpu, 1); return p+1;
+        case 0xa0: logic(bw_and, (cpu->reg)[B], cpu); return p+1;
+        case 0xa1: logic(bw_and, (cpu->reg)[C], cpu); return p+1;
+        case 0xa2: logic(bw_and, (cpu->reg)[D], cpu); return p+1;
+        case 0xa3: logic(bw_and, (cpu->reg)[E], cpu); return p+1;
+        case 0xa4: logic(bw_and, (cpu->reg)[H], cpu); return p+1;
+        case 0xa5: logic(bw_and, (cpu->reg)[L], cpu); return p+1;
+        case 0xa6: logic(bw_and, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
+        case 0xa7: logic(bw_and, (cpu->reg)[A], cpu); return p+1;
+        case 0xa8: logic(bw_xor, (cpu->reg)[B], cpu); return p+1;
+        case 0xa9: logic(bw_xor, (cpu->reg)[C], cpu); return p+1;
+        case 0xaa: logic(bw_xor, (cpu->reg)[D], cpu); return p+1;
+        case 0xab: logic(bw_xor, (cpu->reg)[E], cpu); return p+1;
+        case 0xac: logic(bw_xor, (cpu->reg)[H], cpu); return p+1;
+        case 0xad: logic(bw_xor, (cpu->reg)[L], cpu); return p+1;
+        case 0xae: logic(bw_xor, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
+        case 0xaf: logic(bw_xor, (cpu->reg)[A], cpu); return p+1;
+        case 0xb0: logic(bw_or, (cpu->reg)[B], cpu); return p+1;
+        case 0xb1: logic(bw_or, (cpu->reg)[C], cpu); return p+1;
+        case 0xb2: logic(bw_or, (cpu->reg)[D], cpu); return p+1;
+        case 0xb3: logic(bw_or, (cpu->reg)[E], cpu); return p+1;
+        case 0xb4: logic(bw_or, (cpu->reg)[H], cpu); return p+1;
+        case 0xb5: logic(bw_or, (cpu->reg)[L], cpu); return p+1;
+        case 0xb6: logic(bw_or, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
+        case 0xb7: logic(bw_or, (cpu->reg)[A], cpu); return p+1;
+        case 0xb8: cmp((cpu->reg)[B], cpu); return p+1;
+        case 0xb9: cmp((cpu->reg)[C], cpu); return p+1;
+        case 0xba: cmp((cpu->reg)[D], cpu); return p+1;
+        case 0xbb: cmp((cpu->reg)[E], cpu); return p+1;
+        case 0xbc: cmp((cpu->reg)[H], cpu); return p+1;
+        case 0xbd: cmp((cpu->reg)[L], cpu); return p+1;
+        case 0xbe: cmp(MemRead(dest), /*mem[dest];*/ cpu); return p+1;
+        case 0xbf: cmp((cpu->reg)[A], cpu); return p+1;
+            //ADI, ADC, SUI, SBI, ANI, XRI, ORI, CPI
+        case 0xc6: add(d8, cpu, 0); return p+2;
+        case 0xce: add(d8, cpu, 1); return p+2;
+        case 0xd6: sub(d8, cpu, 0); return p+2;
+        case 0xde: sub(d8, cpu, 1); return p+2;
+        case 0xe6: logic(bw_and, d8, cpu); return p+2;
+        case 0xee: logic(bw_xor, d8, cpu); return p+2;
+        case 0xf6: logic(bw_or, d8, cpu); return p+2;
+        case 0xfe: cmp(d8, cpu); return p+2;
+            //16bit A/L
+        case 0x09: doubleadd(B, cpu); return p+1;
+        case 0x19: doubleadd(D, cpu); return p+1;
+        case 0x29: doubleadd(H, cpu); return p+1;
+        case 0x39: doubleadd(SP, cpu); return p+1;
+            //Push/pop using stack pointer
+        case 0xc1: pop(B, cpu, mem); return p+1;
+        case 0xd1: pop(D, cpu, mem); return p+1;
+        case 0xe1: pop(H, cpu, mem); return p+1;
+        case 0xf1: pop(A, cpu, mem); return p+1;
+        case 0xc5: push(B, cpu, mem); return p+1;
+        case 0xd5: push(D, cpu, mem); return p+1;
+        case 0xe5: push(H, cpu, mem); return p+1;
+        case 0xf5: push(A, cpu, mem); return p+1;
+            //Jumps
+        case 0xcb:
+        case 0xc3: return da;//JMP
+        case 0xc2: // JNZ
+#if DEBUG_CPU
+            printf("[JNZ] PC=%04X, target=%04X, zero=%d, ", p, da, cpu->iszero);
+            if (!(cpu->iszero)) {
+                printf("JUMPING to %04X\n", da);
+                fflush(stdout);
+            } else {
+                printf("NOT jumping (continuing to %04X)\n", p+3);
                 fflush(stdout);
+            }
 #endif
+            return !(cpu->iszero) ? da : p+3;
+
+        case 0xd2: return !(cpu->carry)  ? da : p+3;//JNC
+        case 0xe2: return !(cpu->parity) ? da : p+3;//JPO
+        case 0xf2: return !(cpu->sign)   ? da : p+3;//JP
+        case 0xca: return  (cpu->iszero) ? da : p+3;//JZ
+        case 0xda: return  (cpu->carry)  ? da : p+3;//JC
+        case 0xea: return  (cpu->parity) ? da : p+3;//JPE
+        case 0xfa: return  (cpu->sign)   ? da : p+3;//JM
+        case 0xe9: return 0x100*(cpu->reg)[H]+(cpu->reg)[L];//PCHL
+            //Calls
+        case 0xcd:
+        case 0xdd:
+        case 0xed:
+        case 0xfd: {
+            // CP/M BDOS call: CALL 0005h skips the stack round trip.
+            // Other ways of reaching 0005h hit its HLE trap.
+            if (da == 0x0005) {
+                cpm_bdos_call(cpu);
+                if (cpm_console.line_active) {
+                    cpm_console.line_resume = p+3;  // Suspended in BDOS 10
+                    return p;
+                }
+                // If waiting for input, don't advance PC (retry the CALL)
+                if (cpm_console.waiting_for_input) {
+                    return p;  // Retry this CALL instruction
+                }
+                return p+3; // Skip the CALL, act like it returned
+            }
+            return call(p+3, da, cpu, mem); // Normal CALL
+        }
+        case 0xc4: return !(cpu->iszero) ? call(p+3, da, cpu, mem) : p+3;//CNZ
+        case 0xd4: return !(cpu->carry)  ? call(p+3, da, cpu, mem) : p+3;//CNC
+        case 0xe4: return !(cpu->parity) ? call(p+3, da, cpu, mem) : p+3;//CPO
+        case 0xf4: return !(cpu->sign)   ? call(p+3, da, cpu, mem) : p+3;//CP
+        case 0xcc: return  (cpu->iszero) ? call(p+3, da, cpu, mem) : p+3;//CZ
+        case 0xdc: return  (cpu->carry)  ? call(p+3, da, cpu, mem) : p+3;//CC
+        case 0xec: return  (cpu->parity) ? call(p+3, da, cpu, mem) : p+3;//CPE
+        case 0xfc: return  (cpu->sign)   ? call(p+3, da, cpu, mem) : p+3;//CM
+            //Returns
+        case 0xc9:
+        case 0xd9: return ret(cpu, mem);//RET
+        case 0xc0: return !(cpu->iszero) ? ret(cpu, mem) : p+1;//RNZ
+        case 0xd0: return !(cpu->carry)  ? ret(cpu, mem) : p+1;//RNC
+        case 0xe0: return !(cpu->parity) ? ret(cpu, mem) : p+1;//RPO
+        case 0xf0: return !(cpu->sign)   ? ret(cpu, mem) : p+1;//RP
+        case 0xc8: return  (cpu->iszero) ? ret(cpu, mem) : p+1;//RZ
+        case 0xd8: return  (cpu->carry)  ? ret(cpu, mem) : p+1;//RC
+        case 0xe8: return  (cpu->parity) ? ret(cpu, mem) : p+1;//RPE
+        case 0xf8: return  (cpu->sign)   ? ret(cpu, mem) : p+1;//RM
+            //Restarts
+        case 0xc7: return call(p+1, 0x00, cpu, mem);//RST 0
+        case 0xcf: return call(p+1, 0x08, cpu, mem);//RST 1
+        case 0xd7: return call(p+1, 0x10, cpu, mem);//RST 2
+        case 0xdf: return call(p+1, 0x18, cpu, mem);//RST 3
+        case 0xe7: return call(p+1, 0x20, cpu, mem);//RST 4
+        case 0xef: return call(p+1, 0x28, cpu, mem);//RST 5
+        case 0xf7: return call(p+1, 0x30, cpu, mem);//RST 6
+        case 0xff: return call(p+1, 0x38, cpu, mem);//RST 7
+            
+            // IN, OUT - CP/M Console and Disk I/O
+        case 0xdb: { // IN instruction
+            io_port_t *io = &io_ports[d8];
+            (cpu->reg)[A] = io->read(io->device, (unsigned char)d8);
+            return p+2;
+        }
+        case 0xd3: { // OUT instruction
+            io_port_t *io = &io_ports[d8];
+            io->write(io->device, (unsigned char)d8, (cpu->reg)[A]);
+            return p+2;
+        }
+
+            //EI, DI - Enable/Disable Interrupts
+        case 0xfb: cpu->interrupt_enable = 1; return p+1;//EI
+        case 0xf3: cpu->interrupt_enable = 0; return p+1;//DI
+
+            //NOP
+        case 0x00:
+        case 0x10:
+        case 0x20:
+        case 0x30:
+        case 0x08:
+        case 0x18:
+        case 0x28:
+        case 0x38: return p+1;
+        default: perror("Unrecognized instruction");
+    }
+    
+    return 0;
+}
+
+
+
+char * dumpRegs(struct i8080* p)
+{
+    
+    sprintf(buffer, "PC:%04X\tA:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X\n",
+            (p->prog_ctr),
+            (p->reg)[A], (p->reg)[B], (p->reg)[C], (p->reg)[D],
+            (p->reg)[E], (p->reg)[H], (p->reg)[L], (p->stack_ptr));
+    
+    return buffer;
+}
+
+int currentAddressBus(void)
+{
+    return addressBus;
+}
+
+int currentAddress(void)
+{
+    return cpm_machine->cpu.prog_ctr;
+}
+
+int currentData(void)
+{
+    return mem[cpm_machine->cpu.prog_ctr];
+}
+
+int* instructions(void)
+{
+    return currentAndNext;
+}
+
+
+// Clock states per opcode. Conditional CALL and RET list the not-taken
+// time; cpu_step adds 6 when the branch is taken.
+static const unsigned char cycle_table[256] = {
+    4, 10, 7,  5,  5,  5,  7,  4,  4,  10, 7,  5,  5,  5,  7,  4,   // 0x00
+    4, 10, 7,  5,  5,  5,  7,  4,  4,  10, 7,  5,  5,  5,  7,  4,   // 0x10
+    4, 10, 16, 5,  5,  5,  7,  4,  4,  10, 16, 5,  5,  5,  7,  4,   // 0x20
+    4, 10, 13, 5,  10, 10, 10, 4,  4,  10, 13, 5,  5,  5,  7,  4,   // 0x30
+    5, 5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x40
+    5, 5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x50
+    5, 5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x60
+    7, 7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x70
+    4, 4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0x80
+    4, 4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0x90
+    4, 4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0xA0
+    4, 4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0xB0
+    5, 10, 10, 10, 11, 11, 7,  11, 5,  10, 10, 10, 11, 17, 7,  11,  // 0xC0
+    5, 10, 10, 10, 11, 11, 7,  11, 5,  10, 10, 10, 11, 17, 7,  11,  // 0xD0
+    5, 10, 10, 18, 11, 11, 7,  11, 5,  5,  10, 4,  11, 17, 7,  11,  // 0xE0
+    5, 10, 10, 4,  11, 11, 7,  11, 5,  5,  10, 4,  11, 17, 7,  11,  // 0xF0
+};
+
+#define HLE_TRAP_CYCLES 10             // Charged for a natively served call
+
+// Execute one instruction, or the HLE trap at the PC
+static unsigned int cpu_step(struct i8080* cpu)
+{
+    if (cpu_cycles >= __atomic_load_n(&cpm_replay.due, __ATOMIC_RELAXED)) {
+        replay_feed();
+    }
+    unsigned int p = cpu->prog_ctr;
+    if (history_recording && !(cpm_console.line_active && p == cpm_console.line_pc)) {
+        history_begin(cpu);
+    }
+    if (cpm_console.line_active && p == cpm_console.line_pc) {
+        // Suspended in BDOS 10: nothing is decoded until the line is
+        // complete, but time still passes for budgets and script timeouts
+        cpu_cycles += HLE_TRAP_CYCLES;
+        if (cpm_script.state == SCRIPT_RUNNING && cpm_script.deadline) {
+            script_check_timeout();
+        }
+        if (!cpm_console_line_continue()) {
+            cpm_event_input_wait();
+            return p;
+        }
+        return cpm_console.line_resume >= 0 ? (unsigned int)cpm_console.line_resume : ret(cpu, mem);
+    }
+    #if DEBUG_COVERAGE
+    if (coverage_counts) {
+        coverage_hit(COVERAGE_EXECUTE, p);
+    }
+    #endif
+    if (hle_trapped(p)) {
+        int next = hle_dispatch(cpu, p);
+        if (next >= 0) {
+            cpu_cycles += HLE_TRAP_CYCLES;
+            return (unsigned int)next;
+        }
+    }
+    unsigned char opcode = mem[p];
+    unsigned int next = exec_inst(cpu, mem);
+    cpu_cycles += cycle_table[opcode];
+    if ((opcode & 0xC7) == 0xC0 && next != p + 1) {
+        cpu_cycles += 6;               // Conditional RET taken
+    } else if ((opcode & 0xC7) == 0xC4 && next != p + 3) {
+        cpu_cycles += 6;               // Conditional CALL taken
+    }
+    if (cpm_script.state == SCRIPT_RUNNING && cpm_script.deadline) {
+        script_check_timeout();
+    }
+    return next;
+}
+
+// Reasons cpu_run returns
+enum { RUN_BUDGET, RUN_WAITING, RUN_IDLE, RUN_HALTED, RUN_SCRIPT, RUN_BREAKPOINT, RUN_WATCHPOINT, RUN_DEBUGGER };
+
+// After a step: stop for a watchpoint hit, a breakpoint at pc or the
+// debugger. Returns the reason to report, or RUN_BUDGET to carry on.
+static inline int debug_check(unsigned int pc)
+{
+    debug_state *debug = &cpm_debug;
+    if (debug->armed && (debug->hit || debug->attention || (debug->breakpoint[pc >> 3] & (1 << (pc & 7))))) {
+        int reason = debug_stop();
+        if (!gdb_service(reason)) {
+            return reason;
+        }
+    }
+    return RUN_BUDGET;
+}
+
+// Run until the clock reaches stop or the machine has nothing to do. While
+// a script is running the machine keeps going through input waits, so that
+// step timeouts measured in cycles keep advancing.
+static int cpu_run_until(unsigned long long stop)
+{
+    int scripted = (cpm_script.state == SCRIPT_RUNNING);
+    cpm_debug.hit = 0;
+    while (cpu_cycles < stop) {
+        unsigned int pc = cpu_step(&cpm_machine->cpu) & 0xFFFF;
+        cpm_machine->cpu.prog_ctr = pc;
+        cpm_idle.steps++;
+        int reason = debug_check(pc);
+        if (reason != RUN_BUDGET) {
+            return reason;
+        }
+        if (scripted) {
+            if (cpm_script.state != SCRIPT_RUNNING) {
+                return RUN_SCRIPT;
+            }
+            continue;
+        }
+        if (mem[cpm_machine->cpu.prog_ctr] == 0x76 && !cpm_machine->cpu.interrupt_enable) {
+            return RUN_HALTED;
+        }
+        if (cpm_console.waiting_for_input) {
+            return RUN_WAITING;
+        }
+        if (cpm_idle_flag()) {
+            return RUN_IDLE;
+        }
+    }
+    return RUN_BUDGET;
+}
+
+// Run until budget clock states have passed or the machine has nothing to
+// do. The run is cut where front panel snapshots are due, so the step loop
+// never checks for them.
+int cpu_run(unsigned long long budget)
+{
+    unsigned long long stop = cpu_cycles + budget;
+    int reason;
+    do {
+        reason = cpu_run_until(cpm_panel.due < stop ? cpm_panel.due : stop);
+        if (cpm_panel.interval) {
+            front_panel_publish();
+        }
+    } while (reason == RUN_BUDGET && cpu_cycles < stop);
+    console_flush_burst();
+    return reason;
+}
+
+// Start the script and run the machine until it finishes, times out or
+// max_cycles pass. Returns the script state.
+int cpm_script_run(unsigned long long max_cycles)
+{
+    if (cpm_script.state != SCRIPT_RUNNING && !cpm_script_start()) {
+        return cpm_script.state;
+    }
+    if (cpm_script.state == SCRIPT_RUNNING) {
+        cpu_run(max_cycles);
+    }
+    return cpm_script.state;
+}
+
+unsigned long long cpu_cycle_count(void)
+{
+    return cpu_cycles;
+}
+
+char* codestep(void)
+{
+    currentAndNext[0] = mem[cpm_machine->cpu.prog_ctr];
+    currentAndNext[1] = mem[cpm_machine->cpu.prog_ctr+1];
+    currentAndNext[2] = mem[cpm_machine->cpu.prog_ctr+2];
+    cpm_debug.hit = 0;
+    cpm_machine->cpu.prog_ctr = cpu_step(&cpm_machine->cpu) & 0xFFFF;
+    cpm_idle.steps++;
+    debug_check(cpm_machine->cpu.prog_ctr);  // Notes the stop, or serves an attached debugger
+    currentAndNext[3] = mem[cpm_machine->cpu.prog_ctr];
+    currentAndNext[4] = mem[cpm_machine->cpu.prog_ctr+1];
+    currentAndNext[5] = mem[cpm_machine->cpu.prog_ctr+2];
+    if (cpu_cycles >= cpm_panel.due) {
+        front_panel_publish();
+    }
+    return dumpRegs(&cpm_machine->cpu);
+}
+
+// Clear the registers, flags and interrupt state of the selected machine
+static void cpu_clear(void)
+{
+    // reset all registers
+
+    cpm_machine->cpu.prog_ctr = 0;
+    cpm_machine->cpu.stack_ptr = 0;
+
+    cpm_machine->cpu.reg[A] = 0;
+    cpm_machine->cpu.reg[H] = 0;
+    cpm_machine->cpu.reg[L] = 0;
+    cpm_machine->cpu.reg[B] = 0;
+    cpm_machine->cpu.reg[C] = 0;
+    cpm_machine->cpu.reg[D] = 0;
+    cpm_machine->cpu.reg[E] = 0;
+    cpm_machine->cpu.reg[SP] = 0;
+
+    // Reset flags
+    cpm_machine->cpu.carry = 0;
+    cpm_machine->cpu.aux_carry = 0;
+    cpm_machine->cpu.iszero = 0;
+    cpm_machine->cpu.parity = 0;
+    cpm_machine->cpu.sign = 0;
+
+    // Reset interrupt state
+    cpm_machine->cpu.interrupt_enable = 0;
+    cpm_machine->cpu.interrupt_pending = 0;
+    cpm_machine->cpu.interrupt_opcode = 0;
+    history_clear();
+}
+
+// Power-on reset of the machine running on this thread
+void cpm_machine_reset(void)
+{
+    cpu_clear();
+
+    // Initialize CP/M subsystem
+    cpm_init();
+}
+
+// Reset button: clear the CPU, the console and the disk controller and
+// restart through the BIOS warm-boot vector at 0000h (at 0000h itself
+// when no BIOS is loaded). Memory, the drives and their in-memory sectors
+// are kept, so nothing is reloaded from the host.
+void cpm_machine_warm_reset(void)
+{
+    cpu_clear();
+    cpm_console_init();
+    cpm_events.halted = 0;
+
+    host_close_all_files();
+    memset(&cpm_disk, 0, sizeof(disk_state));
+    cpm_disk.dma_address = 0x0080; // Default DMA address
+
+    if (mem[0] == 0xC3) {
+        cpm_machine->cpu.prog_ctr = get_le16(&mem[1]);
+    }
+}
+
+char* codereset(void)
+{
+    cpm_machine_reset();
+
+    currentAndNext[0] = mem[cpm_machine->cpu.prog_ctr];
+    currentAndNext[1] = mem[cpm_machine->cpu.prog_ctr+1];
+    currentAndNext[2] = mem[cpm_machine->cpu.prog_ctr+2];
+    currentAndNext[3] = mem[cpm_machine->cpu.prog_ctr+3];
+    currentAndNext[4] = mem[cpm_machine->cpu.prog_ctr+4];
+    currentAndNext[5] = mem[cpm_machine->cpu.prog_ctr+5];
+
+    return dumpRegs(&cpm_machine->cpu);
+}
+
+char* codewarmreset(void)
+{
+    cpm_machine_warm_reset();
+
+    currentAndNext[0] = mem[cpm_machine->cpu.prog_ctr];
+    currentAndNext[1] = mem[cpm_machine->cpu.prog_ctr+1];
+    currentAndNext[2] = mem[cpm_machine->cpu.prog_ctr+2];
+    currentAndNext[3] = mem[cpm_machine->cpu.prog_ctr+3];
+    currentAndNext[4] = mem[cpm_machine->cpu.prog_ctr+4];
+    currentAndNext[5] = mem[cpm_machine->cpu.prog_ctr+5];
+
+    return dumpRegs(&cpm_machine->cpu);
+}
+
+// Machine state without memory
+static machine_t* machine_alloc(void)
+{
+    machine_t *machine = calloc(1, sizeof(machine_t));
+    if (!machine) {
+        return NULL;
+    }
+    pthread_mutex_init(&machine->idle.lock, NULL);
+    pthread_cond_init(&machine->idle.wake, NULL);
+    pthread_mutex_init(&machine->events.lock, NULL);
+    machine->events.pipe[0] = machine->events.pipe[1] = -1;
+    machine->host.type[0] = machine->host.type[1] = DRIVE_IMAGE;
+    machine->script.state = SCRIPT_IDLE;
+    machine->replay.due = ~0ULL;
+    machine->panel.due = ~0ULL;
+    return machine;
+}
+
+// A new machine with empty memory and no disks loaded yet. disk_path is the
+// directory holding its A.DSK and B.DSK; with NULL its disks live in memory
+// only. Select it and call cpm_machine_reset to power it on.
+machine_t* cpm_machine_create(const char *disk_path)
+{
+    machine_t *machine = machine_alloc();
+    if (!machine) {
+        return NULL;
+    }
+    machine->memory = calloc(1, 0x10000);
+    if (!machine->memory) {
+        cpm_machine_destroy(machine);
+        return NULL;
+    }
+    if (disk_path) {
+        snprintf(machine->disk_dir, sizeof(machine->disk_dir), "%s", disk_path);
+    }
+    return machine;
+}
+
+// Run this thread on machine (NULL = the default machine). Returns the
+// machine that was selected before.
+machine_t* cpm_machine_select(machine_t *machine)
+{
+    machine_t *previous = cpm_machine;
+    cpm_machine = machine ? machine : &cpm_default_machine;
+    mem = cpm_machine->memory;
+    history_recording = (cpm_history.steps != NULL);
+    watch_page = cpm_debug.watch_page;
+    #if DEBUG_COVERAGE
+    coverage_counts = cpm_coverage.collecting ? cpm_coverage.counts : NULL;
+    #endif
+    return previous;
+}
+
+void cpm_machine_destroy(machine_t *machine)
+{
+    if (!machine || machine == &cpm_default_machine) {
+        return;
+    }
+    gdb_forget_machine(machine);
+    machine_t *previous = cpm_machine_select(machine);
+    host_close_all_files();
+    for (int device = 0; device < CPM_AUX_DEVICES; device++) {
+        cpm_aux_detach(device);
+    }
+    sparse_clear(&disk_a);
+    sparse_clear(&disk_b);
+    base_image_release(disk_a.base);
+    base_image_release(disk_b.base);
+    cpm_script_clear();
+    free(cpm_replay.log);
+    free(cpm_history.steps);
+    free(cpm_history.writes);
+    free(cpm_coverage.counts);
+    free(cpm_coverage.labels);
+    free(cpm_console.output_ring);
+    if (cpm_events.pipe_ready) {
+        close(cpm_events.pipe[0]);
+        close(cpm_events.pipe[1]);
+    }
+    cpm_machine_select(previous == machine ? NULL : previous);
+    pthread_mutex_destroy(&machine->idle.lock);
+    pthread_cond_destroy(&machine->idle.wake);
+    pthread_mutex_destroy(&machine->events.lock);
+    if (machine->memory_mapped) {
+        munmap(machine->memory, 0x10000);
+    } else {
+        free(machine->memory);
+    }
+    ram_template_release(machine->ram_template);
+    free(machine);
+}
+
+void coderun(void)
+{
+    codestep();
+    cpm_machine->cpu.prog_ctr = cpu_step(&cpm_machine->cpu) & 0xFFFF;
+    dumpRegs(&cpm_machine->cpu);
+}
+
+void codeload(const char *sourcecode, unsigned int org)
+{
+    unsigned long length = strlen(sourcecode);
+
+    const char *pos = sourcecode;
+    for (size_t count = 0; count < length / 2; count++)
+    {
+        sscanf(pos, "%2hhx",&mem[org + count]);
+        pos += 2;
+    }
+    printf("[Loader] Loaded %lu bytes at address 0x%04X\n", length/2, org);
+    fflush(stdout);
+
+    // Traps on the loaded addresses belonged to whatever was there before
+    hle_unregister_range(org, length / 2);
+}
+
+void cpu_set_pc(unsigned short addr)
+{
+    cpm_machine->cpu.prog_ctr = addr;
+    cpm_console.line_active = 0;
+    cpm_events.halted = 0;
+    currentAndNext[0] = mem[cpm_machine->cpu.prog_ctr];
+    currentAndNext[1] = mem[cpm_machine->cpu.prog_ctr+1];
+    currentAndNext[2] = mem[cpm_machine->cpu.prog_ctr+2];
+    currentAndNext[3] = mem[cpm_machine->cpu.prog_ctr+3];
+    currentAndNext[4] = mem[cpm_machine->cpu.prog_ctr+4];
+    currentAndNext[5] = mem[cpm_machine->cpu.prog_ctr+5];
+}
+
+// Interrupt support functions
+static void interrupt_raise(unsigned char opcode)
+{
+    cpm_machine->cpu.interrupt_pending = 1;
+    cpm_machine->cpu.interrupt_opcode = opcode;
+    cpm_idle_wake();
+}
+
+void trigger_interrupt(unsigned char opcode)
+{
+    // Queue an interrupt with the given opcode (typically RST 0-7)
+    if (cpm_replay.mode == REPLAY_PLAYING) {
+        return;
+    }
+    if (!record_queue_input(REPLAY_EVENT_TRIGGER, opcode)) {
+        interrupt_raise(opcode);
+    }
+}
+
+int check_interrupt(void)
+{
+    // Returns 1 if interrupt should be processed, 0 otherwise
+    return (cpm_machine->cpu.interrupt_enable && cpm_machine->cpu.interrupt_pending);
+}
+
+static void interrupt_take(void)
+{
+    if (history_recording) {
+        history_begin(&cpm_machine->cpu);  // The interrupt is a step of its own
+        history_write(cpm_machine->cpu.prog_ctr);
+    }
+    cpm_machine->cpu.interrupt_enable = 0; // Disable further interrupts
+    cpm_machine->cpu.interrupt_pending = 0; // Clear pending flag
+    cpm_events.halted = 0;     // An interrupt ends a halt
+
+    // Execute the interrupt opcode (typically RST instruction)
+    unsigned char saved_opcode = mem[cpm_machine->cpu.prog_ctr];
+    mem[cpm_machine->cpu.prog_ctr] = cpm_machine->cpu.interrupt_opcode;
+    cpm_machine->cpu.prog_ctr = exec_inst(&cpm_machine->cpu, mem) & 0xFFFF;
+    if (history_recording) {
+        history_write(cpm_machine->cpu.prog_ctr);
+    }
+    mem[cpm_machine->cpu.prog_ctr] = saved_opcode; // Restore (though PC has changed)
+}
+
+void process_interrupt(void)
+{
+    // Process pending interrupt if enabled
+    if (cpm_replay.mode != REPLAY_PLAYING && check_interrupt()) {
+        record_event(REPLAY_EVENT_INTERRUPT, NULL, 0);
+        interrupt_take();
+    }
+}
+
+// CP/M console waiting state
+int cpm_is_waiting_for_input(void)
+{
+    return cpm_console.waiting_for_input;
+}
+
+void cpm_clear_waiting(void)
+{
+    cpm_console.waiting_for_input = 0;
+}
+
+void cpm_set_echo(int enable)
+{
+    cpm_console.input_echo = enable;
+}
+
+// ============================================================================
+// SAVE STATE
+// ============================================================================
+//
+// A save state captures the machine running on this thread: CPU, 64KB of
+// RAM, console buffers, disk controller, the contents of both image drives
+// and the screen. Host attachments (mapped directories, LST:/PUN:/RDR:
+// routing, scripts, event registration) belong to the host, not the
+// machine, and are left as they are on restore.
+//
+// Layout (all integers little-endian):
+//   header   12 bytes: magic, version, chunk count
+//   chunk    16 byte header: id, flags, raw length, stored length; then data
+// Readers skip chunks they don't know, so chunks can be added without a
+// version bump. With CPM_SAVE_COMPRESS each chunk is run-length coded when
+// that makes it smaller, which shrinks a typical CP/M RAM image to a few KB
+// and decodes at memcpy speed.
+//
+// Restoring leaves A.DSK and B.DSK alone: the restored drives stay in
+// memory until they are loaded again or saved. With CPM_RESTORE_WRITE_BACK
+// the image files are rewritten to match the restored machine instead.
+
+#define SAVE_MAGIC "C8080SST"
+#define SAVE_VERSION 1
+#define SAVE_HEADER_SIZE 12
+#define SAVE_CHUNK_HEADER_SIZE 16
+#define SAVE_CHUNK_RLE 0x0001
+#define SAVE_MAX_CHUNKS 32
+#define CPM_SAVE_COMPRESS 0x01
+#define CPM_RESTORE_WRITE_BACK 0x01
+
+typedef struct {
+    unsigned char *data;
+    size_t used;
+    size_t size;
+    int chunks;
+    int failed;
+} save_buffer_t;
+
+static void save_put(save_buffer_t *out, const void *data, size_t len) {
+    if (out->failed) {
+        return;
+    }
+    if (out->used + len > out->size) {
+        size_t size = out->size ? out->size : 4096;
+        while (size < out->used + len) {
+            size *= 2;
+        }
+        unsigned char *grown = realloc(out->data, size);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->data = grown;
+        out->size = size;
+    }
+    memcpy(out->data + out->used, data, len);
+    out->used += len;
+}
+
+static void save_put8(save_buffer_t *out, unsigned int v) {
+    unsigned char b = v & 0xFF;
+    save_put(out, &b, 1);
+}
+
+static void save_put16(save_buffer_t *out, unsigned int v) {
+    unsigned char b[2];
+    put_le16(b, v);
+    save_put(out, b, 2);
+}
+
+static void save_put32(save_buffer_t *out, unsigned long v) {
+    unsigned char b[4];
+    put_le32(b, v);
+    save_put(out, b, 4);
+}
+
+// Run-length coding: a control byte below 128 is followed by that many plus
+// one literal bytes; 128 and above repeat the next byte (control - 125)
+// times, 3 to 130. dst needs len + len / 128 + 1 bytes.
+static size_t rle_encode(const unsigned char *src, size_t len, unsigned char *dst) {
+    size_t out = 0, i = 0, literal = 0;
+    while (i <= len) {
+        size_t run = 1;
+        while (i < len && i + run < len && run < 130 && src[i + run] == src[i]) {
+            run++;
+        }
+        if (i < len && run < 3) {
+            i++;
+            continue;
+        }
+        while (literal < i) {
+            size_t n = i - literal < 128 ? i - literal : 128;
+            dst[out++] = (unsigned char)(n - 1);
+            memcpy(dst + out, src + literal, n);
+            out += n;
+            literal += n;
+        }
+        if (i == len) {
+            break;
+        }
+        dst[out++] = (unsigned char)(run + 125);
+        dst[out++] = src[i];
+        i += run;
+        literal = i;
+    }
+    return out;
+}
+
+static int rle_decode(const unsigned char *src, size_t len, unsigned char *dst, size_t size) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; ) {
+        unsigned int control = src[i++];
+        if (control < 128) {
+            size_t n = control + 1;
+            if (i + n > len || out + n > size) {
+                return 0;
             }
-            return p+1;
-        case 0x0d: (cpu->reg)[C] = decrement((cpu->reg)[C], cpu); return p+1;
-        case 0x15: (cpu->reg)[D] = decrement((cpu->reg)[D], cpu); return p+1;
-        case 0x1d: (cpu->reg)[E] = decrement((cpu->reg)[E], cpu); return p+1;
-        case 0x25: (cpu->reg)[H] = decrement((cpu->reg)[H], cpu); return p+1;
-        case 0x2d: (cpu->reg)[L] = decrement((cpu->reg)[L], cpu); return p+1;
-        case 0x35: MemWrite(dest, decrement(MemRead(dest), cpu)); return p+1;
-        case 0x3d: (cpu->reg)[A] = decrement((cpu->reg)[A], cpu); return p+1;
-            //Rotate
-        case 0x07: rotate(1, 0, cpu); return p+1;
-        case 0x17: rotate(1, 1, cpu); return p+1;
-        case 0x0f: rotate(0, 0, cpu); return p+1;
-        case 0x1f: rotate(0, 1, cpu); return p+1;
-        case 0x27: daa(cpu); return p+1;//DAA - Decimal Adjust Accumulator
-        case 0x2f: (cpu->reg)[A] = ~(cpu->reg)[A]; return p+1;
-        case 0x37: cpu->carry = 1; return p+1;
-        case 0x3f: cpu->carry = !(cpu->carry); return p+1;
-            //16-bit inc/dec
-        case 0x03: doubleinr(B, cpu); return p+1;
-        case 0x13: doubleinr(D, cpu); return p+1;
-        case 0x23: doubleinr(H, cpu); return p+1;
-        case 0x33: doubleinr(SP, cpu); return p+1;
-        case 0x0b: doubledcr(B, cpu); return p+1;
-        case 0x1b: doubledcr(D, cpu); return p+1;
-        case 0x2b: doubledcr(H, cpu); return p+1;
-        case 0x3b: doubledcr(SP, cpu); return p+1;
-            //XTHL, XCHG, SPHL
-        case 0xe3: xthl(cpu, mem); return p+1;
-        case 0xeb: xchg(cpu); return p+1;
-        case 0xf9: cpu->stack_ptr = 0x100*(cpu->reg)[H]+(cpu->reg)[L]; return p+1;
-            //Arith/logic
-        case 0x80: add((cpu->reg)[B], cpu, 0); return p+1;
-        case 0x81: add((cpu->reg)[C], cpu, 0); return p+1;
-        case 0x82: add((cpu->reg)[D], cpu, 0); return p+1;
-        case 0x83: add((cpu->reg)[E], cpu, 0); return p+1;
-        case 0x84: add((cpu->reg)[H], cpu, 0); return p+1;
-        case 0x85: add((cpu->reg)[L], cpu, 0); return p+1;
-        case 0x86: add(MemRead(dest), /*mem[dest];*/ cpu, 0); return p+1;
-        case 0x87: add((cpu->reg)[A], cpu, 0); return p+1;
-        case 0x88: add((cpu->reg)[B], cpu, 1); return p+1;
-        case 0x89: add((cpu->reg)[C], cpu, 1); return p+1;
-        case 0x8a: add((cpu->reg)[D], cpu, 1); return p+1;
-        case 0x8b: add((cpu->reg)[E], cpu, 1); return p+1;
-        case 0x8c: add((cpu->reg)[H], cpu, 1); return p+1;
-        case 0x8d: add((cpu->reg)[L], cpu, 1); return p+1;
-        case 0x8e: add(MemRead(dest), /*mem[dest];*/ cpu, 1); return p+1;
-        case 0x8f: add((cpu->reg)[A], cpu, 1); return p+1;
-        case 0x90: sub((cpu->reg)[B], cpu, 0); return p+1;
-        case 0x91: sub((cpu->reg)[C], cpu, 0); return p+1;
-        case 0x92: sub((cpu->reg)[D], cpu, 0); return p+1;
-        case 0x93: sub((cpu->reg)[E], cpu, 0); return p+1;
-        case 0x94: sub((cpu->reg)[H], cpu, 0); return p+1;
-        case 0x95: sub((cpu->reg)[L], cpu, 0); return p+1;
-        case 0x96: sub(MemRead(dest), /*mem[dest];*/ cpu, 0); return p+1;
-        case 0x97: sub((cpu->reg)[A], cpu, 0); return p+1;
-        case 0x98: sub((cpu->reg)[B], cpu, 1); return p+1;
-        case 0x99: sub((cpu->reg)[C], cpu, 1); return p+1;
-        case 0x9a: sub((cpu->reg)[D], cpu, 1); return p+1;
-        case 0x9b: sub((cpu->reg)[E], cpu, 1); return p+1;
-        case 0x9c: sub((cpu->reg)[H], cpu, 1); return p+1;
-        case 0x9d: sub((cpu->reg)[L], cpu, 1); return p+1;
-        case 0x9e: sub(MemRead(dest), /*mem[dest];*/ cpu, 1); return p+1;
-        case 0x9f: sub((cpu->reg)[A], cpu, 1); return p+1;
-        case 0xa0: logic(bw_and, (cpu->reg)[B], cpu); return p+1;
-        case 0xa1: logic(bw_and, (cpu->reg)[C], cpu); return p+1;
-        case 0xa2: logic(bw_and, (cpu->reg)[D], cpu); return p+1;
-        case 0xa3: logic(bw_and, (cpu->reg)[E], cpu); return p+1;
-        case 0xa4: logic(bw_and, (cpu->reg)[H], cpu); return p+1;
-        case 0xa5: logic(bw_and, (cpu->reg)[L], cpu); return p+1;
-        case 0xa6: logic(bw_and, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
-        case 0xa7: logic(bw_and, (cpu->reg)[A], cpu); return p+1;
-        case 0xa8: logic(bw_xor, (cpu->reg)[B], cpu); return p+1;
-        case 0xa9: logic(bw_xor, (cpu->reg)[C], cpu); return p+1;
-        case 0xaa: logic(bw_xor, (cpu->reg)[D], cpu); return p+1;
-        case 0xab: logic(bw_xor, (cpu->reg)[E], cpu); return p+1;
-        case 0xac: logic(bw_xor, (cpu->reg)[H], cpu); return p+1;
-        case 0xad: logic(bw_xor, (cpu->reg)[L], cpu); return p+1;
-        case 0xae: logic(bw_xor, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
-        case 0xaf: logic(bw_xor, (cpu->reg)[A], cpu); return p+1;
-        case 0xb0: logic(bw_or, (cpu->reg)[B], cpu); return p+1;
-        case 0xb1: logic(bw_or, (cpu->reg)[C], cpu); return p+1;
-        case 0xb2: logic(bw_or, (cpu->reg)[D], cpu); return p+1;
-        case 0xb3: logic(bw_or, (cpu->reg)[E], cpu); return p+1;
-        case 0xb4: logic(bw_or, (cpu->reg)[H], cpu); return p+1;
-        case 0xb5: logic(bw_or, (cpu->reg)[L], cpu); return p+1;
-        case 0xb6: logic(bw_or, MemRead(dest), /*mem[dest];*/ cpu); return p+1;
-        case 0xb7: logic(bw_or, (cpu->reg)[A], cpu); return p+1;
-        case 0xb8: cmp((cpu->reg)[B], cpu); return p+1;
-        case 0xb9: cmp((cpu->reg)[C], cpu); return p+1;
-        case 0xba: cmp((cpu->reg)[D], cpu); return p+1;
-        case 0xbb: cmp((cpu->reg)[E], cpu); return p+1;
-        case 0xbc: cmp((cpu->reg)[H], cpu); return p+1;
-        case 0xbd: cmp((cpu->reg)[L], cpu); return p+1;
-        case 0xbe: cmp(MemRead(dest), /*mem[dest];*/ cpu); return p+1;
-        case 0xbf: cmp((cpu->reg)[A], cpu); return p+1;
-            //ADI, ADC, SUI, SBI, ANI, XRI, ORI, CPI
-        case 0xc6: add(d8, cpu, 0); return p+2;
-        case 0xce: add(d8, cpu, 1); return p+2;
-        case 0xd6: sub(d8, cpu, 0); return p+2;
-        case 0xde: sub(d8, cpu, 1); return p+2;
-        case 0xe6: logic(bw_and, d8, cpu); return p+2;
-        case 0xee: logic(bw_xor, d8, cpu); return p+2;
-        case 0xf6: logic(bw_or, d8, cpu); return p+2;
-        case 0xfe: cmp(d8, cpu); return p+2;
-            //16bit A/L
-        case 0x09: doubleadd(B, cpu); return p+1;
-        case 0x19: doubleadd(D, cpu); return p+1;
-        case 0x29: doubleadd(H, cpu); return p+1;
-        case 0x39: doubleadd(SP, cpu); return p+1;
-            //Push/pop using stack pointer
-        case 0xc1: pop(B, cpu, mem); return p+1;
-        case 0xd1: pop(D, cpu, mem); return p+1;
-        case 0xe1: pop(H, cpu, mem); return p+1;
-        case 0xf1: pop(A, cpu, mem); return p+1;
-        case 0xc5: push(B, cpu, mem); return p+1;
-        case 0xd5: push(D, cpu, mem); return p+1;
-        case 0xe5: push(H, cpu, mem); return p+1;
-        case 0xf5: push(A, cpu, mem); return p+1;
-            //Jumps
-        case 0xcb:
-        case 0xc3: return da;//JMP
-        case 0xc2: // JNZ
-#if DEBUG_CPU
-            printf("[JNZ] PC=%04X, target=%04X, zero=%d, ", p, da, cpu->iszero);
-            if (!(cpu->iszero)) {
-                printf("JUMPING to %04X\n", da);
-                fflush(stdout);
-            } else {
-                printf("NOT jumping (continuing to %04X)\n", p+3);
-                fflush(stdout);
+            memcpy(dst + out, src + i, n);
+            i += n;
+            out += n;
+        } else {
+            size_t n = control - 125;
+            if (i >= len || out + n > size) {
+                return 0;
+            }
+            memset(dst + out, src[i++], n);
+            out += n;
+        }
+    }
+    return out == size;
+}
+
+static void save_chunk(save_buffer_t *out, const char *id, const save_buffer_t *chunk, int flags) {
+    unsigned char header[SAVE_CHUNK_HEADER_SIZE] = { 0 };
+    unsigned char *packed = NULL;
+    size_t stored = chunk->used;
+    if ((flags & CPM_SAVE_COMPRESS) && chunk->used > 0) {
+        packed = malloc(chunk->used + chunk->used / 128 + 1);
+        if (packed) {
+            stored = rle_encode(chunk->data, chunk->used, packed);
+        }
+        if (stored >= chunk->used) {
+            free(packed);
+            packed = NULL;
+            stored = chunk->used;
+        }
+    }
+    memcpy(header, id, 4);
+    put_le16(header + 4, packed ? SAVE_CHUNK_RLE : 0);
+    put_le32(header + 8, chunk->used);
+    put_le32(header + 12, stored);
+    save_put(out, header, sizeof(header));
+    save_put(out, packed ? packed : chunk->data, stored);
+    out->chunks++;
+    free(packed);
+}
+
+static void save_drive(save_buffer_t *chunk, const sparse_disk_t *disk, int loaded) {
+    const char *base = disk->base ? disk->base->path : "";
+    save_put8(chunk, loaded);
+    save_put8(chunk, disk->format ? (unsigned int)(disk->format - disk_formats) : 0xFF);
+    save_put16(chunk, disk->sectors);
+    save_put8(chunk, disk->sparse_file);
+    save_put16(chunk, (unsigned int)strlen(base));
+    save_put(chunk, base, strlen(base));
+    // The pages: every sector of a plain drive, the delta of an overlay
+    save_put32(chunk, disk->populated);
+    for (unsigned int i = 0; i < disk->sectors; i++) {
+        const disk_page_t *page = disk->page[i / DISK_PAGE_SECTORS];
+        if (page && page->sector[i % DISK_PAGE_SECTORS]) {
+            save_put16(chunk, i);
+            save_put(chunk, page->sector[i % DISK_PAGE_SECTORS], DISK_SECTOR_SIZE);
+        }
+    }
+}
+
+// Snapshot the current machine. Returns a malloc'd buffer (free it) and its
+// length, or NULL when out of memory.
+unsigned char* cpm_machine_save(size_t *length, int flags) {
+    save_buffer_t out = { 0 };
+    save_buffer_t chunk = { 0 };
+    struct i8080 *cpu = &cpm_machine->cpu;
+    unsigned char header[SAVE_HEADER_SIZE];
+    memcpy(header, SAVE_MAGIC, 8);
+    put_le16(header + 8, SAVE_VERSION);
+    put_le16(header + 10, 0);          // Chunk count, filled in at the end
+    save_put(&out, header, sizeof(header));
+
+    save_put(&chunk, cpu->reg, sizeof(cpu->reg));
+    save_put16(&chunk, cpu->stack_ptr);
+    save_put16(&chunk, cpu->prog_ctr);
+    save_put8(&chunk, cpu->carry);
+    save_put8(&chunk, cpu->aux_carry);
+    save_put8(&chunk, cpu->iszero);
+    save_put8(&chunk, cpu->parity);
+    save_put8(&chunk, cpu->sign);
+    save_put8(&chunk, cpu->interrupt_enable);
+    save_put8(&chunk, cpu->interrupt_pending);
+    save_put8(&chunk, cpu->interrupt_opcode);
+    save_put32(&chunk, (unsigned long)(cpu_cycles & 0xFFFFFFFFUL));
+    save_put32(&chunk, (unsigned long)(cpu_cycles >> 32));
+    save_chunk(&out, "CPU ", &chunk, flags);
+
+    chunk.used = 0;
+    save_put(&chunk, mem, 0x10000);
+    save_chunk(&out, "RAM ", &chunk, flags);
+
+    chunk.used = 0;
+    int input = (cpm_console.input_write_pos - cpm_console.input_read_pos) & 0xFF;
+    save_put8(&chunk, cpm_console.input_echo);
+    save_put16(&chunk, input);
+    for (int i = 0; i < input; i++) {
+        save_put8(&chunk, cpm_console.input_buffer[(cpm_console.input_read_pos + i) & 0xFF]);
+    }
+    save_put8(&chunk, cpm_console.line_active);
+    save_put16(&chunk, cpm_console.line_pc);
+    save_put16(&chunk, cpm_console.line_addr);
+    save_put8(&chunk, cpm_console.line_max);
+    save_put8(&chunk, cpm_console.line_count);
+    save_put32(&chunk, (unsigned long)cpm_console.line_resume & 0xFFFFFFFFUL);
+    console_flush_burst();
+    size_t output = cpm_console.output_write - cpm_console.output_read;
+    save_put32(&chunk, output);
+    for (size_t done = 0; done < output; ) {
+        size_t at = (cpm_console.output_read + done) & (cpm_console.output_size - 1);
+        size_t span = cpm_console.output_size - at < output - done ? cpm_console.output_size - at : output - done;
+        save_put(&chunk, cpm_console.output_ring + at, span);
+        done += span;
+    }
+    save_chunk(&out, "CON ", &chunk, flags);
+
+    chunk.used = 0;
+    save_put8(&chunk, cpm_disk.current_disk);
+    save_put8(&chunk, cpm_disk.current_track);
+    save_put8(&chunk, cpm_disk.current_sector);
+    save_put16(&chunk, cpm_disk.dma_address);
+    save_chunk(&out, "DISK", &chunk, flags);
+
+    chunk.used = 0;
+    save_drive(&chunk, &disk_a, disk_a_loaded);
+    save_chunk(&out, "DRVA", &chunk, flags);
+    chunk.used = 0;
+    save_drive(&chunk, &disk_b, disk_b_loaded);
+    save_chunk(&out, "DRVB", &chunk, flags);
+
+    chunk.used = 0;
+    save_put(&chunk, cpm_term.cells, sizeof(cpm_term.cells));
+    save_put8(&chunk, cpm_term.row);
+    save_put8(&chunk, cpm_term.col);
+    save_put8(&chunk, cpm_term.state);
+    save_put8(&chunk, cpm_term.address_row);
+    save_chunk(&out, "TERM", &chunk, flags);
+
+    free(chunk.data);
+    if (out.failed || chunk.failed) {
+        free(out.data);
+        printf("[State] ERROR: Out of memory saving the machine\n");
+        fflush(stdout);
+        return NULL;
+    }
+    put_le16(out.data + 10, out.chunks);
+    if (length) {
+        *length = out.used;
+    }
+    return out.data;
+}
+
+// Bounds-checked reader over one chunk
+typedef struct {
+    const unsigned char *p;
+    size_t left;
+    int failed;
+} save_reader_t;
+
+static const unsigned char* save_get(save_reader_t *in, size_t len) {
+    if (in->failed || len > in->left) {
+        in->failed = 1;
+        return NULL;
+    }
+    const unsigned char *p = in->p;
+    in->p += len;
+    in->left -= len;
+    return p;
+}
+
+static unsigned int save_get8(save_reader_t *in) {
+    const unsigned char *p = save_get(in, 1);
+    return p ? p[0] : 0;
+}
+
+static unsigned int save_get16(save_reader_t *in) {
+    const unsigned char *p = save_get(in, 2);
+    return p ? get_le16(p) : 0;
+}
+
+static unsigned long save_get32(save_reader_t *in) {
+    const unsigned char *p = save_get(in, 4);
+    return p ? get_le32(p) : 0;
+}
+
+typedef struct {
+    char id[4];
+    save_reader_t data;
+    unsigned char *decoded;            // Owned copy of a compressed chunk
+} save_chunk_t;
+
+static save_reader_t* save_find(save_chunk_t *chunks, int count, const char *id) {
+    for (int i = 0; i < count; i++) {
+        if (memcmp(chunks[i].id, id, 4) == 0) {
+            return &chunks[i].data;
+        }
+    }
+    return NULL;
+}
+
+// True when a drive chunk holds exactly what the drive holds now, so restoring
+// it can keep the drive as it is instead of rebuilding every page
+static int restore_drive_unchanged(save_reader_t in, const sparse_disk_t *disk, int loaded) {
+    const char *base = disk->base ? disk->base->path : "";
+    if (save_get8(&in) != (unsigned int)loaded ||
+        save_get8(&in) != (disk->format ? (unsigned int)(disk->format - disk_formats) : 0xFF) ||
+        save_get16(&in) != disk->sectors || save_get8(&in) != (unsigned int)disk->sparse_file) {
+        return 0;
+    }
+    unsigned int path_len = save_get16(&in);
+    const unsigned char *path = save_get(&in, path_len);
+    if (!path || path_len != strlen(base) || memcmp(path, base, path_len) != 0 ||
+        save_get32(&in) != disk->populated) {
+        return 0;
+    }
+    for (unsigned int r = 0; r < disk->populated; r++) {
+        unsigned int index = save_get16(&in);
+        const unsigned char *data = save_get(&in, DISK_SECTOR_SIZE);
+        const disk_page_t *page = data && index < disk->sectors ? disk->page[index / DISK_PAGE_SECTORS] : NULL;
+        if (!page || !page->sector[index % DISK_PAGE_SECTORS] ||
+            memcmp(page->sector[index % DISK_PAGE_SECTORS], data, DISK_SECTOR_SIZE) != 0) {
+            return 0;
+        }
+    }
+    return !in.failed;
+}
+
+// Build a drive from its chunk without touching the machine's own drive
+static int restore_drive(save_reader_t *in, sparse_disk_t *disk, int *loaded) {
+    char path[512];
+    memset(disk, 0, sizeof(sparse_disk_t));
+    *loaded = save_get8(in);
+    unsigned int format = save_get8(in);
+    unsigned int sectors = save_get16(in);
+    disk->sparse_file = save_get8(in);
+    unsigned int path_len = save_get16(in);
+    const unsigned char *base_path = save_get(in, path_len);
+    unsigned long records = save_get32(in);
+    if (in->failed || sectors > DISK_MAX_SECTORS || path_len >= sizeof(path) ||
+        (format >= (unsigned int)DISK_FORMAT_COUNT && format != 0xFF)) {
+        return 0;
+    }
+    pthread_once(&disk_formats_once, disk_formats_build);
+    disk->format = format == 0xFF ? NULL : &disk_formats[format];
+    disk->sectors = sectors;
+    if (path_len > 0) {
+        memcpy(path, base_path, path_len);
+        path[path_len] = '\0';
+        disk->base = base_image_acquire(path);
+        if (!disk->base || disk->base->sectors != sectors) {
+            printf("[State] ERROR: Overlay base %s is missing or changed\n", path);
+            fflush(stdout);
+            base_image_release(disk->base);
+            return 0;
+        }
+    }
+    for (unsigned long r = 0; r < records; r++) {
+        unsigned int index = save_get16(in);
+        const unsigned char *data = save_get(in, DISK_SECTOR_SIZE);
+        if (!data || index >= sectors) {
+            sparse_clear(disk);
+            base_image_release(disk->base);
+            return 0;
+        }
+        sparse_write_sector(disk, index, data);
+    }
+    return 1;
+}
+
+// What a restore does with the image files of plain drives: the boot cache
+// restores drives that already match them, CPM_RESTORE_WRITE_BACK rewrites
+// them to match, and otherwise the drives are detached and stay in memory.
+enum { RESTORE_MATCHING, RESTORE_WRITE_BACK, RESTORE_DETACH };
+
+// Replace an image drive with a restored one, or keep it (restored NULL)
+// when the save state holds the same disk
+static void restore_drive_install(sparse_disk_t *disk, sparse_disk_t *restored, const char *filename, int mode) {
+    char path[512];
+    if (restored) {
+        sparse_clear(disk);
+        base_image_release(disk->base);
+        *disk = *restored;
+        disk->detached = (mode == RESTORE_DETACH && !disk->base);
+    } else if (!disk->detached) {
+        return;  // Still matches its image file
+    }
+    if (mode == RESTORE_WRITE_BACK && !disk->base && disk->format && get_disk_path(path, sizeof(path), filename)) {
+        persist_full_image(path, disk);
+        disk->detached = 0;
+    }
+}
+
+// Replace the current machine with a save state. Everything is checked and
+// decoded before the machine is touched: on failure it runs on unchanged.
+static int machine_restore(const unsigned char *data, size_t length, int mode) {
+    save_chunk_t chunks[SAVE_MAX_CHUNKS];
+    int count = 0;
+    int ok = length >= SAVE_HEADER_SIZE && memcmp(data, SAVE_MAGIC, 8) == 0 &&
+             get_le16(data + 8) == SAVE_VERSION;
+    if (!ok) {
+        printf("[State] ERROR: Not a version %d save state\n", SAVE_VERSION);
+        fflush(stdout);
+        return 0;
+    }
+    unsigned int declared = get_le16(data + 10);
+    size_t at = SAVE_HEADER_SIZE;
+    for (unsigned int i = 0; i < declared && ok; i++) {
+        ok = length - at >= SAVE_CHUNK_HEADER_SIZE;
+        const unsigned char *header = data + at;
+        size_t raw = ok ? get_le32(header + 8) : 0;
+        size_t stored = ok ? get_le32(header + 12) : 0;
+        ok = ok && stored <= length - at - SAVE_CHUNK_HEADER_SIZE;
+        if (!ok || count == SAVE_MAX_CHUNKS) {
+            break;
+        }
+        save_chunk_t *chunk = &chunks[count++];
+        memcpy(chunk->id, header, 4);
+        chunk->decoded = NULL;
+        chunk->data.p = header + SAVE_CHUNK_HEADER_SIZE;
+        chunk->data.left = stored;
+        chunk->data.failed = 0;
+        if (get_le16(header + 4) & SAVE_CHUNK_RLE) {
+            chunk->decoded = malloc(raw ? raw : 1);
+            ok = chunk->decoded && rle_decode(chunk->data.p, stored, chunk->decoded, raw);
+            chunk->data.p = chunk->decoded;
+            chunk->data.left = raw;
+        }
+        at += SAVE_CHUNK_HEADER_SIZE + stored;
+    }
+
+    save_reader_t *cpu_in = save_find(chunks, count, "CPU ");
+    save_reader_t *ram_in = save_find(chunks, count, "RAM ");
+    save_reader_t *drive_in[2] = { save_find(chunks, count, "DRVA"), save_find(chunks, count, "DRVB") };
+    sparse_disk_t drives[2];
+    int loaded[2];
+    int built[2] = { 0, 0 };
+    ok = ok && cpu_in && cpu_in->left >= 29 && ram_in && ram_in->left == 0x10000;
+    for (int d = 0; d < 2 && ok; d++) {
+        sparse_disk_t *disk = d ? &disk_b : &disk_a;
+        if (drive_in[d] && !restore_drive_unchanged(*drive_in[d], disk, d ? disk_b_loaded : disk_a_loaded)) {
+            ok = built[d] = restore_drive(drive_in[d], &drives[d], &loaded[d]);
+        }
+    }
+    if (!ok) {
+        for (int d = 0; d < 2; d++) {
+            if (built[d]) {
+                sparse_clear(&drives[d]);
+                base_image_release(drives[d].base);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            free(chunks[i].decoded);
+        }
+        printf("[State] ERROR: Save state is truncated or corrupt\n");
+        fflush(stdout);
+        return 0;
+    }
+
+    // Validated: from here on the machine is replaced
+    cpm_io_init();
+    cpm_hle_init();
+    host_close_all_files();
+    cpm_console_init();
+
+    struct i8080 *cpu = &cpm_machine->cpu;
+    memcpy(cpu->reg, save_get(cpu_in, sizeof(cpu->reg)), sizeof(cpu->reg));
+    cpu->stack_ptr = save_get16(cpu_in);
+    cpu->prog_ctr = save_get16(cpu_in);
+    cpu->carry = save_get8(cpu_in);
+    cpu->aux_carry = save_get8(cpu_in);
+    cpu->iszero = save_get8(cpu_in);
+    cpu->parity = save_get8(cpu_in);
+    cpu->sign = save_get8(cpu_in);
+    cpu->interrupt_enable = save_get8(cpu_in);
+    cpu->interrupt_pending = save_get8(cpu_in);
+    cpu->interrupt_opcode = save_get8(cpu_in);
+    cpu_cycles = save_get32(cpu_in);
+    cpu_cycles |= (unsigned long long)save_get32(cpu_in) << 32;
+    history_clear();
+    memcpy(mem, ram_in->p, 0x10000);
+
+    save_reader_t *in = save_find(chunks, count, "CON ");
+    if (in) {
+        cpm_console.input_echo = save_get8(in);
+        unsigned int input = save_get16(in);
+        const unsigned char *typed = save_get(in, input);
+        for (unsigned int i = 0; typed && i < input && i < 255; i++) {
+            cpm_console.input_buffer[cpm_console.input_write_pos++] = (char)typed[i];
+        }
+        cpm_console.line_active = save_get8(in);
+        cpm_console.line_pc = save_get16(in);
+        cpm_console.line_addr = save_get16(in);
+        cpm_console.line_max = save_get8(in);
+        cpm_console.line_count = save_get8(in);
+        unsigned long resume = save_get32(in);
+        cpm_console.line_resume = resume == 0xFFFFFFFFUL ? -1 : (int)resume;
+        size_t output = save_get32(in);
+        const unsigned char *pending = save_get(in, output);
+        if (pending && output > 0) {
+            console_output_append(pending, output);
+        }
+        if (in->failed) {
+            cpm_console.line_active = 0;
+        }
+    }
+    in = save_find(chunks, count, "DISK");
+    memset(&cpm_disk, 0, sizeof(disk_state));
+    cpm_disk.dma_address = 0x0080;
+    if (in) {
+        cpm_disk.current_disk = save_get8(in);
+        cpm_disk.current_track = save_get8(in);
+        cpm_disk.current_sector = save_get8(in);
+        cpm_disk.dma_address = save_get16(in);
+    }
+    restore_drive_install(&disk_a, built[0] ? &drives[0] : NULL, "A.DSK", mode);
+    restore_drive_install(&disk_b, built[1] ? &drives[1] : NULL, "B.DSK", mode);
+    if (built[0]) {
+        disk_a_loaded = loaded[0];
+    }
+    if (built[1]) {
+        disk_b_loaded = loaded[1];
+    }
+    in = save_find(chunks, count, "TERM");
+    const unsigned char *cells = in ? save_get(in, sizeof(cpm_term.cells)) : NULL;
+    if (cells) {
+        memcpy(cpm_term.cells, cells, sizeof(cpm_term.cells));
+        cpm_term.row = save_get8(in) % TERM_ROWS;
+        cpm_term.col = save_get8(in) % TERM_COLS;
+        cpm_term.state = save_get8(in);
+        cpm_term.address_row = save_get8(in);
+        if (cpm_term.state > TERM_ADDRESS_COL) {
+            cpm_term.state = TERM_NORMAL;
+        }
+        cpm_term.scrolled_count = 0;
+        cpm_term.dirty = (1u << TERM_ROWS) - 1;
+        cpm_term.generation++;
+    }
+    for (int i = 0; i < count; i++) {
+        free(chunks[i].decoded);
+    }
+
+    // The BIOS traps follow the vector in the restored memory
+    hle_install_page_zero_bios();
+    cpm_events.halted = 0;
+    if (cpm_console.output_write != cpm_console.output_read) {
+        cpm_event_signal(CPM_EVENT_OUTPUT);
+    }
+    printf("[State] Restored machine at PC=0x%04X, %llu cycles\n", cpu->prog_ctr, cpu_cycles);
+    fflush(stdout);
+    return 1;
+}
+
+int cpm_machine_restore(const unsigned char *data, size_t length, int flags) {
+    return machine_restore(data, length, (flags & CPM_RESTORE_WRITE_BACK) ? RESTORE_WRITE_BACK : RESTORE_DETACH);
+}
+
+// Save the current machine to a file, written whole and renamed into place
+int cpm_machine_save_file(const char *path, int flags) {
+    char temp_path[600];
+    size_t length = 0;
+    unsigned char *data = path ? cpm_machine_save(&length, flags) : NULL;
+    if (!data) {
+        return 0;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *f = fopen(temp_path, "wb");
+    int ok = f && fwrite(data, 1, length, f) == length;
+    ok = f && (fflush(f) == 0) && ok && (fsync(fileno(f)) == 0);
+    ok = f && (fclose(f) == 0) && ok;
+    free(data);
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        printf("[State] ERROR: Failed to save %s (%s)\n", path, strerror(errno));
+        fflush(stdout);
+        return 0;
+    }
+    return 1;
+}
+
+static int machine_restore_file(const char *path, int mode) {
+    int fd = path ? open(path, O_RDONLY) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    unsigned char *data = malloc((size_t)st.st_size);
+    ssize_t got = data ? read(fd, data, (size_t)st.st_size) : -1;
+    close(fd);
+    int ok = got == st.st_size && machine_restore(data, (size_t)st.st_size, mode);
+    free(data);
+    return ok;
+}
+
+int cpm_machine_restore_file(const char *path, int flags) {
+    return machine_restore_file(path, (flags & CPM_RESTORE_WRITE_BACK) ? RESTORE_WRITE_BACK : RESTORE_DETACH);
+}
+
+// ============================================================================
+// BOOT CACHE
+// ============================================================================
+//
+// A cold start resets the machine, loads both disk images, loads the boot
+// code and runs CP/M up to the CCP prompt. All of that depends only on the
+// boot code and the disk files, so the first cold boot to reach the prompt
+// saves the machine under a hash of those inputs (and of this build), and
+// later starts restore that instead. A boot that writes to its disks is not
+// cached: a cached machine's drives must be what the files already hold.
+// Looking for the prompt is capped in wall-clock time as well as cycles; a
+// boot that gives up is left running for the caller's own run loop.
+
+#define BOOT_CACHE_MAX_CYCLES 200000000ULL  // Give up looking for a prompt (100s of a 2MHz 8080)
+#define BOOT_CACHE_SLICE_CYCLES 2000000ULL  // Run between wall-clock checks
+#define BOOT_CACHE_MAX_MS 1000
+#define BOOT_CACHE_BUILD __DATE__ " " __TIME__
+
+// FNV-1a over 64-bit words, with a fold so high bits reach the low ones
+static unsigned long long boot_hash_bytes(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word;
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static unsigned long long boot_hash_file(unsigned long long hash, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return boot_hash_bytes(hash, "-", 1);  // Missing file
+    }
+    unsigned long long size = (unsigned long long)st.st_size;
+    hash = boot_hash_bytes(hash, &size, sizeof(size));
+    void *data = size > 0 ? mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data != MAP_FAILED) {
+        hash = boot_hash_bytes(hash, data, (size_t)size);
+        munmap(data, (size_t)size);
+    }
+    return hash;
+}
+
+static unsigned long long boot_cache_key(const char *hex, unsigned int org) {
+    static const char *files[] = { "A.DSK", "A.DSK.journal", "B.DSK", "B.DSK.journal" };
+    char path[512];
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    hash = boot_hash_bytes(hash, BOOT_CACHE_BUILD, strlen(BOOT_CACHE_BUILD));
+    hash = boot_hash_bytes(hash, &org, sizeof(org));
+    hash = boot_hash_bytes(hash, hex, strlen(hex));
+    for (int i = 0; i < 4; i++) {
+        if (get_disk_path(path, sizeof(path), files[i])) {
+            hash = boot_hash_file(hash, path);
+        }
+    }
+    return hash;
+}
+
+// The guest waits for a line after printing a prompt such as "A>"
+static int boot_at_prompt(void) {
+    return (cpm_console.waiting_for_input || cpm_idle_flag()) && cpm_term.col > 0 &&
+           cpm_term.cells[cpm_term.row][cpm_term.col - 1] == '>';
+}
+
+// Remove snapshots of other boot code or disks
+static void boot_cache_prune(const char *cache_dir, const char *keep) {
+    char path[600];
+    DIR *dir = opendir(cache_dir);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "boot-", 5) != 0 || len < 9 || strcmp(entry->d_name + len - 4, ".sav") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        if (strcmp(path, keep) != 0) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Bring the machine up at the CP/M prompt: restored from the snapshot for
+// this boot code and these disks when there is one, else by a cold boot that
+// then fills the cache (NULL cache_dir: always a plain cold start). Returns 1
+// when the machine came from the cache. May be called on a background thread
+// as long as nothing else touches the machine until it returns.
+int cpm_boot_cached(const char *hex, unsigned int org, const char *cache_dir) {
+    char path[600];
+    cpm_disk_flush();
+    unsigned long long key = boot_cache_key(hex, org);
+    int cacheable = cache_dir &&
+        snprintf(path, sizeof(path), "%s/boot-%016llx.sav", cache_dir, key) < (int)sizeof(path);
+    if (cacheable && machine_restore_file(path, RESTORE_MATCHING)) {
+        printf("[Boot] Restored from %s\n", path);
+        fflush(stdout);
+        return 1;
+    }
+
+    codereset();
+    codeload(hex, org);
+    cpu_set_pc(org);
+    if (!cacheable) {
+        return 0;
+    }
+    unsigned long long start = cpu_cycles;
+    struct timespec began, now;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    long elapsed_ms = 0;
+    while (cpu_cycles - start < BOOT_CACHE_MAX_CYCLES && elapsed_ms < BOOT_CACHE_MAX_MS) {
+        int reason = cpu_run(BOOT_CACHE_SLICE_CYCLES);
+        if ((reason != RUN_BUDGET && reason != RUN_IDLE) || boot_at_prompt()) {
+            break;
+        }
+        if (reason == RUN_IDLE) {
+            cpm_idle_set_flag(0);  // Polling without a prompt yet, e.g. a delay loop
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - began.tv_sec) * 1000 + (now.tv_nsec - began.tv_nsec) / 1000000;
+    }
+    if (!boot_at_prompt()) {
+        printf("[Boot] No prompt after %llu cycles (%ld ms), not cached\n", cpu_cycles - start, elapsed_ms);
+        fflush(stdout);
+        return 0;
+    }
+    // Booted through its BIOS: serve the vector it set up natively
+    hle_install_page_zero_bios();
+    cpm_disk_flush();
+    if (boot_cache_key(hex, org) != key) {
+        printf("[Boot] Boot wrote to its disks, not cached\n");
+        fflush(stdout);
+        return 0;
+    }
+    // Stored uncompressed: restoring it is then little more than a read
+    if (cpm_machine_save_file(path, 0)) {
+        boot_cache_prune(cache_dir, path);
+        printf("[Boot] Cached the machine at the prompt in %s\n", path);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// ============================================================================
+// MACHINE FORKING
+// ============================================================================
+//
+// cpm_machine_fork makes a child that starts exactly where its parent is and
+// shares the parent's RAM and disk pages copy-on-write, so one warmed-up
+// machine can fan out into thousands of runs without booting or copying.
+//
+// RAM: the parent's 64KB is frozen into an unlinked temporary file (a
+// template) and each child maps it private, so the kernel copies a page
+// (4KB, 16KB on Apple silicon) on the child's first write to it. Later forks
+// reuse the template while the parent's memory still matches it.
+// Disks: the child takes a reference to each 4KB page of the parent's drives
+// and whichever side writes to a shared page first copies it.
+//
+// A child has no disk files (its drives live in memory), LST:/PUN:/RDR:
+// routing, script or event registration. Mapped host directories, and files
+// open in them, are inherited. Fork a machine only while it is not running.
+
+typedef struct ram_template {
+    int fd;
+    int refs;                          // Machines mapping it, plus the one it was frozen from
+    const unsigned char *view;         // Read-only mapping, to compare against
+} ram_template_t;
+
+static void ram_template_release(ram_template_t *ram) {
+    if (ram && __atomic_sub_fetch(&ram->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap((void *)ram->view, 0x10000);
+        close(ram->fd);
+        free(ram);
+    }
+}
+
+static ram_template_t* ram_template_create(const unsigned char *memory) {
+    char path[600];
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/cpm-ram-XXXXXX", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("[Fork] ERROR: Cannot create RAM template in %s (%s)\n", path, strerror(errno));
+        fflush(stdout);
+        return NULL;
+    }
+    unlink(path);
+    ram_template_t *ram = calloc(1, sizeof(ram_template_t));
+    void *view = MAP_FAILED;
+    if (ram && pwrite(fd, memory, 0x10000, 0) == 0x10000) {
+        view = mmap(NULL, 0x10000, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (view == MAP_FAILED) {
+        free(ram);
+        close(fd);
+        return NULL;
+    }
+    ram->fd = fd;
+    ram->refs = 1;
+    ram->view = view;
+    return ram;
+}
+
+// A reference to a template holding the machine's current memory
+static ram_template_t* ram_template_of(machine_t *machine) {
+    ram_template_t *ram = machine->ram_template;
+    if (!ram || memcmp(ram->view, machine->memory, 0x10000) != 0) {
+        ram = ram_template_create(machine->memory);
+        if (!ram) {
+            return NULL;
+        }
+        ram_template_release(machine->ram_template);
+        machine->ram_template = ram;
+    }
+    __atomic_add_fetch(&ram->refs, 1, __ATOMIC_RELAXED);
+    return ram;
+}
+
+// Copy-on-write child of parent (NULL = the default machine), or NULL
+machine_t* cpm_machine_fork(machine_t *parent)
+{
+    parent = parent ? parent : &cpm_default_machine;
+    machine_t *child = machine_alloc();
+    if (!child) {
+        return NULL;
+    }
+    ram_template_t *ram = ram_template_of(parent);
+    void *memory = ram ? mmap(NULL, 0x10000, PROT_READ | PROT_WRITE, MAP_PRIVATE, ram->fd, 0) : MAP_FAILED;
+    if (memory == MAP_FAILED) {
+        ram_template_release(ram);
+        cpm_machine_destroy(child);
+        printf("[Fork] ERROR: Cannot map the parent's memory\n");
+        fflush(stdout);
+        return NULL;
+    }
+    child->memory = memory;
+    child->memory_mapped = 1;
+    child->ram_template = ram;
+
+    child->cpu = parent->cpu;
+    child->cycles = parent->cycles;
+    child->hle = parent->hle;
+    child->disk = parent->disk;
+    child->term = parent->term;
+    child->console = parent->console;
+    child->console.output_ring = NULL;
+    child->console.output_size = 0;
+    child->console.output_read = child->console.output_write = 0;
+    child->console.burst_len = 0;
+
+    machine_t *previous = cpm_machine_select(parent);
+    const sparse_disk_t *drives[2] = { &disk_a, &disk_b };
+    int loaded[2] = { disk_a_loaded, disk_b_loaded };
+    cpm_machine_select(child);
+    sparse_share(&disk_a, drives[0]);
+    sparse_share(&disk_b, drives[1]);
+    disk_a_loaded = loaded[0];
+    disk_b_loaded = loaded[1];
+    for (size_t done = parent->console.output_read; done != parent->console.output_write; ) {
+        size_t at = done & (parent->console.output_size - 1);
+        size_t span = parent->console.output_size - at;
+        if (span > parent->console.output_write - done) {
+            span = parent->console.output_write - done;
+        }
+        console_output_append(parent->console.output_ring + at, span);
+        done += span;
+    }
+    cpm_machine_select(previous);
+
+    for (int drive = 0; drive < CPM_MAX_DRIVES; drive++) {
+        child->host.type[drive] = parent->host.type[drive];
+        if (parent->host.type[drive] == DRIVE_HOST) {
+            memcpy(child->host.path[drive], parent->host.path[drive], sizeof(child->host.path[drive]));
+        }
+    }
+    for (int i = 0; i < CPM_HOST_MAX_FILES; i++) {
+        const host_file_t *open_file = &parent->host.files[i];
+        int fd = open_file->in_use ? dup(open_file->fd) : -1;
+        unsigned char *ra_buf = fd >= 0 ? malloc(CPM_HOST_READAHEAD) : NULL;
+        if (!ra_buf && fd >= 0) {
+            close(fd);
+        }
+        if (ra_buf) {
+            host_file_t *file = &child->host.files[i];
+            file->in_use = 1;
+            file->fd = fd;
+            file->ra_buf = ra_buf;
+            file->drive = open_file->drive;
+            memcpy(file->name, open_file->name, sizeof(file->name));
+        }
+    }
+    return child;
+}
+
+// ============================================================================
+// RECORD AND REPLAY
+// ============================================================================
+
+// A recording is a save state followed by every input the guest could not
+// have worked out for itself, each stamped with the cycle count at which it
+// reached the machine. Replaying restores the state and hands the inputs
+// back at the same cycles, so the run repeats exactly and at full speed.
+//
+//   "C8080REC" version:le16 flags:le16 state_length:le32 state events
+//
+// An event is a varint of (cycles since the previous event << 3 | kind)
+// and its payload. Console bytes and interrupts arrive between
+// instructions and are injected when the clock reaches them; host drive
+// calls and paper tape reads are answered from the log when the guest makes
+// them. While recording, input from other threads is queued and stamped by
+// the CPU thread at its next step, so every stamp is a cycle the guest
+// reaches and the log is only ever written by one thread.
+
+#define REPLAY_MAGIC "C8080REC"
+#define REPLAY_VERSION 2
+#define REPLAY_HEADER_SIZE 16
+
+static void replay_finish(int mode, const char *why) {
+    cpm_replay.mode = mode;
+    cpm_replay.due = ~0ULL;
+    printf("[Replay] %s at %llu cycles\n", why, cpu_cycles);
+    fflush(stdout);
+}
+
+static void record_event(int kind, const unsigned char *payload, size_t len) {
+    if (cpm_replay.mode != REPLAY_RECORDING) {
+        return;
+    }
+    if (cpm_replay.size - cpm_replay.used < 10 + len) {
+        size_t size = cpm_replay.size * 2 + 10 + len;
+        unsigned char *log = realloc(cpm_replay.log, size);
+        if (!log) {
+            replay_finish(REPLAY_OFF, "ERROR: Out of memory, recording stopped");
+            return;
+        }
+        cpm_replay.log = log;
+        cpm_replay.size = size;
+    }
+    unsigned long long value = ((cpu_cycles - cpm_replay.last) << 3) | (unsigned int)kind;
+    cpm_replay.last = cpu_cycles;
+    unsigned char *out = cpm_replay.log + cpm_replay.used;
+    do {
+        *out++ = (unsigned char)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+        value >>= 7;
+    } while (value);
+    memcpy(out, payload, len);
+    cpm_replay.used = (size_t)(out - cpm_replay.log) + len;
+}
+
+// Decode the next event into kind, payload and due
+static void replay_next(void) {
+    const unsigned char *log = cpm_replay.log;
+    size_t at = cpm_replay.pos;
+    unsigned long long value = 0;
+    int shift = 0;
+    unsigned char byte = 0x80;
+    while ((byte & 0x80) && at < cpm_replay.used && shift < 64) {
+        byte = log[at++];
+        value |= (unsigned long long)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    int kind = (int)(value & 7);
+    size_t len = 0;
+    if (kind == REPLAY_EVENT_KEY || kind == REPLAY_EVENT_TRIGGER || kind == REPLAY_EVENT_READER) {
+        len = 1;
+    } else if (kind == REPLAY_EVENT_HOST_CALL) {
+        len = HOST_CALL_RECORD;
+    }
+    if ((byte & 0x80) || kind > REPLAY_EVENT_END || cpm_replay.used - at < len) {
+        replay_finish(REPLAY_DIVERGED, "ERROR: Log is damaged");
+        return;
+    }
+    cpm_replay.kind = kind;
+    cpm_replay.payload = log + at;
+    cpm_replay.pos = at + len;
+    cpm_replay.last += value >> 3;
+
+    // A read is due during the step that starts at its stamp; once the
+    // clock is past that the guest has gone somewhere else
+    int asked = (kind == REPLAY_EVENT_HOST_CALL || kind == REPLAY_EVENT_READER);
+    cpm_replay.due = cpm_replay.last + (asked ? 1 : 0);
+}
+
+// Host thread, while recording: hand a key or interrupt to the CPU thread.
+// Returns 0 when not recording.
+static int record_queue_input(int kind, unsigned char value) {
+    if (cpm_replay.mode != REPLAY_RECORDING) {
+        return 0;
+    }
+    pthread_mutex_lock(&cpm_idle.lock);
+    int queued = cpm_replay.queued_count < 256;
+    if (queued) {
+        cpm_replay.queued[cpm_replay.queued_count][0] = (unsigned char)kind;
+        cpm_replay.queued[cpm_replay.queued_count][1] = value;
+        cpm_replay.queued_count++;
+        if (kind == REPLAY_EVENT_KEY) {
+            cpm_console.waiting_for_input = 0;
+        }
+        __atomic_store_n(&cpm_replay.due, 0, __ATOMIC_RELAXED);  // Next step delivers it
+    }
+    pthread_mutex_unlock(&cpm_idle.lock);
+    if (!queued) {
+        printf("[Replay] Host input is arriving faster than the machine runs, dropped\n");
+        fflush(stdout);
+    }
+    cpm_idle_wake();
+    return 1;
+}
+
+// CPU thread: log queued host input at the current cycle and deliver it
+static void record_deliver_input(void) {
+    unsigned char queued[256][2];
+    pthread_mutex_lock(&cpm_idle.lock);
+    int count = cpm_replay.queued_count;
+    memcpy(queued, cpm_replay.queued, (size_t)count * 2);
+    cpm_replay.queued_count = 0;
+    __atomic_store_n(&cpm_replay.due, ~0ULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cpm_idle.lock);
+    for (int i = 0; i < count; i++) {
+        record_event(queued[i][0], &queued[i][1], 1);
+        if (queued[i][0] == REPLAY_EVENT_KEY) {
+            console_enqueue(queued[i][1]);
+        } else {
+            interrupt_raise(queued[i][1]);
+        }
+    }
+}
+
+// Called before a step once the clock reaches the next event
+static void replay_feed(void) {
+    if (cpm_replay.mode == REPLAY_RECORDING) {
+        record_deliver_input();
+        return;
+    }
+    while (cpm_replay.mode == REPLAY_PLAYING && cpu_cycles >= cpm_replay.due) {
+        switch (cpm_replay.kind) {
+            case REPLAY_EVENT_KEY:
+                console_enqueue(cpm_replay.payload[0]);
+                break;
+            case REPLAY_EVENT_TRIGGER:
+                interrupt_raise(cpm_replay.payload[0]);
+                break;
+            case REPLAY_EVENT_INTERRUPT:
+                interrupt_take();
+                break;
+            case REPLAY_EVENT_END:
+                replay_finish(REPLAY_DONE, "Finished");
+                return;
+            default:
+                replay_finish(REPLAY_DIVERGED, "ERROR: Diverged, a recorded read never came");
+                return;
+        }
+        replay_next();
+    }
+}
+
+// Answer a read from the log. Returns 1 with the payload copied out, 0 when
+// not replaying (or when the guest no longer matches the recording).
+static int replay_take(int kind, unsigned char *payload) {
+    if (cpm_replay.mode != REPLAY_PLAYING) {
+        return 0;
+    }
+    if (cpm_replay.kind != kind || cpm_replay.last != cpu_cycles) {
+        replay_finish(REPLAY_DIVERGED, "ERROR: Diverged, unexpected read");
+        return 0;
+    }
+    memcpy(payload, cpm_replay.payload, (size_t)(cpm_replay.log + cpm_replay.pos - cpm_replay.payload));
+    replay_next();
+    return 1;
+}
+
+// Start recording from the current machine state
+int cpm_record_start(void) {
+    size_t length = 0;
+    if (cpm_replay.mode == REPLAY_PLAYING) {
+        return 0;
+    }
+    unsigned char *state = cpm_machine_save(&length, CPM_SAVE_COMPRESS);
+    unsigned char *log = state ? malloc(REPLAY_HEADER_SIZE + length + 4096) : NULL;
+    if (!log) {
+        free(state);
+        return 0;
+    }
+    memcpy(log, REPLAY_MAGIC, 8);
+    put_le16(log + 8, REPLAY_VERSION);
+    put_le16(log + 10, 0);
+    put_le32(log + 12, (unsigned int)length);
+    memcpy(log + REPLAY_HEADER_SIZE, state, length);
+    free(state);
+
+    free(cpm_replay.log);
+    cpm_replay.log = log;
+    cpm_replay.used = REPLAY_HEADER_SIZE + length;
+    cpm_replay.size = REPLAY_HEADER_SIZE + length + 4096;
+    cpm_replay.last = cpu_cycles;
+    cpm_replay.due = ~0ULL;
+    cpm_replay.mode = REPLAY_RECORDING;
+    printf("[Replay] Recording from %llu cycles\n", cpu_cycles);
+    fflush(stdout);
+    return 1;
+}
+
+// Stop recording and return the log (the caller frees it)
+unsigned char* cpm_record_stop(size_t *length) {
+    if (cpm_replay.mode != REPLAY_RECORDING) {
+        return NULL;
+    }
+    record_deliver_input();
+    record_event(REPLAY_EVENT_END, NULL, 0);
+    if (cpm_replay.mode != REPLAY_RECORDING) {
+        return NULL;
+    }
+    unsigned char *log = cpm_replay.log;
+    *length = cpm_replay.used;
+    printf("[Replay] Recorded %zu bytes over %llu cycles\n", cpm_replay.used, cpu_cycles);
+    fflush(stdout);
+    memset(&cpm_replay, 0, sizeof(cpm_replay));
+    cpm_replay.due = ~0ULL;
+    return log;
+}
+
+// Restore the recording's starting state and arm the replay. Host input
+// (cpm_put_char, trigger_interrupt, process_interrupt) is ignored until it
+// finishes. The recording's drives stay in memory: A.DSK and B.DSK are
+// neither overwritten nor written through while it plays.
+int cpm_replay_start(const unsigned char *log, size_t length) {
+    int ok = log && length >= REPLAY_HEADER_SIZE && memcmp(log, REPLAY_MAGIC, 8) == 0 &&
+             get_le16(log + 8) == REPLAY_VERSION;
+    size_t state = ok ? get_le32(log + 12) : 0;
+    if (!ok || state > length - REPLAY_HEADER_SIZE) {
+        printf("[Replay] ERROR: Not a version %d recording\n", REPLAY_VERSION);
+        fflush(stdout);
+        return 0;
+    }
+    size_t events = length - REPLAY_HEADER_SIZE - state;
+    unsigned char *copy = malloc(events ? events : 1);
+    if (!copy || !machine_restore(log + REPLAY_HEADER_SIZE, state, RESTORE_DETACH)) {
+        free(copy);
+        return 0;
+    }
+    memcpy(copy, log + REPLAY_HEADER_SIZE + state, events);
+    free(cpm_replay.log);
+    cpm_replay.log = copy;
+    cpm_replay.used = events;
+    cpm_replay.size = events;
+    cpm_replay.pos = 0;
+    cpm_replay.last = cpu_cycles;
+    cpm_replay.mode = REPLAY_PLAYING;
+    printf("[Replay] Playing %zu bytes of events from %llu cycles\n", events, cpu_cycles);
+    fflush(stdout);
+    replay_next();
+    return cpm_replay.mode == REPLAY_PLAYING;
+}
+
+// Run the replay for up to max_cycles, straight through input waits and
+// idle polling; breakpoints and watchpoints stop it early. Returns the
+// replay status.
+int cpm_replay_run(unsigned long long max_cycles) {
+    unsigned long long stop = cpu_cycles + max_cycles;
+    while (cpm_replay.mode == REPLAY_PLAYING && cpu_cycles < stop) {
+        if (cpu_cycles >= cpm_replay.due) {
+            replay_feed();
+            continue;
+        }
+        int reason = cpu_run((cpm_replay.due < stop ? cpm_replay.due : stop) - cpu_cycles);
+        if (reason == RUN_BREAKPOINT || reason == RUN_WATCHPOINT) {
+            break;
+        } else if (reason == RUN_IDLE) {
+            cpm_idle_set_flag(0);
+        }
+    }
+    return cpm_replay.mode;
+}
+
+int cpm_replay_status(void) {
+    return cpm_replay.mode;
+}
+
+// Abandon a recording or replay; the machine carries on live from here
+void cpm_replay_stop(void) {
+    free(cpm_replay.log);
+    memset(&cpm_replay, 0, sizeof(cpm_replay));
+    cpm_replay.due = ~0ULL;
+}
+
+// ============================================================================
+// BREAKPOINTS AND WATCHPOINTS
+// ============================================================================
+
+// Breakpoints are a bitmap over the address space, tested after each step
+// only while something is set. Watchpoints mark their 256-byte pages so
+// MemRead and MemWrite look at the ranges only on watched pages. Either
+// stops cpu_run after the step, with the reason and PC in
+// cpm_debug_last_stop. Guest memory written directly by traps (DMA, FCBs)
+// does not fire watchpoints.
+
+static void debug_rearm(void) {
+    memset(cpm_debug.watch_page, 0, sizeof(cpm_debug.watch_page));
+    for (int i = 0; i < cpm_debug.watches; i++) {
+        const watch_range_t *w = &cpm_debug.watch[i];
+        for (unsigned int page = w->start >> 8; page <= w->end >> 8; page++) {
+            cpm_debug.watch_page[page] |= (unsigned char)w->flags;
+        }
+    }
+    if (cpm_debug.breakpoints > 0 || cpm_debug.watches > 0) {
+        __atomic_fetch_or(&cpm_debug.armed, DEBUG_ARMED_BREAKS, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&cpm_debug.armed, ~DEBUG_ARMED_BREAKS, __ATOMIC_RELAXED);
+    }
+    watch_page = cpm_debug.watch_page;
+}
+
+static int watch_match(unsigned int address, int access) {
+    if (!(cpm_debug.watch_page[(address >> 8) & 0xFF] & access)) {
+        return 0;
+    }
+    for (int i = 0; i < cpm_debug.watches; i++) {
+        const watch_range_t *w = &cpm_debug.watch[i];
+        if ((w->flags & access) && address >= w->start && address <= w->end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A watched page was accessed; note the first match of the step
+static void watch_hit(unsigned int address, int access) {
+    if (!cpm_debug.hit && watch_match(address, access)) {
+        cpm_debug.hit = 1;
+        cpm_debug.stop_pc = cpm_machine->cpu.prog_ctr;
+        cpm_debug.stop_address = address;
+        cpm_debug.stop_access = access;
+    }
+}
+
+// A step hit a watchpoint or reached a breakpoint, or the debugger wants
+// the machine: note which
+static int debug_stop(void) {
+    if (cpm_debug.attention) {
+        return RUN_DEBUGGER;
+    }
+    if (cpm_debug.hit) {
+        cpm_debug.hit = 0;
+        cpm_debug.stop = RUN_WATCHPOINT;
+        return RUN_WATCHPOINT;
+    }
+    cpm_debug.stop = RUN_BREAKPOINT;
+    cpm_debug.stop_pc = cpm_machine->cpu.prog_ctr;
+    cpm_debug.stop_address = cpm_debug.stop_pc;
+    cpm_debug.stop_access = 0;
+    return RUN_BREAKPOINT;
+}
+
+// Stop before executing the instruction at address
+int cpm_break_set(unsigned int address) {
+    address &= 0xFFFF;
+    unsigned char bit = (unsigned char)(1 << (address & 7));
+    if (!(cpm_debug.breakpoint[address >> 3] & bit)) {
+        cpm_debug.breakpoint[address >> 3] |= bit;
+        cpm_debug.breakpoints++;
+        debug_rearm();
+    }
+    return 1;
+}
+
+int cpm_break_clear(unsigned int address) {
+    address &= 0xFFFF;
+    unsigned char bit = (unsigned char)(1 << (address & 7));
+    if (!(cpm_debug.breakpoint[address >> 3] & bit)) {
+        return 0;
+    }
+    cpm_debug.breakpoint[address >> 3] &= (unsigned char)~bit;
+    cpm_debug.breakpoints--;
+    debug_rearm();
+    return 1;
+}
+
+void cpm_break_clear_all(void) {
+    memset(cpm_debug.breakpoint, 0, sizeof(cpm_debug.breakpoint));
+    cpm_debug.breakpoints = 0;
+    debug_rearm();
+}
+
+// Stop after an instruction that reads or writes (flags) start..end inclusive
+int cpm_watch_add(unsigned int start, unsigned int end, int flags) {
+    flags &= WATCH_READ | WATCH_WRITE;
+    if (!flags || start > end || end > 0xFFFF || cpm_debug.watches == DEBUG_MAX_WATCHES) {
+        return 0;
+    }
+    watch_range_t *w = &cpm_debug.watch[cpm_debug.watches++];
+    w->start = start;
+    w->end = end;
+    w->flags = flags;
+    debug_rearm();
+    return 1;
+}
+
+int cpm_watch_remove(unsigned int start, unsigned int end) {
+    for (int i = 0; i < cpm_debug.watches; i++) {
+        if (cpm_debug.watch[i].start == start && cpm_debug.watch[i].end == end) {
+            cpm_debug.watch[i] = cpm_debug.watch[--cpm_debug.watches];
+            debug_rearm();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void cpm_watch_clear_all(void) {
+    cpm_debug.watches = 0;
+    debug_rearm();
+}
+
+// Why the last run stopped for the debugger (0 if it never did), the PC of
+// the instruction, and for a watchpoint the address and access
+int cpm_debug_last_stop(unsigned int *pc, unsigned int *address, int *access) {
+    *pc = cpm_debug.stop_pc;
+    *address = cpm_debug.stop_address;
+    *access = cpm_debug.stop_access;
+    return cpm_debug.stop;
+}
+
+// ============================================================================
+// REVERSE EXECUTION
+// ============================================================================
+
+// While history is on, every step keeps the CPU state it started from and
+// MemWrite keeps the byte it overwrote, in two bounded rings. Stepping
+// backwards puts the bytes back, newest first, and restores the CPU; when a
+// ring fills, the oldest steps are forgotten.
+//
+// Traps and CALL 0005h write guest memory directly, so such a step copies
+// the FCB at DE and the DMA record first and logs whatever changed there
+// afterwards. Sector reads and BDOS 10 line input log their own writes, and
+// the steps a line input spends suspended are not recorded at all: undoing
+// the call undoes the whole line. Only the CPU and memory go backwards:
+// console, disk and host files stay as they are, and changes made from the
+// host between steps are not recorded.
+
+#define HISTORY_DEFAULT_STEPS (1u << 20)
+#define HISTORY_WRITES_PER_STEP 2
+
+static void history_log(unsigned int address, unsigned char old) {
+    history_state *h = &cpm_history;
+    if (h->write_next - h->write_first > h->write_mask) {
+        // Full: forget the oldest steps until their writes free a slot
+        while (h->step_next - h->step_first > 1 && h->write_next - h->write_first > h->write_mask) {
+            h->step_first++;
+            h->write_first = h->steps[h->step_first & h->step_mask].first_write;
+        }
+        if (h->write_next - h->write_first > h->write_mask) {
+            // One step wrote more than the ring holds; it can't be undone
+            h->step_first = h->step_next;
+            h->write_first = h->write_next;
+        }
+    }
+    history_write_t *w = &h->writes[h->write_next++ & h->write_mask];
+    w->address = (unsigned short)address;
+    w->old = old;
+}
+
+static void history_write(unsigned int address) {
+    history_log(address, mem[address]);
+}
+
+// Log what the last trap wrote
+static void history_settle(void) {
+    history_state *h = &cpm_history;
+    if (!h->trap_pending) {
+        return;
+    }
+    h->trap_pending = 0;
+    for (unsigned int i = 0; i < sizeof(h->before); i++) {
+        unsigned int a = (i < HISTORY_TRAP_FCB ? h->trap_fcb + i : h->trap_dma + i - HISTORY_TRAP_FCB) & 0xFFFF;
+        if (h->before[i] != mem[a]) {
+            history_log(a, h->before[i]);
+        }
+    }
+}
+
+static void history_begin(struct i8080 *cpu) {
+    history_state *h = &cpm_history;
+    history_settle();
+    if (h->step_next - h->step_first > h->step_mask) {
+        h->step_first++;
+        h->write_first = h->steps[h->step_first & h->step_mask].first_write;
+    }
+    history_step_t *step = &h->steps[h->step_next++ & h->step_mask];
+    step->cpu = *cpu;
+    step->cycles = cpu_cycles;
+    step->first_write = h->write_next;
+
+    unsigned int p = cpu->prog_ctr;
+    int bdos_call = (mem[p] & 0xCF) == 0xCD && mem[(p + 1) & 0xFFFF] == 0x05 && mem[(p + 2) & 0xFFFF] == 0x00;
+    if ((bdos_call || hle_trapped(p)) && (cpu->reg)[C] != 10) {
+        h->trap_fcb = 0x100 * (cpu->reg)[D] + (cpu->reg)[E];
+        h->trap_dma = cpm_disk.dma_address & 0xFFFF;
+        for (unsigned int i = 0; i < sizeof(h->before); i++) {
+            h->before[i] = mem[(i < HISTORY_TRAP_FCB ? h->trap_fcb + i : h->trap_dma + i - HISTORY_TRAP_FCB) & 0xFFFF];
+        }
+        h->trap_pending = 1;
+    }
+}
+
+// Forget everything recorded so far, e.g. after a reset or restore
+static void history_clear(void) {
+    history_state *h = &cpm_history;
+    h->trap_pending = 0;
+    h->step_first = h->step_next;
+    h->write_first = h->write_next;
+}
+
+void cpm_history_stop(void) {
+    history_state *h = &cpm_history;
+    free(h->steps);
+    free(h->writes);
+    memset(h, 0, sizeof(*h));
+    history_recording = 0;
+}
+
+// Start keeping history of up to steps instructions (0 for the default)
+int cpm_history_start(unsigned int steps) {
+    unsigned int size = 1;
+    while (size < (steps ? steps : HISTORY_DEFAULT_STEPS) && size < (1u << 30)) {
+        size <<= 1;
+    }
+    cpm_history_stop();
+    history_state *h = &cpm_history;
+    h->steps = malloc(sizeof(history_step_t) * size);
+    h->writes = malloc(sizeof(history_write_t) * size * HISTORY_WRITES_PER_STEP);
+    if (!h->steps || !h->writes) {
+        cpm_history_stop();
+        printf("[History] ERROR: Out of memory for %u steps\n", size);
+        fflush(stdout);
+        return 0;
+    }
+    h->step_mask = size - 1;
+    h->write_mask = size * HISTORY_WRITES_PER_STEP - 1;
+    history_recording = 1;
+    printf("[History] Keeping the last %u steps (%zu KB)\n", size,
+           (sizeof(history_step_t) + sizeof(history_write_t) * HISTORY_WRITES_PER_STEP) * size / 1024);
+    fflush(stdout);
+    return 1;
+}
+
+// Number of steps that can be undone
+unsigned int cpm_history_depth(void) {
+    history_settle();
+    return (unsigned int)(cpm_history.step_next - cpm_history.step_first);
+}
+
+// Undo the last step. Returns 0 when there is no history left.
+int cpm_reverse_step(void) {
+    history_state *h = &cpm_history;
+    history_settle();
+    if (h->step_next == h->step_first) {
+        return 0;
+    }
+    const history_step_t *step = &h->steps[--h->step_next & h->step_mask];
+    while (h->write_next > step->first_write) {
+        const history_write_t *w = &h->writes[--h->write_next & h->write_mask];
+        mem[w->address] = w->old;
+    }
+    cpm_machine->cpu = step->cpu;
+    cpu_cycles = step->cycles;
+    cpm_events.halted = 0;
+    return 1;
+}
+
+// Step backwards until about to execute the instruction at pc or at a
+// breakpoint, or until undoing a step that wrote address or hit a write
+// watchpoint (pc and address may be -1). Returns 1 when it stopped there,
+// 0 when the history ran out first.
+int cpm_reverse_continue(int pc, int address) {
+    history_state *h = &cpm_history;
+    history_settle();
+    while (h->step_next != h->step_first) {
+        const history_step_t *step = &h->steps[(h->step_next - 1) & h->step_mask];
+        unsigned int at = step->cpu.prog_ctr;
+        int stop = (int)at == pc || (cpm_debug.breakpoint[at >> 3] & (1 << (at & 7)));
+        for (unsigned long long i = step->first_write; i < h->write_next && !stop; i++) {
+            unsigned int written = h->writes[i & h->write_mask].address;
+            stop = (int)written == address || watch_match(written, WATCH_WRITE);
+        }
+        cpm_reverse_step();
+        if (stop) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Find the step that last wrote address. Returns 1 with its PC and cycle
+// count, 0 when no step in the history wrote it.
+int cpm_history_last_writer(unsigned int address, unsigned int *pc, unsigned long long *cycles) {
+    history_state *h = &cpm_history;
+    history_settle();
+    unsigned long long w = h->write_next;
+    while (w > h->write_first && h->writes[(w - 1) & h->write_mask].address != (address & 0xFFFF)) {
+        w--;
+    }
+    if (w == h->write_first) {
+        return 0;
+    }
+    w--;
+
+    // The writer is the last step whose writes start at or before w
+    unsigned long long lo = h->step_first, hi = h->step_next - 1;
+    while (lo < hi) {
+        unsigned long long mid = lo + (hi - lo + 1) / 2;
+        if (h->steps[mid & h->step_mask].first_write <= w) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    const history_step_t *step = &h->steps[lo & h->step_mask];
+    *pc = step->cpu.prog_ctr;
+    *cycles = step->cycles;
+    return 1;
+}
+
+// ============================================================================
+// GDB REMOTE STUB
+// ============================================================================
+
+// Speaks the GDB remote serial protocol on a TCP or Unix socket, for one
+// debugger at a time on one machine. A thread of its own reads the socket;
+// the machine runs at full speed, with nothing extra to check per step,
+// until a packet arrives. The thread then raises attention and arms the
+// step check, so the machine's next step in cpu_run or codestep stops in
+// gdb_service on the thread that runs it, which answers packets until the
+// debugger continues. Breakpoint and watchpoint hits stop in gdb_service
+// the same way instead of returning from cpu_run. Replies and acks are
+// written under the lock, and only the reader closes the connection, also
+// under the lock.
+//
+// Registers are the 16-bit pairs AF, BC, DE, HL, SP and PC (numbers 0-5),
+// little-endian, with F built from the flags as PUSH PSW does.
+
+#define GDB_PACKET_SIZE 1024
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+
+typedef struct {
+    int listen_fd;
+    int fd;                            // The debugger's connection, or -1
+    int wake[2];                       // Tells the thread to stop
+    pthread_t thread;
+    int running;
+    machine_t *machine;                // The machine being debugged
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char packet[GDB_PACKET_SIZE];      // Received, for the machine's thread
+    int packet_ready;
+    int no_ack;                        // Under the lock: set by the machine, read by the reader
+} gdb_stub_t;
+
+static gdb_stub_t gdb_stub = {
+    .listen_fd = -1,
+    .fd = -1,
+    .wake = { -1, -1 },
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+// Listen on "unix:path" or "[host:]port" (loopback unless a host is given)
+static int socket_listen(const char *spec, int nonblocking) {
+    int fd;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(spec + 5) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, spec + 5);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            goto fail;
+        }
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        const char *colon = strrchr(spec, ':');
+        if (colon) {
+            char host[64];
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+            if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+                errno = EINVAL;
+                return -1;
             }
-#endif
-            return !(cpu->iszero) ? da : p+3;
+        }
+        addr.sin_port = htons((unsigned short)atoi(colon ? colon + 1 : spec));
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            goto fail;
+        }
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if ((!nonblocking || fcntl(fd, F_SETFL, O_NONBLOCK) == 0) && listen(fd, 512) == 0) {
+        return fd;
+    }
+fail:
+    if (fd >= 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
 
-        case 0xd2: return !(cpu->carry)  ? da : p+3;//JNC
-        case 0xe2: return !(cpu->parity) ? da : p+3;//JPO
-        case 0xf2: return !(cpu->sign)   ? da : p+3;//JP
-        case 0xca: return  (cpu->iszero) ? da : p+3;//JZ
-        case 0xda: return  (cpu->carry)  ? da : p+3;//JC
-        case 0xea: return  (cpu->parity) ? da : p+3;//JPE
-        case 0xfa: return  (cpu->sign)   ? da : p+3;//JM
-        case 0xe9: return 0x100*(cpu->reg)[H]+(cpu->reg)[L];//PCHL
-            //Calls
-        case 0xcd:
-        case 0xdd:
-        case 0xed:
-        case 0xfd: {
-            // CP/M BDOS call trap
-            if (da == 0x0005) {
-                cpm_bdos_call(cpu);
-                // If waiting for input, don't advance PC (retry the CALL)
-                if (cpm_console.waiting_for_input) {
-                    return p;  // Retry this CALL instruction
-                }
-                return p+3; // Skip the CALL, act like it returned
+
+static const char gdb_hex_digits[] = "0123456789abcdef";
+
+static int gdb_hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char)tolower((unsigned char)c);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static void gdb_put_hex8(char *out, unsigned int value) {
+    out[0] = gdb_hex_digits[(value >> 4) & 0xF];
+    out[1] = gdb_hex_digits[value & 0xF];
+}
+
+// A register pair as four hex digits, low byte first
+static void gdb_put_reg(char *out, unsigned int value) {
+    gdb_put_hex8(out, value & 0xFF);
+    gdb_put_hex8(out + 2, (value >> 8) & 0xFF);
+}
+
+static unsigned int gdb_get_reg(const char *in) {
+    unsigned int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = gdb_hex_value(in[i]);
+        if (digit < 0) {
+            return value;
+        }
+        value |= (unsigned int)digit << ((i >> 1) * 8 + ((i & 1) ? 0 : 4));
+    }
+    return value;
+}
+
+static unsigned int gdb_read_pair(int number) {
+    struct i8080 *cpu = &cpm_machine->cpu;
+    switch (number) {
+        case 0: {
+            unsigned int flags = cpu->carry + 0x02 + 0x04 * cpu->parity + 0x10 * cpu->aux_carry +
+                                 0x40 * cpu->iszero + 0x80 * cpu->sign;
+            return (cpu->reg[A] << 8) | flags;
+        }
+        case 1: return (cpu->reg[B] << 8) | cpu->reg[C];
+        case 2: return (cpu->reg[D] << 8) | cpu->reg[E];
+        case 3: return (cpu->reg[H] << 8) | cpu->reg[L];
+        case 4: return cpu->stack_ptr & 0xFFFF;
+        default: return cpu->prog_ctr & 0xFFFF;
+    }
+}
+
+static void gdb_write_pair(int number, unsigned int value) {
+    struct i8080 *cpu = &cpm_machine->cpu;
+    unsigned char high = (unsigned char)(value >> 8), low = (unsigned char)value;
+    switch (number) {
+        case 0:
+            cpu->reg[A] = high;
+            cpu->carry = low & 0x01;
+            cpu->parity = (low >> 2) & 1;
+            cpu->aux_carry = (low >> 4) & 1;
+            cpu->iszero = (low >> 6) & 1;
+            cpu->sign = (low >> 7) & 1;
+            break;
+        case 1: cpu->reg[B] = high; cpu->reg[C] = low; break;
+        case 2: cpu->reg[D] = high; cpu->reg[E] = low; break;
+        case 3: cpu->reg[H] = high; cpu->reg[L] = low; break;
+        case 4: cpu->stack_ptr = value & 0xFFFF; break;
+        default: cpu->prog_ctr = value & 0xFFFF; break;
+    }
+}
+
+static void gdb_send(const char *payload) {
+    char frame[GDB_PACKET_SIZE + 8];
+    unsigned int sum = 0;
+    size_t len = strlen(payload);
+    frame[0] = '$';
+    memcpy(frame + 1, payload, len);
+    for (size_t i = 0; i < len; i++) {
+        sum += (unsigned char)payload[i];
+    }
+    frame[len + 1] = '#';
+    gdb_put_hex8(frame + len + 2, sum & 0xFF);
+    size_t total = len + 4, done = 0;
+    pthread_mutex_lock(&gdb_stub.lock);  // The reader closes the fd under the lock
+    while (gdb_stub.fd >= 0 && done < total) {
+        ssize_t wrote = write(gdb_stub.fd, frame + done, total - done);
+        if (wrote <= 0 && errno != EINTR) {
+            break;  // The reader notices the connection closing
+        }
+        done += wrote > 0 ? (size_t)wrote : 0;
+    }
+    pthread_mutex_unlock(&gdb_stub.lock);
+}
+
+// Drop the connection from the machine's side; the reader sees it close
+static void gdb_hang_up(void) {
+    pthread_mutex_lock(&gdb_stub.lock);
+    if (gdb_stub.fd >= 0) {
+        shutdown(gdb_stub.fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&gdb_stub.lock);
+}
+
+static void gdb_send_stop(int reason) {
+    char reply[32];
+    if (reason == RUN_WATCHPOINT) {
+        snprintf(reply, sizeof(reply), "T%02x%swatch:%04x;", GDB_SIGTRAP,
+                 cpm_debug.stop_access == WATCH_READ ? "r" : "", cpm_debug.stop_address);
+    } else {
+        snprintf(reply, sizeof(reply), "S%02x", reason == RUN_DEBUGGER ? GDB_SIGINT : GDB_SIGTRAP);
+    }
+    gdb_send(reply);
+}
+
+// Hand a packet to the machine's thread and get its attention
+static void gdb_deliver(const char *packet, size_t len) {
+    machine_t *machine = gdb_stub.machine;
+    pthread_mutex_lock(&gdb_stub.lock);
+    while (gdb_stub.packet_ready && gdb_stub.running) {
+        pthread_cond_wait(&gdb_stub.changed, &gdb_stub.lock);
+    }
+    memcpy(gdb_stub.packet, packet, len);
+    gdb_stub.packet[len] = '\0';
+    gdb_stub.packet_ready = 1;
+    machine->debug.attention = 1;
+    __atomic_fetch_or(&machine->debug.armed, DEBUG_ARMED_GDB, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&gdb_stub.changed);
+    pthread_mutex_unlock(&gdb_stub.lock);
+
+    pthread_mutex_lock(&machine->idle.lock);
+    __atomic_store_n(&machine->idle.idle, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&machine->idle.wake);
+    pthread_mutex_unlock(&machine->idle.lock);
+}
+
+// Wait for the next packet. Returns 0 when the debugger has gone.
+static int gdb_take(char *packet) {
+    pthread_mutex_lock(&gdb_stub.lock);
+    while (!gdb_stub.packet_ready && gdb_stub.fd >= 0 && gdb_stub.running) {
+        pthread_cond_wait(&gdb_stub.changed, &gdb_stub.lock);
+    }
+    int ready = gdb_stub.packet_ready;
+    if (ready) {
+        strcpy(packet, gdb_stub.packet);
+        gdb_stub.packet_ready = 0;
+    }
+    cpm_debug.attention = 0;
+    __atomic_fetch_and(&cpm_debug.armed, ~DEBUG_ARMED_GDB, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&gdb_stub.changed);
+    pthread_mutex_unlock(&gdb_stub.lock);
+    return ready;
+}
+
+static void gdb_attach(int fd) {
+    pthread_mutex_lock(&gdb_stub.lock);
+    gdb_stub.fd = fd;
+    gdb_stub.no_ack = 0;
+    pthread_mutex_unlock(&gdb_stub.lock);
+    printf("[GDB] Debugger attached\n");
+    fflush(stdout);
+}
+
+// The connection closed: nudge the machine so it drops the debugger's
+// breakpoints and carries on
+static void gdb_detach(void) {
+    pthread_mutex_lock(&gdb_stub.lock);
+    close(gdb_stub.fd);
+    gdb_stub.fd = -1;
+    gdb_stub.packet_ready = 0;
+    gdb_stub.machine->debug.attention = 1;
+    __atomic_fetch_or(&gdb_stub.machine->debug.armed, DEBUG_ARMED_GDB, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&gdb_stub.changed);
+    pthread_mutex_unlock(&gdb_stub.lock);
+    printf("[GDB] Debugger detached\n");
+    fflush(stdout);
+}
+
+static void* gdb_thread_main(void *arg) {
+    (void)arg;
+    char packet[GDB_PACKET_SIZE];
+    size_t used = 0;
+    int in_packet = 0, checksum_digits = 0;
+    unsigned int sum = 0, expected = 0;
+    while (gdb_stub.running) {
+        struct pollfd fds[2] = {
+            { .fd = gdb_stub.fd >= 0 ? gdb_stub.fd : gdb_stub.listen_fd, .events = POLLIN },
+            { .fd = gdb_stub.wake[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+        if (gdb_stub.fd < 0) {
+            int fd = accept(gdb_stub.listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                in_packet = 0;
+                gdb_attach(fd);
             }
-            return call(p+3, da, cpu, mem); // Normal CALL
+            continue;
         }
-        case 0xc4: return !(cpu->iszero) ? call(p+3, da, cpu, mem) : p+3;//CNZ
-        case 0xd4: return !(cpu->carry)  ? call(p+3, da, cpu, mem) : p+3;//CNC
-        case 0xe4: return !(cpu->parity) ? call(p+3, da, cpu, mem) : p+3;//CPO
-        case 0xf4: return !(cpu->sign)   ? call(p+3, da, cpu, mem) : p+3;//CP
-        case 0xcc: return  (cpu->iszero) ? call(p+3, da, cpu, mem) : p+3;//CZ
-        case 0xdc: return  (cpu->carry)  ? call(p+3, da, cpu, mem) : p+3;//CC
-        case 0xec: return  (cpu->parity) ? call(p+3, da, cpu, mem) : p+3;//CPE
-        case 0xfc: return  (cpu->sign)   ? call(p+3, da, cpu, mem) : p+3;//CM
-            //Returns
-        case 0xc9:
-        case 0xd9: return ret(cpu, mem);//RET
-        case 0xc0: return !(cpu->iszero) ? ret(cpu, mem) : p+1;//RNZ
-        case 0xd0: return !(cpu->carry)  ? ret(cpu, mem) : p+1;//RNC
-        case 0xe0: return !(cpu->parity) ? ret(cpu, mem) : p+1;//RPO
-        case 0xf0: return !(cpu->sign)   ? ret(cpu, mem) : p+1;//RP
-        case 0xc8: return  (cpu->iszero) ? ret(cpu, mem) : p+1;//RZ
-        case 0xd8: return  (cpu->carry)  ? ret(cpu, mem) : p+1;//RC
-        case 0xe8: return  (cpu->parity) ? ret(cpu, mem) : p+1;//RPE
-        case 0xf8: return  (cpu->sign)   ? ret(cpu, mem) : p+1;//RM
-            //Restarts
-        case 0xc7: return call(p+1, 0x00, cpu, mem);//RST 0
-        case 0xcf: return call(p+1, 0x08, cpu, mem);//RST 1
-        case 0xd7: return call(p+1, 0x10, cpu, mem);//RST 2
-        case 0xdf: return call(p+1, 0x18, cpu, mem);//RST 3
-        case 0xe7: return call(p+1, 0x20, cpu, mem);//RST 4
-        case 0xef: return call(p+1, 0x28, cpu, mem);//RST 5
-        case 0xf7: return call(p+1, 0x30, cpu, mem);//RST 6
-        case 0xff: return call(p+1, 0x38, cpu, mem);//RST 7
-            
-            // IN, OUT - CP/M Console and Disk I/O
-        case 0xdb: { // IN instruction
-            unsigned char port = d8;
-            if (port == 0x00 || port == 0x01) {
-                // Console status/input (legacy)
-                (cpu->reg)[A] = cpm_console_status();
-            } else if (port == 0x15) {
-                // Disk operation result (0=success, 1=error)
-                (cpu->reg)[A] = 0x00; // Success for now
+        unsigned char data[512];
+        ssize_t got = read(gdb_stub.fd, data, sizeof(data));
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
             }
-            // BIOS I/O ports (0xF0-0xFA)
-            else if (port == 0xF0) {
-                // CONST_PORT - Console status
-                (cpu->reg)[A] = cpm_console_status();
-            } else if (port == 0xF1) {
-                // CONIN_PORT - Console input
-                (cpu->reg)[A] = cpm_console_input();
-            } else if (port == 0xF8) {
-                // DISK_READ - Read sector
-                (cpu->reg)[A] = cpm_read_sector();
-            } else if (port == 0xF9) {
-                // DISK_WRITE - Write sector
-                (cpu->reg)[A] = cpm_write_sector();
-            } else {
-                (cpu->reg)[A] = 0x00; // Other ports return 0
+            gdb_detach();
+            continue;
+        }
+        for (ssize_t i = 0; i < got; i++) {
+            unsigned char c = data[i];
+            if (!in_packet) {
+                if (c == '$') {
+                    in_packet = 1;
+                    used = 0;
+                    sum = 0;
+                    checksum_digits = -1;
+                } else if (c == 0x03) {
+                    gdb_deliver("\x03", 1);  // Ctrl-C: stop the machine
+                }
+                continue;                    // Acks and noise
+            }
+            if (checksum_digits < 0) {
+                if (c == '#') {
+                    checksum_digits = 0;
+                    expected = 0;
+                } else if (used < sizeof(packet) - 1) {
+                    packet[used++] = (char)c;
+                    sum += c;
+                }
+                continue;
+            }
+            expected = (expected << 4) | (unsigned int)(gdb_hex_value((char)c) & 0xF);
+            if (++checksum_digits < 2) {
+                continue;
+            }
+            in_packet = 0;
+            int good = (expected == (sum & 0xFF));
+            pthread_mutex_lock(&gdb_stub.lock);  // Not in the middle of a reply
+            ssize_t acked = gdb_stub.no_ack ? 1 : write(gdb_stub.fd, good ? "+" : "-", 1);
+            pthread_mutex_unlock(&gdb_stub.lock);
+            if (acked < 0) {
+                break;
+            }
+            if (good) {
+                gdb_deliver(packet, used);
             }
-            return p+2;
         }
-        case 0xd3: { // OUT instruction
-            unsigned char port = d8;
-            unsigned char value = (cpu->reg)[A];
-
-            if (port == 0x01) {
-                // Console output
-                cpm_console_output(value);
-            } else if (port == 0x10) {
-                // Disk select
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x10: Select disk %d\n", value);
-                fflush(stdout);
-#endif
-                cpm_select_disk(value);
-            } else if (port == 0x11) {
-                // Set track
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x11: Set track %d\n", value);
-                fflush(stdout);
-#endif
-                cpm_set_track(value);
-            } else if (port == 0x12) {
-                // Set sector
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x12: Set sector %d\n", value);
-                fflush(stdout);
-#endif
-                cpm_set_sector(value);
-            } else if (port == 0x13) {
-                // DMA address low byte
-                cpm_disk.dma_address = (cpm_disk.dma_address & 0xFF00) | value;
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x13: DMA low=0x%02X (DMA now: 0x%04X)\n", value, cpm_disk.dma_address);
-                fflush(stdout);
-#endif
-            } else if (port == 0x14) {
-                // DMA address high byte
-                cpm_disk.dma_address = (cpm_disk.dma_address & 0x00FF) | (value << 8);
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x14: DMA high=0x%02X (DMA now: 0x%04X)\n", value, cpm_disk.dma_address);
-                fflush(stdout);
-#endif
-            } else if (port == 0x15) {
-                // Disk operation (0=read, 1=write, 2=home)
-#if DEBUG_DISK_IO
-                printf("[OUT] Port 0x15: Operation=%d ", value);
-#endif
-                if (value == 0) {
-#if DEBUG_DISK_IO
-                    printf("(READ)\n");
-                    fflush(stdout);
-#endif
-                    cpm_read_sector();
-                } else if (value == 1) {
-#if DEBUG_DISK_IO
-                    printf("(WRITE)\n");
-                    fflush(stdout);
-#endif
-                    cpm_write_sector();
-                } else if (value == 2) {
-#if DEBUG_DISK_IO
-                    printf("(HOME)\n");
-                    fflush(stdout);
-#endif
-                    cpm_home_disk();
+    }
+    return NULL;
+}
+
+// Parse "addr,len" (hex); returns the character after len
+static const char* gdb_parse_range(const char *in, unsigned int *address, unsigned int *length) {
+    char *end;
+    *address = (unsigned int)strtoul(in, &end, 16);
+    *length = (*end == ',') ? (unsigned int)strtoul(end + 1, &end, 16) : 0;
+    return end;
+}
+
+// Answer a breakpoint or watchpoint packet: Z/z type,addr,kind
+static int gdb_breakpoint(const char *packet) {
+    int insert = (packet[0] == 'Z');
+    int type = packet[1] - '0';
+    unsigned int address, length;
+    if (packet[2] != ',') {
+        return 0;
+    }
+    gdb_parse_range(packet + 3, &address, &length);
+    if (type == 0 || type == 1) {
+        return insert ? cpm_break_set(address) : (cpm_break_clear(address), 1);
+    }
+    if (type < 2 || type > 4 || length == 0 || address + length > 0x10000) {
+        return 0;
+    }
+    static const int flags[] = { 0, 0, WATCH_WRITE, WATCH_READ, WATCH_READ | WATCH_WRITE };
+    return insert ? cpm_watch_add(address, address + length - 1, flags[type])
+                  : cpm_watch_remove(address, address + length - 1);
+}
+
+// The machine stopped for the debugger (or the debugger wants it): answer
+// packets until it continues. Returns 0 when no debugger is attached to
+// this machine, so cpu_run reports the stop itself.
+static int gdb_service(int reason) {
+    if (gdb_stub.machine != cpm_machine) {
+        return 0;
+    }
+    if (gdb_stub.fd < 0) {
+        if (reason != RUN_DEBUGGER) {
+            return 0;
+        }
+        pthread_mutex_lock(&gdb_stub.lock);
+        cpm_debug.attention = 0;  // The debugger left: its breakpoints go with it
+        __atomic_fetch_and(&cpm_debug.armed, ~DEBUG_ARMED_GDB, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&gdb_stub.lock);
+        cpm_break_clear_all();
+        cpm_watch_clear_all();
+        return 1;
+    }
+    if (reason != RUN_DEBUGGER) {
+        gdb_send_stop(reason);
+    }
+
+    char packet[GDB_PACKET_SIZE];
+    char reply[GDB_PACKET_SIZE];
+    while (gdb_take(packet)) {
+        unsigned int address, length;
+        const char *rest;
+        reply[0] = '\0';
+        switch (packet[0]) {
+            case 0x03:
+                gdb_send_stop(RUN_DEBUGGER);
+                continue;
+            case '?':
+                gdb_send_stop(RUN_BREAKPOINT);
+                continue;
+            case 'g':
+                for (int i = 0; i < 6; i++) {
+                    gdb_put_reg(reply + i * 4, gdb_read_pair(i));
+                }
+                reply[24] = '\0';
+                break;
+            case 'G':
+                for (int i = 0; i < 6 && strlen(packet + 1) >= (size_t)(i + 1) * 4; i++) {
+                    gdb_write_pair(i, gdb_get_reg(packet + 1 + i * 4));
                 }
-#if DEBUG_DISK_IO
-                else {
-                    printf("(UNKNOWN)\n");
-                    fflush(stdout);
+                strcpy(reply, "OK");
+                break;
+            case 'p': {
+                int number = (int)strtol(packet + 1, NULL, 16);
+                if (number >= 0 && number < 6) {
+                    gdb_put_reg(reply, gdb_read_pair(number));
+                    reply[4] = '\0';
+                } else {
+                    strcpy(reply, "E01");
                 }
-#endif
+                break;
             }
-            // BIOS I/O ports (0xF0-0xFA)
-            else if (port == 0xF2) {
-                // CONOUT_PORT - Console output
-                cpm_console_output(value);
-            } else if (port == 0xF3) {
-                // DISK_SELECT - Select disk
-                cpm_select_disk(value);
-            } else if (port == 0xF4) {
-                // DISK_TRACK - Set track
-                cpm_set_track(value);
-            } else if (port == 0xF5) {
-                // DISK_SECTOR - Set sector
-                cpm_set_sector(value);
-            } else if (port == 0xF6) {
-                // DISK_DMA_LO - DMA address low byte
-                cpm_disk.dma_address = (cpm_disk.dma_address & 0xFF00) | value;
-            } else if (port == 0xF7) {
-                // DISK_DMA_HI - DMA address high byte
-                cpm_disk.dma_address = (cpm_disk.dma_address & 0x00FF) | (value << 8);
-            } else if (port == 0xFA) {
-                // DISK_HOME - Home disk
-                cpm_home_disk();
+            case 'P': {
+                char *value;
+                int number = (int)strtol(packet + 1, &value, 16);
+                if (number >= 0 && number < 6 && *value == '=') {
+                    gdb_write_pair(number, gdb_get_reg(value + 1));
+                    strcpy(reply, "OK");
+                } else {
+                    strcpy(reply, "E01");
+                }
+                break;
             }
-            return p+2;
+            case 'm':
+                gdb_parse_range(packet + 1, &address, &length);
+                if (length > (sizeof(reply) - 1) / 2) {
+                    length = (sizeof(reply) - 1) / 2;
+                }
+                for (unsigned int i = 0; i < length; i++) {
+                    gdb_put_hex8(reply + i * 2, mem[(address + i) & 0xFFFF]);
+                }
+                reply[length * 2] = '\0';
+                break;
+            case 'M':
+                rest = gdb_parse_range(packet + 1, &address, &length);
+                if (*rest != ':' || strlen(rest + 1) < (size_t)length * 2) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (unsigned int i = 0; i < length; i++) {
+                    int high = gdb_hex_value(rest[1 + i * 2]), low = gdb_hex_value(rest[2 + i * 2]);
+                    mem[(address + i) & 0xFFFF] = (unsigned char)(((high & 0xF) << 4) | (low & 0xF));
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'Z':
+            case 'z':
+                if (packet[1] >= '0' && packet[1] <= '4') {
+                    strcpy(reply, gdb_breakpoint(packet) ? "OK" : "E01");
+                }
+                break;
+            case 'c':
+                if (packet[1]) {
+                    cpm_machine->cpu.prog_ctr = (unsigned int)strtoul(packet + 1, NULL, 16) & 0xFFFF;
+                }
+                return 1;
+            case 's':
+                if (packet[1]) {
+                    cpm_machine->cpu.prog_ctr = (unsigned int)strtoul(packet + 1, NULL, 16) & 0xFFFF;
+                }
+                cpm_debug.hit = 0;
+                cpm_machine->cpu.prog_ctr = cpu_step(&cpm_machine->cpu) & 0xFFFF;
+                gdb_send_stop(cpm_debug.hit ? RUN_WATCHPOINT : RUN_BREAKPOINT);
+                cpm_debug.hit = 0;
+                continue;
+            case 'D':
+                gdb_send("OK");
+                gdb_hang_up();  // The reader closes it and nudges the machine
+                return 1;
+            case 'k':
+                gdb_hang_up();
+                return 1;
+            case 'H':
+            case 'T':
+                strcpy(reply, "OK");
+                break;
+            case 'q':
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    snprintf(reply, sizeof(reply), "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                } else if (strcmp(packet, "qfThreadInfo") == 0) {
+                    strcpy(reply, "m1");
+                } else if (strcmp(packet, "qsThreadInfo") == 0) {
+                    strcpy(reply, "l");
+                } else if (strcmp(packet, "qOffsets") == 0) {
+                    strcpy(reply, "Text=0;Data=0;Bss=0");
+                }
+                break;
+            case 'Q':
+                if (strcmp(packet, "QStartNoAckMode") == 0) {
+                    gdb_send("OK");
+                    pthread_mutex_lock(&gdb_stub.lock);
+                    gdb_stub.no_ack = 1;
+                    pthread_mutex_unlock(&gdb_stub.lock);
+                    continue;
+                }
+                break;
         }
+        gdb_send(reply);  // Empty for anything unsupported
+    }
+    return 1;
+}
 
-            //EI, DI - Enable/Disable Interrupts
-        case 0xfb: cpu->interrupt_enable = 1; return p+1;//EI
-        case 0xf3: cpu->interrupt_enable = 0; return p+1;//DI
+// Stop listening and drop the debugger; the machine carries on
+void cpm_gdb_stop(void) {
+    if (gdb_stub.listen_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&gdb_stub.lock);
+    int started = gdb_stub.running;
+    gdb_stub.running = 0;
+    pthread_cond_broadcast(&gdb_stub.changed);
+    pthread_mutex_unlock(&gdb_stub.lock);
+    if (started && write(gdb_stub.wake[1], "x", 1) == 1) {
+        pthread_join(gdb_stub.thread, NULL);
+    }
+    if (gdb_stub.fd >= 0) {
+        gdb_detach();
+    }
+    close(gdb_stub.listen_fd);
+    close(gdb_stub.wake[0]);
+    close(gdb_stub.wake[1]);
+    gdb_stub.listen_fd = -1;
+    gdb_stub.wake[0] = gdb_stub.wake[1] = -1;
+}
 
-            //NOP
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-        case 0x08:
-        case 0x18:
-        case 0x28:
-        case 0x38: return p+1;
-        default: perror("Unrecognized instruction");
+// The machine being debugged is going away
+static void gdb_forget_machine(machine_t *machine) {
+    if (gdb_stub.machine == machine) {
+        cpm_gdb_stop();
+        gdb_stub.machine = NULL;
     }
-    
-    return 0;
 }
 
+// Serve the GDB remote protocol for the selected machine on "unix:path" or
+// "[host:]port"
+int cpm_gdb_listen(const char *spec) {
+    if (gdb_stub.running || !spec) {
+        return 0;
+    }
+    int fd = socket_listen(spec, 0);
+    if (fd < 0 || pipe(gdb_stub.wake) != 0) {
+        printf("[GDB] ERROR: Cannot listen on %s (%s)\n", spec, strerror(errno));
+        fflush(stdout);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    gdb_stub.listen_fd = fd;
+    gdb_stub.machine = cpm_machine;
+    gdb_stub.running = 1;
+    if (pthread_create(&gdb_stub.thread, NULL, gdb_thread_main, NULL) != 0) {
+        cpm_gdb_stop();
+        return 0;
+    }
+    printf("[GDB] Listening on %s\n", spec);
+    fflush(stdout);
+    return 1;
+}
+
+// ============================================================================
+// FRONT PANEL
+// ============================================================================
 
+// The thread running a machine publishes a binary cpu_state_t every
+// interval cycles (and whenever cpu_run returns) under a sequence lock, so
+// another thread can sample registers, flags, the address bus and the next
+// instruction without stopping the CPU or formatting strings. The writer
+// never waits; a reader retries the rare copy that overlapped a write.
+
+static void front_panel_publish(void) {
+    front_panel_t *panel = &cpm_panel;
+    const struct i8080 *cpu = &cpm_machine->cpu;
+    cpu_state_t state;
+    state.cycles = cpu_cycles;
+    state.steps = cpm_idle.steps;
+    state.pc = (unsigned short)cpu->prog_ctr;
+    state.sp = (unsigned short)cpu->stack_ptr;
+    state.address_bus = (unsigned short)addressBus;
+    state.a = cpu->reg[A];
+    state.b = cpu->reg[B];
+    state.c = cpu->reg[C];
+    state.d = cpu->reg[D];
+    state.e = cpu->reg[E];
+    state.h = cpu->reg[H];
+    state.l = cpu->reg[L];
+    state.flags = (unsigned char)(cpu->carry + 0x02 + 0x04 * cpu->parity + 0x10 * cpu->aux_carry +
+                                  0x40 * cpu->iszero + 0x80 * cpu->sign);
+    state.interrupt_enable = (unsigned char)cpu->interrupt_enable;
+    state.halted = (unsigned char)cpm_events.halted;
+    for (int i = 0; i < 4; i++) {
+        state.next[i] = mem[(cpu->prog_ctr + i) & 0xFFFF];
+    }
 
-char * dumpRegs(struct i8080* p)
-{
-    
-    sprintf(buffer, "PC:%04X\tA:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X\n",
-            (p->prog_ctr),
-            (p->reg)[A], (p->reg)[B], (p->reg)[C], (p->reg)[D],
-            (p->reg)[E], (p->reg)[H], (p->reg)[L], (p->stack_ptr));
-    
-    return buffer;
+    unsigned int sequence = panel->sequence;
+    __atomic_store_n(&panel->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&panel->state, &state, sizeof(state));
+    __atomic_store_n(&panel->sequence, sequence + 2, __ATOMIC_RELEASE);
+    panel->due = panel->interval ? cpu_cycles + panel->interval : ~0ULL;
 }
 
-int currentAddressBus(void)
-{
-    return addressBus;
+// Publish the selected machine's state every interval cycles (0 stops)
+void cpm_front_panel_enable(unsigned long long interval) {
+    cpm_panel.interval = interval;
+    cpm_panel.due = interval ? cpu_cycles : ~0ULL;
+    if (interval) {
+        front_panel_publish();
+    }
 }
 
-int currentAddress(void)
-{
-    return cpu.prog_ctr;
+// Copy the latest snapshot of machine (NULL for the default machine) from
+// any thread. Returns 0 if nothing has been published yet.
+int cpm_front_panel_read(machine_t *machine, cpu_state_t *out) {
+    front_panel_t *panel = &(machine ? machine : &cpm_default_machine)->panel;
+    unsigned int before, after;
+    do {
+        before = __atomic_load_n(&panel->sequence, __ATOMIC_ACQUIRE);
+        memcpy(out, &panel->state, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&panel->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return before != 0;
 }
 
-int currentData(void)
-{
-    return mem[cpu.prog_ctr];
+// ============================================================================
+// COVERAGE
+// ============================================================================
+
+// With DEBUG_COVERAGE built in, a machine can count, per guest address,
+// the instructions executed there (at the opcode byte, including trapped
+// BDOS and BIOS entries) and the MemRead and MemWrite accesses to it. The
+// 16-bit counters saturate at 65535. Operand fetches and memory written by
+// traps and disk DMA are not counted. Built with DEBUG_COVERAGE 0 the hooks
+// are compiled out and cpm_coverage_start fails.
+//
+// Labels handed over from the assembler name the ranges in the exports; a
+// label covers the addresses up to the next one.
+
+#define COVERAGE_MAGIC "C8080COV"
+#define COVERAGE_VERSION 1
+
+static const char *const coverage_kind_names[COVERAGE_KINDS] = { "execute", "read", "write" };
+
+// Start (or resume) counting on the selected machine. Counts are kept
+// across resets until cpm_coverage_clear.
+int cpm_coverage_start(void) {
+#if DEBUG_COVERAGE
+    if (!cpm_coverage.counts) {
+        cpm_coverage.counts = calloc(COVERAGE_KINDS, sizeof(*cpm_coverage.counts));
+        if (!cpm_coverage.counts) {
+            printf("[Coverage] ERROR: Out of memory\n");
+            fflush(stdout);
+            return 0;
+        }
+    }
+    cpm_coverage.collecting = 1;
+    coverage_counts = cpm_coverage.counts;
+    return 1;
+#else
+    printf("[Coverage] ERROR: Built without DEBUG_COVERAGE\n");
+    fflush(stdout);
+    return 0;
+#endif
 }
 
-int* instructions(void)
-{
-    return currentAndNext;
+// Stop counting; the counts stay available for export
+void cpm_coverage_stop(void) {
+    cpm_coverage.collecting = 0;
+    #if DEBUG_COVERAGE
+    coverage_counts = NULL;
+    #endif
 }
 
+void cpm_coverage_clear(void) {
+    if (cpm_coverage.counts) {
+        memset(cpm_coverage.counts, 0, COVERAGE_KINDS * sizeof(*cpm_coverage.counts));
+    }
+}
 
-char* codestep(void)
-{
-    currentAndNext[0] = mem[cpu.prog_ctr];
-    currentAndNext[1] = mem[cpu.prog_ctr+1];
-    currentAndNext[2] = mem[cpu.prog_ctr+2];
-    cpu.prog_ctr = exec_inst(&cpu, mem) & 0xFFFF;
-    currentAndNext[3] = mem[cpu.prog_ctr];
-    currentAndNext[4] = mem[cpu.prog_ctr+1];
-    currentAndNext[5] = mem[cpu.prog_ctr+2];
-    return dumpRegs(&cpu);
+// Hits of kind (CPM_COVERAGE_EXECUTE, _READ, _WRITE) at address
+unsigned int cpm_coverage_hits(unsigned int address, int kind) {
+    if (!cpm_coverage.counts || kind < 0 || kind >= COVERAGE_KINDS) {
+        return 0;
+    }
+    return cpm_coverage.counts[kind][address & 0xFFFF];
 }
 
-char* codereset(void)
-{
-    // reset all registers
+// Name address in the exports, as the assembler's Labels table does
+int cpm_coverage_label(const char *name, unsigned int address) {
+    if (cpm_coverage.label_count == cpm_coverage.label_capacity) {
+        int capacity = cpm_coverage.label_capacity ? cpm_coverage.label_capacity * 2 : 64;
+        coverage_label_t *grown = realloc(cpm_coverage.labels, capacity * sizeof(coverage_label_t));
+        if (!grown) {
+            return 0;
+        }
+        cpm_coverage.labels = grown;
+        cpm_coverage.label_capacity = capacity;
+    }
+    coverage_label_t *label = &cpm_coverage.labels[cpm_coverage.label_count++];
+    snprintf(label->name, sizeof(label->name), "%s", name);
+    label->address = address & 0xFFFF;
+    return 1;
+}
 
-    cpu.prog_ctr = 0;
-    cpu.stack_ptr = 0;
+void cpm_coverage_clear_labels(void) {
+    cpm_coverage.label_count = 0;
+}
 
-    cpu.reg[A] = 0;
-    cpu.reg[H] = 0;
-    cpu.reg[L] = 0;
-    cpu.reg[B] = 0;
-    cpu.reg[C] = 0;
-    cpu.reg[D] = 0;
-    cpu.reg[E] = 0;
-    cpu.reg[SP] = 0;
+static int coverage_label_compare(const void *a, const void *b) {
+    const coverage_label_t *x = a, *y = b;
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
 
-    // Reset flags
-    cpu.carry = 0;
-    cpu.aux_carry = 0;
-    cpu.iszero = 0;
-    cpu.parity = 0;
-    cpu.sign = 0;
+// The last label at or below address, or -1
+static int coverage_label_at(unsigned int address) {
+    int low = 0, high = cpm_coverage.label_count - 1, found = -1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (cpm_coverage.labels[middle].address <= address) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
 
-    // Reset interrupt state
-    cpu.interrupt_enable = 0;
-    cpu.interrupt_pending = 0;
-    cpu.interrupt_opcode = 0;
+// Compact binary export, freed with free:
+//   "C8080COV", u16 version, u16 label count, then per kind (execute, read,
+//   write) an 8KB bitmap of the addresses hit (bit n of byte n/8) followed
+//   by the u16 count of each address set in it, ascending; then per label
+//   u16 address, u8 name length and the name. Integers are little-endian.
+unsigned char* cpm_coverage_export(size_t *length) {
+    save_buffer_t out = { 0 };
+    unsigned char bitmap[0x10000 / 8];
+    qsort(cpm_coverage.labels, cpm_coverage.label_count, sizeof(coverage_label_t), coverage_label_compare);
+    save_put(&out, COVERAGE_MAGIC, 8);
+    save_put16(&out, COVERAGE_VERSION);
+    save_put16(&out, cpm_coverage.label_count);
+    for (int kind = 0; kind < COVERAGE_KINDS; kind++) {
+        memset(bitmap, 0, sizeof(bitmap));
+        for (unsigned int address = 0; cpm_coverage.counts && address < 0x10000; address++) {
+            if (cpm_coverage.counts[kind][address]) {
+                bitmap[address >> 3] |= (unsigned char)(1 << (address & 7));
+            }
+        }
+        save_put(&out, bitmap, sizeof(bitmap));
+        for (unsigned int address = 0; address < 0x10000; address++) {
+            if (bitmap[address >> 3] & (1 << (address & 7))) {
+                save_put16(&out, cpm_coverage.counts[kind][address]);
+            }
+        }
+    }
+    for (int i = 0; i < cpm_coverage.label_count; i++) {
+        size_t name_length = strlen(cpm_coverage.labels[i].name);
+        save_put16(&out, cpm_coverage.labels[i].address);
+        save_put8(&out, (unsigned int)name_length);
+        save_put(&out, cpm_coverage.labels[i].name, name_length);
+    }
+    if (out.failed) {
+        free(out.data);
+        return NULL;
+    }
+    *length = out.used;
+    return out.data;
+}
 
-    // Initialize CP/M subsystem
-    cpm_init();
+static void coverage_json_put(save_buffer_t *out, const char *format, ...) {
+    char text[160];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len > 0) {
+        save_put(out, text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+    }
+}
+
+static void coverage_json_name(save_buffer_t *out, const char *name) {
+    save_put8(out, '"');
+    for (; *name; name++) {
+        unsigned char ch = (unsigned char)*name;
+        if (ch == '"' || ch == '\\') {
+            save_put8(out, '\\');
+            save_put8(out, ch);
+        } else if (ch < 0x20) {
+            coverage_json_put(out, "\\u%04x", ch);
+        } else {
+            save_put8(out, ch);
+        }
+    }
+    save_put8(out, '"');
+}
+
+// JSON export, a NUL-terminated string freed with free:
+//   {"execute":[{"start":256,"end":271,"hits":40,"label":"LOOP","offset":0},
+//   ...],"read":[...],"write":[...],"labels":[{"name":"LOOP","address":256,
+//   "size":16,"executed":16,"hits":40},...]}
+// Ranges are runs of consecutive addresses hit, with end inclusive; label
+// and offset are present when a label lies at or below start. A label's
+// size runs to the next label, and executed counts its addresses run.
+char* cpm_coverage_json(void) {
+    save_buffer_t out = { 0 };
+    qsort(cpm_coverage.labels, cpm_coverage.label_count, sizeof(coverage_label_t), coverage_label_compare);
+    save_put8(&out, '{');
+    for (int kind = 0; kind < COVERAGE_KINDS; kind++) {
+        coverage_json_put(&out, "%s\"%s\":[", kind ? "," : "", coverage_kind_names[kind]);
+        int ranges = 0;
+        for (unsigned int address = 0; cpm_coverage.counts && address < 0x10000; address++) {
+            if (!cpm_coverage.counts[kind][address]) {
+                continue;
+            }
+            unsigned int start = address;
+            unsigned long long hits = 0;
+            while (address < 0x10000 && cpm_coverage.counts[kind][address]) {
+                hits += cpm_coverage.counts[kind][address++];
+            }
+            coverage_json_put(&out, "%s{\"start\":%u,\"end\":%u,\"hits\":%llu", ranges++ ? "," : "",
+                              start, address - 1, hits);
+            int label = coverage_label_at(start);
+            if (label >= 0) {
+                save_put(&out, ",\"label\":", 9);
+                coverage_json_name(&out, cpm_coverage.labels[label].name);
+                coverage_json_put(&out, ",\"offset\":%u", start - cpm_coverage.labels[label].address);
+            }
+            save_put8(&out, '}');
+        }
+        save_put8(&out, ']');
+    }
+    save_put(&out, ",\"labels\":[", 11);
+    for (int i = 0; i < cpm_coverage.label_count; i++) {
+        const coverage_label_t *label = &cpm_coverage.labels[i];
+        unsigned int end = i + 1 < cpm_coverage.label_count ? cpm_coverage.labels[i + 1].address : 0x10000;
+        unsigned int executed = 0;
+        unsigned long long hits = 0;
+        for (unsigned int address = label->address; cpm_coverage.counts && address < end; address++) {
+            executed += cpm_coverage.counts[COVERAGE_EXECUTE][address] != 0;
+            hits += cpm_coverage.counts[COVERAGE_EXECUTE][address];
+        }
+        save_put(&out, i ? ",{\"name\":" : "{\"name\":", i ? 9 : 8);
+        coverage_json_name(&out, label->name);
+        coverage_json_put(&out, ",\"address\":%u,\"size\":%u,\"executed\":%u,\"hits\":%llu}",
+                          label->address, end - label->address, executed, hits);
+    }
+    save_put(&out, "]}", 3);
+    if (out.failed) {
+        free(out.data);
+        return NULL;
+    }
+    return (char *)out.data;
+}
+
+// ============================================================================
+// SESSION SERVER
+// ============================================================================
+//
+// Serves one CP/M machine per connection on a TCP or Unix socket. A single
+// epoll thread accepts connections and watches the sockets; a pool of worker
+// threads runs the machines in time slices measured in cycles. A session is
+// only scheduled when it has something to do: a machine blocked on console
+// input or halted costs nothing until bytes arrive, and one spinning on
+// console status is parked for an idle tick between slices. Each session can
+// be held to a cycle quota per second.
+//
+// Sockets are armed one-shot, so a session is owned by at most one thread
+// at a time: the worker that runs it also reads its input and writes its
+// output, then re-arms the socket. The epoll thread only moves sessions
+// between the parked and queued states and reaps closed ones; even a new
+// session's machine is built and reset by the worker that first runs it.
+//
+// Machines share a few process-wide tables, which constrains what a server
+// may change while it runs:
+//   - The I/O port table. The boot machine's reset registers the built-in
+//     controllers before any worker starts; a device registered later is
+//     mapped for every session, so register devices before cpm_server_run.
+//   - The disk writer. Session A: drives are in-memory overlays and never
+//     queue sectors, so only the host application's own drives use it.
+//   - The GDB stub, which debugs one machine at a time.
+// HLE traps, consoles, disks and debug state are per machine.
+
+#if CPM_SERVER
+
+#define SERVER_TICK_MS CPM_IDLE_TICK_MS
+#define SERVER_SLICE_CYCLES 200000ULL  // Default time slice (about 0.1s of a 2MHz 8080)
+#define SERVER_MAX_SESSIONS 4096
+#define SERVER_OUTPUT_BACKLOG 65536    // Stop running a machine the client isn't reading
 
-    currentAndNext[0] = mem[cpu.prog_ctr];
-    currentAndNext[1] = mem[cpu.prog_ctr+1];
-    currentAndNext[2] = mem[cpu.prog_ctr+2];
-    currentAndNext[3] = mem[cpu.prog_ctr+3];
-    currentAndNext[4] = mem[cpu.prog_ctr+4];
-    currentAndNext[5] = mem[cpu.prog_ctr+5];
+typedef struct {
+    const char *listen;                // "unix:/path", "port" or "host:port" (default host 127.0.0.1)
+    const char *boot_hex;              // Program loaded into every machine, as for codeload
+    unsigned int boot_org;
+    const char *disk_image;            // Shared A: base image (overlay per session), or NULL
+    int workers;                       // CPU threads, 0 = one per online core
+    int max_sessions;                  // 0 = SERVER_MAX_SESSIONS
+    unsigned long long slice_cycles;   // 0 = SERVER_SLICE_CYCLES
+    unsigned long long quota_cycles;   // Per session per second, 0 = unlimited
+} cpm_server_config;
+
+enum { SESSION_PARKED, SESSION_QUEUED, SESSION_RUNNING, SESSION_DEAD };
+
+typedef struct server_session {
+    int fd;
+    unsigned int id;
+    machine_t *machine;
+    int state;                         // Guarded by the server lock
+    int closing;                       // Client went away; reap after this slice
+    long long wake_at;                 // Parked: ms at which to run again, 0 = on socket activity
+    long long quota_window;            // Start (ms) of the current quota second
+    unsigned long long quota_used;     // Cycles run in that second
+    unsigned char last_input;          // For CR LF / LF to CR translation
+    struct server_session *next;       // Run queue link
+} server_session_t;
 
-    return dumpRegs(&cpu);
+typedef struct {
+    cpm_server_config config;
+    char disk_image[PATH_MAX];
+    int epoll_fd;
+    int listen_fd;
+    int stop_pipe[2];
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    server_session_t *queue_head;
+    server_session_t *queue_tail;
+    server_session_t **sessions;
+    int session_count;
+    unsigned int next_id;
+    int running;
+    pthread_t *workers;
+    int worker_count;
+    machine_t *boot;                   // Machine holding the booted image all sessions copy
+} server_state;
+
+static server_state cpm_server = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                                   .epoll_fd = -1, .listen_fd = -1, .stop_pipe = { -1, -1 } };
+static char server_listen_tag;         // epoll data for the listening socket
+
+static long long server_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-void coderun(void)
-{
-    codestep();
-    cpu.prog_ctr = exec_inst(&cpu, mem) & 0xFFFF;
-    dumpRegs(&cpu);
+// Caller holds the server lock
+static void server_enqueue(server_session_t *session) {
+    session->state = SESSION_QUEUED;
+    session->wake_at = 0;
+    session->next = NULL;
+    if (cpm_server.queue_tail) {
+        cpm_server.queue_tail->next = session;
+    } else {
+        cpm_server.queue_head = session;
+    }
+    cpm_server.queue_tail = session;
+    pthread_cond_signal(&cpm_server.work);
 }
 
-void codeload(const char *sourcecode, unsigned int org)
-{
-    unsigned long length = strlen(sourcecode);
+// Power on a machine for a new connection: its own memory and console, A:
+// as a private overlay of the shared image, and the boot image copied in
+static machine_t* server_new_machine(void) {
+    machine_t *machine = cpm_machine_create(NULL);
+    if (!machine) {
+        return NULL;
+    }
+    machine_t *previous = cpm_machine_select(machine);
+    if (cpm_server.disk_image[0] != '\0') {
+        cpm_mount_overlay(0, cpm_server.disk_image);
+    }
+    cpm_machine_reset();
+    memcpy(mem, cpm_server.boot->memory, 0x10000);
+    cpm_machine->cpu.prog_ctr = cpm_server.config.boot_org;
+    cpm_machine_select(previous);
+    return machine;
+}
 
-    const char *pos = sourcecode;
-    for (size_t count = 0; count < length / 2; count++)
-    {
-        sscanf(pos, "%2hhx",&mem[org + count]);
-        pos += 2;
+// New sessions are queued without a machine; the worker builds it
+static void server_accept(void) {
+    for (;;) {
+        int fd = accept(cpm_server.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("[Server] accept failed: %s\n", strerror(errno));
+                fflush(stdout);
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        server_session_t *session = NULL;
+        if (cpm_server.session_count < cpm_server.config.max_sessions) {
+            session = calloc(1, sizeof(server_session_t));
+        }
+        if (!session) {
+            printf("[Server] Refusing connection (%d sessions)\n", cpm_server.session_count);
+            fflush(stdout);
+            close(fd);
+            continue;
+        }
+        session->fd = fd;
+        session->quota_window = server_now_ms();
+
+        // Registered disarmed; the worker arms it after each slice
+        struct epoll_event event = { .events = EPOLLONESHOT, .data.ptr = session };
+        epoll_ctl(cpm_server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+        pthread_mutex_lock(&cpm_server.lock);
+        session->id = ++cpm_server.next_id;
+        cpm_server.sessions[cpm_server.session_count++] = session;
+        server_enqueue(session);  // Build the machine and run it until it waits for input
+        pthread_mutex_unlock(&cpm_server.lock);
+        printf("[Server] Session %u connected (%d active)\n", session->id, cpm_server.session_count);
+        fflush(stdout);
     }
-    printf("[Loader] Loaded %lu bytes at address 0x%04X\n", length/2, org);
-    fflush(stdout);
 }
 
-void cpu_set_pc(unsigned short addr)
-{
-    cpu.prog_ctr = addr;
-    currentAndNext[0] = mem[cpu.prog_ctr];
-    currentAndNext[1] = mem[cpu.prog_ctr+1];
-    currentAndNext[2] = mem[cpu.prog_ctr+2];
-    currentAndNext[3] = mem[cpu.prog_ctr+3];
-    currentAndNext[4] = mem[cpu.prog_ctr+4];
-    currentAndNext[5] = mem[cpu.prog_ctr+5];
+static int server_input_room(void) {
+    return (cpm_console.input_read_pos - cpm_console.input_write_pos - 1 + 256) % 256;
 }
 
-// Interrupt support functions
-void trigger_interrupt(unsigned char opcode)
-{
-    // Queue an interrupt with the given opcode (typically RST 0-7)
-    cpu.interrupt_pending = 1;
-    cpu.interrupt_opcode = opcode;
+// Move client bytes into the console, as many as the input ring can take
+static void server_read_input(server_session_t *session) {
+    unsigned char data[256];
+    int room = server_input_room();
+    if (room == 0) {
+        return;
+    }
+    ssize_t n = recv(session->fd, data, (size_t)room, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        session->closing = 1;
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        unsigned char ch = data[i];
+        unsigned char last = session->last_input;
+        session->last_input = ch;
+        if (ch == '\n') {
+            if (last == '\r') {
+                continue;  // CR LF: the CR already ended the line
+            }
+            ch = '\r';     // Bare LF (nc, line-buffered clients) ends a CP/M line
+        }
+        cpm_put_char(ch);
+    }
 }
 
-int check_interrupt(void)
-{
-    // Returns 1 if interrupt should be processed, 0 otherwise
-    return (cpu.interrupt_enable && cpu.interrupt_pending);
+// Send console output straight from the ring; what the socket won't take
+// stays queued for EPOLLOUT
+static void server_write_output(server_session_t *session) {
+    while (cpm_console.output_write != cpm_console.output_read) {
+        size_t pending = cpm_console.output_write - cpm_console.output_read;
+        size_t at = cpm_console.output_read & (cpm_console.output_size - 1);
+        size_t chunk = cpm_console.output_size - at < pending ? cpm_console.output_size - at : pending;
+        ssize_t sent = send(session->fd, cpm_console.output_ring + at, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                session->closing = 1;
+            }
+            return;
+        }
+        cpm_console.output_read += (size_t)sent;
+    }
 }
 
-void process_interrupt(void)
-{
-    // Process pending interrupt if enabled
-    if (check_interrupt()) {
-        cpu.interrupt_enable = 0; // Disable further interrupts
-        cpu.interrupt_pending = 0; // Clear pending flag
+// Run one slice of a session on this worker, then decide when it runs next
+static void server_run_session(server_session_t *session) {
+    const cpm_server_config *config = &cpm_server.config;
+    int result = RUN_WAITING;
+    long long now = server_now_ms();
+
+    if (!session->machine && !(session->machine = server_new_machine())) {
+        printf("[Server] Session %u: cannot create a machine\n", session->id);
+        fflush(stdout);
+        pthread_mutex_lock(&cpm_server.lock);
+        session->state = SESSION_DEAD;
+        pthread_mutex_unlock(&cpm_server.lock);
+        return;
+    }
+    machine_t *previous = cpm_machine_select(session->machine);
+    server_read_input(session);
+
+    if (now - session->quota_window >= 1000) {
+        session->quota_window = now;
+        session->quota_used = 0;
+    }
+    unsigned long long budget = config->slice_cycles;
+    int throttled = 0;
+    if (config->quota_cycles) {
+        unsigned long long left = config->quota_cycles > session->quota_used ?
+                                  config->quota_cycles - session->quota_used : 0;
+        throttled = (left == 0);
+        budget = left < budget ? left : budget;
+    }
+    size_t backlog = cpm_console.output_write - cpm_console.output_read;
+    if (!session->closing && !throttled && backlog < SERVER_OUTPUT_BACKLOG) {
+        unsigned long long start = cpu_cycles;
+        cpm_is_idle();  // Lets a spin parked for a full tick run again
+        result = cpu_run(budget);
+        session->quota_used += cpu_cycles - start;
+    }
+    server_write_output(session);
+
+    backlog = cpm_console.output_write - cpm_console.output_read;
+    unsigned int events = EPOLLONESHOT | EPOLLRDHUP;
+    if (server_input_room() > 0) {
+        events |= EPOLLIN;
+    }
+    if (backlog > 0) {
+        events |= EPOLLOUT;
+    }
+    cpm_machine_select(previous);
 
-        // Execute the interrupt opcode (typically RST instruction)
-        unsigned char saved_opcode = mem[cpu.prog_ctr];
-        mem[cpu.prog_ctr] = cpu.interrupt_opcode;
-        cpu.prog_ctr = exec_inst(&cpu, mem) & 0xFFFF;
-        mem[cpu.prog_ctr] = saved_opcode; // Restore (though PC has changed)
+    pthread_mutex_lock(&cpm_server.lock);
+    if (session->closing) {
+        session->state = SESSION_DEAD;  // Reaped by the epoll thread
+        pthread_mutex_unlock(&cpm_server.lock);
+        return;
+    }
+    if (config->quota_cycles && session->quota_used >= config->quota_cycles) {
+        session->state = SESSION_PARKED;
+        session->wake_at = session->quota_window + 1000;
+    } else if (backlog >= SERVER_OUTPUT_BACKLOG) {
+        session->state = SESSION_PARKED;  // Until the client drains its output
+        session->wake_at = 0;
+    } else if (result == RUN_BUDGET || result == RUN_SCRIPT) {
+        server_enqueue(session);
+    } else if (result == RUN_IDLE) {
+        session->state = SESSION_PARKED;
+        session->wake_at = now + SERVER_TICK_MS;
+    } else {
+        session->state = SESSION_PARKED;  // Waiting for input or halted
+        session->wake_at = 0;
     }
+    pthread_mutex_unlock(&cpm_server.lock);
+
+    // Re-arm last: from here the epoll thread may queue it again
+    struct epoll_event event = { .events = events, .data.ptr = session };
+    epoll_ctl(cpm_server.epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
 }
 
-// CP/M console waiting state
-int cpm_is_waiting_for_input(void)
-{
-    return cpm_console.waiting_for_input;
+static void* server_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&cpm_server.lock);
+        while (cpm_server.running && !cpm_server.queue_head) {
+            pthread_cond_wait(&cpm_server.work, &cpm_server.lock);
+        }
+        if (!cpm_server.running) {
+            pthread_mutex_unlock(&cpm_server.lock);
+            return NULL;
+        }
+        server_session_t *session = cpm_server.queue_head;
+        cpm_server.queue_head = session->next;
+        if (!cpm_server.queue_head) {
+            cpm_server.queue_tail = NULL;
+        }
+        session->state = SESSION_RUNNING;
+        pthread_mutex_unlock(&cpm_server.lock);
+
+        server_run_session(session);
+    }
 }
 
-void cpm_clear_waiting(void)
-{
-    cpm_console.waiting_for_input = 0;
+// Once per tick: wake sessions whose timer expired, reap closed ones
+static void server_tick(void) {
+    long long now = server_now_ms();
+    server_session_t *dead = NULL;
+    pthread_mutex_lock(&cpm_server.lock);
+    for (int i = 0; i < cpm_server.session_count; i++) {
+        server_session_t *session = cpm_server.sessions[i];
+        if (session->state == SESSION_DEAD) {
+            cpm_server.sessions[i--] = cpm_server.sessions[--cpm_server.session_count];
+            session->next = dead;
+            dead = session;
+        } else if (session->state == SESSION_PARKED && session->wake_at && now >= session->wake_at) {
+            server_enqueue(session);
+        }
+    }
+    pthread_mutex_unlock(&cpm_server.lock);
+
+    while (dead) {
+        server_session_t *next = dead->next;
+        close(dead->fd);
+        cpm_machine_destroy(dead->machine);
+        printf("[Server] Session %u closed (%d active)\n", dead->id, cpm_server.session_count);
+        fflush(stdout);
+        free(dead);
+        dead = next;
+    }
 }
 
-void cpm_set_echo(int enable)
-{
-    cpm_console.input_echo = enable;
+static void server_shutdown(void) {
+    pthread_mutex_lock(&cpm_server.lock);
+    cpm_server.running = 0;
+    pthread_cond_broadcast(&cpm_server.work);
+    pthread_mutex_unlock(&cpm_server.lock);
+    for (int i = 0; i < cpm_server.worker_count; i++) {
+        pthread_join(cpm_server.workers[i], NULL);
+    }
+    for (int i = 0; i < cpm_server.session_count; i++) {
+        close(cpm_server.sessions[i]->fd);
+        cpm_machine_destroy(cpm_server.sessions[i]->machine);
+        free(cpm_server.sessions[i]);
+    }
+    free(cpm_server.sessions);
+    free(cpm_server.workers);
+    cpm_machine_destroy(cpm_server.boot);
+    int fds[] = { cpm_server.listen_fd, cpm_server.epoll_fd, cpm_server.stop_pipe[0], cpm_server.stop_pipe[1] };
+    for (int i = 0; i < 4; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    if (strncmp(cpm_server.config.listen, "unix:", 5) == 0) {
+        unlink(cpm_server.config.listen + 5);
+    }
+    cpm_server.sessions = NULL;
+    cpm_server.workers = NULL;
+    cpm_server.worker_count = 0;
+    cpm_server.session_count = 0;
+    cpm_server.queue_head = cpm_server.queue_tail = NULL;
+    cpm_server.boot = NULL;
+    cpm_server.listen_fd = cpm_server.epoll_fd = -1;
+    cpm_server.stop_pipe[0] = cpm_server.stop_pipe[1] = -1;
+}
+
+// Serve sessions until cpm_server_stop is called. Returns 0 on a clean
+// stop, -1 if the server could not start.
+int cpm_server_run(const cpm_server_config *config) {
+    if (!config || !config->listen || !config->boot_hex) {
+        return -1;
+    }
+    cpm_server.config = *config;
+    if (cpm_server.config.workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        cpm_server.config.workers = cores > 0 ? (int)cores : 1;
+    }
+    if (cpm_server.config.max_sessions <= 0) {
+        cpm_server.config.max_sessions = SERVER_MAX_SESSIONS;
+    }
+    if (!cpm_server.config.slice_cycles) {
+        cpm_server.config.slice_cycles = SERVER_SLICE_CYCLES;
+    }
+    cpm_server.disk_image[0] = '\0';
+    if (config->disk_image && !realpath(config->disk_image, cpm_server.disk_image)) {
+        printf("[Server] ERROR: Disk image %s: %s\n", config->disk_image, strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+
+    // Boot once on a private machine; sessions start from a copy of its
+    // memory. This also registers the shared I/O ports before any worker runs.
+    cpm_server.boot = cpm_machine_create(NULL);
+    cpm_server.sessions = calloc((size_t)cpm_server.config.max_sessions, sizeof(server_session_t *));
+    cpm_server.workers = calloc((size_t)cpm_server.config.workers, sizeof(pthread_t));
+    cpm_server.listen_fd = socket_listen(config->listen, 1);
+    cpm_server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!cpm_server.boot || !cpm_server.sessions || !cpm_server.workers || cpm_server.listen_fd < 0 ||
+        cpm_server.epoll_fd < 0 || pipe(cpm_server.stop_pipe) < 0) {
+        printf("[Server] ERROR: Cannot listen on %s: %s\n", config->listen, strerror(errno));
+        fflush(stdout);
+        server_shutdown();
+        return -1;
+    }
+    machine_t *previous = cpm_machine_select(cpm_server.boot);
+    cpm_machine_reset();
+    codeload(config->boot_hex, config->boot_org);
+    cpm_machine_select(previous);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &server_listen_tag };
+    epoll_ctl(cpm_server.epoll_fd, EPOLL_CTL_ADD, cpm_server.listen_fd, &event);
+    event.data.ptr = NULL;
+    epoll_ctl(cpm_server.epoll_fd, EPOLL_CTL_ADD, cpm_server.stop_pipe[0], &event);
+
+    cpm_server.running = 1;
+    for (int i = 0; i < cpm_server.config.workers; i++) {
+        if (pthread_create(&cpm_server.workers[i], NULL, server_worker, NULL) != 0) {
+            break;
+        }
+        cpm_server.worker_count++;
+    }
+    printf("[Server] Listening on %s with %d workers\n", config->listen, cpm_server.worker_count);
+    fflush(stdout);
+
+    struct epoll_event events[256];
+    long long next_tick = server_now_ms() + SERVER_TICK_MS;
+    int stopping = 0;
+    while (!stopping) {
+        long long wait = next_tick - server_now_ms();
+        int count = epoll_wait(cpm_server.epoll_fd, events, 256, wait > 0 ? (int)wait : 0);
+        for (int i = 0; i < count; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == NULL) {
+                stopping = 1;
+            } else if (tag == &server_listen_tag) {
+                server_accept();
+            } else {
+                server_session_t *session = tag;
+                pthread_mutex_lock(&cpm_server.lock);
+                if (session->state == SESSION_PARKED) {
+                    server_enqueue(session);
+                }
+                pthread_mutex_unlock(&cpm_server.lock);
+            }
+        }
+        if (server_now_ms() >= next_tick) {
+            server_tick();
+            next_tick = server_now_ms() + SERVER_TICK_MS;
+        }
+    }
+
+    printf("[Server] Stopping (%d sessions)\n", cpm_server.session_count);
+    fflush(stdout);
+    server_shutdown();
+    return 0;
+}
+
+// Make cpm_server_run return; safe from any thread or a signal handler
+void cpm_server_stop(void) {
+    if (cpm_server.stop_pipe[1] >= 0) {
+        unsigned char token = 1;
+        (void)!write(cpm_server.stop_pipe[1], &token, 1);
+    }
+}
+
+int cpm_server_session_count(void) {
+    return cpm_server.session_count;
 }
 
+#endif // CPM_SERVER
+
 /*
  int execute8080code(const char *sourcecode) {
  
@@ -699,6 +699,16 @@ class Assemble : NSObject {
         return (objectCode, prettyCode, objectHex, buildOK, orgAddress)
     }
     
+    // Name the assembled addresses in the selected machine's coverage exports
+    func exportLabelsToCoverage()
+    {
+        cpm_coverage_clear_labels()
+        for (name, address) in Labels
+        {
+            cpm_coverage_label(name, UInt32(address))
+        }
+    }
+    
     
     
     func OutputByte(thebyte : Int)
@@ -19,12 +19,20 @@ class CPMTerminalViewController: UIViewController {
     var toolbarBottomConstraint: NSLayoutConstraint?
 
     // MARK: - State
+    static let cyclesPerTick: UInt64 = 2000  // 1ms of a 2 MHz 8080
+    static let screenRows = 24
+    static let screenColumns = 80
+    static let scrollbackLimit = 200_000     // UTF-16 units kept above the screen
     var isRunning = false
     var emulatorTimer: Timer?
-    var outputCheckTimer: Timer?
+    var outputSource: DispatchSourceRead?
     private var pendingHexCode: String?
     private var pendingOrg: UInt16 = 0
     private var didStartEmulator = false
+    private var isBooting = false            // The boot thread owns the machine: hands off
+    private var startWhenBooted = false
+    private var screenStart: Int?            // Where the screen rows begin in the text storage
+    private var screenGeneration: UInt = 0
 
     // Terminal colors
     let backgroundColor = UIColor.black
@@ -249,101 +257,174 @@ class CPMTerminalViewController: UIViewController {
 
         installBundledDiskIfNeeded()
 
-        // Load and reset
-        codereset()
-        codeload(hexCode, UInt32(pendingOrg))
-        cpu_set_pc(pendingOrg)
+        // Come up at the CP/M prompt: restored from the boot cache when this
+        // program and disk have booted before, else a cold boot that fills it.
+        // That can take a while, so it runs off the main thread; a boot that
+        // gives up on the prompt carries on under the emulator timer.
+        let cachePath = FileManager.default.urls(for: .cachesDirectory, in: .userDomainMask).first?.path
+        let org = UInt32(pendingOrg)
+        isBooting = true
+        startWhenBooted = true
+        DispatchQueue.global(qos: .userInitiated).async { [weak self] in
+            if cpm_boot_cached(hexCode, org, cachePath) != 0 {
+                print("[Emulator] Restored CP/M from the boot cache")
+            }
+            DispatchQueue.main.async {
+                self?.bootFinished()
+            }
+        }
+    }
 
+    private func bootFinished() {
+        isBooting = false
+        guard startWhenBooted else { return }  // Stopped while booting
         print("[Emulator] Starting CP/M emulator")
 
-        // Start emulator loop - run more instructions per timer tick for better performance
         isRunning = true
-        emulatorTimer = Timer.scheduledTimer(withTimeInterval: 0.001, repeats: true) { [weak self] _ in
-            guard let self = self else { return }
-            // Execute multiple instructions per tick (unless waiting for input)
-            for _ in 0..<100 {
-                if cpm_is_waiting_for_input() != 0 {
-                    break
+        resumeEmulator()
+
+        // Redraw as soon as the core signals output, rather than polling
+        let eventFD = cpm_event_fd()
+        if eventFD >= 0 {
+            let source = DispatchSource.makeReadSource(fileDescriptor: eventFD, queue: .main)
+            source.setEventHandler { [weak self] in
+                if cpm_event_take() & UInt32(CPM_EVENT_OUTPUT) != 0 {
+                    self?.checkOutput()
                 }
-                self.emulatorStep()
             }
-        }
-
-        // Start output checking - check more frequently
-        outputCheckTimer = Timer.scheduledTimer(withTimeInterval: 0.01, repeats: true) { [weak self] _ in
-            self?.checkOutput()
+            source.resume()
+            outputSource = source
         }
     }
 
     func stopEmulator() {
+        startWhenBooted = false
         isRunning = false
         emulatorTimer?.invalidate()
         emulatorTimer = nil
-        outputCheckTimer?.invalidate()
-        outputCheckTimer = nil
+        outputSource?.cancel()
+        outputSource = nil
     }
 
-    func emulatorStep() {
-        guard isRunning else { return }
+    // Run the machine in 1ms slices while it has work. The timer is stopped
+    // while the guest waits for a key or has halted, and sendToCPM starts it
+    // again, so an idle terminal costs no CPU.
+    func resumeEmulator() {
+        guard isRunning, emulatorTimer == nil else { return }
+        emulatorTimer = Timer.scheduledTimer(withTimeInterval: 0.001, repeats: true) { [weak self] _ in
+            self?.emulatorTick()
+        }
+    }
 
-        // Execute one instruction
-        // (input waiting check is now done in the timer loop for efficiency)
-        codestep()
+    func suspendEmulator() {
+        emulatorTimer?.invalidate()
+        emulatorTimer = nil
     }
 
-    func checkOutput() {
-        // Get any output characters from CP/M
-        var charCount = 0
-        while true {
-            let ch = cpm_get_char()
-            if ch == 0 {
-                break
+    func emulatorTick() {
+        switch cpu_run(CPMTerminalViewController.cyclesPerTick) {
+        case CPM_RUN_WAITING, CPM_RUN_HALTED:
+            suspendEmulator()
+        case CPM_RUN_IDLE:
+            // Spinning on console status: look again after one idle tick, so
+            // timed polling loops still advance
+            suspendEmulator()
+            DispatchQueue.main.asyncAfter(deadline: .now() + .milliseconds(10)) { [weak self] in
+                _ = cpm_is_idle()
+                self?.resumeEmulator()
             }
+        default:
+            break
+        }
+    }
 
-            charCount += 1
-            DispatchQueue.main.async { [weak self] in
-                self?.handleOutputChar(ch)
-            }
+    func sendToCPM(_ ch: UInt8) {
+        guard !isBooting else { return }
+        cpm_put_char(ch)
+        resumeEmulator()
+    }
+
+    func checkOutput() {
+        // Drain the raw output stream; the screen model has already consumed it
+        var buffer = [UInt8](repeating: 0, count: 4096)
+        while cpm_read_output(&buffer, Int32(buffer.count)) > 0 {
         }
 
-        // Debug: Log if we got characters
-        if charCount > 0 {
-            print("[CP/M] Retrieved \(charCount) output characters")
+        // Redraw only when the screen or caret changed. The banner and the
+        // scrollback sit above the 24 screen rows, which are fixed-width lines
+        // at screenStart; only dirty rows are replaced in the text storage.
+        let generation = UInt(cpm_term_generation())
+        guard generation != screenGeneration else { return }
+        screenGeneration = generation
+
+        let rows = CPMTerminalViewController.screenRows
+        let lineLength = CPMTerminalViewController.screenColumns + 1
+        let storage = textView.textStorage
+        var row = [CChar](repeating: 0, count: lineLength)
+        var dirty = cpm_term_take_dirty()
+        storage.beginEditing()
+        var start: Int
+        if let attached = screenStart {
+            start = attached
+        } else {
+            // First frame: add blank rows after the banner and draw them all
+            start = storage.length
+            let blank = String(repeating: " ", count: lineLength - 1)
+            storage.replaceCharacters(in: NSRange(location: start, length: 0),
+                                      with: [String](repeating: blank, count: rows).joined(separator: "\n"))
+            dirty = UInt32((1 << rows) - 1)
+        }
+
+        // Rows that scrolled off the top move into the scrollback
+        var scrolled = [CChar](repeating: 0, count: rows * lineLength)
+        let scrolledCount = Int(cpm_term_take_scrolled(&scrolled))
+        if scrolledCount > 0 {
+            var lines = ""
+            for index in 0..<scrolledCount {
+                let line = scrolled[(index * lineLength)..<((index + 1) * lineLength)]
+                let text = line.withUnsafeBufferPointer { String(cString: $0.baseAddress!) }
+                lines += text.replacingOccurrences(of: " +$", with: "", options: .regularExpression) + "\n"
+            }
+            storage.replaceCharacters(in: NSRange(location: start, length: 0), with: lines)
+            start += lines.utf16.count
         }
-    }
 
-    func handleOutputChar(_ ch: UInt8) {
-        // Debug: Log all output characters
-        if ch < 32 || ch >= 127 {
-            print("[CP/M Output] Char: 0x\(String(format: "%02X", ch))")
+        // Keep the scrollback bounded, trimming whole lines
+        let limit = CPMTerminalViewController.scrollbackLimit
+        if start > limit {
+            let search = NSRange(location: start - limit, length: limit)
+            let newline = (storage.string as NSString).range(of: "\n", options: [], range: search)
+            let cut = newline.location == NSNotFound ? start - limit : newline.location + 1
+            storage.deleteCharacters(in: NSRange(location: 0, length: cut))
+            start -= cut
         }
 
-        switch ch {
-        case 0x0D:  // Carriage return
-            // CP/M uses CR+LF, so process CR as newline
-            // (in case LF doesn't come)
-            appendText("\n")
-        case 0x0A:  // Line feed
-            // If we already handled CR, this might create double newline
-            // But CP/M text files use both, so we need to handle it
-            break  // Skip LF if CR already handled
-        case 0x08:  // Backspace
-            deleteLastChar()
-        case 0x07:  // Bell
-            // Could add haptic feedback here
-            break
-        case 32..<127:  // Printable ASCII
-            appendText(String(UnicodeScalar(ch)))
-        default:
-            // Show non-printable as hex for debugging
-            print("[CP/M] Non-printable char: 0x\(String(format: "%02X", ch))")
+        for index in 0..<rows where dirty & (1 << UInt32(index)) != 0 {
+            cpm_term_get_row(Int32(index), &row)
+            storage.replaceCharacters(in: NSRange(location: start + index * lineLength, length: lineLength - 1),
+                                      with: String(cString: row))
         }
+        storage.endEditing()
+        screenStart = start
+
+        var cursorRow: Int32 = 0
+        var cursorCol: Int32 = 0
+        cpm_term_get_cursor(&cursorRow, &cursorCol)
+        let caret = NSRange(location: start + Int(cursorRow) * lineLength + Int(cursorCol), length: 0)
+        textView.selectedRange = caret
+        textView.scrollRangeToVisible(caret)
     }
 
     // MARK: - Text Management
 
     func appendText(_ text: String) {
-        textView.text.append(text)
+        // Once the screen is shown, messages go above it into the scrollback
+        if let start = screenStart {
+            textView.textStorage.replaceCharacters(in: NSRange(location: start, length: 0), with: text)
+            screenStart = start + text.utf16.count
+        } else {
+            textView.text.append(text)
+        }
         scrollToBottom()
     }
 
@@ -369,21 +450,31 @@ class CPMTerminalViewController: UIViewController {
     }
 
     @objc func resetTapped() {
+        guard !isBooting else { return }
         let alert = UIAlertController(title: "Reset", message: nil, preferredStyle: .actionSheet)
         alert.addAction(UIAlertAction(title: "Reset CPU", style: .default) { [weak self] _ in
             guard let self = self else { return }
             self.stopEmulator()
             codereset()
             self.textView.text = ""
+            self.screenStart = nil
             self.appendText("CP/M 2.2 Terminal\n")
             self.appendText("System Reset.\n\n")
         })
+        alert.addAction(UIAlertAction(title: "Warm Boot", style: .default) { [weak self] _ in
+            guard let self = self else { return }
+            // Keeps running from the BIOS warm-boot entry
+            codewarmreset()
+            self.resumeEmulator()
+            self.appendText("\nWarm Boot.\n\n")
+        })
         alert.addAction(UIAlertAction(title: "Replace A.DSK from Bundled CPM22", style: .destructive) { [weak self] _ in
             guard let self = self else { return }
             self.replaceDiskFromBundle()
             self.stopEmulator()
             codereset()
             self.textView.text = ""
+            self.screenStart = nil
             self.appendText("CP/M 2.2 Terminal\n")
             self.appendText("Disk Replaced.\n\n")
         })
@@ -395,15 +486,15 @@ class CPMTerminalViewController: UIViewController {
     }
 
     @objc func sendControlC() {
-        cpm_put_char(0x03)  // ^C (ETX)
+        sendToCPM(0x03)  // ^C (ETX)
     }
 
     @objc func sendControlZ() {
-        cpm_put_char(0x1A)  // ^Z (EOF)
+        sendToCPM(0x1A)  // ^Z (EOF)
     }
 
     @objc func sendEscape() {
-        cpm_put_char(0x1B)  // ESC
+        sendToCPM(0x1B)  // ESC
     }
 
     @objc func dismissKeyboard() {
@@ -437,7 +528,7 @@ extension CPMTerminalViewController: UITextViewDelegate {
 
         // Handle return key
         if text == "\n" {
-            cpm_put_char(0x0D)  // Send CR to CP/M
+            sendToCPM(0x0D)  // Send CR to CP/M
             return false  // Don't add newline to text view (CP/M will echo it)
         }
 
@@ -446,7 +537,7 @@ extension CPMTerminalViewController: UITextViewDelegate {
             if let ascii = char.asciiValue {
                 // Convert lowercase to uppercase for CP/M
                 let cpChar = (ascii >= 97 && ascii <= 122) ? ascii - 32 : ascii
-                cpm_put_char(cpChar)
+                sendToCPM(cpChar)
             }
         }
 
@@ -6,6 +6,7 @@ void codeload(const char *sourcecode, unsigned int org);
 void coderun();
 char* codestep();
 char* codereset();
+char* codewarmreset(void);
 void cpu_set_pc(unsigned short addr);
 int currentAddress();
 int currentAddressBus();
@@ -20,8 +21,155 @@ void process_interrupt();
 // CP/M console I/O
 void cpm_put_char(unsigned char ch);
 unsigned char cpm_get_char();
+int cpm_read_output(unsigned char *buffer, int max);
 int cpm_console_status();
 int cpm_is_waiting_for_input();
 void cpm_clear_waiting();
+int cpm_is_idle();
+int cpm_wait_for_event(int timeout_ms);
 void cpm_set_echo(int enable);
 void cpm_set_disk_base_path(const char *path);
+
+// CP/M host directory drives (C: through P:)
+int cpm_mount_host_dir(int drive, const char *path);
+void cpm_unmount_host_dir(int drive);
+
+// CP/M sparse disk images
+int cpm_save_disk_sparse(int drive, const char *filename);
+unsigned long cpm_disk_bytes_allocated(void);
+const char* cpm_disk_format_name(int drive);
+
+// CP/M overlay drives (shared read-only base + private delta)
+int cpm_mount_overlay(int drive, const char *base_path);
+int cpm_overlay_commit(int drive, const char *filename);
+void cpm_overlay_discard(int drive);
+void cpm_unmount_overlay(int drive);
+
+// CP/M disk persistence
+void cpm_disk_flush(void);
+
+// I/O port devices (one handler pair per port)
+typedef unsigned char (*io_read_fn)(void *device, unsigned char port);
+typedef void (*io_write_fn)(void *device, unsigned char port, unsigned char value);
+int cpm_io_register(unsigned char port, io_read_fn read, io_write_fn write, void *device);
+void cpm_io_unregister(unsigned char port);
+
+// Native BIOS entry points (HLE traps on the jump vector)
+int cpm_hle_install_bios(unsigned int base);
+
+// CP/M terminal screen model (80x24, ADM-3A / VT52)
+unsigned long cpm_term_generation(void);
+unsigned int cpm_term_take_dirty(void);
+int cpm_term_take_scrolled(char *buffer);
+int cpm_term_get_row(int row, char *buffer);
+void cpm_term_get_cursor(int *row, int *col);
+
+// Batched execution and scripted sessions (timeouts in 8080 clock states)
+#define CPM_RUN_BUDGET 0
+#define CPM_RUN_WAITING 1
+#define CPM_RUN_IDLE 2
+#define CPM_RUN_HALTED 3
+#define CPM_RUN_SCRIPT 4
+int cpu_run(unsigned long long budget);
+unsigned long long cpu_cycle_count(void);
+int cpm_script_add(const char *expect, const char *send, unsigned long long timeout_cycles);
+int cpm_script_start(void);
+int cpm_script_run(unsigned long long max_cycles);
+int cpm_script_state(int *step);
+void cpm_script_clear(void);
+
+// Host notification (output available, input wait, halt)
+#define CPM_EVENT_OUTPUT 0x01
+#define CPM_EVENT_INPUT  0x02
+#define CPM_EVENT_HALT   0x04
+typedef void (*cpm_event_fn)(void *context, unsigned int events);
+int cpm_event_fd(void);
+void cpm_event_set_callback(cpm_event_fn callback, void *context);
+unsigned int cpm_event_take(void);
+
+// Machines (codestep and the cpm_ calls act on the thread's selected machine)
+typedef struct machine machine_t;
+machine_t* cpm_machine_create(const char *disk_path);
+machine_t* cpm_machine_select(machine_t *machine);
+void cpm_machine_reset(void);
+void cpm_machine_warm_reset(void);
+void cpm_machine_destroy(machine_t *machine);
+machine_t* cpm_machine_fork(machine_t *parent);
+
+// CP/M logical devices LST: (0), PUN: (1) and RDR: (2)
+int cpm_aux_attach_file(int device, const char *path);
+int cpm_aux_attach_fd(int device, int fd, int own_fd);
+int cpm_aux_capture(int device);
+int cpm_aux_feed(const unsigned char *data, size_t len);
+size_t cpm_aux_take(int device, unsigned char *buffer, size_t max);
+void cpm_aux_flush(void);
+void cpm_aux_detach(int device);
+
+// Save states of the selected machine (buffers from cpm_machine_save are freed with free).
+// A restore keeps its drives in memory and leaves A.DSK/B.DSK alone unless given CPM_RESTORE_WRITE_BACK.
+#define CPM_SAVE_COMPRESS 0x01
+#define CPM_RESTORE_WRITE_BACK 0x01
+unsigned char* cpm_machine_save(size_t *length, int flags);
+int cpm_machine_restore(const unsigned char *data, size_t length, int flags);
+int cpm_machine_save_file(const char *path, int flags);
+int cpm_machine_restore_file(const char *path, int flags);
+
+// Record the selected machine's inputs and replay them exactly (logs are freed with free)
+#define CPM_REPLAY_OFF 0
+#define CPM_REPLAY_RECORDING 1
+#define CPM_REPLAY_PLAYING 2
+#define CPM_REPLAY_DONE 3
+#define CPM_REPLAY_DIVERGED 4
+int cpm_record_start(void);
+unsigned char* cpm_record_stop(size_t *length);
+int cpm_replay_start(const unsigned char *log, size_t length);
+int cpm_replay_run(unsigned long long max_cycles);
+int cpm_replay_status(void);
+void cpm_replay_stop(void);
+
+// Reverse execution: history of the last steps of the selected machine (0 steps for the default)
+int cpm_history_start(unsigned int steps);
+void cpm_history_stop(void);
+unsigned int cpm_history_depth(void);
+int cpm_reverse_step(void);
+int cpm_reverse_continue(int pc, int address);
+int cpm_history_last_writer(unsigned int address, unsigned int *pc, unsigned long long *cycles);
+
+// Breakpoints and watchpoints of the selected machine (cpu_run returns CPM_RUN_BREAKPOINT or CPM_RUN_WATCHPOINT)
+#define CPM_RUN_BREAKPOINT 5
+#define CPM_RUN_WATCHPOINT 6
+#define CPM_WATCH_READ 0x01
+#define CPM_WATCH_WRITE 0x02
+int cpm_break_set(unsigned int address);
+int cpm_break_clear(unsigned int address);
+void cpm_break_clear_all(void);
+int cpm_watch_add(unsigned int start, unsigned int end, int flags);
+int cpm_watch_remove(unsigned int start, unsigned int end);
+void cpm_watch_clear_all(void);
+int cpm_debug_last_stop(unsigned int *pc, unsigned int *address, int *access);
+
+// GDB remote protocol for the selected machine on "unix:path" or "[host:]port" (served while cpu_run runs it)
+int cpm_gdb_listen(const char *spec);
+void cpm_gdb_stop(void);
+
+// Start at the CP/M prompt, from a cached snapshot when this program and disk booted before.
+// Safe on a background thread while nothing else touches the machine.
+int cpm_boot_cached(const char *hex, unsigned int org, const char *cache_dir);
+
+// Front panel: sample a machine's registers from any thread without stopping it
+#include "cpu_state.h"
+void cpm_front_panel_enable(unsigned long long interval);
+int cpm_front_panel_read(machine_t *machine, cpu_state_t *out);
+
+// Coverage of the selected machine (needs DEBUG_COVERAGE in 8080.c; exports are freed with free)
+#define CPM_COVERAGE_EXECUTE 0
+#define CPM_COVERAGE_READ 1
+#define CPM_COVERAGE_WRITE 2
+int cpm_coverage_start(void);
+void cpm_coverage_stop(void);
+void cpm_coverage_clear(void);
+unsigned int cpm_coverage_hits(unsigned int address, int kind);
+int cpm_coverage_label(const char *name, unsigned int address);
+void cpm_coverage_clear_labels(void);
+unsigned char* cpm_coverage_export(size_t *length);
+char* cpm_coverage_json(void);
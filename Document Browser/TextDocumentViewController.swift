@@ -405,6 +405,9 @@ class TextDocumentViewController: UIViewController, UITextViewDelegate, TextDocu
             return
         }
 
+        // Name the program's addresses in coverage exports of the terminal's machine
+        CPU.exportLabelsToCoverage()
+
         // Create and present the terminal view controller
         let terminalVC = CPMTerminalViewController()
         terminalVC.configureProgram(hexCode: self.hexOutput, org: self.orgAddress)
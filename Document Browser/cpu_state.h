@@ -0,0 +1,22 @@
+//
+//  cpu_state.h
+//  Front panel snapshot, shared by 8080.c and the bridging header
+//
+
+#ifndef cpu_state_h
+#define cpu_state_h
+
+typedef struct {
+    unsigned long long cycles;
+    unsigned long long steps;          // Instructions executed
+    unsigned short pc;
+    unsigned short sp;
+    unsigned short address_bus;        // Last address read or written
+    unsigned char a, b, c, d, e, h, l;
+    unsigned char flags;               // As PUSH PSW stores them
+    unsigned char interrupt_enable;
+    unsigned char halted;
+    unsigned char next[4];             // Instruction bytes at pc
+} cpu_state_t;
+
+#endif /* cpu_state_h */